@@ -7,9 +7,11 @@
 #include <bitmap.h>
 #include <rbtree.h>
 #include "mem/malloc.h"
+#include "mem/snapshot.h"
 #include "peep/tb.h"
 #include "sys/rr_log.h"
 #include "sys/vcpu.h"
+#include "threads/thread.h"
 
 #define MICRO_REPLAY_FREQUENCY 0x1000000
 
@@ -23,6 +25,12 @@
 #define MREP_CUMULATIVE
 #define MICRO_REPLAY_GEOMETRIC
 
+/* Roll back to an in-memory checkpoint taken while verifying the log,
+ * instead of re-reading the log from its first machine state. Undefine to
+ * measure the log-based rollback. */
+#define MREP_SNAPSHOTS
+#define MICRO_REPLAY_CHECKPOINT_FREQUENCY (MICRO_REPLAY_FREQUENCY >> 4)
+
 static off_t rollback_offset = 0;
 static uint64_t rollback_n_exec = (uint64_t)-1;
 static int rollback_mode = 0;
@@ -45,6 +53,19 @@ struct mrep_interrupt {
 static struct mrep_interrupt *last_n_interrupts = NULL;
 static size_t n = 0;
 
+#ifdef MREP_SNAPSHOTS
+/* The replay log position at each checkpoint. Checkpoint ID is kept in
+ * checkpoints[ID % SNAPSHOT_NUM]. */
+struct mrep_checkpoint {
+	bool valid;
+	int id;
+	uint64_t n_exec;
+	struct replay_log_pos pos;
+};
+static struct mrep_checkpoint checkpoints[SNAPSHOT_NUM];
+static uint64_t last_checkpoint_n_exec = 0;
+#endif
+
 /* Helper functions. */
 static void blacklisted_eips_insert(target_ulong eip);
 static void blacklisted_eips_clear(void);
@@ -54,11 +75,90 @@ static int blacklisted_eips_size(void);
 
 /* Stats. */
 static int num_micro_replays = 0;
+static int num_rollbacks = 0;
+static int num_checkpoint_rollbacks = 0;
+static int num_indexed_rollbacks = 0;
+static uint64_t rollback_start_tsc = 0;
+static uint64_t rollback_cycles = 0;
 
 void
 micro_replay_init(void)
 {
 	blacklisted_eips_init();
+	snapshot_init();
+}
+
+static void
+checkpoints_clear(void)
+{
+#ifdef MREP_SNAPSHOTS
+	int i;
+	for (i = 0; i < SNAPSHOT_NUM; i++) {
+		checkpoints[i].valid = false;
+	}
+#endif
+	snapshot_clear();
+}
+
+/* Called from the monitor loop between tbs. While the log is being verified,
+ * takes a checkpoint every MICRO_REPLAY_CHECKPOINT_FREQUENCY instructions. */
+void
+micro_replay_checkpoint(void)
+{
+#ifdef MREP_SNAPSHOTS
+	struct mrep_checkpoint *c;
+	int id;
+
+	if (rollback_mode != 1 || !vcpu.replay_log) {
+		return;
+	}
+	if (   snapshot_armed
+			&& vcpu.n_exec - last_checkpoint_n_exec
+			   < MICRO_REPLAY_CHECKPOINT_FREQUENCY) {
+		return;
+	}
+	if (vcpu.n_exec != get_n_exec(vcpu.callout_next)) {
+		return;
+	}
+	id = snapshot_take();
+	c = &checkpoints[id % SNAPSHOT_NUM];
+	c->valid = true;
+	c->id = id;
+	c->n_exec = vcpu.n_exec;
+	replay_log_get_pos(&c->pos);
+	last_checkpoint_n_exec = vcpu.n_exec;
+#endif
+}
+
+/* Rolls back to the newest checkpoint that precedes the rollback point and
+ * the MREP entry written at MREP_OFFSET. Replay then continues from the
+ * checkpoint up to the MREP entry. */
+static bool
+restore_checkpoint(off_t mrep_offset)
+{
+#ifdef MREP_SNAPSHOTS
+	struct mrep_checkpoint const *best = NULL;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_NUM; i++) {
+		struct mrep_checkpoint const *c = &checkpoints[i];
+		if (   c->valid && c->n_exec <= rollback_n_exec
+				&& c->pos.offset <= mrep_offset
+				&& (!best || c->id > best->id)) {
+			best = c;
+		}
+	}
+	if (!best || !snapshot_restore(best->id)) {
+		return false;
+	}
+	printf("%llx: Restored checkpoint at %llx.\n", rollback_n_exec,
+			best->n_exec);
+	replay_log_set_pos(&best->pos);
+	num_checkpoint_rollbacks++;
+	return true;
+#else
+	return false;
+#endif
 }
 
 static void
@@ -131,7 +231,7 @@ decide_rollback_point_and_fill_blacklisted_eips(void)
 void
 micro_replay_switch_mode(void)
 {
-	bool first_replay;
+	bool first_replay, seeked = false;
 	int seek;
 
 	if (!vcpu.record_log && !vcpu.replay_log) {
@@ -149,6 +249,7 @@ micro_replay_switch_mode(void)
 		seek = fseeko(vcpu.replay_log, record_log_disk_begin, SEEK_SET);
 		ASSERT(seek == 0);
 		rr_log_unregister_callback(micro_replay_callback, NULL);
+		replay_log_index_clear();
 		vcpu.record_log = vcpu.replay_log;
 		vcpu.replay_log = NULL;
 		vcpu.n_exec = rollback_n_exec;
@@ -156,6 +257,8 @@ micro_replay_switch_mode(void)
 		rollback_mode = 0;
 
 		num_micro_replays++;
+		num_rollbacks++;
+		rollback_cycles += rdtsc() - rollback_start_tsc;
 	} else {
 		first_replay = rollback_mode == 1 && vcpu.replay_log;
 		if (vcpu.record_log || first_replay) {
@@ -163,6 +266,7 @@ micro_replay_switch_mode(void)
 				/* Decide rollback point, fill blacklisted eips, and
 				 * start replay (again). */
 				decide_rollback_point_and_fill_blacklisted_eips();
+				rollback_start_tsc = rdtsc();
 				printf("%llx: Fixed rollback_n_exec at %llx, replaying again "
 						"at offset %llx.\n", get_n_exec(vcpu.callout_next),
 						rollback_n_exec, rollback_offset);
@@ -190,7 +294,20 @@ micro_replay_switch_mode(void)
 			rollback_mode = 1;
 		}
 	}
-	rr_log_start();
+	if (   rollback_mode != 2
+			|| !restore_checkpoint(rollback_offset - RR_LOG_ENTRY_SIZE)) {
+		checkpoints_clear();
+		if (rollback_mode == 2) {
+			/* Start from the newest machine state before the rollback point,
+			 * not from the first one. */
+			seeked = replay_log_seek(rollback_n_exec, "MS",
+					rollback_offset - RR_LOG_ENTRY_SIZE);
+		}
+		rr_log_start();
+		if (seeked && vcpu.n_exec) {
+			num_indexed_rollbacks++;
+		}
+	}
 	if (rollback_mode == 1) {
 		rollback_offset = ftello(vcpu.replay_log);
 		rollback_n_exec = vcpu.n_exec;
@@ -234,6 +351,10 @@ void
 micro_replay_print_stats(void)
 {
 	printf("MON-STATS: Number of micro replays: %d\n", num_micro_replays);
+	printf("MON-STATS: Rollbacks: %d (%d from checkpoints, %d from a later "
+			"machine state), %llu cycles avg.\n", num_rollbacks,
+			num_checkpoint_rollbacks, num_indexed_rollbacks,
+			num_rollbacks?rollback_cycles/num_rollbacks:0);
 	printf("MON-STATS: Size of blacklisted memory: %d\n",blacklisted_eips_size());
 }
 
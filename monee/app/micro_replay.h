@@ -6,6 +6,7 @@
 
 void micro_replay_init(void);
 void check_micro_replay(void);
+void micro_replay_checkpoint(void);
 void micro_replay_switch_mode(void);
 bool interrupts_black_listed_eip(target_ulong eip);
 void micro_replay_print_stats(void);
@@ -1,17 +1,52 @@
 #include "mdisk.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/disk.h"
 #include "mem/malloc.h"
 #include "mem/vaddr.h"
 #include "sys/io.h"
 #include "sys/vcpu.h"
+#include "threads/synch.h"
 
 #define MAX_MDISKS 2
 
+/* Descriptor ring shared with qemu; see qemu/hw/mdisk.c. A transfer is one
+ * descriptor and one doorbell OUT, and qemu moves the data straight between
+ * our buffer and its block driver. */
+#define MDISK_RING_MAGIC 0x474e4952       /* "RING" */
+#define MDISK_RING_SIZE 32
+#define MDISK_MAX_SEGS 8
+#define MDISK_PENDING 1
+
+struct mdisk_seg {
+  uint32_t paddr;
+  uint32_t len;
+};
+
+struct mdisk_desc {
+  uint32_t op;
+  uint32_t block;
+  uint32_t n_segs;
+  int32_t status;
+  struct mdisk_seg segs[MDISK_MAX_SEGS];
+};
+
+struct mdisk_ring {
+  uint32_t magic;
+  uint32_t irq;
+  uint32_t prod;
+  uint32_t cons;
+  uint32_t done;
+  uint32_t pad[3];
+  struct mdisk_desc desc[MDISK_RING_SIZE];
+};
+
 struct mdisk {
   char filename[128];
   int  iobase;
+  struct mdisk_ring ring;
+  bool use_ring;
 };
 
 struct mdisk mdisk[MAX_MDISKS];
@@ -23,10 +58,26 @@ static int num_mdisks;
 #define START_TRANSFER 0x345678
 #define SET_BLOCK 0x456789
 #define SET_OP 0x56789a
+#define SET_RING 0x6789ab
+#define DOORBELL 0x789abc
 
 #define READ 0
 #define WRITE 1
 
+/* Hands MDISK's ring to qemu. Completions are polled, because transfers
+ * happen with interrupts off, so no irq is requested. */
+static void
+mdisk_ring_init(struct mdisk *mdisk)
+{
+  struct mdisk_ring *ring = &mdisk->ring;
+
+  ASSERT(is_monitor_vaddr(ring));
+  memset(ring, 0, sizeof *ring);
+  outl(mdisk->iobase, SET_RING);
+  outl(mdisk->iobase, vtop_mon(ring));
+  mdisk->use_ring = (*(volatile uint32_t *)&ring->magic == MDISK_RING_MAGIC);
+}
+
 void
 mdisk_init(void)
 {
@@ -49,8 +100,10 @@ mdisk_init(void)
       }
       mdisk[num_mdisks].filename[pos] = '\0';
       mdisk[num_mdisks].iobase = iobase;
-      MSG("Found MDISK %d at 0x%x: %s\n", num_mdisks, iobase,
-          mdisk[num_mdisks].filename);
+      mdisk_ring_init(&mdisk[num_mdisks]);
+      MSG("Found MDISK %d at 0x%x: %s%s\n", num_mdisks, iobase,
+          mdisk[num_mdisks].filename,
+          mdisk[num_mdisks].use_ring ? " (ring)" : "");
       num_mdisks++;
     }
     iobase+=4;
@@ -58,10 +111,39 @@ mdisk_init(void)
   MSG("Number of MDISKS: %d\n", num_mdisks);
 }
 
+/* Posts one descriptor for COUNT sectors at PADDR and waits for it. The
+ * buffer is physically contiguous, so it takes a single segment. */
+static bool
+mdisk_ring_transfer(struct mdisk *mdisk, target_phys_addr_t paddr,
+    uint32_t block, uint16_t count, int op)
+{
+  struct mdisk_ring *ring = &mdisk->ring;
+  struct mdisk_desc *desc = &ring->desc[ring->prod % MDISK_RING_SIZE];
+  volatile int32_t *status = &desc->status;
+
+  ASSERT(*status != MDISK_PENDING);
+  desc->op = op;
+  desc->block = block;
+  desc->n_segs = 1;
+  desc->segs[0].paddr = paddr;
+  desc->segs[0].len = count*DISK_SECTOR_SIZE;
+  *status = MDISK_PENDING;
+  barrier();
+  ring->prod++;
+  outl(mdisk->iobase, DOORBELL);
+  while (*status == MDISK_PENDING) {
+    asm volatile ("pause");
+  }
+  return *status == 0;
+}
+
 static bool
 mdisk_transfer(struct mdisk *mdisk, target_phys_addr_t paddr, uint32_t block,
     uint16_t count, int op)
 {
+  if (mdisk->use_ring) {
+    return mdisk_ring_transfer(mdisk, paddr, block, count, op);
+  }
   outl(mdisk->iobase, SET_OP);
   outl(mdisk->iobase, op);
   outl(mdisk->iobase, SET_ADDR);
@@ -286,23 +286,56 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+/* Returns the index of the first bit in B at or after START
+   that is set to VALUE, or the size of B if there is none.
+   Elements without such a bit are skipped whole. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, bool value) 
+{
+  size_t idx = elem_idx (start);
+  size_t cnt = elem_cnt (b->bit_cnt);
+  elem_type e;
+
+  if (start >= b->bit_cnt)
+    return b->bit_cnt;
+  e = value ? b->bits[idx] : ~b->bits[idx];
+  e &= (elem_type) -1 << (start % ELEM_BITS);
+  while (e == 0) 
+    {
+      if (++idx >= cnt)
+        return b->bit_cnt;
+      e = value ? b->bits[idx] : ~b->bits[idx];
+    }
+  start = idx * ELEM_BITS + __builtin_ctzl (e);
+  return start < b->bit_cnt ? start : b->bit_cnt;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   Runs of bits are found an element at a time, so the cost is
+   linear in the number of elements and runs, not in CNT times
+   the number of bits. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
+  if (cnt == 0)
+    return start;
   if (cnt <= b->bit_cnt) 
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+      while ((i = next_bit (b, i, value)) <= last) 
+        {
+          size_t end = next_bit (b, i, !value);
+          if (end - i >= cnt)
+            return i;
+          i = end;
+        }
     }
   return BITMAP_ERROR;
 }
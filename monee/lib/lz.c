@@ -0,0 +1,171 @@
+#include "lz.h"
+#include <string.h>
+
+#define LZ_HLOG 12
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+/* Position + 1 of the last occurrence of each 3-byte hash. Static, because
+ * monitor stacks are small. */
+static uint32_t lz_htab[1 << LZ_HLOG];
+
+static inline unsigned
+lz_hash(uint8_t const *p)
+{
+  uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - LZ_HLOG);
+}
+
+/* Returns the number of bytes, up to MAXLEN, that match at IP and REF. */
+static inline size_t
+lz_match(uint8_t const *ip, uint8_t const *ref, size_t maxlen)
+{
+  size_t len = 0;
+
+  while (len < maxlen && ref[len] == ip[len]) {
+    len++;
+  }
+  return len;
+}
+
+/* Compresses IN_LEN bytes at IN into OUT. Returns the compressed length, or
+ * 0 if it would exceed OUT_LEN. */
+size_t
+lz_compress(void const *in_, size_t in_len, void *out_, size_t out_len)
+{
+  uint8_t const *in = in_, *ip = in, *in_end = in + in_len;
+  uint8_t *out = out_, *op = out, *out_end = out + out_len;
+  uint8_t *lit_ctrl;
+  unsigned lit = 0;
+  size_t last_off = 0;
+
+  if (!in_len || !out_len) {
+    return 0;
+  }
+  memset(lz_htab, 0, sizeof lz_htab);
+  lit_ctrl = op++;
+  while (ip < in_end) {
+    uint8_t const *ref = NULL;
+    size_t off = 0, len = 0;
+
+    if (ip + 2 < in_end) {
+      size_t pos = ip - in, maxlen = in_end - ip;
+      unsigned h = lz_hash(ip);
+
+      if (maxlen > LZ_MAX_REF) {
+        maxlen = LZ_MAX_REF;
+      }
+      /* Try the last occurrence of the hash, and the offset of the previous
+       * match, which wins on periodic data. Keep the longer match. */
+      if (lz_htab[h] && pos - lz_htab[h] < LZ_MAX_OFF) {
+        ref = in + lz_htab[h] - 1;
+        len = lz_match(ip, ref, maxlen);
+      }
+      if (last_off && pos > last_off) {
+        size_t rlen = lz_match(ip, ip - last_off - 1, maxlen);
+        if (rlen > len) {
+          ref = ip - last_off - 1;
+          len = rlen;
+        }
+      }
+      if (ref) {
+        off = ip - ref - 1;
+      }
+      lz_htab[h] = pos + 1;
+    }
+    if (len >= 3) {
+      /* Close the literal run, or drop its unused control byte. */
+      if (lit) {
+        *lit_ctrl = lit - 1;
+      } else {
+        op--;
+      }
+      if (op + 4 > out_end) {
+        return 0;
+      }
+      ip += len;
+      last_off = off;
+      len -= 2;
+      if (len < 7) {
+        *op++ = (off >> 8) + (len << 5);
+      } else {
+        *op++ = (off >> 8) + (7 << 5);
+        *op++ = len - 7;
+      }
+      *op++ = off;
+      /* Keep the table fresh for the next match in repetitive data. */
+      if (ip + 2 < in_end) {
+        lz_htab[lz_hash(ip - 2)] = ip - 2 - in + 1;
+        lz_htab[lz_hash(ip - 1)] = ip - 1 - in + 1;
+      }
+      lit_ctrl = op++;
+      lit = 0;
+    } else {
+      if (op >= out_end) {
+        return 0;
+      }
+      *op++ = *ip++;
+      if (++lit == LZ_MAX_LIT) {
+        *lit_ctrl = lit - 1;
+        if (op >= out_end) {
+          return 0;
+        }
+        lit_ctrl = op++;
+        lit = 0;
+      }
+    }
+  }
+  if (lit) {
+    *lit_ctrl = lit - 1;
+  } else {
+    op--;
+  }
+  return op - out;
+}
+
+/* Decompresses IN_LEN bytes at IN into OUT. Returns the decompressed length,
+ * or 0 if the data is corrupt or does not fit in OUT_LEN bytes. */
+size_t
+lz_decompress(void const *in_, size_t in_len, void *out_, size_t out_len)
+{
+  uint8_t const *ip = in_, *in_end = ip + in_len;
+  uint8_t *out = out_, *op = out, *out_end = out + out_len;
+
+  while (ip < in_end) {
+    unsigned c = *ip++;
+
+    if (c < 32) {
+      size_t n = c + 1;
+      if (ip + n > in_end || op + n > out_end) {
+        return 0;
+      }
+      memcpy(op, ip, n);
+      ip += n;
+      op += n;
+    } else {
+      size_t len = c >> 5;
+      uint8_t const *ref;
+
+      if (len == 7) {
+        if (ip >= in_end) {
+          return 0;
+        }
+        len += *ip++;
+      }
+      if (ip >= in_end) {
+        return 0;
+      }
+      ref = op - ((c & 0x1f) << 8) - 1 - *ip++;
+      len += 2;
+      if (ref < out || op + len > out_end) {
+        return 0;
+      }
+      /* May overlap; copy byte by byte. */
+      while (len--) {
+        *op++ = *ref++;
+      }
+    }
+  }
+  return op - out;
+}
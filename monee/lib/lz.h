@@ -0,0 +1,38 @@
+#ifndef __LIB_LZ_H
+#define __LIB_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A small LZ77 codec in the LZF format. The compressed data is a sequence of
+ * items, each starting with a control byte C:
+ *   C < 32:  a run of C + 1 literal bytes follows.
+ *   C >= 32: a back reference. LEN = C >> 5 (if 7, add the next byte),
+ *            OFF = (C & 0x1f) << 8 | the next byte; copy LEN + 2 bytes from
+ *            OFF + 1 bytes back in the output.
+ * The decompressor in qemu/rr_lz.c must stay in sync. */
+size_t lz_compress(void const *in, size_t in_len, void *out, size_t out_len);
+size_t lz_decompress(void const *in, size_t in_len, void *out,
+    size_t out_len);
+
+/* Block framing of compressed files (see lib/stdio.c). Logical block N of a
+ * compressed file is stored as one frame at byte N * FILE_BLOCK_SIZE of the
+ * disk, so any block can be found without reading the ones before it. A
+ * frame is a header followed by COMP_LEN bytes: LZ data, or the raw block if
+ * it did not compress. A block holds up to LZ_BLOCK_SIZE logical bytes, so
+ * that a stored frame still fits in FILE_BLOCK_SIZE. */
+#define LZ_FRAME_MAGIC 0x315a5252       /* "RRZ1" */
+#define LZ_FRAME_STORED 0x1
+
+struct lz_frame_header {
+  uint32_t magic;
+  uint32_t block;
+  uint16_t raw_len;
+  uint16_t flags;
+  uint32_t comp_len;
+};
+
+#define LZ_BLOCK_SIZE(file_block_size)                                        \
+  ((file_block_size) - sizeof(struct lz_frame_header))
+
+#endif /* lib/lz.h */
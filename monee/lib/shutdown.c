@@ -4,10 +4,19 @@
 #include <string.h>
 #include "app/micro_replay.h"
 #include "devices/serial.h"
+#include "mem/kmap.h"
+#include "mem/mtrace.h"
 #include "mem/palloc.h"
+#include "mem/snapshot.h"
 #include "mem/swap.h"
 #include "peep/callouts.h"
+#include "peep/jumptable1.h"
+#include "peep/rollback_cache.h"
+#include "peep/insn_cache.h"
+#include "peep/superblock.h"
 #include "peep/tb.h"
+#include "sys/interrupt.h"
+#include "sys/rr_log.h"
 
 static void print_stats(void);
 
@@ -86,9 +95,19 @@ print_stats(void)
 {
 	thread_print_stats();
 	tb_print_stats();
+	jumptable1_print_stats();
+	superblock_print_stats();
+	rollback_cache_print_stats();
+	insn_cache_print_stats();
+	palloc_print_stats();
 	swap_print_stats();
+	kmap_print_stats();
+	mtrace_print_stats();
 	exception_print_stats();
-	//micro_replay_print_stats();
+	intr_print_stats();
+	micro_replay_print_stats();
+	snapshot_print_stats();
+	rr_log_print_stats();
 	callout_print_stats();
 }
 
@@ -11,6 +11,8 @@
 #include "sys/interrupt.h"
 #include "sys/mode.h"
 #include "sys/rr_log.h"
+#include "lib/lz.h"
+#include "threads/thread.h"
 
 /* Auxiliary data for vsnprintf_helper(). */
 struct vsnprintf_aux 
@@ -721,10 +723,23 @@ sputc(int c,struct str_data* sd)
   return (*--sd->str==c)?c:-1;
 }
 
+#ifdef __MONITOR__
+static int zfile_getc(FILE *stream);
+static size_t zfile_read(void *buf, size_t count, FILE *stream);
+static size_t zfile_write(void const *buf, size_t count, FILE *stream);
+static void zfile_flush(FILE *stream);
+static void zfile_seek(FILE *stream, off_t offset);
+#endif
+
 int
 fgetc(struct FILE *stream)
 {
   ASSERT(!strcmp(stream->mode, "r") || !strcmp(stream->mode, "rw"));
+#ifdef __MONITOR__
+  if (stream->compress) {
+    return zfile_getc(stream);
+  }
+#endif
   if (!stream->sector_in_memory) {
     disk_read(stream->disk, stream->disk_sector,
         FILE_BLOCK_SIZE/DISK_SECTOR_SIZE, stream->sector);
@@ -763,6 +778,12 @@ fputc(int c, FILE *stream)
   ASSERT(stream);
   ASSERT(stream->disk);
   ASSERT(!strcmp(stream->mode, "w") || !strcmp(stream->mode, "rw"));
+#ifdef __MONITOR__
+  if (stream->compress) {
+    uint8_t ch = c;
+    return zfile_write(&ch, 1, stream) ? 0 : EOF;
+  }
+#endif
   //ASSERT(stream->sector_in_memory == false);
   if (stream->pos < FILE_BLOCK_SIZE) {
     stream->sector[stream->pos++] = c;
@@ -782,6 +803,12 @@ fputc(int c, FILE *stream)
 void
 fflush(FILE *stream)
 {
+#ifdef __MONITOR__
+  if (stream->compress) {
+    zfile_flush(stream);
+    return;
+  }
+#endif
   if (!strcmp(stream->mode, "w") || !strcmp(stream->mode, "rw")) {
     disk_sector_t disk_sectors_finished_writing;
 
@@ -1278,6 +1305,13 @@ fopen(struct disk *disk, char const *mode)
   stream->disk_sector = 0;
   //stream->disk_sector = 0x200000;   //2M*DISK_SECTOR_SIZE=1G for hardware tests
   stream->sector_in_memory = false;
+  stream->compress = false;
+  stream->frame = NULL;
+  stream->tag = 0;
+  memset(stream->tag_bytes, 0, sizeof stream->tag_bytes);
+  memset(stream->stats_raw, 0, sizeof stream->stats_raw);
+  memset(stream->stats_comp, 0, sizeof stream->stats_comp);
+  memset(stream->stats_cycles, 0, sizeof stream->stats_cycles);
   stream->mode = malloc(strlen(mode) + 1);
   strlcpy(stream->mode, mode, strlen(mode) + 1);
   ASSERT((FILE_BLOCK_SIZE % DISK_SECTOR_SIZE) == 0);
@@ -1302,6 +1336,11 @@ fread(void *buf, size_t size, size_t nmemb, FILE *stream)
   uint8_t *end = ptr + count;
 
   ASSERT(!strcmp(stream->mode, "r") || !strcmp(stream->mode, "rw"));
+#ifdef __MONITOR__
+  if (stream->compress) {
+    return zfile_read(buf, count, stream)/size;
+  }
+#endif
   do {
     size_t num_read;
     if (!stream->sector_in_memory) {
@@ -1338,6 +1377,11 @@ fwrite(const void *buf, size_t size, size_t nmemb, FILE *stream)
   uint8_t const *end = ptr + count;
 
   ASSERT(!strcmp(stream->mode, "w") || !strcmp(stream->mode, "rw"));
+#ifdef __MONITOR__
+  if (stream->compress) {
+    return zfile_write(buf, count, stream)/size;
+  }
+#endif
   //ASSERT(stream->sector_in_memory == false);
   do {
     if (stream->pos < FILE_BLOCK_SIZE) {
@@ -1369,6 +1413,12 @@ fseeko(struct FILE *stream, off_t offset, int whence)
 	if (whence != SEEK_SET) {
 		NOT_IMPLEMENTED();
 	}
+#ifdef __MONITOR__
+	if (stream->compress) {
+		zfile_seek(stream, offset);
+		return 0;
+	}
+#endif
 	stream->disk_sector = ((int)(offset/FILE_BLOCK_SIZE))*
 		FILE_BLOCK_SIZE/DISK_SECTOR_SIZE;
 	if (stream->disk_sector > disk_size(stream->disk)) {
@@ -1385,6 +1435,11 @@ fseeko(struct FILE *stream, off_t offset, int whence)
 off_t
 ftello(struct FILE *stream)
 {
+#ifdef __MONITOR__
+	if (stream->compress) {
+		return (off_t)stream->block*LZ_BLOCK_SIZE(FILE_BLOCK_SIZE) + stream->pos;
+	}
+#endif
 	return stream->disk_sector*DISK_SECTOR_SIZE + stream->pos;
 }
 
@@ -1399,6 +1454,226 @@ file_check(FILE *stream)
   }
 }
 
+void
+file_set_tag(FILE *stream, int tag)
+{
+  ASSERT(tag >= 0 && tag < FILE_NUM_TAGS);
+  stream->tag = tag;
+}
+
+#ifdef __MONITOR__
+/******************************************************************************
+ * Compressed files. Logical block N (ZBLOCK_SIZE bytes) is kept as one frame
+ * in the FILE_BLOCK_SIZE slot at disk sector N * ZBLOCK_SECTORS; only the
+ * sectors the frame occupies are written. See lib/lz.h.
+ ******************************************************************************/
+#define ZBLOCK_SIZE LZ_BLOCK_SIZE(FILE_BLOCK_SIZE)
+#define ZBLOCK_SECTORS (FILE_BLOCK_SIZE/DISK_SECTOR_SIZE)
+
+/* Switches STREAM, which must have just been opened, to block-framed
+ * compression. */
+void
+file_set_compress(FILE *stream)
+{
+  ASSERT(!stream->sector_in_memory && ftello(stream) == 0);
+  stream->frame = malloc(FILE_BLOCK_SIZE);
+  ASSERT(stream->frame);
+  stream->compress = true;
+  stream->block = 0;
+  stream->block_len = 0;
+  stream->frame_raw_len = 0;
+  stream->frame_comp_len = 0;
+}
+
+/* Starts block BLOCK in memory, empty. */
+static void
+zfile_new_block(FILE *stream, size_t block)
+{
+  stream->block = block;
+  stream->block_len = 0;
+  stream->pos = 0;
+  stream->frame_raw_len = 0;
+  stream->frame_comp_len = 0;
+  stream->sector_in_memory = true;
+}
+
+/* Reads block BLOCK from its frame. A slot without a valid frame for BLOCK
+ * reads as an empty block. */
+static void
+zfile_load_block(FILE *stream, size_t block)
+{
+  struct lz_frame_header const *h = (void *)stream->frame;
+  disk_sector_t sector = block * ZBLOCK_SECTORS;
+  size_t n_sectors;
+
+  zfile_new_block(stream, block);
+  if (sector >= disk_size(stream->disk)) {
+    return;
+  }
+  disk_read(stream->disk, sector, 1, stream->frame);
+  if (   h->magic != LZ_FRAME_MAGIC || h->block != block
+      || h->raw_len > ZBLOCK_SIZE || h->comp_len > ZBLOCK_SIZE) {
+    return;
+  }
+  n_sectors = DIV_ROUND_UP(sizeof *h + h->comp_len, DISK_SECTOR_SIZE);
+  if (n_sectors > 1) {
+    disk_read(stream->disk, sector + 1, n_sectors - 1,
+        stream->frame + DISK_SECTOR_SIZE);
+  }
+  if (h->flags & LZ_FRAME_STORED) {
+    ASSERT(h->comp_len == h->raw_len);
+    memcpy(stream->sector, h + 1, h->raw_len);
+  } else if (lz_decompress(h + 1, h->comp_len, stream->sector, ZBLOCK_SIZE)
+      != h->raw_len) {
+    printf("Corrupt frame for block %zu, ignoring it.\n", block);
+    return;
+  }
+  stream->block_len = h->raw_len;
+  stream->frame_raw_len = h->raw_len;
+  stream->frame_comp_len = sizeof *h + h->comp_len;
+}
+
+/* Compresses the block in memory and writes its frame. The growth of the
+ * frame since it was last written is charged to the tags of the bytes
+ * written meanwhile. Returns false if the frame does not fit on the disk. */
+static bool
+zfile_write_block(FILE *stream)
+{
+  struct lz_frame_header *h = (void *)stream->frame;
+  size_t raw_len = stream->block_len, frame_len, n_sectors, total = 0;
+  uint64_t start = rdtsc(), cycles;
+  int64_t grown;
+  int i;
+
+  h->comp_len = lz_compress(stream->sector, raw_len, h + 1, raw_len - 1);
+  h->flags = 0;
+  if (!h->comp_len) {
+    memcpy(h + 1, stream->sector, raw_len);
+    h->comp_len = raw_len;
+    h->flags = LZ_FRAME_STORED;
+  }
+  h->magic = LZ_FRAME_MAGIC;
+  h->block = stream->block;
+  h->raw_len = raw_len;
+  frame_len = sizeof *h + h->comp_len;
+  n_sectors = DIV_ROUND_UP(frame_len, DISK_SECTOR_SIZE);
+  if (stream->block * ZBLOCK_SECTORS + n_sectors > disk_size(stream->disk)) {
+    return false;
+  }
+  memset(stream->frame + frame_len, 0, n_sectors*DISK_SECTOR_SIZE - frame_len);
+  disk_write(stream->disk, stream->block * ZBLOCK_SECTORS, n_sectors,
+      stream->frame);
+  cycles = rdtsc() - start;
+
+  grown = (int64_t)frame_len - (int64_t)stream->frame_comp_len;
+  for (i = 0; i < FILE_NUM_TAGS; i++) {
+    total += stream->tag_bytes[i];
+  }
+  if (!total) {
+    stream->stats_cycles[stream->tag] += cycles;
+    stream->stats_comp[stream->tag] += grown;
+  }
+  for (i = 0; total && i < FILE_NUM_TAGS; i++) {
+    if (stream->tag_bytes[i]) {
+      stream->stats_raw[i] += stream->tag_bytes[i];
+      stream->stats_comp[i] += grown * (int64_t)stream->tag_bytes[i]
+        / (int64_t)total;
+      stream->stats_cycles[i] += cycles * stream->tag_bytes[i] / total;
+      stream->tag_bytes[i] = 0;
+    }
+  }
+  stream->frame_raw_len = raw_len;
+  stream->frame_comp_len = frame_len;
+  return true;
+}
+
+/* Makes sure that a byte can be read at STREAM->pos. */
+static bool
+zfile_readable(FILE *stream)
+{
+  if (!stream->sector_in_memory) {
+    zfile_load_block(stream, stream->block);
+  }
+  if (stream->pos < stream->block_len) {
+    return true;
+  }
+  if (stream->block_len < ZBLOCK_SIZE) {
+    return false;
+  }
+  zfile_load_block(stream, stream->block + 1);
+  return stream->block_len > 0;
+}
+
+static int
+zfile_getc(FILE *stream)
+{
+  if (!zfile_readable(stream)) {
+    return EOF;
+  }
+  return (uint8_t)stream->sector[stream->pos++];
+}
+
+static size_t
+zfile_read(void *buf, size_t count, FILE *stream)
+{
+  uint8_t *ptr = buf, *end = ptr + count;
+
+  while (ptr < end && zfile_readable(stream)) {
+    size_t n = min((size_t)(end - ptr), stream->block_len - stream->pos);
+    memcpy(ptr, &stream->sector[stream->pos], n);
+    ptr += n;
+    stream->pos += n;
+  }
+  return ptr - (uint8_t *)buf;
+}
+
+static size_t
+zfile_write(void const *buf, size_t count, FILE *stream)
+{
+  uint8_t const *ptr = buf, *end = ptr + count;
+
+  while (ptr < end) {
+    size_t n;
+
+    if (!stream->sector_in_memory) {
+      /* Writing starts a block afresh; there is nothing to merge with. */
+      zfile_new_block(stream, stream->block);
+    }
+    n = min((size_t)(end - ptr), ZBLOCK_SIZE - stream->pos);
+    memcpy(&stream->sector[stream->pos], ptr, n);
+    ptr += n;
+    stream->pos += n;
+    stream->tag_bytes[stream->tag] += n;
+    if (stream->pos > stream->block_len) {
+      stream->block_len = stream->pos;
+    }
+    if (stream->pos == ZBLOCK_SIZE) {
+      if (!zfile_write_block(stream)) {
+        break;
+      }
+      zfile_new_block(stream, stream->block + 1);
+    }
+  }
+  return ptr - (uint8_t *)buf;
+}
+
+static void
+zfile_flush(FILE *stream)
+{
+  if (   (!strcmp(stream->mode, "w") || !strcmp(stream->mode, "rw"))
+      && stream->sector_in_memory && stream->block_len) {
+    zfile_write_block(stream);
+  }
+}
+
+static void
+zfile_seek(FILE *stream, off_t offset)
+{
+  zfile_load_block(stream, offset / ZBLOCK_SIZE);
+  stream->pos = offset % ZBLOCK_SIZE;
+}
+#endif
+
 /* Prints SIZE, which represents a number of bytes, in a
    human-readable format, e.g. "256 kB". */
 void
@@ -20,6 +20,8 @@
 
 #define FILE_BLOCK_SIZE 65536
 
+#define FILE_NUM_TAGS 8
+
 typedef struct FILE {
   char *mode;
   struct disk *disk;
@@ -27,6 +29,23 @@ typedef struct FILE {
   bool sector_in_memory;
   disk_sector_t disk_sector;
   size_t pos;
+
+  /* Block-framed LZ compression, see lib/lz.h and file_set_compress(). In
+   * this mode sector[] holds logical block BLOCK, of which BLOCK_LEN bytes
+   * are valid, and DISK_SECTOR is not used. */
+  bool compress;
+  size_t block;
+  size_t block_len;
+  uint8_t *frame;
+  size_t frame_raw_len;         /* raw bytes in the last frame written. */
+  size_t frame_comp_len;        /* size of the last frame written. */
+
+  /* Compression stats, by the tag set with file_set_tag(). */
+  int tag;
+  size_t tag_bytes[FILE_NUM_TAGS];
+  uint64_t stats_raw[FILE_NUM_TAGS];
+  int64_t stats_comp[FILE_NUM_TAGS];
+  uint64_t stats_cycles[FILE_NUM_TAGS];
 } FILE;
 
 FILE *fopen(struct disk *disk, char const *mode);
@@ -77,6 +96,8 @@ long strtol(char const *nptr, char **endptr, int base);
 long long strtoll(char const *nptr, char **endptr, int base);
 int vfprintf(FILE *stream, char const *format, va_list args);
 void file_check(FILE *stream);
+void file_set_compress(FILE *stream);
+void file_set_tag(FILE *stream, int tag);
 
 /* Try to be helpful. */
 #define sprintf dont_use_sprintf_use_snprintf
@@ -2,22 +2,34 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <debug.h>
+#include "mem/vaddr.h"
 #include "threads/thread.h"
 
 /* Copies SIZE bytes from SRC to DST, which must not overlap.
-   Returns DST. */
+   Returns DST. Copies bytes up to a 4-byte boundary of DST, then
+   words with rep movsl, then the remaining bytes. */
 void *
 memcpy (void *dst_, const void *src_, size_t size) 
 {
-  unsigned char *dst = dst_;
-  const unsigned char *src = src_;
+  void *dst = dst_;
+  const void *src = src_;
 
   //ASSERT (dst != NULL || size == 0);
   //ASSERT (src != NULL || size == 0);
 
-  while (size-- > 0) {
-    *dst++ = *src++;
+  if (size >= 16) {
+    size_t head = -(uintptr_t) dst & 3, words;
+
+    size -= head;
+    words = size / 4;
+    size %= 4;
+    asm volatile ("cld; rep movsb"
+        : "+D" (dst), "+S" (src), "+c" (head) : : "memory");
+    asm volatile ("rep movsl"
+        : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
   }
+  asm volatile ("cld; rep movsb"
+      : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
 
   return dst_;
 }
@@ -29,26 +41,33 @@ memmove (void *dst_, const void *src_, size_t size)
 {
   unsigned char *dst = dst_;
   const unsigned char *src = src_;
+  size_t words;
 
   ASSERT (dst != NULL || size == 0);
   ASSERT (src != NULL || size == 0);
 
-  if (dst < src) 
-    {
-      while (size-- > 0)
-        *dst++ = *src++;
-    }
-  else 
-    {
-      dst += size;
-      src += size;
-      while (size-- > 0)
-        *--dst = *--src;
-    }
+  if (dst <= src || dst >= src + size) 
+    return memcpy (dst_, src_, size);
+
+  /* DST overlaps the end of SRC: copy downward, the odd bytes at the
+     end first, then words. */
+  words = size / 4;
+  size %= 4;
+  dst += words * 4 + size - 1;
+  src += words * 4 + size - 1;
+  asm volatile ("std; rep movsb"
+      : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+  dst -= 3;
+  src -= 3;
+  asm volatile ("rep movsl; cld"
+      : "+D" (dst), "+S" (src), "+c" (words) : : "memory", "cc");
 
-  return dst;
+  return dst_;
 }
 
+/* A 32-bit word that may be unaligned and may alias anything. */
+typedef uint32_t __attribute__ ((may_alias)) string_word_t;
+
 /* Find the first differing byte in the two blocks of SIZE bytes
    at A and B.  Returns a positive value if the byte in A is
    greater, a negative value if the byte in B is greater, or zero
@@ -64,6 +83,11 @@ memcmp (const void *a_, const void *b_, size_t size)
   ASSERT (b != NULL || size == 0);
   */
 
+  /* Skip equal words; the bytes of the first differing one are
+     compared below. */
+  for (; size >= 4; a += 4, b += 4, size -= 4)
+    if (*(const string_word_t *) a != *(const string_word_t *) b)
+      break;
   for (; size-- > 0; a++, b++)
     if (*a != *b)
       return *a > *b ? +1 : -1;
@@ -312,16 +336,66 @@ strtok_r (char *s, const char *delimiters, char **save_ptr)
 void *
 memset (void *dst_, int value, size_t size) 
 {
-  unsigned char *dst = dst_;
+  void *dst = dst_;
+  uint32_t word = (unsigned char) value * 0x01010101u;
 
   ASSERT (dst != NULL || size == 0);
   
-  while (size-- > 0)
-    *dst++ = value;
+  if (size >= 16) {
+    size_t head = -(uintptr_t) dst & 3, words;
+
+    size -= head;
+    words = size / 4;
+    size %= 4;
+    asm volatile ("cld; rep stosb"
+        : "+D" (dst), "+c" (head) : "a" (word) : "memory");
+    asm volatile ("rep stosl"
+        : "+D" (dst), "+c" (words) : "a" (word) : "memory");
+  }
+  asm volatile ("cld; rep stosb"
+      : "+D" (dst), "+c" (size) : "a" (word) : "memory");
 
   return dst_;
 }
 
+/* Copies the page at SRC to DST. Both must be page-aligned. */
+void
+copy_page (void *dst, const void *src)
+{
+  size_t words = PGSIZE / 4;
+
+  ASSERT (pg_ofs (dst) == 0 && pg_ofs (src) == 0);
+  asm volatile ("cld; rep movsl"
+      : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+}
+
+/* Zeroes the page at DST, which must be page-aligned. */
+void
+zero_page (void *dst)
+{
+  size_t words = PGSIZE / 4;
+
+  ASSERT (pg_ofs (dst) == 0);
+  asm volatile ("cld; rep stosl"
+      : "+D" (dst), "+c" (words) : "a" (0) : "memory");
+}
+
+/* Returns true if the pages at A and B, which must be page-aligned,
+   hold the same bytes. */
+bool
+pages_equal (const void *a_, const void *b_)
+{
+  const uint32_t *a = a_, *b = b_;
+  size_t i;
+
+  ASSERT (pg_ofs (a) == 0 && pg_ofs (b) == 0);
+  for (i = 0; i < PGSIZE / 4; i += 4)
+    if ((a[i] ^ b[i]) | (a[i + 1] ^ b[i + 1])
+        | (a[i + 2] ^ b[i + 2]) | (a[i + 3] ^ b[i + 3]))
+      return false;
+  return true;
+}
+
 /* Returns the length of STRING. */
 size_t
 strlen (const char *string) 
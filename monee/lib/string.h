@@ -31,6 +31,9 @@ int strstart(const char *str, const char *val, const char **ptr);
 bool is_whitespace(char const *);
 
 /* Custom functions. */
+void copy_page (void *dst, const void *src);
+void zero_page (void *dst);
+bool pages_equal (const void *a, const void *b);
 void make_string_replacements(char *out, unsigned out_size, char const *in,
     char **patterns, char **replacements, int num_patterns);
 
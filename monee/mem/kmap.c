@@ -0,0 +1,186 @@
+#include "mem/kmap.h"
+#include <debug.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "mem/paging.h"
+#include "mem/palloc.h"
+#include "mem/pte.h"
+#include "sys/mode.h"
+#include "sys/vcpu.h"
+
+/* Never a frame address, so that every slot starts out empty. */
+#define KMAP_NONE ((target_phys_addr_t)1)
+
+uint8_t *kmap_base;
+target_phys_addr_t kmap_frames[KMAP_SLOTS] = {
+  [0 ... KMAP_SLOTS - 1] = KMAP_NONE
+};
+
+/* The window is at most KMAP_SLOTS pages, so it touches at most two large
+ * monitor pages. Those are mapped through KMAP_PTS instead of large pdes. */
+static uint32_t *kmap_pts[2];
+static size_t kmap_first_pd, kmap_num_pts;
+
+#ifdef KMAP_STATS
+long long kmap_num_hits = 0, kmap_num_fallbacks = 0;
+#endif
+static long long kmap_num_misses = 0;
+
+static uint32_t *
+kmap_pte(void const *vaddr)
+{
+  ASSERT(pd_no(vaddr) - kmap_first_pd < kmap_num_pts);
+  return &kmap_pts[pd_no(vaddr) - kmap_first_pd][pt_no(vaddr)];
+}
+
+void
+kmap_init(void)
+{
+  size_t i, j;
+
+  kmap_base = palloc_get_multiple(PAL_ASSERT, KMAP_SLOTS);
+  kmap_first_pd = pd_no(kmap_base);
+  kmap_num_pts = pd_no(kmap_base + KMAP_SLOTS * PGSIZE - 1) - kmap_first_pd + 1;
+  ASSERT(kmap_num_pts <= sizeof kmap_pts / sizeof kmap_pts[0]);
+
+  /* Map the large pages of the window in 4KB pages, as they were. */
+  for (i = 0; i < kmap_num_pts; i++) {
+    uint8_t *lpage = (uint8_t *)((kmap_first_pd + i) << LPGBITS);
+
+    kmap_pts[i] = palloc_get_page(PAL_ASSERT);
+    for (j = 0; j < (1 << 10); j++) {
+      kmap_pts[i][j] = pte_create(vtop_mon(lpage + j * PGSIZE), true) | PTE_G;
+    }
+  }
+  /* The frames behind the window are not used again. */
+  for (i = 0; i < KMAP_SLOTS; i++) {
+    *kmap_pte(kmap_base + i * PGSIZE) = 0;
+  }
+  MSG("%s(): kmap_base=%p, %d slots\n", __func__, kmap_base, KMAP_SLOTS);
+}
+
+/* Maps the monitor, including the window, into page directory PD. */
+void
+kmap_map_monitor(uint32_t *pd)
+{
+  target_ulong page;
+
+  for (page = LOADER_MONITOR_BASE; page < LOADER_MONITOR_END; page += LPGSIZE) {
+    size_t pd_num = pd_no(ptov_mon(page));
+
+    if (kmap_base && pd_num - kmap_first_pd < kmap_num_pts) {
+      pd[pd_num] = pde_create_mon(vtop_mon(kmap_pts[pd_num - kmap_first_pd]),
+          true);
+    } else {
+      pd[pd_num] = pde_create_large_mon(page, true);
+    }
+  }
+}
+
+/* Maps the frame of PADDR into its slot, and returns the address of PADDR
+ * in the window, or NULL if the frame cannot be mapped. */
+void *
+kmap_install(target_phys_addr_t paddr)
+{
+  target_phys_addr_t frame = paddr & ~PGMASK;
+  size_t slot = (paddr >> PGBITS) % KMAP_SLOTS;
+  uint8_t *vaddr;
+  enum mode_t mode;
+
+  ASSERT(kmap_base);
+  if (frame >= LOADER_MONITOR_BASE && frame < LOADER_MONITOR_END) {
+    KMAP_COUNT(kmap_num_fallbacks);
+    return NULL;
+  }
+  vaddr = kmap_base + slot * PGSIZE;
+  kmap_frames[slot] = frame;
+  *kmap_pte(vaddr) = pte_create(frame, true) | PTE_G;
+  /* Also drops a global 4MB translation left from before kmap_init(). */
+  mode = switch_to_kernel();
+  asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
+  switch_mode(mode);
+  kmap_num_misses++;
+  return vaddr + (paddr & PGMASK);
+}
+
+/* Returns the frame address to which the supervisor shadow page dir maps
+ * the LEN bytes at guest-virtual VADDR, or KMAP_NO_PADDR if they cross a page
+ * or if a load through the shadow would fault. */
+target_phys_addr_t
+kmap_shadow_paddr(target_ulong vaddr, size_t len)
+{
+  target_phys_addr_t paddr;
+
+  if (   vaddr >= LOADER_MONITOR_VIRT_BASE
+      || (vaddr & PGMASK) + len > PGSIZE
+      || !vcpu.shadow_page_dir[0]) {
+    return KMAP_NO_PADDR;
+  }
+  paddr = pt_walk(vcpu.shadow_page_dir[0], vaddr, NULL, NULL, PTWALK_SHADOW);
+  if (paddr == PDE_ERR || paddr == PTE_ERR) {
+    return KMAP_NO_PADDR;
+  }
+  return paddr;
+}
+
+#define KMAP_BENCH_BASE   0x100000
+#define KMAP_BENCH_SPAN   0x100000
+#define KMAP_BENCH_STRIDE 64
+#define KMAP_BENCH_TICKS  TIMER_FREQ
+
+static volatile uint32_t kmap_bench_sink;
+
+/* Returns the number of 4-byte loads per second, through the window or
+ * through phys_map, walking KMAP_BENCH_SPAN bytes of guest memory. */
+static long long
+kmap_bench_run(bool window)
+{
+  target_phys_addr_t ofs = 0;
+  long long n = 0;
+  uint32_t sum = 0;
+  int64_t start;
+  int i;
+
+  start = timer_ticks();
+  while (timer_ticks() == start);
+  start = timer_ticks();
+  while (timer_elapsed(start) < KMAP_BENCH_TICKS) {
+    for (i = 0; i < 1024; i++) {
+      target_phys_addr_t paddr = KMAP_BENCH_BASE + ofs;
+
+      if (window) {
+        sum += ldl_phys(paddr);
+      } else {
+        sum += ld_phys_map(paddr, uint32_t, l);
+      }
+      ofs = (ofs + KMAP_BENCH_STRIDE) % KMAP_BENCH_SPAN;
+    }
+    n += 1024;
+  }
+  kmap_bench_sink = sum;
+  return n * TIMER_FREQ / KMAP_BENCH_TICKS;
+}
+
+/* Compares guest-physical loads through the window with loads that switch
+ * to phys_map. Interrupts must be on and paging_init() must have run. */
+void
+kmap_bench(void)
+{
+  long long window, phys_map;
+
+  window = kmap_bench_run(true);
+  phys_map = kmap_bench_run(false);
+  printf("%s(): %lld loads/s through the window, %lld loads/s through "
+      "phys_map.\n", __func__, window, phys_map);
+}
+
+void
+kmap_print_stats(void)
+{
+#ifdef KMAP_STATS
+  printf("MON-STATS: kmap: %lld hits, %lld misses, %lld fallbacks to "
+      "phys_map.\n", kmap_num_hits, kmap_num_misses, kmap_num_fallbacks);
+#else
+  printf("MON-STATS: kmap: %lld misses.\n", kmap_num_misses);
+#endif
+}
@@ -0,0 +1,96 @@
+#ifndef MEM_KMAP_H
+#define MEM_KMAP_H
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/types.h>
+#include "mem/vaddr.h"
+
+/* A window of KMAP_SLOTS monitor pages through which the monitor reads and
+ * writes guest-physical memory without switching to phys_map. The window
+ * lives in the monitor's part of the address space, which is the same in
+ * phys_map and in all shadow page directories, so a mapped frame can be
+ * accessed with a plain load or store under any of them.
+ *
+ * Slot I maps the last frame accessed whose frame number is I modulo
+ * KMAP_SLOTS. Replacing a slot rewrites its pte and invalidates the old
+ * translation with invlpg; CR3 is never reloaded. Frames in
+ * LOADER_MONITOR_BASE..LOADER_MONITOR_END are swapped in and out by
+ * mem/swap.c and are never mapped in the window. Accesses to them, and
+ * accesses that cross a page boundary, still go through phys_map.
+ *
+ * Guest-physical accesses (ld_phys/st_phys) and guest-virtual loads
+ * (ld_kernel) use the window. A load first walks the supervisor shadow page
+ * dir, which is monitor memory, and goes through the window only if the
+ * shadow already maps the page; otherwise it switches to the shadow as
+ * before and takes the fault that fills it in, or that reaches the guest.
+ * Guest-virtual stores (st_kernel) always switch to the shadow: their write
+ * faults are what drive mtrace, the snapshot and the guest dirty bits.
+ *
+ * Hits and fallbacks are only counted with KMAP_STATS, to keep the inline
+ * fast path free of global counters. */
+#ifndef KMAP_SLOTS
+#define KMAP_SLOTS 32
+#endif
+
+#ifdef KMAP_STATS
+#define KMAP_COUNT(counter) ((counter)++)
+#else
+#define KMAP_COUNT(counter)
+#endif
+
+/* Never a frame address. */
+#define KMAP_NO_PADDR ((target_phys_addr_t)-1)
+
+#ifdef __MONITOR__
+extern uint8_t *kmap_base;
+extern target_phys_addr_t kmap_frames[KMAP_SLOTS];
+#ifdef KMAP_STATS
+extern long long kmap_num_hits, kmap_num_fallbacks;
+#endif
+
+void kmap_init(void);
+void kmap_map_monitor(uint32_t *pd);
+void *kmap_install(target_phys_addr_t paddr);
+target_phys_addr_t kmap_shadow_paddr(target_ulong vaddr, size_t len);
+void kmap_bench(void);
+void kmap_print_stats(void);
+
+/* Returns a monitor address through which the LEN bytes of guest memory at
+ * PADDR can be accessed, or NULL if they must be accessed through
+ * phys_map. */
+static inline void *
+kmap_phys(target_phys_addr_t paddr, size_t len)
+{
+  size_t slot = (paddr >> PGBITS) % KMAP_SLOTS;
+
+  if ((paddr & PGMASK) + len > PGSIZE) {
+    KMAP_COUNT(kmap_num_fallbacks);
+    return NULL;
+  }
+  if (kmap_frames[slot] != (paddr & ~PGMASK)) {
+    return kmap_install(paddr);
+  }
+  KMAP_COUNT(kmap_num_hits);
+  return kmap_base + slot * PGSIZE + (paddr & PGMASK);
+}
+
+/* Returns a monitor address through which the LEN bytes at guest-virtual
+ * VADDR can be loaded, or NULL if they must be loaded through the supervisor
+ * shadow page dir. */
+static inline void *
+kmap_kernel(target_ulong vaddr, size_t len)
+{
+  target_phys_addr_t paddr = kmap_shadow_paddr(vaddr, len);
+
+  if (paddr == KMAP_NO_PADDR) {
+    KMAP_COUNT(kmap_num_fallbacks);
+    return NULL;
+  }
+  return kmap_phys(paddr, len);
+}
+#else
+#define kmap_phys(paddr, len) ((void *)NULL)
+#define kmap_kernel(vaddr, len) ((void *)NULL)
+#endif
+
+#endif /* mem/kmap.h */
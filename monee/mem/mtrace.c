@@ -4,12 +4,14 @@
 #include <hash.h>
 #include <rbtree.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "mem/malloc.h"
 #include "mem/malloc_cb.h"
 #include "mem/paging.h"
 #include "mem/palloc.h"
 #include "mem/pte.h"
 #include "mem/simulate_insn.h"
+#include "mem/snapshot.h"
 #include "mem/swap.h"
 #include "peep/i386-dis.h"
 #include "peep/insn.h"
@@ -19,6 +21,7 @@
 #include "sys/exception.h"
 #include "sys/interrupt.h"
 #include "sys/rr_log.h"
+#include "threads/thread.h"
 
 #define MTRACE  2
 #define MTRACE2 2
@@ -353,6 +356,7 @@ pte_remove_mtrace(uint32_t *pte, target_phys_addr_t paddr, void *opaque)
 		ASSERT(e);
 		ASSERT(found == hash_entry(e, struct pte_entry, h_elem));
 		*found->pte = found->pte_val;
+		snapshot_protect_pte(found->pte, found->paddr, NULL);
 		free(found);
 	}
 }
@@ -401,24 +405,51 @@ pte_remove_all_mtraces(uint32_t *pte)
 	ASSERT(pte == pe->pte);
 	ASSERT((*pte & ~PTE_MASK) == (pe->pte_val & ~PTE_MASK));
 	*pte = pe->pte_val;
+	snapshot_protect_pte(pte, pe->paddr, NULL);
 	free(pe);
 }
 
-struct callback_ls_entry {
+/* A write fault collects its callbacks on the stack, and only moves them to
+ * the heap if more than this many mtraces cover the page. */
+#define MTRACE_STACK_CALLBACKS 16
+
+struct mtrace_callback {
 	void (*callback)(target_phys_addr_t start, size_t len, void *opaque);
 	void *opaque;
-	struct list_elem l_elem;
 };
 
+static long long mtrace_num_faults = 0;
+
+/* Returns a copy of the *MAX callbacks at CALLBACKS with room for twice as
+ * many, allocated through MTRACE's malloc_cb, and frees CALLBACKS unless it
+ * is STACK. */
+static struct mtrace_callback *
+mtrace_grow_callbacks(struct mtrace_callback *callbacks,
+		struct mtrace_callback const *stack, size_t *max,
+		struct mtrace const *mtrace)
+{
+	struct mtrace_callback *grown;
+
+	(*mtrace->malloc_cb->lock)(mtrace->opaque);
+	grown = (*mtrace->malloc_cb->malloc)(2 * *max * sizeof *grown);
+	(*mtrace->malloc_cb->unlock)(mtrace->opaque);
+	ASSERT(grown);
+	memcpy(grown, callbacks, *max * sizeof *grown);
+	if (callbacks != stack) {
+		free(callbacks);
+	}
+	*max *= 2;
+	return grown;
+}
+
 bool
 mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 		target_phys_addr_t paddr, struct intr_frame *f)
 {
+	struct mtrace_callback stack_callbacks[MTRACE_STACK_CALLBACKS], *callbacks;
+	size_t n_callbacks, max_callbacks, i;
 	struct pte_entry needle, *found;
 	target_ulong fault_addr2;
-	struct list callback_ls;
-	struct h_elem *me;
-	struct mtrace mneedle;
 	size_t memaccess_size;
 	struct hash_elem *e;
 
@@ -429,6 +460,7 @@ mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 	}
 	LOG(MTRACE, "%s(): fault_addr=0x%x, paddr=0x%x\n", __func__, fault_addr,
 			paddr);
+	mtrace_num_faults++;
 	found = hash_entry(e, struct pte_entry, h_elem);
 	ASSERT(found->pte == needle.pte);
 	ASSERT(is_monitor_vaddr(found->pte));
@@ -449,7 +481,9 @@ mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 		NOT_IMPLEMENTED();
 	}
 
-	list_init(&callback_ls);
+	callbacks = stack_callbacks;
+	max_callbacks = MTRACE_STACK_CALLBACKS;
+	n_callbacks = 0;
 
 #define scan_hash(type, addr) do {																						\
 	struct list *eqlist;																												\
@@ -464,15 +498,14 @@ mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 		mtrace = hash_entry(elem, struct mtrace, h_elem_##type);									\
 		if (((addr) & ~PGMASK) == found->paddr) {																	\
 			/* We cannot make the callback because it may spoil the iterators, rather\
-			 * just store the callbacks in a list and call them outside the loop. */\
-			struct callback_ls_entry *cle;																					\
-			(*mtrace->malloc_cb->lock)(mtrace->opaque);															\
-			cle = (*mtrace->malloc_cb->malloc)(sizeof *cle);												\
-			(*mtrace->malloc_cb->unlock)(mtrace->opaque);														\
-			ASSERT(cle);																														\
-			cle->callback = mtrace->callback;																				\
-			cle->opaque = mtrace->opaque;																						\
-			list_push_back(&callback_ls, &cle->l_elem);															\
+			 * just store the callbacks and call them outside the loop. */					\
+			if (n_callbacks == max_callbacks) {																			\
+				callbacks = mtrace_grow_callbacks(callbacks, stack_callbacks,					\
+						&max_callbacks, mtrace);																					\
+			}																																				\
+			callbacks[n_callbacks].callback = mtrace->callback;											\
+			callbacks[n_callbacks].opaque = mtrace->opaque;													\
+			n_callbacks++;																													\
 		}																																					\
 	}																																						\
 } while (0)
@@ -480,13 +513,22 @@ mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 	scan_hash(begin, mtrace->start);
 	scan_hash(end, (mtrace->start + mtrace->len - 1));
 
-	ASSERT(!list_empty(&callback_ls));
-	while (!list_empty(&callback_ls)) {
-		struct list_elem *e = list_pop_front(&callback_ls);
-		struct callback_ls_entry *cle;
-		cle = list_entry(e, struct callback_ls_entry, l_elem);
-		(*cle->callback)(paddr, memaccess_size, cle->opaque);
-		free(cle);
+	ASSERT(n_callbacks > 0);
+	for (i = 0; i < n_callbacks; i++) {
+		(*callbacks[i].callback)(paddr, memaccess_size, callbacks[i].opaque);
+	}
+	if (callbacks != stack_callbacks) {
+		free(callbacks);
 	}
 	return true;
 }
+
+void
+mtrace_print_stats(void)
+{
+	long long ticks = monitor_ticks + guest_ticks;
+
+	printf("MON-STATS: mtrace: %lld write faults, %lld per second.\n",
+			mtrace_num_faults, ticks ? mtrace_num_faults * TIMER_FREQ / ticks : 0);
+	simulate_print_stats();
+}
@@ -23,6 +23,7 @@ void pte_remove_mtrace(uint32_t *pte, target_phys_addr_t paddr,
 
 bool mtraces_handle_page_fault(uint32_t *shadow_pte, target_ulong fault_addr,
 		target_phys_addr_t paddr, struct intr_frame *f);
+void mtrace_print_stats(void);
 
 
 #endif /* mem/mtrace.h */
@@ -5,11 +5,13 @@
 #include <string.h>
 #include <macros.h>
 #include <hash.h>
+#include "mem/kmap.h"
 #include "mem/malloc.h"
 #include "mem/vaddr.h"
 #include "mem/pte.h"
 #include "mem/pt_mode.h"
 #include "mem/palloc.h"
+#include "mem/snapshot.h"
 #include "mem/swap.h"
 #include "sys/exception.h"
 #include "sys/loader.h"
@@ -174,9 +176,10 @@ real_pagedir_load(bool init)
     }
   }
 
-  for (page = LOADER_MONITOR_BASE; page < LOADER_MONITOR_END; page += LPGSIZE) {
-    pd[((target_ulong)ptov_mon(page)) >> LPGBITS]
-      = pde_create_large_mon(page, true);
+  kmap_map_monitor(pd);
+
+  if (snapshot_armed) {
+    shadow_pt_scan(pd, snapshot_protect_pte, NULL);
   }
 
   vcpu.shadow_page_dir[0] = pd;
@@ -286,10 +289,7 @@ phys_map_init(void)
     }
   }
 
-  for (page = LOADER_MONITOR_BASE; page < LOADER_MONITOR_END; page += LPGSIZE) {
-    phys_map[((target_ulong)ptov_mon(page)) >> LPGBITS]
-      = pde_create_large_mon(page, true);
-  }
+  kmap_map_monitor(phys_map);
 }
 
 void
@@ -335,6 +335,7 @@ paging_init(void)
   //a20_enabled = false;
   vcpu.a20_mask = 0xffefffff;
 
+  kmap_init();
   phys_map_init();
 	vcpu.shadow_page_dir[0] = NULL;
 	vcpu.shadow_page_dir[1] = NULL;
@@ -352,6 +353,30 @@ cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf, int len,
   target_phys_addr_t cr3;
   int i;
 
+  if (is_write) {
+    snapshot_note_write(addr, len);
+  }
+  /* Copy page by page through the kmap window while it can map them. */
+  while (len > 0) {
+    int n = min(len, (int)(PGSIZE - (addr & PGMASK)));
+    uint8_t *kaddr = kmap_phys(addr, n);
+
+    if (!kaddr) {
+      break;
+    }
+    if (is_write) {
+      memcpy(kaddr, buf, n);
+    } else {
+      memcpy(buf, kaddr, n);
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+  if (!len) {
+    return;
+  }
+  ptr = (void *)addr;
   pt_mode = switch_to_phys();
   //asm volatile ("movl %%cr3, %0" : "=r" (cr3));
   //asm volatile ("movl %0, %%cr3" : : "r" (vtop_mon(phys_map)));
@@ -515,6 +540,7 @@ pt_mark_accessed_dirty(uint32_t *pd, target_ulong vaddr, bool dirty)
   if (pde & PTE_PS) {
     goto done;
   }
+  snapshot_note_write((target_phys_addr_t)&pd[pd_num], sizeof pd[0]);
   pd[pd_num] |= PG_ACCESSED_MASK;
   pt = (void *)(pde & PTE_ADDR);
   pt_num = (vaddr & PTMASK) >> PTSHIFT;
@@ -522,6 +548,7 @@ pt_mark_accessed_dirty(uint32_t *pd, target_ulong vaddr, bool dirty)
   if (!(pte & PTE_P)) {
     goto done;
   }
+  snapshot_note_write((target_phys_addr_t)&pt[pt_num], sizeof pt[0]);
   pt[pt_num] |= PG_ACCESSED_MASK;
   if (dirty) {
     pt[pt_num] |= PG_DIRTY_MASK;
@@ -606,6 +633,7 @@ pd_install_shadow_page(uint32_t pte, uint32_t *pte_shadow)
   }
   *pte_shadow = (paddr & PTE_ADDR) | shadow_pte_flags(pte & PTE_FLAGS);
 	pte_add_mtrace(pte_shadow, paddr, NULL);
+	snapshot_protect_pte(pte_shadow, paddr, NULL);
   DBGn(SWAP, "%d: pte_shadow=%p pte_shadow=0x%x\n", __LINE__, pte_shadow,
       *pte_shadow);
 }
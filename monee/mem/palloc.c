@@ -10,6 +10,7 @@
 #include "sys/init.h"
 #include "sys/loader.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 #include "mem/vaddr.h"
 
 #define PALLOC 2
@@ -35,15 +36,24 @@
    half to the user pool.  That should be huge overkill for the
    kernel pool, but that's just fine for demonstration purposes. */
 
-/* A memory pool. */
+/* A memory pool.
+
+   Every free page is on a doubly linked free list, threaded through
+   FREE_NEXT and FREE_PREV by page index, so that single pages are
+   allocated and freed in O(1) from its head.  Runs of pages are
+   found in USED_MAP, an element at a time (see bitmap_scan()), and
+   unlinked from the list page by page.  The list starts out with the
+   highest page at its head, so that single pages come from the top of
+   the pool and runs from the bottom, and the two fragment each other
+   as little as possible. */
 struct pool
   {
     struct lock lock;                   /* Mutual exclusion. */
 
-#define NUM_BITMAPS 3
-    struct bitmap *used_map;            /* Bitmap of free pages. */
-    struct bitmap *tc_map;              /* Bitmap indicating if page in TC. */
-    struct bitmap *swap_map;            /* Bitmap indicating if page in Swap. */
+    struct bitmap *used_map;            /* Bitmap of allocated pages. */
+    uint8_t *page_class;                /* PAL_TC, PAL_SWAP or 0, per page. */
+    int32_t *free_next, *free_prev;     /* Free list links, -1 at the ends. */
+    int32_t free_head;                  /* First free page, or -1. */
 
     uint8_t *base;                      /* Base of pool. */
   };
@@ -65,9 +75,15 @@ size_t free_pages;
 
 size_t kernel_page_count = 0;
 
+/* Allocation latency, for single pages ([0]) and runs ([1]). */
+static long long stats_num_allocs[2], stats_num_failures[2];
+static uint64_t stats_alloc_cycles[2], stats_max_alloc_cycles[2];
+static long long stats_num_frees;
+
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
-static bool page_from_pool (enum palloc_flags pool_id, void *page);
+static void free_list_push (struct pool *, size_t page_idx);
+static void free_list_remove (struct pool *, size_t page_idx);
 
 bool
 is_heap_addr(const void *addr)
@@ -128,7 +144,9 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
   struct pool *pool;
   void *pages;
-  size_t page_idx;
+  size_t page_idx, i;
+  uint64_t start, cycles;
+  int multi = page_cnt > 1;
 
   if (flags & PAL_TC) {
     if (tc_page_count + page_cnt > tc_page_limit) {
@@ -146,8 +164,26 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
     return NULL;
   }
 
+  start = rdtsc ();
   lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (!multi) {
+    if (pool->free_head != -1) {
+      page_idx = pool->free_head;
+      free_list_remove (pool, page_idx);
+      bitmap_mark (pool->used_map, page_idx);
+    } else {
+      page_idx = BITMAP_ERROR;
+    }
+  } else {
+    /* Unlink the run while its pages are still marked free. */
+    page_idx = bitmap_scan (pool->used_map, 0, page_cnt, false);
+    if (page_idx != BITMAP_ERROR) {
+      for (i = 0; i < page_cnt; i++) {
+        free_list_remove (pool, page_idx + i);
+      }
+      bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+    }
+  }
   lock_release (&pool->lock);
 
   if (page_idx != BITMAP_ERROR) {
@@ -163,23 +199,32 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 
   if (pages != NULL) {
     if (flags & PAL_ZERO) {
-      memset (pages, 0, PGSIZE * page_cnt);
+      for (i = 0; i < page_cnt; i++) {
+        zero_page ((uint8_t *) pages + i * PGSIZE);
+      }
     }
     if (flags & PAL_TC) {
-      ASSERT(bitmap_none(pool->tc_map, page_idx, page_cnt));
-      bitmap_set_multiple(pool->tc_map, page_idx, page_cnt, true);
+      memset (pool->page_class + page_idx, PAL_TC, page_cnt);
       tc_page_count += page_cnt;
     } else if (flags & PAL_SWAP) {
-      ASSERT(bitmap_none(pool->swap_map, page_idx, page_cnt));
-      bitmap_set_multiple(pool->swap_map, page_idx, page_cnt, true);
+      memset (pool->page_class + page_idx, PAL_SWAP, page_cnt);
       swap_page_count += page_cnt;
     } else {
+      memset (pool->page_class + page_idx, 0, page_cnt);
       kernel_page_count += page_cnt;
     }
+    cycles = rdtsc () - start;
+    stats_num_allocs[multi]++;
+    stats_alloc_cycles[multi] += cycles;
+    if (cycles > stats_max_alloc_cycles[multi]) {
+      stats_max_alloc_cycles[multi] = cycles;
+    }
   } else if (flags & PAL_ASSERT) {
     PANIC ("palloc_get: out of pages. request=%zu pages. "
         "tc_page_count=%zu, swap_page_count=%zu, kernel_page_count=%zu\n",
         page_cnt, tc_page_count, swap_page_count, kernel_page_count);
+  } else {
+    stats_num_failures[multi]++;
   }
 
   return pages;
@@ -203,22 +248,26 @@ void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
   struct pool *pool = &mem_pool;
-  size_t page_idx;
+  size_t page_idx, i;
+  uint8_t class;
 
   ASSERT (pg_ofs (pages) == 0);
   if (pages == NULL || page_cnt == 0)
     return;
 
   page_idx = pg_no (pages) - pg_no (pool->base);
+  ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 
-  if (page_from_pool (PAL_TC, pages)) {
-    ASSERT (bitmap_all (pool->tc_map, page_idx, page_cnt));
-    ASSERT(bitmap_none(pool->swap_map, page_idx, page_cnt));
+  class = pool->page_class[page_idx];
+#ifndef NDEBUG
+  for (i = 1; i < page_cnt; i++) {
+    ASSERT (pool->page_class[page_idx + i] == class);
+  }
+#endif
+  if (class == PAL_TC) {
     tc_page_count -= page_cnt;
     ASSERT(tc_page_count >= 0);
-  } else if (page_from_pool (PAL_SWAP, pages)) {
-    ASSERT (bitmap_all (pool->swap_map, page_idx, page_cnt));
-    ASSERT(bitmap_none(pool->tc_map, page_idx, page_cnt));
+  } else if (class == PAL_SWAP) {
     swap_page_count -= page_cnt;
     ASSERT(swap_page_count >= 0);
   } else {
@@ -229,10 +278,13 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
-  ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+  lock_acquire (&pool->lock);
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
-  bitmap_set_multiple (pool->tc_map, page_idx, page_cnt, false);
-  bitmap_set_multiple (pool->swap_map, page_idx, page_cnt, false);
+  for (i = page_cnt; i-- > 0; ) {
+    free_list_push (pool, page_idx + i);
+  }
+  lock_release (&pool->lock);
+  stats_num_frees++;
 }
 
 /* Frees the page at PAGE. */
@@ -247,13 +299,15 @@ palloc_free_page (void *page)
 static void
 init_pool (struct pool *p, void *base, size_t page_cnt, const char *name) 
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
+  /* We'll put the pool's used_map, free list and page classes at
+     its base.  Calculate the space needed for them and subtract it
+     from the pool's size. */
   size_t bm_size = bitmap_buf_size (page_cnt);
-  size_t bm_pages = DIV_ROUND_UP(NUM_BITMAPS * bm_size, PGSIZE);
+  size_t links_size = page_cnt * sizeof (int32_t);
+  size_t bm_pages = DIV_ROUND_UP(bm_size + 2 * links_size + page_cnt,
+      PGSIZE);
   uint8_t *ptr = base;
-  int i;
+  size_t i;
   if (bm_pages > page_cnt) {
     PANIC ("Not enough memory in %s for bitmap.", name);
   }
@@ -264,34 +318,61 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   /* Initialize the pool. */
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, ptr, bm_size);
-  p->tc_map = bitmap_create_in_buf (page_cnt, ptr + bm_size, bm_size);
-  p->swap_map = bitmap_create_in_buf (page_cnt, ptr + 2*bm_size, bm_size);
-  p->base = (char *)base + bm_pages * PGSIZE;
+  p->free_next = (int32_t *)(ptr + bm_size);
+  p->free_prev = (int32_t *)(ptr + bm_size + links_size);
+  p->page_class = ptr + bm_size + 2 * links_size;
+  p->base = (uint8_t *)base + bm_pages * PGSIZE;
+
+  p->free_head = -1;
+  for (i = 0; i < page_cnt; i++) {
+    free_list_push (p, i);
+  }
 }
 
-/* Returns true if PAGE was allocated from POOL,
-   false otherwise. */
-static bool
-page_from_pool (enum palloc_flags pool_id, void *page) 
+/* Puts free page PAGE_IDX at the head of P's free list. */
+static void
+free_list_push (struct pool *p, size_t page_idx)
 {
-  struct pool *pool = &mem_pool;
-  size_t page_idx;
+  p->free_prev[page_idx] = -1;
+  p->free_next[page_idx] = p->free_head;
+  if (p->free_head != -1) {
+    p->free_prev[p->free_head] = page_idx;
+  }
+  p->free_head = page_idx;
+}
 
-  page_idx = pg_no (page) - pg_no (pool->base);
+/* Takes page PAGE_IDX off P's free list. */
+static void
+free_list_remove (struct pool *p, size_t page_idx)
+{
+  int32_t next = p->free_next[page_idx], prev = p->free_prev[page_idx];
 
-  ASSERT(bitmap_test(pool->used_map, page_idx));
-  if (pool_id == PAL_TC) {
-    if (bitmap_test(pool->tc_map, page_idx)) {
-      ASSERT(!bitmap_test(pool->swap_map, page_idx));
-      return true;
-    }
-  } else if (pool_id == PAL_SWAP) {
-    if (bitmap_test(pool->swap_map, page_idx)) {
-      ASSERT(!bitmap_test(pool->tc_map, page_idx));
-      return true;
-    }
+  ASSERT (!bitmap_test (p->used_map, page_idx));
+  if (prev != -1) {
+    p->free_next[prev] = next;
   } else {
-    NOT_REACHED();
+    ASSERT (p->free_head == (int32_t)page_idx);
+    p->free_head = next;
   }
-  return false;
+  if (next != -1) {
+    p->free_prev[next] = prev;
+  }
+}
+
+void
+palloc_print_stats (void)
+{
+  static char const *kind[2] = { "single", "multi" };
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    printf ("MON-STATS: palloc: %lld %s-page allocs, %lld failed, "
+        "%llu cycles avg, %llu cycles max.\n", stats_num_allocs[i], kind[i],
+        stats_num_failures[i],
+        stats_num_allocs[i]?stats_alloc_cycles[i]/stats_num_allocs[i]:0,
+        stats_max_alloc_cycles[i]);
+  }
+  printf ("MON-STATS: palloc: %lld frees, %d tc pages, %d swap pages, "
+      "%zu kernel pages.\n", stats_num_frees, tc_page_count,
+      swap_page_count, kernel_page_count);
 }
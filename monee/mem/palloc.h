@@ -27,6 +27,7 @@ void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
 bool is_heap_addr(const void *addr);
+void palloc_print_stats (void);
 
 extern size_t free_pages, tc_page_limit, swap_page_limit;
 extern int swap_page_count, tc_page_count;
@@ -172,64 +172,139 @@ operand_is_monitor_memaddr(operand_t const *op, struct intr_frame const *f)
 	return true;
 }
 
+/* Copies LEN bytes between BUF and VADDR, a guest virtual address if GUEST
+ * and a monitor address otherwise. The guest page tables are walked once
+ * per page. On failure, sets *FAULT_ADDR to the first byte of the page that
+ * could not be accessed. */
 static bool
-ldub_simulate(target_ulong vaddr, bool guest, uint8_t *val)
+mem_simulate(target_ulong vaddr, bool guest, uint8_t *buf, size_t len,
+		bool is_write, target_ulong *fault_addr)
 {
 	enum ptwalk_flags_t ptwalk_flags;
-	uint32_t *pde = NULL, *pte = NULL;
-	bool pde_err, pte_err;
-	target_phys_addr_t paddr;
 
 	if (!guest) {
 		ASSERT(is_monitor_vaddr((void *)vaddr));
-		*val = *(uint8_t *)vaddr;
+		if (is_write) {
+			memcpy((void *)vaddr, buf, len);
+		} else {
+			memcpy(buf, (void *)vaddr, len);
+		}
 		return true;
 	}
 
 	ptwalk_flags = PTWALK_SET_A;
+	if (is_write) {
+		ptwalk_flags |= PTWALK_SET_D;
+	}
 	if (vcpu_get_privilege_level() == 1) {
 		ptwalk_flags |= PTWALK_U;
 	}
-	paddr = pt_walk((void *)vcpu.cr[3], vaddr, &pde, &pte, ptwalk_flags);
-	pde_err = pde_error(paddr, pde, ptwalk_flags);
-	pte_err = pde_error(paddr, pte, ptwalk_flags);
-	if (pde_err || pte_err) {
-		void *fault_addr;
-		NOT_TESTED();
-		asm ("movl %%cr2, %0" : "=r" (fault_addr));
-		printf("%s(): fault_addr=%p, vaddr=%x\n", __func__, fault_addr, vaddr);
-		return false;
+	while (len > 0) {
+		size_t n = min(len, (size_t)(PGSIZE - (vaddr & PGMASK)));
+		uint32_t *pde = NULL, *pte = NULL;
+		target_phys_addr_t paddr;
+
+		paddr = pt_walk((void *)vcpu.cr[3], vaddr, &pde, &pte, ptwalk_flags);
+		if (   pde_error(paddr, pde, ptwalk_flags)
+				|| pte_error(paddr, pte, ptwalk_flags)) {
+			NOT_TESTED();
+			*fault_addr = vaddr;
+			return false;
+		}
+		if (is_write) {
+			cpu_physical_memory_write(paddr, buf, n);
+		} else {
+			cpu_physical_memory_read(paddr, buf, n);
+		}
+		vaddr += n;
+		buf += n;
+		len -= n;
 	}
-	*val = ldub_phys(paddr);
 	return true;
 }
 
-static bool
-stb_simulate(target_ulong vaddr, bool guest, uint8_t val)
+/* Simulation stubs, cached by the address of the faulting instruction in
+ * the translation cache. Pages of the translation cache are reused for
+ * other code, so an entry also keeps the bytes of its instruction and only
+ * hits while they are unchanged. */
+#define SIM_CACHE_SIZE 64
+#define SIM_STUB_SIZE 128
+
+struct sim_stub {
+	uint8_t const *eip;							/* NULL if the entry is not valid. */
+	uint8_t code[16];								/* The instruction at EIP. */
+	size_t ilen;
+	insn_t insn;
+	operand_t const *memop0, *memop1;
+	unsigned memop_size;
+	bool insn_has_memop, insn_touches_stack;
+	size_t len;
+	uint8_t code_out[SIM_STUB_SIZE];
+};
+
+static struct sim_stub sim_cache[SIM_CACHE_SIZE];
+static long long sim_num_hits = 0, sim_num_misses = 0;
+
+/* The stubs load the addresses of the operand copies from these, so they
+ * must stay at the same place from one fault to the next. */
+static uint8_t *memptr0, *memptr1;
+
+/* Builds the stub that simulates the instruction at EIP into S, and caches
+ * it if it fits. */
+static void
+sim_stub_build(struct sim_stub *s, uint8_t const *eip, uint8_t *scratch)
 {
-	enum ptwalk_flags_t ptwalk_flags;
-	uint32_t *pde = NULL, *pte = NULL;
-  target_phys_addr_t paddr;
-	bool pde_err, pte_err;
+	cpu_constraints_t cpu_constraints;
+	uint8_t *outptr = scratch;
+	size_t tlen;
 
-	if (!guest) {
-		ASSERT(is_monitor_vaddr((void *)vaddr));
-		*(uint8_t *)vaddr = val;
-		return true;
+	s->eip = NULL;
+	s->ilen = disas_insn((uint8_t *)eip, (target_ulong)eip, &s->insn, 4, false);
+	ASSERT(s->ilen > 0 && s->ilen <= sizeof s->code);
+	memcpy(s->code, eip, s->ilen);
+	cpu_constraints = CPU_CONSTRAINT_SIMULATE;
+	if (tlen = peep_translate(scratch, PGSIZE/2, &s->insn, 1, NULL,
+				NULL, NULL, NULL, NULL, NULL, (target_ulong)eip,
+				(target_ulong)eip + s->ilen, false, &cpu_constraints, NULL)) {
+		printf("SIM IN:\n");
+		print_asm((void *)eip, 1, 4);
+		NOT_IMPLEMENTED();
 	}
-	ptwalk_flags = PTWALK_SET_A | PTWALK_SET_D;
-	if (vcpu_get_privilege_level() == 1) {
-		ptwalk_flags |= PTWALK_U;
+
+	s->memop0 = s->memop1 = NULL;
+	s->memop_size = 0;
+	s->insn_has_memop = insn_accesses_mem(&s->insn, &s->memop0, &s->memop1);
+	s->insn_touches_stack = insn_accesses_stack(&s->insn);
+	if (s->insn_has_memop) {
+		ASSERT(s->memop0);
+		s->memop_size = insn_get_operand_size(&s->insn);
+		ASSERT(s->memop_size > 0 && s->memop_size <= 4);
+		outptr += rename_mem_operands_to_disps(outptr, PGSIZE/2, (uint8_t *)eip,
+				(target_ulong)&memptr0, (target_ulong)&memptr1, false);
+
+		if (loglevel & VCPU_LOG_MTRACE) {
+			printf("SIM IN:\n");
+			print_asm((void *)eip, 1, 4);
+			printf("SIM OUT:\n");
+			print_asm(scratch, outptr - scratch, 4);
+		}
 	}
-  paddr = pt_walk((void *)vcpu.cr[3], vaddr, &pde, &pte, ptwalk_flags);
-	pde_err = pde_error(paddr, pde, ptwalk_flags);
-	pte_err = pde_error(paddr, pte, ptwalk_flags);
-	if (pde_err || pte_err) {
+	if (s->insn_touches_stack) {
 		NOT_TESTED();
-		return false;
+		//insn must be push or pop, because call/ret are translated to jumps
+		ASSERT(insn_is_push(&s->insn) || insn_is_pop(&s->insn));
+
+		if (!s->insn_has_memop) {
+			memcpy(outptr, eip, s->ilen);
+			outptr += s->ilen;
+		}
+	}
+	ASSERT(s->insn_has_memop || s->insn_touches_stack);
+	s->len = outptr - scratch;
+	if (s->len <= sizeof s->code_out) {
+		memcpy(s->code_out, scratch, s->len);
+		s->eip = eip;
 	}
-	stb_phys(paddr, val);
-	return true;
 }
 
 bool
@@ -239,172 +314,103 @@ simulate_faulting_instruction(struct intr_frame *f, size_t *memaccess_size,
 	static uint8_t *scratch = NULL;
 	if (!scratch) {
 		scratch = palloc_get_page(PAL_ASSERT|PAL_ZERO);
+		memptr0 = scratch + PGSIZE/2;
+		memptr1 = memptr0 + 16;
 	}
-	uint8_t *outptr, *memptr0, *memptr0_copy, *memptr1;
-	uint8_t *stack_ptr, *stack_ptr_copy;
-	uint8_t *scratch_end = scratch + PGSIZE;
-	operand_t const *memop0 = NULL, *memop1 = NULL;
-	bool insn_has_memop, insn_touches_stack;
+	uint8_t *memptr0_copy = memptr1 + 128;
+	uint8_t *stack_ptr = memptr0_copy + 128, *stack_ptr_copy = stack_ptr + 32;
+	uint8_t const *eip = (uint8_t const *)f->eip;
 	target_ulong vaddr0 = 0, vaddr1 = 0, stack_addr = 0;
 	bool guest0 = false, guest1 = false;
-	cpu_constraints_t cpu_constraints;
-	bool peep_translated = false;
-	unsigned memop_size = 0;
 	void *saved_esp = NULL;
 	uint16_t saved_ss = 0;
-	static insn_t insn;
-	void (*eip)(void);
-	size_t ilen, tlen;
+	struct sim_stub *s;
 	unsigned i;
 
 	/* The exception should only occur in user/guest mode. */
 	ASSERT((f->cs & 3) == 3);
+	ASSERT(stack_ptr_copy + 32 <= scratch + PGSIZE);
 
-  ilen = disas_insn((uint8_t *)f->eip, (target_ulong)f->eip, &insn, 4, false);
-	cpu_constraints = CPU_CONSTRAINT_SIMULATE;
-	if (tlen = peep_translate(scratch, scratch_end - scratch, &insn, 1, NULL,
-				NULL, NULL, NULL, NULL, NULL, (target_ulong)f->eip,
-				(target_ulong)f->eip + ilen, false, &cpu_constraints, NULL)) {
-		printf("SIM IN:\n");
-		print_asm(f->eip, 1, 4);
-		NOT_IMPLEMENTED();
-		peep_translated = true;
-		*memaccess_size = 4;
-		outptr = (uint8_t *)scratch + tlen;
+	s = &sim_cache[(uintptr_t)eip % SIM_CACHE_SIZE];
+	if (s->eip == eip && !memcmp(s->code, eip, s->ilen)) {
+		sim_num_hits++;
 	} else {
-		outptr = scratch;
-		memptr0 = scratch + PGSIZE/2;
-		memptr0_copy = memptr0 + 8;
-		memptr1 = memptr0_copy + 8;
-		stack_ptr = memptr1 + 128;
-		stack_ptr_copy = stack_ptr + 128;
-		ASSERT(stack_ptr_copy <= (uint8_t *)scratch_end);
-
-		insn_has_memop = insn_accesses_mem(&insn, &memop0, &memop1);
-		insn_touches_stack = insn_accesses_stack(&insn);
-		if (insn_has_memop) {
-			ASSERT(memop0);
-			memop_size = insn_get_operand_size(&insn);
-			ASSERT(memop_size > 0 && memop_size <= 4);
-			outptr += rename_mem_operands_to_disps(outptr, PGSIZE/2, (uint8_t*)f->eip,
-					(target_ulong)&memptr0, (target_ulong)&memptr1, false);
+		sim_stub_build(s, eip, scratch);
+		sim_num_misses++;
+	}
 
-			if (loglevel & VCPU_LOG_MTRACE) {
-				static void *last_eip = NULL;
-				if (last_eip != f->eip) {
-					printf("SIM IN:\n");
-					print_asm(f->eip, 1, 4);
-					printf("SIM OUT:\n");
-					print_asm(scratch, outptr - scratch, 4);
-					last_eip = f->eip;
-				}
-			}
-			vaddr0 = operand_evaluate_on_intr_frame(memop0, f);
-			guest0 = !operand_is_monitor_memaddr(memop0, f);
-			if (memop1) {
-				vaddr1 = operand_evaluate_on_intr_frame(memop1, f);
-				guest1 = !operand_is_monitor_memaddr(memop1, f);
+	if (s->insn_has_memop) {
+		vaddr0 = operand_evaluate_on_intr_frame(s->memop0, f);
+		guest0 = !operand_is_monitor_memaddr(s->memop0, f);
+		if (!mem_simulate(vaddr0, guest0, memptr0, s->memop_size, false,
+					fault_addr)) {
+			return false;
+		}
+		if (s->memop1) {
+			vaddr1 = operand_evaluate_on_intr_frame(s->memop1, f);
+			guest1 = !operand_is_monitor_memaddr(s->memop1, f);
+			if (!mem_simulate(vaddr1, guest1, memptr1, s->memop_size, false,
+						fault_addr)) {
+				return false;
 			}
+		}
+		memcpy(memptr0_copy, memptr0, s->memop_size);
+	}
+	if (s->insn_touches_stack) {
+		uint32_t e1, e2;
 
-			for (i = 0; i < memop_size; i++) {
-				if (!ldub_simulate(vaddr0 + i, guest0, &memptr0[i])) {
-					//printf("%s(): vaddr0=%x, i=%d\n", __func__, vaddr0, i);
-					*fault_addr = vaddr0 + i;
-					return false;
-				}
-				if (memop1) {
-					if (!ldub_simulate(vaddr1 + i, guest1, &memptr1[i])) {
-						//printf("%s(): vaddr1=%x, i=%d\n", __func__, vaddr1, i);
-						*fault_addr = vaddr1 + i;
-						return false;
-					}
-				}
-			}
-			memcpy(memptr0_copy, memptr0, memop_size);
+		read_segment(&e1, &e2, f->ss, true, false);
+		stack_addr = (target_ulong)f->esp;
+		ASSERT((target_ulong)f->esp < (target_ulong)get_seg_limit(e1, e2));
+		stack_addr += get_seg_base(e1, e2);
+		if (!mem_simulate(stack_addr, true, stack_ptr, 32, false, fault_addr)) {
+			return false;
 		}
-		if (insn_touches_stack) {
-			uint32_t e1, e2;
-			int i;
+		memcpy(stack_ptr_copy, stack_ptr, 32);
+		saved_esp = f->esp;
+		saved_ss = f->ss;
+		f->esp = (void *)stack_ptr;
+		f->ss = SEL_UDSEG;
+	}
+	ASSERT(guest0 || guest1 || s->insn_touches_stack);
 
-			NOT_TESTED();
-			//insn must be push or pop, because call/ret are translated to jumps
-			ASSERT(insn_is_push(&insn) || insn_is_pop(&insn));
+	execute_code_in_intr_frame_context(f, s->eip ? s->code_out : scratch,
+			s->len);
+	insn_advance_eip_on_intr_frame(&s->insn, s->ilen, f);
 
-			if (!insn_has_memop) {
-				memcpy(outptr, f->eip, ilen);
-				outptr += ilen;
+	if (s->insn_has_memop) {
+		for (i = 0; i < s->memop_size; i++) {
+			if (memptr0[i] != memptr0_copy[i]) {
+				DBGn(SIM_INSN, "%x: %hhx->%hhx [memptr1: %hhx]\n", vaddr0 + i,
+						memptr0_copy[i], memptr0[i], memptr1[i]);
 			}
-			read_segment(&e1, &e2, f->ss, true, false);
-			stack_addr = (target_ulong)f->esp;
-			ASSERT((target_ulong)f->esp < (target_ulong)get_seg_limit(e1, e2));
-			stack_addr += get_seg_base(e1, e2);
-			for (i = 0; i < 32; i++) {
-				if (!ldub_simulate(stack_addr + i, true, &stack_ptr[i])) {
-					//printf("%s(): stack_addr=%x, i=%d\n", __func__, stack_addr, i);
-					*fault_addr = stack_addr + i;
-					return false;
-				}
-				stack_ptr_copy[i] = stack_ptr[i];
-			}
-			saved_esp = f->esp;
-			saved_ss = f->ss;
-			f->esp = (void *)stack_ptr;
-			f->ss = SEL_UDSEG;
 		}
-		/*
-		if (insn_touches_stack) {
-			printf("MTRACE IN:\n");
-			print_asm(f->eip, 1, 4);
-			printf("MTRACE OUT:\n");
-			print_asm(scratch, outptr - scratch, 4);
+		if (!mem_simulate(vaddr0, guest0, memptr0, s->memop_size, true,
+					fault_addr)) {
+			return false;
 		}
-		*/
-		ASSERT(guest0 || guest1 || insn_touches_stack);
-		ASSERT(insn_has_memop || insn_touches_stack);
+		*memaccess_size = s->memop_size;
 	}
-	execute_code_in_intr_frame_context(f, scratch, outptr - scratch);
-	insn_advance_eip_on_intr_frame(&insn, ilen, f);
-	if (!peep_translated) {
-		if (insn_has_memop) {
-			bool changed = false;		//to check if memop0 was a write operand
-			for (i = 0; i < memop_size; i++) {
-				if (memptr0[i] != memptr0_copy[i]) {
-					DBGn(SIM_INSN, "%x: %hhx->%hhx [memptr1: %hhx]\n", vaddr0 + i,
-							memptr0_copy[i], memptr0[i], memptr1[i]);
-				}
-				changed = true;
-			}
+	if (s->insn_touches_stack) {
+		int pushed = stack_ptr - (uint8_t *)f->esp;
 
-			for (i = 0; changed && i < memop_size; i++) {
-				if (!stb_simulate(vaddr0 + i, guest0, memptr0[i])) {
-					//printf("%s() %d: vaddr0=%x, i=%d\n", __func__, __LINE__, vaddr0, i);
-					*fault_addr = vaddr0 + i;
-					return false;
-				}
-			}
-			*memaccess_size = memop_size;
-		}
-		if (insn_touches_stack) {
-			int i;
-			for (i = (uint8_t *)f->esp - stack_ptr; i < 0; i++) {
-				if (!stb_simulate(stack_addr + i, true, stack_ptr[i])) {
-					/* printf("%s() %d: stack_addr=%x, i=%d\n", __func__, __LINE__,
-							stack_addr, i); */
-					*fault_addr = stack_addr + i;
-					return false;
-				}
-				memop_size = stack_ptr - (uint8_t *)f->esp;
-				/* printf("%x: esp %p: %hhx->%hhx\n", stack_addr + i, saved_esp,
-						stack_ptr_copy[i], stack_ptr[i]); */
-			}
-			f->esp = (uint8_t *)saved_esp + ((uint8_t *)f->esp - stack_ptr);
-			f->ss = saved_ss;
-			*memaccess_size = stack_ptr - (uint8_t *)f->esp;
+		if (   pushed > 0
+				&& !mem_simulate(stack_addr - pushed, true, (uint8_t *)f->esp, pushed,
+					true, fault_addr)) {
+			return false;
 		}
-	} else {
-		NOT_REACHED();
+		f->esp = (uint8_t *)saved_esp + ((uint8_t *)f->esp - stack_ptr);
+		f->ss = saved_ss;
+		*memaccess_size = stack_ptr - (uint8_t *)f->esp;
 	}
 	ASSERT(*memaccess_size);
 	//rr_log_force_dump_on_next_tb_entry = true;
 	return true;
 }
+
+void
+simulate_print_stats(void)
+{
+	printf("MON-STATS: simulation stubs: %lld cache hits, %lld misses.\n",
+			sim_num_hits, sim_num_misses);
+}
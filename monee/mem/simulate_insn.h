@@ -8,5 +8,6 @@ struct intr_frame;
 
 bool simulate_faulting_instruction(struct intr_frame *f,
 		size_t *memaccess_size, target_ulong *fault_addr);
+void simulate_print_stats(void);
 
 #endif /* mem/simulate_insn.h */
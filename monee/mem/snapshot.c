@@ -0,0 +1,270 @@
+#include "mem/snapshot.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "mem/palloc.h"
+#include "mem/paging.h"
+#include "mem/pt_mode.h"
+#include "mem/pte.h"
+#include "mem/swap.h"
+#include "mem/vaddr.h"
+#include "peep/forced_callouts.h"
+#include "peep/insntypes.h"
+#include "peep/tb.h"
+#include "sys/desc_cache.h"
+#include "sys/gdt.h"
+#include "sys/vcpu.h"
+#include "threads/thread.h"
+
+#define SNAPSHOT_MEM_PAGES (MAX_MEM_SIZE / PGSIZE)
+
+extern size_t ram_pages;
+
+struct saved_page {
+  target_phys_addr_t paddr;
+  void *data;
+};
+
+/* Checkpoint ID lives in snapshots[ID % SNAPSHOT_NUM]. PAGES holds the
+ * pre-images of the pages first written after checkpoint ID and before
+ * checkpoint ID + 1. A page is saved at most once per checkpoint. */
+static struct snapshot {
+  vcpu_t vcpu;
+  size_t n_pages;
+  struct saved_page pages[SNAPSHOT_MEM_PAGES];
+} snapshots[SNAPSHOT_NUM];
+
+/* The valid checkpoints are first_id .. next_id - 1. */
+static int first_id = 0, next_id = 0;
+
+/* Pages saved since checkpoint next_id - 1. */
+static bool page_saved[SNAPSHOT_MEM_PAGES];
+static size_t snapshot_mem_pages;
+static size_t num_saved_pages = 0;
+
+bool snapshot_armed = false;
+
+static long long stats_num_taken = 0;
+static long long stats_num_dropped = 0;
+static long long stats_num_overflows = 0;
+static long long stats_num_pages_saved = 0;
+static long long stats_num_restores = 0;
+static long long stats_num_pages_restored = 0;
+static uint64_t stats_restore_cycles = 0;
+
+void
+snapshot_init(void)
+{
+  snapshot_mem_pages = min(ram_pages, (size_t)SNAPSHOT_MEM_PAGES);
+}
+
+static void
+snapshot_free_pages(struct snapshot *s)
+{
+  size_t i;
+
+  for (i = 0; i < s->n_pages; i++) {
+    palloc_free_page(s->pages[i].data);
+  }
+  num_saved_pages -= s->n_pages;
+  s->n_pages = 0;
+}
+
+static void
+snapshot_drop_oldest(void)
+{
+  ASSERT(first_id < next_id);
+  snapshot_free_pages(&snapshots[first_id % SNAPSHOT_NUM]);
+  first_id++;
+  stats_num_dropped++;
+}
+
+void
+snapshot_clear(void)
+{
+  while (first_id < next_id) {
+    snapshot_drop_oldest();
+  }
+  snapshot_armed = false;
+}
+
+/* Write-protects PTE if it maps a guest page that has not been saved since
+ * the newest checkpoint. The resulting write fault is resolved by the
+ * ordinary shadow page fault path, which reinstalls PTE from the guest pte
+ * once the page has been saved. Has the signature of a shadow_pt_scan()
+ * callback. */
+void
+snapshot_protect_pte(uint32_t *pte, target_phys_addr_t paddr,
+    void *opaque UNUSED)
+{
+  size_t pg = paddr >> PGBITS;
+
+  if (snapshot_armed && pg < snapshot_mem_pages && !page_saved[pg]) {
+    *pte &= ~PTE_W;
+  }
+}
+
+static void
+snapshot_protect_all(void)
+{
+  /* Drop the cached shadow page tables of other address spaces; they are
+   * rebuilt, write-protected, through pd_install_shadow_page(). */
+  swap_flush();
+  shadow_pt_scan(vcpu.shadow_page_dir[0], snapshot_protect_pte, NULL);
+  if (vcpu.shadow_page_dir[1]) {
+    shadow_pt_scan(vcpu.shadow_page_dir[1], snapshot_protect_pte, NULL);
+  }
+  pt_reload();
+}
+
+static void
+snapshot_save_page(size_t pg)
+{
+  struct snapshot *s;
+  pt_mode_t pt_mode;
+  void *data;
+
+  while (   num_saved_pages >= SNAPSHOT_MAX_PAGES
+         || !(data = palloc_get_page(0))) {
+    if (first_id == next_id - 1) {
+      /* Not even the newest checkpoint can be kept. */
+      snapshot_clear();
+      stats_num_overflows++;
+      return;
+    }
+    snapshot_drop_oldest();
+  }
+
+  pt_mode = switch_to_phys();
+  copy_page(data, (void *)(pg << PGBITS));
+  switch_pt(pt_mode);
+
+  s = &snapshots[(next_id - 1) % SNAPSHOT_NUM];
+  ASSERT(s->n_pages < SNAPSHOT_MEM_PAGES);
+  s->pages[s->n_pages].paddr = pg << PGBITS;
+  s->pages[s->n_pages].data = data;
+  s->n_pages++;
+  num_saved_pages++;
+  page_saved[pg] = true;
+  stats_num_pages_saved++;
+}
+
+void
+snapshot_save_pages(target_phys_addr_t paddr, size_t len)
+{
+  size_t pg, last;
+
+  if (!len) {
+    return;
+  }
+  last = min((paddr + len - 1) >> PGBITS, snapshot_mem_pages - 1);
+  for (pg = paddr >> PGBITS; pg <= last && snapshot_armed; pg++) {
+    if (!page_saved[pg]) {
+      snapshot_save_page(pg);
+    }
+  }
+}
+
+/* Takes a checkpoint of the vcpu and of guest memory. Must be called from
+ * the monitor loop, between tbs. Returns the id of the checkpoint. */
+int
+snapshot_take(void)
+{
+  struct snapshot *s;
+
+  if (next_id - first_id == SNAPSHOT_NUM) {
+    snapshot_drop_oldest();
+  }
+  s = &snapshots[next_id % SNAPSHOT_NUM];
+  memcpy(&s->vcpu, &vcpu, offsetof(vcpu_t, jmp_env));
+  s->n_pages = 0;
+  next_id++;
+
+  memset(page_saved, 0, sizeof page_saved);
+  snapshot_armed = true;
+  snapshot_protect_all();
+  stats_num_taken++;
+  return next_id - 1;
+}
+
+/* Restores the vcpu fields that describe the guest. The log files, the
+ * shadow page dirs and the jump buffer belong to the monitor. */
+static void
+snapshot_restore_vcpu(vcpu_t const *saved)
+{
+  struct FILE *record_log = vcpu.record_log, *replay_log = vcpu.replay_log;
+  uint32_t *shadow_page_dir[2];
+  long long cur_mtraces_version = vcpu.cur_mtraces_version;
+
+  shadow_page_dir[0] = vcpu.shadow_page_dir[0];
+  shadow_page_dir[1] = vcpu.shadow_page_dir[1];
+  memcpy(&vcpu, saved, offsetof(vcpu_t, jmp_env));
+  vcpu.record_log = record_log;
+  vcpu.replay_log = replay_log;
+  vcpu.shadow_page_dir[0] = shadow_page_dir[0];
+  vcpu.shadow_page_dir[1] = shadow_page_dir[1];
+  vcpu.cur_mtraces_version = cur_mtraces_version;
+  vcpu.callout_next = NULL;
+  vcpu.prev_tb = 0;
+  vcpu.edge = TB_EDGE_NONE;
+}
+
+/* Rolls the vcpu and guest memory back to checkpoint ID, and discards the
+ * checkpoints taken after it. Returns false if ID is no longer available.
+ * The caller must re-enter the monitor loop afterwards. */
+bool
+snapshot_restore(int id)
+{
+  pt_mode_t pt_mode;
+  uint64_t start;
+  size_t j;
+  int i;
+
+  if (!snapshot_armed || id < first_id || id >= next_id) {
+    return false;
+  }
+  start = rdtsc();
+  pt_mode = switch_to_phys();
+  for (i = next_id - 1; i >= id; i--) {
+    struct snapshot const *s = &snapshots[i % SNAPSHOT_NUM];
+    for (j = 0; j < s->n_pages; j++) {
+      copy_page((void *)s->pages[j].paddr, s->pages[j].data);
+    }
+    stats_num_pages_restored += s->n_pages;
+  }
+  switch_pt(pt_mode);
+  for (i = next_id - 1; i >= id; i--) {
+    snapshot_free_pages(&snapshots[i % SNAPSHOT_NUM]);
+  }
+  next_id = id + 1;
+
+  snapshot_restore_vcpu(&snapshots[id % SNAPSHOT_NUM].vcpu);
+  shadow_pagedir_sync();
+  for (i = 0; i < NUM_SEGS; i++) {
+    gdt_make_shadow_segdesc(i);
+  }
+  if (vcpu.a20_mask == 0xffffffff) {
+    paging_enable_a20();
+  }
+  clear_fcallout_patches();
+  tb_flush();
+  desc_cache_flush();
+
+  memset(page_saved, 0, sizeof page_saved);
+  snapshot_protect_all();
+  stats_num_restores++;
+  stats_restore_cycles += rdtsc() - start;
+  return true;
+}
+
+void
+snapshot_print_stats(void)
+{
+  printf("MON-STATS: snapshots: %lld taken, %lld dropped, %lld overflows, "
+      "%lld pages saved.\n", stats_num_taken, stats_num_dropped,
+      stats_num_overflows, stats_num_pages_saved);
+  printf("MON-STATS: snapshots: %lld restores, %lld pages restored, "
+      "%llu cycles per restore.\n", stats_num_restores,
+      stats_num_pages_restored,
+      stats_num_restores?stats_restore_cycles/stats_num_restores:0);
+}
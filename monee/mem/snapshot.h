@@ -0,0 +1,52 @@
+#ifndef MEM_SNAPSHOT_H
+#define MEM_SNAPSHOT_H
+#include <stddef.h>
+#include <stdbool.h>
+#include <lib/types.h>
+
+/* In-memory checkpoints of the vcpu and of guest memory. Guest memory is not
+ * copied when a checkpoint is taken. Instead, every shadow pte that maps
+ * guest memory is write-protected, and the first write to a page after the
+ * newest checkpoint saves the old contents of the page (its pre-image)
+ * before the write goes through. Writes that the monitor makes through
+ * phys_map are caught by snapshot_note_write().
+ *
+ * Restoring checkpoint n copies back the pre-images saved since n, newest
+ * first, so its cost is proportional to the number of pages dirtied since n,
+ * not to the size of guest memory. Up to SNAPSHOT_NUM checkpoints are kept;
+ * the oldest one is dropped to make room for a new one, or when more than
+ * SNAPSHOT_MAX_PAGES pre-images would be held. */
+#ifndef SNAPSHOT_NUM
+#define SNAPSHOT_NUM 4
+#endif
+#ifndef SNAPSHOT_MAX_PAGES
+#define SNAPSHOT_MAX_PAGES 2048
+#endif
+
+extern bool snapshot_armed;
+
+void snapshot_init(void);
+int snapshot_take(void);
+bool snapshot_restore(int id);
+void snapshot_clear(void);
+void snapshot_save_pages(target_phys_addr_t paddr, size_t len);
+void snapshot_protect_pte(uint32_t *pte, target_phys_addr_t paddr,
+    void *opaque);
+void snapshot_print_stats(void);
+
+/* Must be called before the monitor writes LEN bytes of guest memory at
+ * PADDR without going through the shadow page tables. The loader takes no
+ * snapshots. */
+#ifdef __MONITOR__
+static inline void
+snapshot_note_write(target_phys_addr_t paddr, size_t len)
+{
+  if (snapshot_armed) {
+    snapshot_save_pages(paddr, len);
+  }
+}
+#else
+#define snapshot_note_write(paddr, len)
+#endif
+
+#endif /* mem/snapshot.h */
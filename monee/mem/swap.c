@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/disk.h"
+#include "mem/kmap.h"
 #include "mem/malloc.h"
 #include "mem/malloc_cb.h"
 #include "mem/mtrace.h"
@@ -567,16 +568,10 @@ static void
 swap_pd_init(uint32_t *pd)
 {
   size_t pd_num;
-  for (pd_num = 0; pd_num < (1 << 10); pd_num++) {
-    void *vaddr = (void *)(pd_num * LPGSIZE);
-
-    if (vaddr >= (void *)LOADER_MONITOR_VIRT_BASE) {
-      uintptr_t paddr = vtop_mon(vaddr);
-      pd[pd_num] = pde_create_large_mon(paddr, true);
-    } else {
-      pd[pd_num] = 0;
-    }
+  for (pd_num = 0; pd_num < (LOADER_MONITOR_VIRT_BASE >> LPGBITS); pd_num++) {
+    pd[pd_num] = 0;
   }
+  kmap_map_monitor(pd);
 }
 
 static void
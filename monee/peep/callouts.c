@@ -12,8 +12,11 @@
 #include "peep/cpu_constraints.h"
 #include "peep/callouts.h"
 #include "peep/insn.h"
+#include "peep/rollback_cache.h"
+#include "peep/superblock.h"
 #include "peepgen_offsets.h"
 #include "peep/peeptab_defs.h"
+#include "sys/desc_cache.h"
 #include "sys/gdt.h"
 #include "sys/interrupt.h"
 #include "sys/exception.h"
@@ -23,6 +26,7 @@
 #include "sys/flags.h"
 #include "sys/mode.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
 #define PCALL 2
 
@@ -76,6 +80,17 @@ static long long stats_num_callouts = 0;
 static long long stats_num_forced_callouts = 0;
 static long long stats_num_sti_callouts = 0;
 
+/* Interrupt delivery. Latency is measured from the arrival of an interrupt
+ * that the guest could take (IF set) until it is raised in the guest, for
+ * each IRQ line separately, as several can be pending at once. */
+static long long stats_num_irqs_delivered = 0;
+static long long stats_num_irq_polls = 0;
+static long long stats_num_irq_patches = 0;
+static uint64_t stats_irq_patch_cycles = 0;
+static uint64_t stats_irq_latency_cycles = 0;
+static uint64_t stats_irq_latency_max = 0;
+static uint64_t irq_arrival_tsc[16];
+
 #define CALLOUT_INC_STATS() do {																						\
 	stats_num_callouts++;																											\
 	if (!strcmp(__func__, "callout_sti")) {																		\
@@ -264,6 +279,7 @@ callout_ltr_val(unsigned long val)
     stl_kernel(ptr + 4, e2);
   }
   vcpu.tr.selector = selector;
+  desc_cache_flush();
 }
 
 void
@@ -299,6 +315,7 @@ callout_restore_tr0_and_lgdt(long tr0, long segno)
   vcpu.gdt.base = *((uint32_t *)(memaddr + 2));
 
   gdt_load(vcpu.gdt.base, vcpu.gdt.limit);
+  desc_cache_flush();
 }
 
 void
@@ -318,6 +335,7 @@ callout_restore_tr0_and_lidt(long tr0, long segno)
 
   vcpu.idt.limit = *((uint16_t *)memaddr);
   vcpu.idt.base = *((uint32_t *)(memaddr + 2));
+  desc_cache_flush();
 }
 
 static void
@@ -713,6 +731,36 @@ callout_nop(void)
 	CALLOUT_INC_STATS();
 }
 
+/* A back-edge or a superblock part found vcpu.irq_pending set. The interrupt is delivered by
+ * handle_pending_interrupts() before the monitor re-enters the tc. */
+void
+callout_irq_poll(void)
+{
+	CALLOUT_INC_STATS();
+	stats_num_irq_polls++;
+}
+
+/* The superblock counter of the tb being executed reached zero. */
+void
+callout_superblock(long counter, long ends_in_jcc)
+{
+  tb_t *tb;
+
+	CALLOUT_INC_STATS();
+  tb = tb_find(vcpu.callout_cur);
+  ASSERT(tb);
+  superblock_request(tb, (uint32_t *)counter, ends_in_jcc);
+  /* vcpu.eip is still the start of tb. Drop tb and let the monitor
+   * retranslate it, as a superblock or without the counter. The tb header has
+   * already been executed, and will be executed again by the new tb. */
+  ASSERT((target_ulong)vcpu.eip == tb->eip);
+  if (vcpu.record_log) {
+    vcpu.n_exec -= tb->num_insns;
+  }
+  vcpu.callout_next = NULL;
+  tb_invalidate(tb);
+}
+
 void
 callout_invd(void)
 {
@@ -820,7 +868,7 @@ gpf_load_seg(long segno, long descno_val)
   } else {
     vcpu.segs[segno].selector = descno;
   }
-  rdseg = read_segment(&e1, &e2, descno, false, true);
+  rdseg = read_segment_cached(&e1, &e2, descno, true);
   if (!rdseg) {
     NOT_IMPLEMENTED();
   }
@@ -871,6 +919,9 @@ vcpu_exception_rollback(struct intr_frame *f)
   unsigned i;
 	int cur_pos;
 	void (*eip)(void);
+  rollbacks_t const *rollbacks;
+  uint8_t eip_boundaries[MAX_SUPERBLOCK_SIZE + 1];
+  uint16_t tc_boundaries[MAX_SUPERBLOCK_SIZE + 1];
   tb_t *tb;
 
 	eip = f->eip;
@@ -880,22 +931,24 @@ vcpu_exception_rollback(struct intr_frame *f)
     NOT_REACHED();
   }
   cur_pos = -1;
+  tb_get_boundaries(tb, eip_boundaries, tc_boundaries);
   for (i = 0; i < tb->num_insns; i++) {
-    if (tb->tc_ptr + tb->tc_boundaries[i + 1] > (uint8_t *)eip) {
-      if (tb->rollbacks[i].buf) {
+    if (tb->tc_ptr + tc_boundaries[i + 1] > (uint8_t *)eip) {
+      rollbacks = rollback_cache_get(tb, i);
+      if (rollbacks->buf_size) {
         int j;
-        for (j = 0; j < tb->rollbacks[i].nb_rollbacks; j++) {
-          if (tb->tc_ptr + tb->tc_boundaries[i] +
-              tb->rollbacks[i].code_offset[j] >= (uint8_t *)eip) {
-						size_t rb_off = tb->rollbacks[i].rb_offset[j];
+        for (j = 0; j < rollbacks->nb_rollbacks; j++) {
+          if (tb->tc_ptr + tc_boundaries[i] +
+              rollbacks->code_offset[j] >= (uint8_t *)eip) {
+						size_t rb_off = rollbacks->rb_offset[j];
             LOG(INT, "Rolling back 0x%x[%p].\n",
-                tb->eip_virt + ((i == 0)?0:tb->eip_boundaries[i-1]), eip);
-						execute_code_in_intr_frame_context(f, tb->rollbacks[i].buf + rb_off,
-								tb->rollbacks[i].buf_size - rb_off);
+                tb->eip_virt + eip_boundaries[i], eip);
+						execute_code_in_intr_frame_context(f, rollbacks->buf + rb_off,
+								rollbacks->buf_size - rb_off);
 							/*
             mode_t mode;
-            vcpu.func_tc_ptr = tb->rollbacks[i].buf
-              + tb->rollbacks[i].rb_offset[j];
+            vcpu.func_tc_ptr = rollbacks->buf
+              + rollbacks->rb_offset[j];
             vcpu.func_tc_done = &&done_rollback;
             mode = switch_to_user();
             asm("jmp *%%gs:%0" : : "m"(vcpu.tc_label));
@@ -906,15 +959,15 @@ done_rollback:
           }
         }
       }
-      ASSERT(tb->tc_ptr + tb->tc_boundaries[i] <= (uint8_t *)eip);
+      ASSERT(tb->tc_ptr + tc_boundaries[i] <= (uint8_t *)eip);
       LOG(INT, "%d: eip=%p, i=%d, num_insns=%dtb->tc_ptr=%p,%p,%p\n", __LINE__,
-          eip, i, tb->num_insns, tb->tc_ptr, tb->tc_ptr + tb->tc_boundaries[i],
-          tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
-      return tb->tc_ptr + tb->tc_boundaries[i];
+          eip, i, tb->num_insns, tb->tc_ptr, tb->tc_ptr + tc_boundaries[i],
+          tb->tc_ptr + tb->tc_len);
+      return tb->tc_ptr + tc_boundaries[i];
     }
   }
   LOG(INT, "eip=%p, tb->tc_ptr=%p,%p\n", eip, tb->tc_ptr,
-      tb->tc_ptr + tb->tc_boundaries[tb->num_insns - 1]);
+      tb->tc_ptr + tc_boundaries[tb->num_insns - 1]);
   NOT_REACHED();
 }
 
@@ -984,18 +1037,29 @@ guest_intr_handler(struct intr_frame *frame)
 		return true;
 	}
 
+	if (vcpu.IF == 1 && !irq_arrival_tsc[frame->vec_no - 0x20]) {
+		irq_arrival_tsc[frame->vec_no - 0x20] = rdtsc();
+	}
 	if (!(vcpu.interrupt_request & CPU_INTERRUPT_HARD)) {
 		cpu_interrupt(CPU_INTERRUPT_HARD);
 		//printf("registering interrupt 0x%x at %p.\n", frame->vec_no, frame->eip);
 		if (vcpu.IF == 1) {
+#ifdef IRQ_POLL
+			vcpu.irq_pending = 1;
+#else
 			struct tb_t *tb;
+			uint64_t start;
+			start = rdtsc();
 			if (!fcallout_patch_exists() && (tb = tb_find(frame->eip))) {
 				uint8_t *ptr1, *ptr2;
 				scan_next_insn((void *)frame->eip, &ptr1, &ptr2);
 				if (ptr1 && !fcallout_already_patched(ptr1)) {
 					apply_fcallout_patch(ptr1, ptr2);
+					stats_num_irq_patches++;
+					stats_irq_patch_cycles += rdtsc() - start;
 				}
 			}
+#endif
 		}
 	}
 
@@ -1080,12 +1144,29 @@ guest_handle_exception(struct intr_frame *f, cpu_constraints_t cpu_constraints)
   return false;
 }
 
+/* Returns the IRQ line on which INTNO, as returned by pic_read_irq(), was
+ * raised. */
+static int
+pic_intno_irq(int intno)
+{
+  PicState const *pics = vcpu.isa_pic.pics;
+
+  if (intno >= pics[1].irq_base && intno < pics[1].irq_base + 8) {
+    return 8 + intno - pics[1].irq_base;
+  }
+  return (intno - pics[0].irq_base) & 7;
+}
+
 void
 handle_pending_interrupts(uint8_t *tc_ptr)
 {
-  int intno;
+  int intno, irq;
   enum intr_level level;
 
+  /* If the guest cannot take the interrupt now, it is picked up again when it
+   * sets IF (see CALLOUT_NOP_IF_PENDING_IRQ). Polling for it meanwhile would
+   * only make every tb exit. */
+  vcpu.irq_pending = 0;
   if (vcpu.IF != 1) {
 		//printf("%s() %d:\n", __func__, __LINE__);
     return;
@@ -1109,6 +1190,16 @@ handle_pending_interrupts(uint8_t *tc_ptr)
       if (vcpu.record_log || vcpu.replay_log) {
         vcpu.n_exec = get_n_exec(vcpu.callout_next);
       }
+      stats_num_irqs_delivered++;
+      irq = pic_intno_irq(intno);
+      if (irq_arrival_tsc[irq]) {
+        uint64_t latency = rdtsc() - irq_arrival_tsc[irq];
+        stats_irq_latency_cycles += latency;
+        if (latency > stats_irq_latency_max) {
+          stats_irq_latency_max = latency;
+        }
+        irq_arrival_tsc[irq] = 0;
+      }
       raise_interrupt(intno, 0, -1, 0);
       NOT_REACHED();
     } else {
@@ -1245,4 +1336,18 @@ callout_print_stats(void)
 {
 	printf("MON-STATS: callouts: %lld all, %lld forced, %lld sti\n",
 			stats_num_callouts, stats_num_forced_callouts, stats_num_sti_callouts);
+#ifdef IRQ_POLL
+	printf("MON-STATS: irqs (polled): %lld delivered, %lld poll exits, "
+			"%d bytes per check.\n", stats_num_irqs_delivered,
+			stats_num_irq_polls, (int)irq_poll_check_size());
+#else
+	printf("MON-STATS: irqs (patched): %lld delivered, %lld patches, "
+			"%llu cycles per patch.\n", stats_num_irqs_delivered,
+			stats_num_irq_patches, stats_num_irq_patches
+			?stats_irq_patch_cycles/stats_num_irq_patches:0);
+#endif
+	printf("MON-STATS: irq latency: %llu cycles avg, %llu cycles max.\n",
+			stats_num_irqs_delivered
+			?stats_irq_latency_cycles/stats_num_irqs_delivered:0,
+			stats_irq_latency_max);
 }
@@ -8,6 +8,7 @@ cpu_constraints_t const constraint_bits[] = {
   CPU_CONSTRAINT_GPF,
   CPU_CONSTRAINT_FORCED_CALLOUT,
 	CPU_CONSTRAINT_SIMULATE,
+  CPU_CONSTRAINT_SIDE_EXIT,
 };
 
 static char const *
@@ -26,6 +27,8 @@ constraint_bit2str(cpu_constraints_t constraint)
       return "forced_callout";
     case CPU_CONSTRAINT_SIMULATE:
       return "simulate";
+    case CPU_CONSTRAINT_SIDE_EXIT:
+      return "side_exit";
     default:
       NOT_REACHED();
   }
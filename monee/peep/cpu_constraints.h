@@ -11,6 +11,7 @@ typedef uint64_t cpu_constraints_t;
 #define CPU_CONSTRAINT_GPF            (1 << 3)
 #define CPU_CONSTRAINT_FORCED_CALLOUT (1 << 4)
 #define CPU_CONSTRAINT_SIMULATE       (1 << 5)
+#define CPU_CONSTRAINT_SIDE_EXIT      (1 << 6)
 #define DEFAULT_CPU_CONSTRAINTS \
   (CPU_CONSTRAINT_REAL | CPU_CONSTRAINT_PROTECTED | CPU_CONSTRAINT_NO_EXCP)
 
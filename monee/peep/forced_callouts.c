@@ -59,8 +59,7 @@ clear_fcallout_patches(void)
 static bool
 insn_is_forced_callout(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (!strcmp(opc, "int")) {
+  if (opctable_class(insn->opc) & OPC_CLASS_INT) {
     ASSERT(insn->op[0].type == op_imm);
     if (insn->op[0].val.imm == FORCED_CALLOUT) {
       return true;
@@ -84,7 +83,7 @@ scan_next_insn(uint8_t const *tc_ptr, uint8_t const **ptr1,
 	}
   ASSERT(tb);
   tc_next = tb_get_tc_next(tb, tc_ptr);
-  ASSERT(tc_next <= tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+  ASSERT(tc_next <= tb->tc_ptr + tb->tc_len);
   while (tc_ptr < tc_next) {
     len = disas_insn(tc_ptr, tc_ptr, &insn, 4, false);
     if (insn_is_forced_callout(&insn)) {
@@ -133,7 +132,7 @@ scan_next_insn(uint8_t const *tc_ptr, uint8_t const **ptr1,
     }
     tc_ptr += len;
   }
-  ASSERT(tc_next < tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+  ASSERT(tc_next < tb->tc_ptr + tb->tc_len);
   *ptr1 = tc_next;
   *ptr2 = NULL;
   return;
@@ -182,31 +181,34 @@ static bool
 tc_belongs_to_tb(uint8_t *tcptr, tb_t const *tb)
 {
   return (   tcptr >= tb->tc_ptr
-          && tcptr < tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+          && tcptr < tb->tc_ptr + tb->tc_len);
 }
 
 static void
 fcallout_patches_tb_add(tb_t *tb)
 {
   uint8_t const *ptr1 = NULL, *ptr2 = NULL;
+  uint8_t eip_boundaries[MAX_SUPERBLOCK_SIZE + 1];
+  uint16_t tc_boundaries[MAX_SUPERBLOCK_SIZE + 1];
   int deleted = -1;
   unsigned i;
 
+  tb_get_boundaries(tb, eip_boundaries, tc_boundaries);
   for (i = 0; i < num_fcallout_patches_pending; i++) {
     if (pc_belongs_to_tb(fcallout_patches_pending[i].eip_phys,
           fcallout_patches_pending[i].eip_virt, tb)) {
       unsigned inum;
       for (inum = 0; inum < tb->num_insns; inum++) {
         if (fcallout_patches_pending[i].eip_virt ==
-            tb->eip_virt + ((inum==0)?0:tb->eip_boundaries[inum-1])) {
+            tb->eip_virt + eip_boundaries[inum]) {
           ASSERT(fcallout_patches_pending[i].eip_phys == tb->eip_phys
-              + ((inum==0)?0:tb->eip_boundaries[inum-1]));
+              + eip_boundaries[inum]);
           if (fcallout_patches_pending[i].use_next_insn) {
             //XXX
             printf("Warning: not tested.\n");
-            scan_next_insn(tb->tc_ptr + tb->tc_boundaries[inum], &ptr1, &ptr2);
+            scan_next_insn(tb->tc_ptr + tc_boundaries[inum], &ptr1, &ptr2);
           } else {
-            ptr1 = tb->tc_ptr + tb->tc_boundaries[inum];
+            ptr1 = tb->tc_ptr + tc_boundaries[inum];
             ptr2 = NULL;
           }
           ASSERT(!fcallout_already_patched(ptr1));
@@ -315,8 +317,8 @@ fcallout_patch_pc(target_ulong eip_phys, target_ulong eip_virt)
     return;
   }
   ASSERT(inum < tb->num_insns);
-  ASSERT(tb->tc_boundaries[inum] + 1 <= tb->tc_boundaries[tb->num_insns]);
-  ptr = tb->tc_ptr+tb->tc_boundaries[inum];
+  ptr = tb->tc_ptr + tb_tc_boundary(tb, inum);
+  ASSERT(ptr + 1 <= tb->tc_ptr + tb->tc_len);
   ASSERT(tb_find(tb->tc_ptr));
   ASSERT(tb_find(ptr));
   if (!fcallout_already_patched((uint8_t const *)ptr)) {
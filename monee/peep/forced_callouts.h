@@ -5,6 +5,13 @@
 #include <types.h>
 struct tb_t;
 
+/* Asynchronous interrupts that the guest can take right away are normally
+ * delivered by patching an "int $FORCED_CALLOUT" over the next insn boundary
+ * of the running tb. With IRQ_POLL defined, the monitor instead sets
+ * vcpu.irq_pending, which translated code tests (CHECK_IRQ_PENDING) before
+ * every insn that may close a loop and at every superblock part, so no tc is
+ * decoded or patched, at the cost of a check per back-edge. */
+
 void clear_fcallout_patches(void);
 void scan_next_insn(uint8_t const *tc_ptr, uint8_t const **ptr1,
     uint8_t const **ptr2);
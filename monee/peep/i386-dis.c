@@ -4245,7 +4245,6 @@ disas_dofloat (insn_t *insn, int sizeflag)
 
     insn->opc = opctable_find(float_mem_dpnum[fp_indx], sizeflag);
     ASSERT(insn->opc != -1);
-    obufp = op_out[0];
     op_ad = 2;
     DIS_E (&insn->op[0], float_mem_mode[fp_indx], sizeflag);
     for (i = 1; i < MAX_NUM_OPERANDS; i++) {
@@ -4277,7 +4276,6 @@ disas_dofloat (insn_t *insn, int sizeflag)
     insn->opc = opctable_find(dp->dpnum, sizeflag);
     //putop (dp->name, sizeflag);
 
-    obufp = op_out[0];
     op_ad = 2;
     if (dp->op[0].disas_rtn) {
       (*dp->op[0].disas_rtn) (&insn->op[0], dp->op[0].bytemode, sizeflag);
@@ -4285,7 +4283,6 @@ disas_dofloat (insn_t *insn, int sizeflag)
       insn->op[0].type = invalid;
     }
 
-    obufp = op_out[1];
     op_ad = 1;
     if (dp->op[1].disas_rtn) {
       (*dp->op[1].disas_rtn) (&insn->op[1], dp->op[1].bytemode, sizeflag);
@@ -6968,7 +6965,6 @@ disas_insn(unsigned char const *code, target_ulong eip, insn_t *insn,
 
   start_codep = (target_ulong)(code - eip);
   codep = code;
-  obufp = obuf;
   ckprefix();
 
   insn_codep = codep;
@@ -7044,10 +7040,6 @@ disas_insn(unsigned char const *code, target_ulong eip, insn_t *insn,
     sizeflag ^= AFLAG;
     if (dp->op[2].bytemode != loop_jcxz_mode || intel_syntax)
     {
-      if ((sizeflag & AFLAG) || address_mode == mode_64bit)
-        oappend ("addr32 ");
-      else
-        oappend ("addr16 ");
       used_prefixes |= PREFIX_ADDR;
     }
   }
@@ -7059,10 +7051,6 @@ disas_insn(unsigned char const *code, target_ulong eip, insn_t *insn,
         && dp->op[0].bytemode == v_mode
         && !intel_syntax)
     {
-      if (sizeflag & DFLAG)
-        oappend ("data32 ");
-      else
-        oappend ("data16 ");
       used_prefixes |= PREFIX_DATA;
     }
   }
@@ -7124,7 +7112,7 @@ disas_insn(unsigned char const *code, target_ulong eip, insn_t *insn,
           break;
 
         default:
-          oappend (INTERNAL_DISASSEMBLER_ERROR);
+          ASSERT(0);
           break;
       }
     }
@@ -7276,19 +7264,19 @@ opc_init(void)
 }
 
 
+/* The x87 stack registers have no operand_t representation. */
 static void
 DIS_ST (operand_t *op, int bytemode ATTRIBUTE_UNUSED,
         int sizeflag ATTRIBUTE_UNUSED)
 {
-  oappend ("%st" + intel_syntax);
+  op->type = invalid;
 }
 
 static void
 DIS_STi (operand_t *op, int bytemode ATTRIBUTE_UNUSED,
          int sizeflag ATTRIBUTE_UNUSED)
 {
-  snprintf (scratchbuf, sizeof scratchbuf, "%%st(%d)", modrm.rm);
-  oappend (scratchbuf + intel_syntax);
+  op->type = invalid;
 }
 
 static int
@@ -8174,12 +8162,9 @@ DIS_I (operand_t *op, int bytemode, int sizeflag)
       oper = get16 ();
       break;
     case const_1_mode:
-      if (intel_syntax)
-        oappend ("1");
       return;
     default:
       ASSERT(0);
-      //oappend (INTERNAL_DISASSEMBLER_ERROR);
       return;
   }
 
@@ -8227,7 +8212,7 @@ DIS_I64 (operand_t *op, int bytemode, int sizeflag)
       oper = get16 ();
       break;
     default:
-      oappend (INTERNAL_DISASSEMBLER_ERROR);
+      ASSERT(0);
       return;
   }
 
@@ -8279,7 +8264,7 @@ DIS_sI (operand_t *op, int bytemode, int sizeflag)
         oper -= 0x10000;
       break;
     default:
-      oappend (INTERNAL_DISASSEMBLER_ERROR);
+      ASSERT(0);
       return;
   }
 
@@ -8323,7 +8308,7 @@ DIS_J (operand_t *op, int bytemode, int sizeflag)
       used_prefixes |= (prefixes & PREFIX_DATA);
       break;
     default:
-      oappend (INTERNAL_DISASSEMBLER_ERROR);
+      ASSERT(0);
       return;
   }
   op->type = op_imm;
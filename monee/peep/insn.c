@@ -481,40 +481,12 @@ insns2str(insn_t const *insns, int n_insns, char *buf, size_t size)
 bool
 insn_is_terminating(insn_t const *insn)
 {
-  char const *opc;
-  opc = opctable_name(insn->opc);
-  if (opc[0] == 'j') {
-    return true;
-  }
-  if (opc[0] == 'l' && opc[1] == 'j') {
-    return true;
-  }
-  if (strstart(opc, "call", NULL)) {
-    return true;
-  }
-  if (strstart(opc, "lcall", NULL)) {
-    return true;
-  }
-  if (strstart(opc, "loop", NULL)) {
-    return true;
-  }
-  if (!strcmp(opc, "int")) {
-    return true;
-  }
-  if (!strcmp(opc, "retw") || !strcmp(opc, "retl")) {
-    return true;
-  }
-  if (!strcmp(opc, "lretw") || !strcmp(opc, "lretl")) {
-    return true;
-  }
-  if (!strcmp(opc, "iret")) {
-    return true;
-  }
-  if (!strcmp(opc, "hlt")) {
+  unsigned classes = opctable_class(insn->opc);
+  if (classes & OPC_CLASS_TERMINATING) {
     return true;
   }
   /* mov_to_cr3, mov_to_cr0 */
-  if (   !strcmp(opc, "mov") && insn->op[0].type == op_cr
+  if (   (classes & OPC_CLASS_MOV) && insn->op[0].type == op_cr
       && (insn->op[0].val.cr == 3 || insn->op[0].val.cr == 0)
       && insn->op[0].tag.cr == tag_const) {
     return true;
@@ -692,10 +664,7 @@ str2operand(operand_t *op, char const *str)
 static bool
 is_pcrel_operand(insn_t const *insn, int j)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (   opc[0] == 'j'
-      || !strcmp(opc, "call")
-      || !strcmp(opc, "loop")) {
+  if (opctable_class(insn->opc) & OPC_CLASS_PCREL) {
     if (j == 0) {
       return true;
     }
@@ -909,8 +878,8 @@ operand_get_value(operand_t const *op)
 bool
 insn_is_indirect_jump(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (!strcmp(opc, "jmp") && insn->op[0].type == op_mem) {
+  if (   (opctable_class(insn->opc) & OPC_CLASS_JMP)
+      && insn->op[0].type == op_mem) {
     return true;
   }
   return false;
@@ -919,85 +888,45 @@ insn_is_indirect_jump(insn_t const *insn)
 bool
 insn_is_string_op(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (   !strcmp(opc, "movs")
-			|| !strcmp(opc, "cmps")
-			|| !strcmp(opc, "stos")
-			|| !strcmp(opc, "lods")
-			|| !strcmp(opc, "scas")
-			|| !strcmp(opc, "ins")
-			|| !strcmp(opc, "outs")) {
-    return true;
-  }
-  return false;
+  return (opctable_class(insn->opc) & OPC_CLASS_STRING) != 0;
 }
 
 bool
 insn_is_movs_or_cmps(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (   !strcmp(opc, "movs")
-			|| !strcmp(opc, "cmps")) {
-    return true;
-  }
-  return false;
+  return (opctable_class(insn->opc) & OPC_CLASS_MOVS_CMPS) != 0;
 }
 
 bool
 insn_is_cmps_or_scas(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (   !strcmp(opc, "cmps")
-			|| !strcmp(opc, "scas")) {
-    return true;
-  }
-  return false;
+  return (opctable_class(insn->opc) & OPC_CLASS_CMPS_SCAS) != 0;
 }
 
 bool
 insn_is_push(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (strstart(opc, "push", NULL)) {
-    return true;
-  }
-  return false;
+  return (opctable_class(insn->opc) & OPC_CLASS_PUSH) != 0;
 }
 
 bool
 insn_is_pop(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (strstart(opc, "pop", NULL)) {
-    return true;
-  }
-  return false;
+  return (opctable_class(insn->opc) & OPC_CLASS_POP) != 0;
 }
 
 bool
 insn_is_sti(insn_t const *insn)
 {
-	char const *opc = opctable_name(insn->opc);
-	if (strstart(opc, "sti", NULL)) {
-		return true;
-	}
-	return false;
+	return (opctable_class(insn->opc) & OPC_CLASS_STI) != 0;
 }
 
-char *jmp_opcodes[] = {"jmp", "je", "jne", "jg", "jle", "jl", "jge", "ja",
-  "jbe", "jb", "jae", "jo", "jno", "js", "jns"};
-
 bool
 insn_is_direct_jump(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  char **jmp_opc;
-  for (jmp_opc = jmp_opcodes;
-       jmp_opc < jmp_opcodes + sizeof jmp_opcodes/sizeof jmp_opcodes[0];
-       jmp_opc++) {
-    if (!strcmp(opc, *jmp_opc) && insn->op[0].type == op_imm) {
-      return true;
-    }
+  if (   (opctable_class(insn->opc) & (OPC_CLASS_JMP | OPC_CLASS_JCC))
+      && insn->op[0].type == op_imm) {
+    return true;
   }
   return false;
 }
@@ -1005,8 +934,8 @@ insn_is_direct_jump(insn_t const *insn)
 bool
 insn_is_conditional_jump(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-  if (insn_is_direct_jump(insn) && strcmp(opc, "jmp")) {
+  if (   (opctable_class(insn->opc) & OPC_CLASS_JCC)
+      && insn->op[0].type == op_imm) {
     return true;
   }
   return false;
@@ -1039,7 +968,7 @@ insn_accesses_op_type(insn_t const *insn, struct operand_t const **op1,
 {
 	struct operand_t const *retop1 = NULL, *retop2 = NULL;
 	bool ret = false;
-  if (!strcmp(opctable_name(insn->opc), "lea")) {
+  if (opctable_class(insn->opc) & OPC_CLASS_LEA) {
 		return false;
   }
   if ((*type_fn)(&insn->op[0])) {
@@ -1088,17 +1017,7 @@ insn_accesses_mem(insn_t const *insn, struct operand_t const **op1,
 bool
 insn_accesses_stack(insn_t const *insn)
 {
-  char const *opc = opctable_name(insn->opc);
-	if (   strstart(opc, "push", NULL)
-			|| strstart(opc, "pop", NULL)
-			|| !strcmp(opc, "call")
-			|| !strcmp(opc, "ret")
-			|| !strcmp(opc, "lcall")
-			|| !strcmp(opc, "lret")
-			|| !strcmp(opc, "iret")) {
-		return true;
-	}
-	return false;
+	return (opctable_class(insn->opc) & OPC_CLASS_STACK) != 0;
 }
 
 struct operand_t const *
@@ -0,0 +1,143 @@
+#include "peep/insn_cache.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "peep/i386-dis.h"
+#include "peep/insntypes.h"
+#include "mem/paging.h"
+#include "sys/vcpu.h"
+
+#if (INSN_CACHE_SIZE & (INSN_CACHE_SIZE - 1)) != 0
+#error "INSN_CACHE_SIZE must be a power of two."
+#endif
+
+typedef struct insn_cache_entry_t {
+  target_phys_addr_t paddr;
+  target_ulong eip;
+  uint8_t size;
+  uint8_t len;                  /* 0 if the entry is invalid. */
+  uint8_t bytes[INSN_CACHE_MAX_LEN];
+  insn_t insn;
+} insn_cache_entry_t;
+
+static insn_cache_entry_t insn_cache[INSN_CACHE_SIZE];
+
+static long long stats_num_hits = 0;
+static long long stats_num_misses = 0;
+static long long stats_num_stale = 0;
+
+static inline insn_cache_entry_t *
+insn_cache_entry(target_phys_addr_t paddr)
+{
+  return &insn_cache[(paddr ^ (paddr >> 9)) & (INSN_CACHE_SIZE - 1)];
+}
+
+static bool
+insn_cache_bytes_equal(insn_cache_entry_t const *e, uint8_t const *code,
+    bool guest)
+{
+  unsigned i;
+
+  if (!guest) {
+    return !memcmp(e->bytes, code, e->len);
+  }
+  for (i = 0; i < e->len; i++) {
+    if (ldub((target_ulong)(code + i)) != e->bytes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+insn_cache_init(void)
+{
+  memset(insn_cache, 0x0, sizeof insn_cache);
+}
+
+/* Same as disas_insn(). PADDR is the guest-physical address of the insn at
+ * CODE, or INSN_CACHE_NO_PADDR. */
+int
+insn_cache_disas(uint8_t const *code, target_ulong eip,
+    target_phys_addr_t paddr, insn_t *insn, unsigned size, bool guest)
+{
+  insn_cache_entry_t *e;
+  unsigned i;
+  int len;
+
+  if (paddr == INSN_CACHE_NO_PADDR) {
+    return disas_insn(code, eip, insn, size, guest);
+  }
+  e = insn_cache_entry(paddr);
+  if (e->len && e->paddr == paddr && e->eip == eip && e->size == size) {
+    if (insn_cache_bytes_equal(e, code, guest)) {
+      *insn = e->insn;
+      stats_num_hits++;
+      return e->len;
+    }
+    stats_num_stale++;
+  }
+  stats_num_misses++;
+
+  len = disas_insn(code, eip, insn, size, guest);
+  if (len <= 0 || len > INSN_CACHE_MAX_LEN) {
+    return len;
+  }
+  e->paddr = paddr;
+  e->eip = eip;
+  e->size = size;
+  e->len = len;
+  for (i = 0; i < (unsigned)len; i++) {
+    e->bytes[i] = guest?ldub((target_ulong)(code + i)):code[i];
+  }
+  e->insn = *insn;
+  return len;
+}
+
+/* Returns the guest-physical address of the guest code at CODE, or
+ * INSN_CACHE_NO_PADDR if it is not mapped. */
+target_phys_addr_t
+insn_cache_guest_paddr(uint8_t const *code)
+{
+  target_phys_addr_t paddr;
+
+  paddr = pt_walk((void *)vcpu.cr[3], (target_ulong)code, NULL, NULL, 0);
+  if (paddr == PDE_ERR || paddr == PTE_ERR) {
+    return INSN_CACHE_NO_PADDR;
+  }
+  return paddr;
+}
+
+/* Drops the insns that overlap the guest-physical range [PADDR, PADDR + LEN),
+ * which has been written to. */
+void
+insn_cache_invalidate(target_phys_addr_t paddr, size_t len)
+{
+  insn_cache_entry_t *e;
+  target_phys_addr_t start;
+  size_t i;
+
+  start = (paddr < INSN_CACHE_MAX_LEN - 1)?0:paddr - (INSN_CACHE_MAX_LEN - 1);
+  len += paddr - start;
+  if (len >= INSN_CACHE_SIZE) {
+    insn_cache_init();
+    return;
+  }
+  for (i = 0; i < len; i++) {
+    e = insn_cache_entry(start + i);
+    if (   e->len && e->paddr == start + i
+        && e->paddr + e->len > paddr) {
+      e->len = 0;
+    }
+  }
+}
+
+void
+insn_cache_print_stats(void)
+{
+  long long lookups = stats_num_hits + stats_num_misses;
+
+  printf("MON-STATS: insn_cache: %lld hits, %lld misses (%lld stale), "
+      "%lld%% hit rate.\n", stats_num_hits, stats_num_misses, stats_num_stale,
+      lookups?(stats_num_hits * 100 / lookups):0);
+}
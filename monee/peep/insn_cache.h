@@ -0,0 +1,35 @@
+#ifndef PEEP_INSN_CACHE_H
+#define PEEP_INSN_CACHE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <types.h>
+
+/* Decoded insns, so that retranslating the same guest code (after a tb
+ * has been evicted or flushed, or to regenerate its rollback code) does not
+ * decode it again. The cache is direct-mapped on the guest-physical address
+ * of the insn, so that every mapping of the code shares an entry and a write
+ * to the page can drop it. An entry is used only for the same eip (which
+ * pc-relative operands depend on) and size. It also holds the insn's bytes,
+ * which are compared with the code on every hit, so a modified insn is never
+ * served stale even if the write was not traced. */
+#ifndef INSN_CACHE_SIZE
+#define INSN_CACHE_SIZE 512
+#endif
+
+/* Longest x86 insn. */
+#define INSN_CACHE_MAX_LEN 15
+
+/* Bypasses the cache. */
+#define INSN_CACHE_NO_PADDR ((target_phys_addr_t)-1)
+
+struct insn_t;
+
+void insn_cache_init(void);
+int insn_cache_disas(uint8_t const *code, target_ulong eip,
+    target_phys_addr_t paddr, struct insn_t *insn, unsigned size, bool guest);
+target_phys_addr_t insn_cache_guest_paddr(uint8_t const *code);
+void insn_cache_invalidate(target_phys_addr_t paddr, size_t len);
+void insn_cache_print_stats(void);
+
+#endif
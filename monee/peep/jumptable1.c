@@ -1,40 +1,259 @@
 #include "peep/jumptable1.h"
 #include <debug.h>
+#include <stdio.h>
 #include <string.h>
+#include "mem/malloc.h"
 
-jumptable1_entry_t jumptable1[JUMPTABLE1_SIZE];
+jumptable1_entry_t jumptable1[JUMPTABLE1_SIZE * JUMPTABLE1_WAYS];
+/* Empty inline caches point here. Its tc_ptr is zero, so it never hits. */
+static jumptable1_entry_t jumptable1_none;
+/* Stands in for the sites of translations that are only measured. */
+jumptable1_site_t jumptable1_site_none;
+/* The sites of the tbs that end with a call, chained by return eip. */
+static struct list jumptable1_ret_sites[JUMPTABLE1_RET_SITES_SIZE];
+
+#ifndef NDEBUG
+/* The live sites, and the counts of the freed ones. */
+static struct list jumptable1_sites;
+static long long freed_hits, freed_misses, freed_ret_hits;
+#endif
+
+jumptable1_rstack_entry_t jumptable1_rstack[JUMPTABLE1_RSTACK_SIZE];
+uint32_t jumptable1_rstack_top;
+
+#if JUMPTABLE1_RSTACK_SIZE * 8 != 256
+#error "The shadow return stack must be 256 bytes long."
+#endif
+
+static inline jumptable1_entry_t *
+jumptable1_set(uint32_t eip)
+{
+  return &jumptable1[(eip & JUMPTABLE1_MASK) << JUMPTABLE1_WAYS_SHIFT];
+}
+
+static inline struct list *
+jumptable1_ret_chain(uint32_t eip)
+{
+  return &jumptable1_ret_sites[eip & (JUMPTABLE1_RET_SITES_SIZE - 1)];
+}
+
+/* Makes the calls that return to EIP push TC_PTR on the shadow return
+ * stack. */
+static void
+jumptable1_patch_ret_sites(uint32_t eip, uint32_t tc_ptr)
+{
+  struct list *chain = jumptable1_ret_chain(eip);
+  struct list_elem *e;
+
+  for (e = list_begin(chain); e != list_end(chain); e = list_next(e)) {
+    jumptable1_site_t *site = list_entry(e, jumptable1_site_t, ret_elem);
+
+    if (site->ret_eip == eip) {
+      *site->ret_tc_ptr = tc_ptr;
+    }
+  }
+}
+
+static void
+jumptable1_site_init(jumptable1_site_t *site)
+{
+  memset(site, 0x0, sizeof *site);
+  site->ic.entry = (uint32_t)&jumptable1_none;
+}
 
 void
 jumptable1_init(void)
 {
+  int i;
+
+  for (i = 0; i < JUMPTABLE1_RET_SITES_SIZE; i++) {
+    list_init(&jumptable1_ret_sites[i]);
+  }
+  jumptable1_site_init(&jumptable1_site_none);
   jumptable1_clear();
+#ifndef NDEBUG
+  list_init(&jumptable1_sites);
+#endif
 }
 
 void
 jumptable1_add(uint32_t eip, uint32_t tc_ptr)
 {
 #ifndef NO_JUMPTABLE1
-  /*
-  if (*(uint32_t *)((uint8_t *)jumptable1 + (eip & JUMPTABLE1_MASK)) == eip) {
-    log_printf("%s(): Adding duplicate %#x at %#x.\n", __func__, eip,
-        eip & JUMPTABLE1_MASK);
-  }
-  */
+  jumptable1_entry_t *set;
+  int i, way;
+
 	ASSERT(tc_ptr);		/* We rely on tc_ptr being non-zero. */
-  *(uint32_t *)((uint8_t *)jumptable1 + (eip & JUMPTABLE1_MASK)) = eip;
-  *(uint32_t *)((uint8_t *)jumptable1 + (eip & JUMPTABLE1_MASK) + 4) = tc_ptr;
+  set = jumptable1_set(eip);
+  for (way = 0; way < JUMPTABLE1_WAYS - 1; way++) {
+    if (set[way].eip == eip || !set[way].tc_ptr) {
+      break;
+    }
+  }
+  /* Insert at way 0 and age the others, so that the most recently added
+   * target is probed first and the least recently added one is evicted. */
+  for (i = way; i > 0; i--) {
+    set[i] = set[i - 1];
+  }
+  set[0].eip = eip;
+  set[0].tc_ptr = tc_ptr;
+  jumptable1_patch_ret_sites(eip, tc_ptr);
 #endif
 }
 
 void
 jumptable1_remove(uint32_t eip)
 {
-  *(uint32_t *)((uint8_t *)jumptable1 + (eip & JUMPTABLE1_MASK)) = 0;
-  *(uint32_t *)((uint8_t *)jumptable1 + (eip & JUMPTABLE1_MASK) + 4) = 0;
+  jumptable1_entry_t *set;
+  int way, i;
+
+  set = jumptable1_set(eip);
+  for (way = 0; way < JUMPTABLE1_WAYS; way++) {
+    if (set[way].eip == eip) {
+      set[way].eip = 0;
+      set[way].tc_ptr = 0;
+    }
+  }
+  /* The calls that return to eip, and the shadow return stack, may hold the
+   * tc_ptr of the translation being removed. */
+  jumptable1_patch_ret_sites(eip, 0);
+  for (i = 0; i < JUMPTABLE1_RSTACK_SIZE; i++) {
+    if (jumptable1_rstack[i].eip == eip) {
+      jumptable1_rstack[i].eip = 0;
+      jumptable1_rstack[i].tc_ptr = 0;
+    }
+  }
 }
 
 void
 jumptable1_clear(void)
 {
+  struct list_elem *e;
+  int i;
+
   memset(jumptable1, 0x0, sizeof jumptable1);
+  for (i = 0; i < JUMPTABLE1_RET_SITES_SIZE; i++) {
+    struct list *chain = &jumptable1_ret_sites[i];
+
+    for (e = list_begin(chain); e != list_end(chain); e = list_next(e)) {
+      *list_entry(e, jumptable1_site_t, ret_elem)->ret_tc_ptr = 0;
+    }
+  }
+  jumptable1_rstack_clear();
+}
+
+/* Returns the site of a new tb. */
+jumptable1_site_t *
+jumptable1_site_alloc(void)
+{
+  jumptable1_site_t *site;
+
+  site = malloc(sizeof *site);
+  ASSERT(site);
+  jumptable1_site_init(site);
+#ifndef NDEBUG
+  list_push_back(&jumptable1_sites, &site->elem);
+#endif
+  return site;
+}
+
+void
+jumptable1_site_free(jumptable1_site_t *site)
+{
+  if (site->ret_tc_ptr) {
+    list_remove(&site->ret_elem);
+  }
+#ifndef NDEBUG
+  freed_hits += site->ic.hits;
+  freed_misses += site->ic.misses;
+  freed_ret_hits += site->ret_hits;
+  list_remove(&site->elem);
+#endif
+  free(site);
+}
+
+/* Records that the tb of SITE ends with a call that returns to RET_EIP, and
+ * whose translation pushes the immediate at RET_TC_PTR on the shadow return
+ * stack. The immediate is set at once if jumptable1 knows RET_EIP, and is
+ * patched by jumptable1_add() otherwise. */
+void
+jumptable1_site_set_return(jumptable1_site_t *site, uint32_t ret_eip,
+    uint32_t *ret_tc_ptr)
+{
+  jumptable1_entry_t const *set;
+  int way;
+
+  ASSERT(site != &jumptable1_site_none);
+  ASSERT(!site->ret_tc_ptr);
+  site->ret_eip = ret_eip;
+  site->ret_tc_ptr = ret_tc_ptr;
+  list_push_back(jumptable1_ret_chain(ret_eip), &site->ret_elem);
+
+  *ret_tc_ptr = 0;
+  set = jumptable1_set(ret_eip);
+  for (way = 0; way < JUMPTABLE1_WAYS; way++) {
+    if (set[way].eip == ret_eip && set[way].tc_ptr) {
+      *ret_tc_ptr = set[way].tc_ptr;
+      break;
+    }
+  }
+}
+
+void
+jumptable1_rstack_clear(void)
+{
+  int i;
+
+  for (i = 0; i < JUMPTABLE1_RSTACK_SIZE; i++) {
+    jumptable1_rstack[i].eip = 0;
+    jumptable1_rstack[i].tc_ptr = 0;
+  }
+  jumptable1_rstack_top = 0;
+}
+
+void
+jumptable1_print_stats(void)
+{
+#ifndef NDEBUG
+#define NUM_HOT_SITES 8
+  jumptable1_ic_t const *hot[NUM_HOT_SITES];
+  long long hits, misses, ret_hits;
+  struct list_elem *e;
+  unsigned j, num_sites = 0;
+
+  memset(hot, 0x0, sizeof hot);
+  hits = freed_hits;
+  misses = freed_misses;
+  ret_hits = freed_ret_hits;
+  for (e = list_begin(&jumptable1_sites); e != list_end(&jumptable1_sites);
+      e = list_next(e)) {
+    jumptable1_site_t const *site = list_entry(e, jumptable1_site_t, elem);
+    jumptable1_ic_t const *ic = &site->ic;
+    uint32_t n = ic->hits + ic->misses;
+
+    ret_hits += site->ret_hits;
+    if (!n) {
+      continue;
+    }
+    num_sites++;
+    hits += ic->hits;
+    misses += ic->misses;
+    for (j = 0; j < NUM_HOT_SITES; j++) {
+      if (!hot[j] || n > hot[j]->hits + hot[j]->misses) {
+        memmove(&hot[j + 1], &hot[j], (NUM_HOT_SITES - j - 1) * sizeof hot[0]);
+        hot[j] = ic;
+        break;
+      }
+    }
+  }
+	printf("MON-STATS: jumptable1: %d sets x %d ways, inline caches: %lld hits, "
+      "%lld misses at %d live sites.\n", JUMPTABLE1_SIZE, JUMPTABLE1_WAYS,
+      hits, misses, num_sites);
+	printf("MON-STATS: jumptable1: shadow return stack: %lld rets predicted.\n",
+      ret_hits);
+  for (j = 0; j < NUM_HOT_SITES && hot[j]; j++) {
+	  printf("MON-STATS: jumptable1: site %#x: %u hits, %u misses\n",
+        hot[j]->site, hot[j]->hits, hot[j]->misses);
+  }
+#endif
 }
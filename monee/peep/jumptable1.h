@@ -1,18 +1,99 @@
 #ifndef PEEP_JUMPTABLE1_H
-#define PEEP_JUMPTABLE1_h
+#define PEEP_JUMPTABLE1_H
 #include <stdint.h>
+#include <list.h>
 
+/* jumptable1 is a set-associative (eip -> tc_ptr) cache that is looked up
+ * inline by translated indirect branches. JUMPTABLE1_SIZE is the number of
+ * sets and JUMPTABLE1_WAYS the number of entries in each set. */
+#ifndef JUMPTABLE1_SIZE
 #define JUMPTABLE1_SIZE 4096
-#define JUMPTABLE1_MASK ((JUMPTABLE1_SIZE*8 - 1) & ~0x7)
+#endif
+#ifndef JUMPTABLE1_WAYS
+#define JUMPTABLE1_WAYS 2
+#endif
+
+#if JUMPTABLE1_WAYS == 1
+#define JUMPTABLE1_WAYS_SHIFT 0
+#elif JUMPTABLE1_WAYS == 2
+#define JUMPTABLE1_WAYS_SHIFT 1
+#elif JUMPTABLE1_WAYS == 4
+#define JUMPTABLE1_WAYS_SHIFT 2
+#else
+#error "JUMPTABLE1_WAYS must be 1, 2 or 4."
+#endif
+
+#if (JUMPTABLE1_SIZE & (JUMPTABLE1_SIZE - 1)) != 0
+#error "JUMPTABLE1_SIZE must be a power of two."
+#endif
+
+/* (eip & JUMPTABLE1_MASK) << JUMPTABLE1_SET_SHIFT is the byte offset of the
+ * set for eip. */
+#define JUMPTABLE1_MASK (JUMPTABLE1_SIZE - 1)
+#define JUMPTABLE1_SET_SHIFT (3 + JUMPTABLE1_WAYS_SHIFT)
+
+/* Shadow return stack. Translated calls push (return eip, tc_ptr of the
+ * return eip) and translated rets pop it, to jump straight to the tc_ptr
+ * when the return address matches. The translated code wraps the stack top
+ * by reading only its low byte, so the stack must be exactly 256 bytes
+ * long. A mismatch, an unknown tc_ptr, an overflow or an invalidated stack
+ * only costs a lookup. */
+#define JUMPTABLE1_RSTACK_SIZE 32
+
+/* The call sites are indexed by their return eip in a hash table of
+ * JUMPTABLE1_RET_SITES_SIZE chains. */
+#define JUMPTABLE1_RET_SITES_SIZE 1024
 
 typedef struct jumptable1_entry_t {
   uint32_t eip;
   uint32_t tc_ptr;
 } jumptable1_entry_t;
 
+/* Inline cache. It points to the jumptable1 entry that last resolved the
+ * target of the indirect jump, call or ret, so that a correctly predicted
+ * branch does not need to hash into jumptable1. The translated code checks
+ * the eip of that entry on every use: an entry that was removed, replaced or
+ * aged into another way only costs a miss, and jumptable1_remove() never
+ * needs to look at the inline caches. */
+typedef struct jumptable1_ic_t {
+  uint32_t entry;       /* The jumptable1_entry_t, never NULL. */
+  /* Maintained by the translated code in debug builds only. */
+  uint32_t site;        /* The tc address of the branch that last refilled. */
+  uint32_t hits;
+  uint32_t misses;
+} jumptable1_ic_t;
+
+/* Every tb owns a jumptable1_site_t, whose address the translated code uses
+ * as a constant. If the tb ends with a call, ret_tc_ptr points to the
+ * immediate that the call pushes on the shadow return stack, which is kept
+ * equal to the tc_ptr that jumptable1 has for ret_eip, or zero. */
+typedef struct jumptable1_site_t {
+  jumptable1_ic_t ic;
+  uint32_t ret_eip;
+  uint32_t *ret_tc_ptr;
+  struct list_elem ret_elem;  /* In the chain of ret_eip, if ret_tc_ptr. */
+  /* Rets of the tb that the shadow return stack predicted. Maintained by the
+   * translated code in debug builds only. */
+  uint32_t ret_hits;
+  struct list_elem elem;      /* For jumptable1_print_stats(). */
+} jumptable1_site_t;
+
+typedef struct jumptable1_rstack_entry_t {
+  uint32_t eip;
+  uint32_t tc_ptr;      /* Zero if unknown. */
+} jumptable1_rstack_entry_t;
+
+extern jumptable1_site_t jumptable1_site_none;
+
 void jumptable1_init(void);
 void jumptable1_add(uint32_t eip, uint32_t tc_ptr);
 void jumptable1_remove(uint32_t eip);
 void jumptable1_clear(void);
+jumptable1_site_t *jumptable1_site_alloc(void);
+void jumptable1_site_free(jumptable1_site_t *site);
+void jumptable1_site_set_return(jumptable1_site_t *site, uint32_t ret_eip,
+    uint32_t *ret_tc_ptr);
+void jumptable1_rstack_clear(void);
+void jumptable1_print_stats(void);
 
 #endif
@@ -2,23 +2,25 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <debug.h>
 #include "sys/vcpu.h"
 
 #define MAX_DISAS_ENTRIES 2560
+/* The sizeflag (a combination of AFLAG and DFLAG) indexes opctable
+ * directly. */
 #define MAX_SIZEFLAGS 4
 #define MAX_OPCS 1024
-#define MAX_
 
 static opc_t opctable[MAX_DISAS_ENTRIES][MAX_SIZEFLAGS];
 
 static char nametable[MAX_OPCS][8];
 static size_t nametable_size = 0;
 
-static int sizeflagtable[MAX_SIZEFLAGS];
-static int sizeflagtable_size = 0;
+uint16_t opctable_classes[MAX_OPCS];
 
-static int find_sizeflag_num(int sizeflag);
+static char const *jmp_opcodes[] = {"jmp", "je", "jne", "jg", "jle", "jl",
+  "jge", "ja", "jbe", "jb", "jae", "jo", "jno", "js", "jns"};
 
 void
 opctable_init(void)
@@ -39,7 +41,6 @@ opctable_insert(char const *name, int dp_num, int sizeflag)
 {
   unsigned i;
   opc_t opc = (opc_t)nametable_size;
-  int sizeflag_num;
 
   for (i = 0; i < nametable_size; i++) {
     if (!strcmp(nametable[i], name)) {
@@ -47,21 +48,16 @@ opctable_insert(char const *name, int dp_num, int sizeflag)
     }
   }
   ASSERT(opc < MAX_OPCS);
-  sizeflag_num = find_sizeflag_num(sizeflag);
-  ASSERT(sizeflag_num < MAX_SIZEFLAGS);
+  ASSERT(sizeflag >= 0 && sizeflag < MAX_SIZEFLAGS);
   ASSERT(dp_num < MAX_DISAS_ENTRIES);
 
-  opctable[dp_num][sizeflag_num] = opc;
+  opctable[dp_num][sizeflag] = opc;
 
   if (opc == (int)nametable_size) {
     snprintf(nametable[opc], sizeof nametable[opc], "%s", name);
+    opctable_classes[opc] = opctable_classify(nametable[opc]);
     nametable_size++;
   }
-  if (sizeflag_num == sizeflagtable_size) {
-    //printf("Adding %d to sizeflagtable.\n", sizeflag);
-    sizeflagtable[sizeflag_num] = sizeflag;
-    sizeflagtable_size++;
-  }
 }
 
 void
@@ -82,13 +78,12 @@ opctable_print(FILE *fp)
 opc_t
 opctable_find(int dp_num, int sizeflag)
 {
-  int sizeflagnum = find_sizeflag_num(sizeflag);
-  ASSERT(sizeflagnum < sizeflagtable_size);
-  if (opctable[dp_num][sizeflagnum] == opc_inval) {
+  ASSERT(sizeflag >= 0 && sizeflag < MAX_SIZEFLAGS);
+  if (opctable[dp_num][sizeflag] == opc_inval) {
     //printf("Invalid opcode found at eip=%#x.\n", vcpu.eip);
     return -1;
   }
-  return opctable[dp_num][sizeflagnum];
+  return opctable[dp_num][sizeflag];
 }
 
 char const *
@@ -97,18 +92,68 @@ opctable_name(opc_t opc)
   return nametable[opc];
 }
 
-static int
-find_sizeflag_num(int sizeflag)
+/* Returns the OPC_CLASS_* bits of the opcode named OPC. This compares strings
+ * the way the insn_is_*() predicates did before the classes existed. */
+unsigned
+opctable_classify(char const *opc)
 {
-  int i;
-  int sizeflag_num = sizeflagtable_size;
-  for (i = 0; i < sizeflagtable_size; i++) {
-    if (sizeflagtable[i] == sizeflag) {
-      sizeflag_num = i;
-      break;
+  unsigned classes = 0;
+  size_t i;
+
+  if (   opc[0] == 'j'
+      || (opc[0] == 'l' && opc[1] == 'j')
+      || strstart(opc, "call", NULL)
+      || strstart(opc, "lcall", NULL)
+      || strstart(opc, "loop", NULL)
+      || !strcmp(opc, "int")
+      || !strcmp(opc, "retw") || !strcmp(opc, "retl")
+      || !strcmp(opc, "lretw") || !strcmp(opc, "lretl")
+      || !strcmp(opc, "iret")
+      || !strcmp(opc, "hlt")) {
+    classes |= OPC_CLASS_TERMINATING;
+  }
+  for (i = 0; i < sizeof jmp_opcodes/sizeof jmp_opcodes[0]; i++) {
+    if (!strcmp(opc, jmp_opcodes[i])) {
+      classes |= (i == 0)?OPC_CLASS_JMP:OPC_CLASS_JCC;
     }
   }
-  ASSERT(sizeflagtable_size <= MAX_SIZEFLAGS);
-  ASSERT(sizeflag_num < MAX_SIZEFLAGS);
-  return sizeflag_num;
+  if (opc[0] == 'j' || !strcmp(opc, "call") || !strcmp(opc, "loop")) {
+    classes |= OPC_CLASS_PCREL;
+  }
+  if (   !strcmp(opc, "movs") || !strcmp(opc, "cmps")
+      || !strcmp(opc, "stos") || !strcmp(opc, "lods")
+      || !strcmp(opc, "scas") || !strcmp(opc, "ins")
+      || !strcmp(opc, "outs")) {
+    classes |= OPC_CLASS_STRING;
+  }
+  if (!strcmp(opc, "movs") || !strcmp(opc, "cmps")) {
+    classes |= OPC_CLASS_MOVS_CMPS;
+  }
+  if (!strcmp(opc, "cmps") || !strcmp(opc, "scas")) {
+    classes |= OPC_CLASS_CMPS_SCAS;
+  }
+  if (strstart(opc, "push", NULL)) {
+    classes |= OPC_CLASS_PUSH | OPC_CLASS_STACK;
+  }
+  if (strstart(opc, "pop", NULL)) {
+    classes |= OPC_CLASS_POP | OPC_CLASS_STACK;
+  }
+  if (strstart(opc, "sti", NULL)) {
+    classes |= OPC_CLASS_STI;
+  }
+  if (   !strcmp(opc, "call") || !strcmp(opc, "ret")
+      || !strcmp(opc, "lcall") || !strcmp(opc, "lret")
+      || !strcmp(opc, "iret")) {
+    classes |= OPC_CLASS_STACK;
+  }
+  if (!strcmp(opc, "lea")) {
+    classes |= OPC_CLASS_LEA;
+  }
+  if (!strcmp(opc, "mov")) {
+    classes |= OPC_CLASS_MOV;
+  }
+  if (!strcmp(opc, "int")) {
+    classes |= OPC_CLASS_INT;
+  }
+  return classes;
 }
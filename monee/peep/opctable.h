@@ -1,10 +1,31 @@
 #ifndef PEEP_OPCTABLE_H
 #define PEEP_OPCTABLE_H
 #include <stdio.h>
+#include <stdint.h>
 
 typedef int opc_t;
 #define opc_inval 0
 
+/* Opcode classes. They are derived once from the opcode name when the name
+ * is inserted, so that the insn_is_*() predicates, which run for every
+ * translated insn, test a bit instead of comparing strings. */
+#define OPC_CLASS_TERMINATING   0x0001  /* Ends a tb (see insn_is_terminating). */
+#define OPC_CLASS_JMP           0x0002
+#define OPC_CLASS_JCC           0x0004  /* Conditional jumps with an imm form. */
+#define OPC_CLASS_PCREL         0x0008  /* First operand is pc-relative. */
+#define OPC_CLASS_STRING        0x0010
+#define OPC_CLASS_MOVS_CMPS     0x0020
+#define OPC_CLASS_CMPS_SCAS     0x0040
+#define OPC_CLASS_PUSH          0x0080
+#define OPC_CLASS_POP           0x0100
+#define OPC_CLASS_STI           0x0200
+#define OPC_CLASS_STACK         0x0400  /* Implicitly accesses the stack. */
+#define OPC_CLASS_LEA           0x0800
+#define OPC_CLASS_MOV           0x1000
+#define OPC_CLASS_INT           0x2000
+
+extern uint16_t opctable_classes[];
+
 #define FGRPS_DPNUM(dp, rm)    
 #define FLOAT_MEM_DPNUM(fp_index)
 
@@ -12,6 +33,14 @@ void opctable_init(void);
 void opctable_insert(char const *name, int dp_num, int sizeflag);
 opc_t opctable_find(int dp_num, int sizeflag);
 char const *opctable_name(opc_t opc);
+unsigned opctable_classify(char const *name);
+
+static inline unsigned
+opctable_class(opc_t opc)
+{
+  return opctable_classes[opc];
+}
+
 int opctable_size(void);
 void opctable_print(FILE *fp);
 
@@ -11,6 +11,8 @@
 #include "peep/i386-dis.h"
 #include "peep/insntypes.h"
 #include "peep/insn.h"
+#include "peep/insn_cache.h"
+#include "peep/jumptable1.h"
 #include "peep/peeptab.h"
 #include "peep/assignments.h"
 #include "peep/regset.h"
@@ -18,6 +20,7 @@
 #include "peep/cpu_constraints.h"
 #include "peep/debug.h"
 #include "peep/sti_fallthrough.h"
+#include "peep/superblock.h"
 #include "sys/bootsector.h"
 #include "sys/gdt.h"
 #include "sys/monitor.h"
@@ -47,6 +50,13 @@ size_t peepgen_code(peepgen_label_t label, long *peep_param_buf,
 		uint8_t *gen_code_buf, uint16_t *edge_offset, uint16_t *jmp_offset,
 		rollbacks_t *rollbacks, long cur_addr, long fallthrough_addr, int is_terminating);
 
+/* The inline caches that the indirect branches being translated refer to, as
+ * site_ic; see set_jumptable1_site(). */
+static jumptable1_site_t *jumptable1_site = &jumptable1_site_none;
+/* Where the last translated call put the tc_ptr that it pushes on the shadow
+ * return stack (ret_tc_ptr), or NULL. Set by the generated code. */
+static uint32_t *jumptable1_ret_tc_ptr;
+
 #include "peepgen_gencode.h"
 
 peep_entry_t peep_tab_entries[] = {
@@ -57,6 +67,12 @@ peep_entry_t peep_tab_entries[] = {
 
 struct hash peep_tab;
 int max_tu_size;
+/* The number of side exits the next translation may have, or -1 if it is not
+ * a superblock. */
+static int superblock_side_exits = -1;
+
+/* The longest insn on x86. */
+#define MAX_INSN_LEN 15
 
 static inline unsigned
 hash_insns(size_t n_insns, insn_t const *insns)
@@ -549,7 +565,8 @@ rename_mem_operands_to_disps(uint8_t *obuf, size_t obuf_size,
   uint8_t modrm_byte, new_modrm_byte, sib_byte, mod, nnn, rm;
 	static uint8_t prefixes[16];
 	size_t prefixes_out_bytes;
-  target_ulong scratch_reg;
+  /* Static: the code that refers to it outlives this call. */
+  static target_ulong scratch_reg;
   static regset_t use, def;
   static insn_t insn;
   int opc, disas;
@@ -712,8 +729,6 @@ operand_accesses_cs_gs(operand_t const *op)
   return false;
 }
 
-#define MAX_PEEP_STRING_SIZE  80
-
 static size_t
 mode_translate(void *out_buf, size_t out_buf_size, void *in_buf,
     size_t in_buf_len, insn_t const *insn,
@@ -1012,31 +1027,84 @@ translation_contains_jump_to_monitor(uint8_t const *obuf, size_t osize)
 	}
 }
 
+/* Returns true if the translation of CODE may turn into a superblock, i.e. if
+ * it ends in a conditional jump or at the size limit. Sets *ENDS_IN_JCC
+ * accordingly. */
+static bool
+superblock_candidate(uint8_t const *code, target_ulong eip_virt,
+    cpu_constraints_t const *cpu_constraints, unsigned size, bool *ends_in_jcc)
+{
+  uint8_t const *ptr = code;
+  insn_t insn;
+  int n, disas;
+
+  if (   vcpu.replay_log || rr_log_lockstep_mode() || max_tu_size <= 1
+      || size != 4 || !(*cpu_constraints & CPU_CONSTRAINT_PROTECTED)) {
+    return false;
+  }
+  for (n = 0; n < max_tu_size; n++) {
+    disas = insn_cache_disas(ptr, (ptr - code) + eip_virt,
+        insn_cache_guest_paddr(ptr), &insn, size, true);
+    if (!disas) {
+      return false;
+    }
+    ptr += disas;
+    if (insn_is_terminating(&insn)) {
+      *ends_in_jcc = insn_is_conditional_jump(&insn);
+      return *ends_in_jcc;
+    }
+  }
+  *ends_in_jcc = false;
+  return true;
+}
+
+#ifdef IRQ_POLL
+/* Returns true if INSN, at EIP, may close a loop: a pc-relative jump back to
+ * EIP or before, or a control transfer whose target is not known at
+ * translation time. */
+static bool
+insn_is_back_edge(insn_t const *insn, target_ulong eip)
+{
+  if (   (opctable_class(insn->opc) & OPC_CLASS_PCREL)
+      && insn->op[0].type == op_imm) {
+    return insn->op[0].val.imm <= eip;
+  }
+  return insn_is_terminating(insn);
+}
+#endif
+
 size_t
 translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
-    rollbacks_t *rollbacks, size_t *tb_len, uint16_t *edge_offsets,
-    uint16_t *jmp_offsets, uint8_t *eip_boundaries, uint16_t *tc_boundaries,
-    char **peep_string, size_t *num_insns,
+    size_t *tb_len, uint16_t *edge_offsets, uint16_t *jmp_offsets,
+    uint8_t *eip_boundaries, uint16_t *tc_boundaries, size_t *num_insns,
+    uint32_t *part_starts, uint32_t *sti_checks,
     cpu_constraints_t const *cpu_constraints)
 {
   uint8_t *ptr = code, *ptr_next;
-  char *optr, *oend, *rbptr, *rr_log_ptr, *rr_log_end;
-  static insn_t insns[MAX_TU_SIZE];
+  char *optr, *oend;
+  static insn_t insns[MAX_SUPERBLOCK_SIZE];
+  /* The tb headers of the parts of a superblock, to be patched at the end. */
+  static char *part_header[MAX_SUPERBLOCK_SIZE + 1];
+  static char *part_header_end[MAX_SUPERBLOCK_SIZE];
+  static int part_first_insn[MAX_SUPERBLOCK_SIZE + 1];
+  static target_ulong part_addr[MAX_SUPERBLOCK_SIZE];
+  int n_parts, side_exits, tu_size, i;
+  bool superblock, is_side_exit = false, ends_in_jcc;
+  uint32_t *counter;
   int n_in = 0, peep;
   void *translated_code;
   size_t tlen, n_insns_off;
   static long params[4];
-  static uint16_t edge_offset[2], jmp_offset[2];
+  static uint16_t edge_offset[TB_NUM_EDGES], jmp_offset[TB_NUM_EDGES];
   int n_params = 0, disas;
   target_ulong cur_addr, fallthrough_addr;
   static char tmp_peep_string[MAX_PEEP_STRING_SIZE];
   bool is_terminating, is_sti_fallthrough_addr;
 	cpu_constraints_t constraints;
-  char *rb_buf;
-
-  ASSERT(rollbacks);
 
-  jmp_offset[0] = jmp_offset[1] = edge_offset[0] = edge_offset[1] = 0xffff;
+  for (i = 0; i < TB_NUM_EDGES; i++) {
+    jmp_offset[i] = edge_offset[i] = 0xffff;
+  }
 
   /* use 2 for real mode, 4 for protected. */
   unsigned size = (vcpu.segs[R_CS].flags & DESC_B_MASK)?4:2;
@@ -1044,25 +1112,40 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
   optr = tpage;
   oend = (char *)tpage + tpage_size;
 
-  rr_log_ptr = optr;
+  superblock = (superblock_side_exits >= 0);
+  tu_size = superblock ? MAX_SUPERBLOCK_SIZE : max_tu_size;
+  side_exits = 0;
+  if (part_starts) {
+    *part_starts = 0;
+  }
+  if (sti_checks) {
+    *sti_checks = 0;
+  }
+
+  jumptable1_ret_tc_ptr = NULL;
+
+  n_parts = 0;
+  part_first_insn[n_parts] = 0;
+  part_addr[n_parts] = eip_virt;
+  part_header[n_parts] = optr;
   optr += emit_tb_header(optr, 0, 0, 0);
-  rr_log_end = optr;
+  part_header_end[n_parts] = optr;
+  n_parts++;
+
+  if (   !superblock
+      && superblock_candidate(code, eip_virt, cpu_constraints, size,
+           &ends_in_jcc)
+      && (counter = superblock_counter(eip_virt))) {
+    params[0] = (long)counter;
+    params[1] = ends_in_jcc;
+    optr += peepgen_code(peep_snippet_superblock_count, params, optr, NULL,
+        NULL, NULL, eip_virt, eip_virt, 0);
+  }
 
   do {
-    ASSERT(rollbacks);
-    if (rollbacks[n_in].buf) {
-      rb_buf = rollbacks[n_in].buf;
-    } else {
-      /* we just need a dummy memory store. use tpage. */
-      rb_buf = tpage;
-    }
-
-    if (tc_boundaries) {
-      tc_boundaries[n_in] = optr - (char *)tpage;
-    }
-    rollbacks[n_in].nb_rollbacks = 0;
 		cur_addr = (ptr - code) + eip_virt;
-    disas = disas_insn(ptr, cur_addr, &insns[n_in], size, true);
+    disas = insn_cache_disas(ptr, cur_addr, insn_cache_guest_paddr(ptr),
+        &insns[n_in], size, true);
     if (!disas) {
 			target_ulong addr = (target_ulong)ptr;
       printf("disas failed: size=%d. ptr=%p, ptr[]=%hhx,%hhx,%hhx,%hhx,%hhx,"
@@ -1072,10 +1155,49 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
 					ldub(addr+11), ldub(addr+12));
     }
     ASSERT(disas);
+#ifdef IRQ_POLL
+    if (is_side_exit || insn_is_back_edge(&insns[n_in], cur_addr)) {
+      /* Emitted before the insn boundary, and before the header of a new
+       * part, so that get_n_exec() counts none of the insns from CUR_ADDR on
+       * if the callout delivers an interrupt here. */
+      optr += peepgen_code(peep_snippet_check_irq_pending, NULL, optr, NULL,
+          NULL, NULL, cur_addr, cur_addr, 0);
+    }
+#endif
+    if (tc_boundaries) {
+      tc_boundaries[n_in] = optr - (char *)tpage;
+    }
+    if (is_side_exit) {
+      /* The insn following a side exit starts a new part, which counts its own
+       * insns. */
+      part_first_insn[n_parts] = n_in;
+      part_addr[n_parts] = cur_addr;
+      part_header[n_parts] = optr;
+      optr += emit_tb_header((uint8_t *)optr, 0, 0, 0);
+      part_header_end[n_parts] = optr;
+      n_parts++;
+      if (part_starts) {
+        *part_starts |= 1 << n_in;
+      }
+    }
     ptr_next = ptr + disas;
-		ASSERT(n_in < max_tu_size);
+		ASSERT(n_in < tu_size);
+    is_side_exit = false;
     if (   insn_is_terminating(&insns[n_in])
-				|| n_in == max_tu_size - 1) {
+				|| n_in == tu_size - 1) {
+      is_terminating = true;
+      if (   superblock && side_exits < superblock_side_exits
+          && n_in < tu_size - 1 && ptr_next - code <= MAX_SUPERBLOCK_LEN
+          && insn_is_conditional_jump(&insns[n_in])) {
+        is_terminating = false;
+        is_side_exit = true;
+      }
+    } else if (superblock
+        && (   ptr_next - code > MAX_SUPERBLOCK_LEN
+            || (((target_ulong)ptr_next + MAX_INSN_LEN - 1) & ~PGMASK)
+                 != ((target_ulong)code & ~PGMASK))) {
+      /* Stay within eip_boundaries and do not run into the next page, which
+       * the original tb did not need to be mapped. */
       is_terminating = true;
     } else {
 			is_terminating = false;
@@ -1096,7 +1218,6 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
 #endif
     }
     fallthrough_addr = (ptr_next - code) + eip_virt;
-    rbptr = rb_buf;
     tmp_peep_string[0] = '\0';
 		constraints = *cpu_constraints;
 		is_sti_fallthrough_addr = (vcpu.IF==2) || remove_sti_fallthrough_addr(ptr);
@@ -1104,21 +1225,39 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
 		if (is_sti_fallthrough_addr) {
 			optr += peepgen_code(peep_snippet_check_IF2_and_set, NULL, optr, NULL,
 					NULL, NULL, cur_addr, fallthrough_addr, 0);
+      if (sti_checks) {
+        *sti_checks |= 1 << n_in;
+      }
 			/* XXX: have a way to tell the translator that this translation should
 			 * not be chained. It will involve setting edge0 to NULL or something
 			 * to that effect.
 			 */
 		}
 
-    peep = peep_translate(optr, oend - optr, &insns[n_in], 1,
-				edge_offset, jmp_offset, &rbptr, rollbacks[n_in].code_offset,
-        rollbacks[n_in].rb_offset, &rollbacks[n_in].nb_rollbacks, cur_addr,
-        fallthrough_addr, is_terminating, &constraints, tmp_peep_string);
+    if (is_side_exit) {
+      constraints = (constraints & ~CPU_CONSTRAINT_NO_EXCP)
+          | CPU_CONSTRAINT_SIDE_EXIT;
+      peep = peep_translate(optr, oend - optr, &insns[n_in], 1,
+          edge_offset, jmp_offset, NULL, NULL, NULL, NULL, cur_addr,
+          fallthrough_addr, false, &constraints, tmp_peep_string);
+      if (peep) {
+        side_exits++;
+      } else {
+        /* No side exit rule for this jump; end the superblock here. */
+        is_side_exit = false;
+        is_terminating = true;
+        constraints = *cpu_constraints;
+      }
+    }
+    if (!is_side_exit) {
+      peep = peep_translate(optr, oend - optr, &insns[n_in], 1,
+          edge_offset, jmp_offset, NULL, NULL, NULL, NULL, cur_addr,
+          fallthrough_addr, is_terminating, &constraints, tmp_peep_string);
+    }
     if (!peep) {
       peep = mode_translate(optr, oend - optr, ptr, ptr_next - ptr,
           &insns[n_in], &constraints, tmp_peep_string);
     }
-    rollbacks[n_in].buf_size = rbptr - rb_buf;
 #define adjust_offset(offset, curptr, begin) do {                           \
   if (offset != 0xffff) {                                                   \
     offset += (char *)curptr - (char *)begin;                               \
@@ -1129,6 +1268,11 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
 
     adjust_offset(jmp_offset[0], optr, tpage);
     adjust_offset(jmp_offset[1], optr, tpage);
+    if (is_side_exit) {
+      /* The only side exit; see set_superblock_side_exits(). */
+      adjust_offset(edge_offset[2], optr, tpage);
+      adjust_offset(jmp_offset[2], optr, tpage);
+    }
 
 		optr += peep;
     ASSERT(optr <= oend);
@@ -1144,17 +1288,6 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
     if (eip_boundaries) {
       eip_boundaries[n_in] = ptr - code;
     }
-#ifndef NDEBUG
-    if (peep_string) {
-      if (strlen(tmp_peep_string)) {
-        peep_string[n_in] = malloc(strlen(tmp_peep_string) + 1);
-				ASSERT(peep_string[n_in]);
-        strlcpy(peep_string[n_in], tmp_peep_string, strlen(tmp_peep_string)+1);
-      } else {
-        peep_string[n_in] = NULL;
-      }
-    }
-#endif
 		if (insn_is_sti(&insns[n_in])) {
 			add_sti_fallthrough_addr(ptr);
 			/* XXX: need to invalidate existing translations of ptr. */
@@ -1163,14 +1296,21 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
   } while (!is_terminating);
 
   if (edge_offsets) {
-    edge_offsets[0] = edge_offset[0];
-    edge_offsets[1] = edge_offset[1];
+    for (i = 0; i < TB_NUM_EDGES; i++) {
+      edge_offsets[i] = edge_offset[i];
+    }
   }
   if (jmp_offsets) {
-    jmp_offsets[0] = jmp_offset[0];
-    jmp_offsets[1] = jmp_offset[1];
+    for (i = 0; i < TB_NUM_EDGES; i++) {
+      jmp_offsets[i] = jmp_offset[i];
+    }
   }
   fallthrough_addr = (ptr - code) + eip_virt;
+  if (jumptable1_ret_tc_ptr && jumptable1_site != &jumptable1_site_none) {
+    /* The tb ends with a call that returns to fallthrough_addr. */
+    jumptable1_site_set_return(jumptable1_site, fallthrough_addr,
+        jumptable1_ret_tc_ptr);
+  }
   if (!insn_is_terminating(&insns[n_in - 1])) {
     int size;
     size = peepgen_code(peep_snippet_emit_edge1, params, optr, edge_offset,
@@ -1185,7 +1325,11 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
   }
 
   /* patch n_insns. */
-  emit_tb_header(rr_log_ptr, rr_log_end, n_in, eip_virt);
+  part_first_insn[n_parts] = n_in;
+  for (i = 0; i < n_parts; i++) {
+    emit_tb_header((uint8_t *)part_header[i], (uint8_t *)part_header_end[i],
+        part_first_insn[i + 1] - part_first_insn[i], part_addr[i]);
+  }
 
   if (tb_len) {
     *tb_len = ptr - code;
@@ -1206,6 +1350,76 @@ translate(uint8_t *code, target_ulong eip_virt, void *tpage, size_t tpage_size,
   return tlen;
 }
 
+/* Translates insn N of TB again, the way translate() did, to recover what was
+ * not kept with the tb: its rollback code (if ROLLBACKS is not NULL) and its
+ * peep string (if PEEP_STRING is not NULL). The code offsets in ROLLBACKS are
+ * made relative to tb_tc_boundary(tb, n). Returns false if the insn was not
+ * translated by a peephole rule, in which case it has no rollback code. */
+bool
+peep_retranslate_insn(tb_t const *tb, unsigned n, rollbacks_t *rollbacks,
+    char *peep_string)
+{
+  static uint8_t code[MAX_INSN_LEN];
+  static uint8_t obuf[PGSIZE];
+  static insn_t insn;
+  target_ulong cur_addr, fallthrough_addr;
+  cpu_constraints_t constraints;
+  char *rb_buf = NULL;
+  size_t nb_rollbacks = 0, prefix = 0, peep;
+  unsigned size, j;
+
+  ASSERT(n < tb->num_insns);
+  if (rollbacks) {
+    rb_buf = (char *)rollbacks->buf;
+    rollbacks->buf_size = 0;
+    rollbacks->nb_rollbacks = 0;
+  }
+
+  size = tb->code32?4:2;
+  cur_addr = tb_read_insn(tb, n, code, sizeof code);
+  fallthrough_addr = tb->eip + tb_eip_boundary(tb, n + 1);
+  if (!insn_cache_disas(code, cur_addr, tb_insn_paddr(tb, n), &insn, size,
+        false)) {
+    return false;
+  }
+
+  constraints = CPU_CONSTRAINT_NO_EXCP;
+  constraints |= tb->protected_mode?CPU_CONSTRAINT_PROTECTED
+                                   :CPU_CONSTRAINT_REAL;
+  if (n + 1 < tb->num_insns && (tb->part_starts & (1 << (n + 1)))) {
+    constraints = (constraints & ~CPU_CONSTRAINT_NO_EXCP)
+        | CPU_CONSTRAINT_SIDE_EXIT;
+  }
+
+  /* The code translate() emitted at tc_boundaries[n] before the insn's own
+   * translation. */
+  if (tb->part_starts & (1 << n)) {
+    prefix += emit_tb_header(obuf, 0, 0, 0);
+  }
+  if (tb->sti_checks & (1 << n)) {
+    prefix += peepgen_code(peep_snippet_check_IF2_and_set, NULL, obuf, NULL,
+        NULL, NULL, cur_addr, fallthrough_addr, 0);
+  }
+
+  peep = peep_translate(obuf, sizeof obuf, &insn, 1, NULL, NULL,
+      rollbacks?&rb_buf:NULL, rollbacks?rollbacks->code_offset:NULL,
+      rollbacks?rollbacks->rb_offset:NULL, &nb_rollbacks, cur_addr,
+      fallthrough_addr, n == tb->num_insns - 1, &constraints, peep_string);
+  if (!peep) {
+    return false;
+  }
+  if (rollbacks) {
+    ASSERT(nb_rollbacks <= MAX_ROLLBACKS);
+    rollbacks->nb_rollbacks = nb_rollbacks;
+    rollbacks->buf_size = rb_buf - (char *)rollbacks->buf;
+    ASSERT(rollbacks->buf_size <= MAX_ROLLBACK_SIZE);
+    for (j = 0; j < nb_rollbacks; j++) {
+      rollbacks->code_offset[j] += prefix;
+    }
+  }
+  return true;
+}
+
 void
 peep_init(void)
 {
@@ -1225,6 +1439,22 @@ set_max_tu_size(int size)
   max_tu_size = size;
 }
 
+void
+set_superblock_side_exits(int side_exits)
+{
+  /* A superblock chains its side exit through edge 2, so it can have one. */
+  ASSERT(side_exits >= -1 && side_exits <= 1);
+  superblock_side_exits = side_exits;
+}
+
+/* The next translations are for the tb that owns SITE. Translations that are
+ * only measured, or retranslations, pass NULL; their code never runs. */
+void
+set_jumptable1_site(jumptable1_site_t *site)
+{
+  jumptable1_site = site ? site : &jumptable1_site_none;
+}
+
 size_t
 emit_jump_indir_insn(uint8_t *optr, target_ulong target)
 {
@@ -1236,3 +1466,15 @@ emit_jump_indir_insn(uint8_t *optr, target_ulong target)
       NULL, 0, 0, 1);
   return size;
 }
+
+#ifdef IRQ_POLL
+/* Returns the size of one pending-interrupt check. */
+size_t
+irq_poll_check_size(void)
+{
+  static uint8_t buf[64];
+
+  return peepgen_code(peep_snippet_check_irq_pending, NULL, buf, NULL, NULL,
+      NULL, 0, 0, 0);
+}
+#endif
@@ -7,15 +7,26 @@
 
 #define PEEP_PREFIX peep_
 #define ROLLBACK_PREFIX rb_
+#define MAX_PEEP_STRING_SIZE  80
+
+/* Bounds on the rollback code of a single insn. */
+#define MAX_ROLLBACKS 8
+#define MAX_ROLLBACK_SIZE 256
 struct rollbacks_t;
+struct tb_t;
+struct jumptable1_site_t;
 
 void peep_init(void);
 void set_max_tu_size(int size);
+void set_superblock_side_exits(int side_exits);
+void set_jumptable1_site(struct jumptable1_site_t *site);
 size_t translate(uint8_t *code, target_ulong eip_virt, void *buf, size_t buf_size,
-		struct rollbacks_t *rollbacks, size_t *tb_len, uint16_t *edge_offsets,
-		uint16_t *jmp_offsets, uint8_t *eip_boundaries, uint16_t *tc_boundaries,
-		char **peep_string, size_t *num_insns,
+		size_t *tb_len, uint16_t *edge_offsets, uint16_t *jmp_offsets,
+		uint8_t *eip_boundaries, uint16_t *tc_boundaries, size_t *num_insns,
+		uint32_t *part_starts, uint32_t *sti_checks,
 		cpu_constraints_t const *cpu_constraints);
+bool peep_retranslate_insn(struct tb_t const *tb, unsigned n,
+		struct rollbacks_t *rollbacks, char *peep_string);
 
 struct insn_t;
 size_t
@@ -27,6 +38,9 @@ peep_translate(void *buf, size_t buf_size, struct insn_t *insns,
     char *peep_string);
 
 size_t emit_jump_indir_insn(uint8_t *optr, target_ulong target);
+#ifdef IRQ_POLL
+size_t irq_poll_check_size(void);
+#endif
 
 void *hw_memcpy(void *dst, const void *src, size_t n);
 size_t rename_mem_operands_to_disps(uint8_t *obuf, size_t obuf_size,
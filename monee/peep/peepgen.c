@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include "lib/debug.h"
 #include "peep/peep.h"
 #include "peep/insntypes.h"
@@ -24,6 +25,7 @@
 #include "peep/cpu_constraints.h"
 #include "peep/peeptab_defs.h"
 #include "peep/regset.h"
+#include "peep/tb.h"
 #include "sys/vcpu.h"
 #include "sys/monitor.h"
 
@@ -81,6 +83,7 @@ static void usage(void)
          "-t    generate peeptab in peeptab.h\n"
          "-g    output gencode\n"
          "-f    output offsets.h\n"
+         "-b    benchmark the insn decoders on a 32-bit code image\n"
       );
   exit(1);
 }
@@ -1169,7 +1172,7 @@ gen_as_files(char const *filename)
         }
 
         //rename exit labels
-        for (k = 0; k < 2; k++) {
+        for (k = 0; k < TB_NUM_EDGES; k++) {
           patterns[num_patterns] = (char *)malloc(16*sizeof(char));
           snprintf(patterns[num_patterns], 16, ".edge%d", k);
           if (strstr(out_text, patterns[num_patterns])) {
@@ -1293,6 +1296,8 @@ gen_offsets(void)
       offsetof(vcpu_t, next_eip_is_set));
   fprintf(fp, "#define VCPU_INTERRUPT_REQUEST_OFF %d\n",
       offsetof(vcpu_t, interrupt_request));
+  fprintf(fp, "#define VCPU_IRQ_PENDING_OFF %d\n",
+      offsetof(vcpu_t, irq_pending));
   fprintf(fp, "#define VCPU_REGS_OFF(i) (%d+i*%d)\n",
       offsetof(vcpu_t, regs[0]), sizeof vcpu.regs[0]);
   fprintf(fp, "#define VCPU_EAX_OFF VCPU_REGS_OFF(0)\n");
@@ -1360,6 +1365,29 @@ gen_offsets(void)
   fprintf(fp, "#ifndef JUMPTABLE1_MASK\n"
               "#define JUMPTABLE1_MASK %#x\n"
               "#endif\n", JUMPTABLE1_MASK);
+  fprintf(fp, "#ifndef JUMPTABLE1_WAYS\n"
+              "#define JUMPTABLE1_WAYS %d\n"
+              "#endif\n", JUMPTABLE1_WAYS);
+  fprintf(fp, "#ifndef JUMPTABLE1_SET_SHIFT\n"
+              "#define JUMPTABLE1_SET_SHIFT %d\n"
+              "#endif\n", JUMPTABLE1_SET_SHIFT);
+  fprintf(fp, "#define JUMPTABLE1_RSTACK_EIP_OFF %d\n",
+      offsetof(jumptable1_rstack_entry_t, eip));
+  fprintf(fp, "#define JUMPTABLE1_RSTACK_TC_PTR_OFF %d\n",
+      offsetof(jumptable1_rstack_entry_t, tc_ptr));
+  fprintf(fp, "#define JUMPTABLE1_IC_ENTRY_OFF %d\n",
+      offsetof(jumptable1_site_t, ic.entry));
+  fprintf(fp, "#define JUMPTABLE1_IC_SITE_OFF %d\n",
+      offsetof(jumptable1_site_t, ic.site));
+  fprintf(fp, "#define JUMPTABLE1_IC_HITS_OFF %d\n",
+      offsetof(jumptable1_site_t, ic.hits));
+  fprintf(fp, "#define JUMPTABLE1_IC_MISSES_OFF %d\n",
+      offsetof(jumptable1_site_t, ic.misses));
+  fprintf(fp, "#define JUMPTABLE1_SITE_RET_HITS_OFF %d\n",
+      offsetof(jumptable1_site_t, ret_hits));
+#ifndef NDEBUG
+  fprintf(fp, "#define JUMPTABLE1_IC_STATS\n");
+#endif
   fprintf(fp, "#define VCPU_TEMPORARIES_OFF(i) (%d + i*%d)\n",
       offsetof(vcpu_t, temporaries), sizeof vcpu.temporaries[0]);
 
@@ -2203,6 +2231,9 @@ is_variable_name(char const *name, assignments_t const *assignments)
   }
   if (!strcmp(name, "cur_addr") || !strcmp(name, "fallthrough_addr")) {
     return true;
+  }
+  if (!strcmp(name, "site_ic") || !strcmp(name, "ret_tc_ptr")) {
+    return true;
   }
 	if (!strcmp(name, "tc_end")) {
     return true;
@@ -2262,6 +2293,11 @@ output_constant_variable_code(FILE *outfile, EXE_SYM **entries, int entrynum,
           addend = *((uint32_t *)(text + rel->r_offset));
           fprintf(outfile, "  *(uint32_t *)(%s + %d) = "
               "%s + %d;\n", optr, reloc_offset, relname, addend);
+          if (   !strcmp(sym_name, "ret_tc_ptr")
+              && !strcmp(optr, "gen_code_ptr")) {
+            fprintf(outfile, "  jumptable1_ret_tc_ptr = "
+                "(uint32_t *)(%s + %d);\n", optr, reloc_offset);
+          }
           break;
         case R_386_16:
           addend = *((uint16_t *)(text + rel->r_offset));
@@ -2274,7 +2310,8 @@ output_constant_variable_code(FILE *outfile, EXE_SYM **entries, int entrynum,
               "%s - (long)(%s + %d) + %d;\n", optr, reloc_offset,
               relname, optr, reloc_offset, addend);
           if (strstr(relname, "target_C0")) {
-            fprintf(outfile, "  jmp_offset[0] = %d;\n", reloc_offset);
+            fprintf(outfile, "  jmp_offset[target_C0_edge] = %d;\n",
+                reloc_offset);
           }
           if (strstr(relname, "tc_next_eip")) {
             fprintf(outfile, "  jmp_offset[1] = %d;\n", reloc_offset);
@@ -2555,8 +2592,10 @@ output_edge_offsets(FILE *outfile, EXE_SYM *entry, size_t entry_size,
     uint16_t *edge_offsets)
 {
   int edgenum;
-  edge_offsets[0] = edge_offsets[1] = 0xffff;
-  for (edgenum = 0; edgenum < 2; edgenum++) {
+  for (edgenum = 0; edgenum < TB_NUM_EDGES; edgenum++) {
+    edge_offsets[edgenum] = 0xffff;
+  }
+  for (edgenum = 0; edgenum < TB_NUM_EDGES; edgenum++) {
     EXE_SYM *edges[nb_syms];
     int i, nb_edges;
     char edge_str[64];
@@ -2641,7 +2680,7 @@ output_gencode_and_rollback_from_file(FILE *outfile, FILE *codefile,
   int num_variants, rb_num_variants;
   assignments_t assignments;
   int num_entries, num_rb_entries;
-  uint16_t edges[2];
+  uint16_t edges[TB_NUM_EDGES];
 
   if (!(vars_fp = fopen("vars.ordered", "r"))) {
     ERR("fopen '%s' failed. %s\n", "vars.ordered", strerror(errno));
@@ -2694,6 +2733,13 @@ output_gencode_and_rollback_from_file(FILE *outfile, FILE *codefile,
       fprintf(outfile, "  tc_next_eip = (long)gen_code_ptr + "
           "edge_offset[1];\n");
     }
+    /* A side exit jumps to target_C0 through edge 2. */
+    if (edges[2] != 0xffff) {
+      ASSERT(edges[0] == 0xffff);
+      fprintf(outfile, "  target_C0 = (long)gen_code_ptr + "
+          "edge_offset[2];\n");
+    }
+    fprintf(outfile, "  target_C0_edge = %d;\n", edges[2] != 0xffff ? 2 : 0);
 
     /* If fallthrough_addr is not zero, this instruction must be a terminating
      * instruction. */
@@ -2760,7 +2806,10 @@ output_gencode(char const *outfilename)
   fprintf(outfile, "{\n");
   fprintf(outfile, "uint8_t *gen_code_ptr = gen_code_buf;\n");
   fprintf(outfile, "long *peep_param_ptr = peep_param_buf;\n");
-  fprintf(outfile, "static uint16_t dummy[2];\n");
+  fprintf(outfile, "static uint16_t dummy[%d];\n", TB_NUM_EDGES);
+  fprintf(outfile, "int target_C0_edge;\n");
+  fprintf(outfile, "long site_ic = (long)jumptable1_site;\n");
+  fprintf(outfile, "long ret_tc_ptr = 0;\n");
   fprintf(outfile, "uint8_t *rollback_ptr;\n\n");
   fprintf(outfile, "long vr0d=-1, vr1d=-1, vr2d=-1, vseg0=-1, vseg1=-1, "
 			"tc_end=-1, C0, C1, target_C0, tc_next_eip, tr0d=-1, tr1d=-1, "
@@ -3179,6 +3228,77 @@ scan_error:
   fclose(outfile);
 }
 
+#define DECODE_BENCH_ROUNDS 16
+/* disas_insn() may read this many bytes past the start of an insn. */
+#define DECODE_BENCH_TAIL 16
+
+/* Decodes the code image CODE..END, DECODE_BENCH_ROUNDS times, and classifies
+ * every insn the way the translator needs to: by comparing the opcode name
+ * (the old decoder) if OLD, or by testing its class bits. Returns the number
+ * of insns/s, and in *CHECKSUM a sum of their classes. */
+static double
+decode_bench_run(uint8_t const *code, uint8_t const *end, bool old,
+    unsigned long *checksum)
+{
+  uint8_t const *ptr;
+  unsigned long n_insns = 0;
+  clock_t start;
+  insn_t insn;
+  int i, len;
+
+  *checksum = 0;
+  start = clock();
+  for (i = 0; i < DECODE_BENCH_ROUNDS; i++) {
+    for (ptr = code; ptr < end; ptr += (len > 0)?len:1) {
+      len = disas_insn(ptr, ptr - code, &insn, 4, false);
+      if (len > 0) {
+        *checksum += old?opctable_classify(opctable_name(insn.opc))
+                        :opctable_class(insn.opc);
+      }
+      n_insns++;
+    }
+  }
+  return n_insns / ((double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+/* Decodes the code image in FILENAME (e.g. a dump of the guest kernel's text
+ * section) with the old decoder, which classified insns by name, and with the
+ * new one, which tests the class bits that opctable computed at init. Reports
+ * the number of insns each decodes per second. Undecodable bytes are
+ * skipped. */
+static void
+decode_bench(char const *filename)
+{
+  uint8_t *code, *end;
+  unsigned long old_sum, new_sum;
+  double old_rate, new_rate;
+  struct stat st;
+  FILE *fp;
+
+  fp = xfopen(filename, "r");
+  if (fstat(fileno(fp), &st) < 0 || st.st_size <= DECODE_BENCH_TAIL) {
+    ERR("Can't use '%s' as a code image.\n", filename);
+    exit(1);
+  }
+  code = malloc(st.st_size);
+  ASSERT(code);
+  if (fread(code, 1, st.st_size, fp) != (size_t)st.st_size) {
+    ERR("Can't read '%s' : %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  fclose(fp);
+  end = code + st.st_size - DECODE_BENCH_TAIL;
+
+  old_rate = decode_bench_run(code, end, true, &old_sum);
+  new_rate = decode_bench_run(code, end, false, &new_sum);
+  /* Both decoders must agree on every insn. */
+  ASSERT(old_sum == new_sum);
+  printf("old decoder: %.0f insns/s\n", old_rate);
+  printf("new decoder: %.0f insns/s (%.2fx)\n", new_rate,
+      new_rate / old_rate);
+  free(code);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -3194,12 +3314,13 @@ main(int argc, char **argv)
     OUT_CODE_SNIPPETS,
     OUT_NOMATCH_PAIRS,
     OUT_VARS_ORDERED,
+    OUT_DECODE_BENCH,
   };
 
   outfilename = "out.c";
   out_type = OUT_ASFILES;
   for (;;) {
-    c = getopt(argc, argv, "ho:r:a:tgfdsnv");
+    c = getopt(argc, argv, "ho:r:a:tgfdsnvb");
     if (c == -1) {
       break;
     }
@@ -3234,6 +3355,9 @@ main(int argc, char **argv)
       case 'n':
         out_type = OUT_NOMATCH_PAIRS;
         break;
+      case 'b':
+        out_type = OUT_DECODE_BENCH;
+        break;
     }
   }
   if (c == 't' && optind >= argc)
@@ -3270,6 +3394,13 @@ main(int argc, char **argv)
     case OUT_CODE_SNIPPETS:
       append_code_snippets(filename, outfilename);
       break;
+    case OUT_DECODE_BENCH:
+      if (optind >= argc) {
+        usage();
+      }
+      opc_init();
+      decode_bench(filename);
+      break;
     default:
       assert(0);
   }
@@ -173,27 +173,114 @@
 9:movw loc, %temp##w;                                   \
   sahf;                                                 \
 
-#define __JUMP_INDIRECT_PART1(target, temp)                   \
-  save_flags_use_eax_temp(%gs:vcpu + VCPU_SCRATCH_OFF(1), temp);              \
+#ifdef JUMPTABLE1_IC_STATS
+#define JUMPTABLE1_IC_COUNT(field)                                            \
+  incl %gs:(site_ic + field)
+#define JUMPTABLE1_IC_SET_SITE                                                \
+  movl $gen_code_ptr, %gs:(site_ic + JUMPTABLE1_IC_SITE_OFF)
+#else
+#define JUMPTABLE1_IC_COUNT(field)
+#define JUMPTABLE1_IC_SET_SITE
+#endif
+
+/* Looks up one way of the jumptable1 set whose address is in temp (and in
+ * scratch(3)). On a hit, refills the inline cache of this site with the
+ * entry and jumps to 2f with the tc_ptr in temp. Falls through with temp
+ * holding the set address on a miss. */
+#define __JUMPTABLE1_PROBE(eip_off, temp)                                     \
+  movl %gs:eip_off(%temp##d,%eiz,1), %temp##d;                                \
+  cmpl %temp##d, %gs:(vcpu + VCPU_SCRATCH_OFF(2));                            \
+  movl %gs:(vcpu + VCPU_SCRATCH_OFF(3)), %temp##d;                            \
+  jne 5f;                                                                     \
+  leal eip_off(%temp##d), %temp##d;                                           \
+  movl %temp##d, %gs:(site_ic + JUMPTABLE1_IC_ENTRY_OFF);                     \
+	/* Check if the target is NULL, in which case this entry does not exist. */ \
+  movl %gs:0x4(%temp##d,%eiz,1), %temp##d;                                    \
+  testl %temp##d, %temp##d;                                                   \
+  jne 2f;                                                                     \
+  movl %gs:(vcpu + VCPU_SCRATCH_OFF(3)), %temp##d;                            \
+5:
+
+#if JUMPTABLE1_WAYS == 1
+#define __JUMPTABLE1_PROBE_SET(temp)                                          \
+  __JUMPTABLE1_PROBE(0x0, temp)
+#elif JUMPTABLE1_WAYS == 2
+#define __JUMPTABLE1_PROBE_SET(temp)                                          \
+  __JUMPTABLE1_PROBE(0x0, temp);                                              \
+  __JUMPTABLE1_PROBE(0x8, temp)
+#else
+#define __JUMPTABLE1_PROBE_SET(temp)                                          \
+  __JUMPTABLE1_PROBE(0x0, temp);                                              \
+  __JUMPTABLE1_PROBE(0x8, temp);                                              \
+  __JUMPTABLE1_PROBE(0x10, temp);                                             \
+  __JUMPTABLE1_PROBE(0x18, temp)
+#endif
+
+/* temp must be eax. Checks the inline cache of this site first, whose
+ * address is the constant site_ic. The cached entry is used only if its eip
+ * is still the target. Expects the flags to have been saved in scratch(1). */
+#define __JUMP_INDIRECT_LOOKUP(target, temp)                                  \
   movl target, %temp##d;                                                      \
   addl %gs:(vcpu + VCPU_SEGS_BASE_OFF(R_CS)), %temp##d;                       \
   movl %temp##d, %gs:(vcpu + VCPU_SCRATCH_OFF(2));                            \
   /*XXX: also check against cs limit. */                                      \
+  movl %gs:(site_ic + JUMPTABLE1_IC_ENTRY_OFF), %temp##d;                     \
+  movl %gs:(%temp##d,%eiz,1), %temp##d;                                       \
+  cmpl %temp##d, %gs:(vcpu + VCPU_SCRATCH_OFF(2));                            \
+  jne 3f;                                                                     \
+  movl %gs:(site_ic + JUMPTABLE1_IC_ENTRY_OFF), %temp##d;                     \
+  movl %gs:0x4(%temp##d,%eiz,1), %temp##d;                                    \
+  testl %temp##d, %temp##d;                                                   \
+  je 3f;                                                                      \
+  JUMPTABLE1_IC_COUNT(JUMPTABLE1_IC_HITS_OFF);                                \
+  jmp 4f;                                                                     \
+3:JUMPTABLE1_IC_COUNT(JUMPTABLE1_IC_MISSES_OFF);                              \
+  movl %gs:(vcpu + VCPU_SCRATCH_OFF(2)), %temp##d;                            \
   andl $JUMPTABLE1_MASK, %temp##d;                                            \
+  shll $JUMPTABLE1_SET_SHIFT, %temp##d;                                       \
   addl $jumptable1, %temp##d;                                                 \
   movl %temp##d, %gs:(vcpu + VCPU_SCRATCH_OFF(3));                            \
-	/* Check if the target is NULL, in which case this entry does not exist. */ \
-  cmpl $0x0, %gs:0x4(%temp##d,%eiz,1);     		                                \
-	je	 1f;																																		\
-	/* Check if the table's eip matches ours. */																\
-  movl %gs:(%temp##d,%eiz,1), %temp##d;                                       \
-  cmpl %temp##d, %gs:(vcpu + VCPU_SCRATCH_OFF(2));                            \
-  jne  1f;                                                                    \
-  movl %gs:(vcpu + VCPU_SCRATCH_OFF(3)), %temp##d;                            \
-  movl %gs:4(%temp##d,%eiz,1), %temp##d;                                      \
-  movl %temp##d, %gs:(vcpu + VCPU_JTARGET_OFF);                               \
+  __JUMPTABLE1_PROBE_SET(temp);                                               \
+  jmp 1f;                                                                     \
+	/* jumptable1 hit. The inline cache has been refilled. */										\
+2:JUMPTABLE1_IC_SET_SITE;                                                     \
+4:movl %temp##d, %gs:(vcpu + VCPU_JTARGET_OFF);                               \
   restore_flags_use_eax_temp(%gs:vcpu + VCPU_SCRATCH_OFF(1), temp);
 
+/* temp must be eax. */
+#define __JUMP_INDIRECT_PART1(target, temp)                                   \
+  save_flags_use_eax_temp(%gs:vcpu + VCPU_SCRATCH_OFF(1), temp);              \
+  __JUMP_INDIRECT_LOOKUP(target, temp)
+
+/* Pushes the return address of a call site on the shadow return stack,
+ * along with ret_tc_ptr, the tc_ptr of the return address. ret_tc_ptr is
+ * zero until jumptable1_add() learns it and patches it into the call site.
+ * Does not touch the flags: the stack top is the byte offset of the next
+ * free entry, and wraps by reading only its low byte. */
+#define PUSH_RETURN_ADDRESS(retaddr, temp)                                    \
+  movzbl %gs:jumptable1_rstack_top, %temp##d;                                 \
+  movl retaddr, %gs:(jumptable1_rstack + JUMPTABLE1_RSTACK_EIP_OFF)(%temp##d,%eiz,1);\
+  movl $ret_tc_ptr, %gs:(jumptable1_rstack + JUMPTABLE1_RSTACK_TC_PTR_OFF)(%temp##d,%eiz,1);\
+  leal 8(%temp##d), %temp##d;                                                 \
+  movl %temp##d, %gs:jumptable1_rstack_top
+
+/* temp must be eax. Pops the shadow return stack. If the popped return
+ * address matches target and its tc_ptr is known, jumps there directly.
+ * Otherwise, falls back to this site's inline cache. */
+#define __JUMP_RETURN_PART1(target, temp)                                     \
+  save_flags_use_eax_temp(%gs:vcpu + VCPU_SCRATCH_OFF(1), temp);              \
+  subb $8, %gs:jumptable1_rstack_top;                                         \
+  movzbl %gs:jumptable1_rstack_top, %temp##d;                                 \
+  cmpl target, %gs:(jumptable1_rstack + JUMPTABLE1_RSTACK_EIP_OFF)(%temp##d,%eiz,1);\
+  jne 6f;                                                                     \
+  movl %gs:(jumptable1_rstack + JUMPTABLE1_RSTACK_TC_PTR_OFF)(%temp##d,%eiz,1),\
+      %temp##d;                                                               \
+  testl %temp##d, %temp##d;                                                   \
+  je 6f;                                                                      \
+  JUMPTABLE1_IC_COUNT(JUMPTABLE1_SITE_RET_HITS_OFF);                          \
+  jmp 4f;                                                                     \
+6:__JUMP_INDIRECT_LOOKUP(target, temp)
+
 #define __JUMP_INDIRECT_PART2(target, temp)                                   \
 1:set_eip(target);                                                            \
   restore_flags_use_eax_temp(%gs:vcpu + VCPU_SCRATCH_OFF(1), temp);
@@ -220,6 +307,15 @@
   RESTORE_TEMPORARY(0);                                                       \
   EXIT_TB
 
+#define JUMP_RETURN_AFTER_TR1_RESTORE_USE_EAX_TEMP(target, temp)              \
+  __JUMP_RETURN_PART1(target, temp);                                          \
+  RESTORE_TEMPORARY(1);                                                       \
+  RESTORE_TEMPORARY(0);                                                       \
+  jmpl *%gs:(vcpu + VCPU_JTARGET_OFF);                                        \
+  __JUMP_INDIRECT_PART2(target, temp);                                        \
+  RESTORE_TEMPORARY(1);                                                       \
+  RESTORE_TEMPORARY(0);                                                       \
+  EXIT_TB
 
 #define JUMP_INDIRECT_USE_EAX_TEMP(target, tmpno)       \
   __JUMP_INDIRECT_PART1(target, tr##tmpno);             \
@@ -405,6 +501,12 @@
 #define INCREMENT_VCPU_N_EXEC movl %eax, %gs:(vcpu + VCPU_SCRATCH_OFF(0)); movl %gs:(vcpu + VCPU_N_EXEC_OFF), %eax; leal C0(%eax), %eax; movl %eax, %gs:(vcpu + VCPU_N_EXEC_OFF); movl %gs:(vcpu + VCPU_SCRATCH_OFF(0)), %eax
 #define CALLOUT_RR_LOG_VCPU_STATE SAVE_FLAGS(vcpu + VCPU_TEMPORARIES_OFF(0)); movl %eax, %gs:(vcpu + VCPU_TEMPORARIES_OFF(1)); movl %gs:(vcpu + VCPU_N_EXEC_OFF), %eax; cmpl %gs:(vcpu + VCPU_REPLAY_LAST_ENTRY_N_EXEC_OFF), %eax; jb 1f; RESTORE_FLAGS(vcpu + VCPU_TEMPORARIES_OFF(0)); movl %gs:(vcpu + VCPU_TEMPORARIES_OFF(1)), %eax; CALLOUT1(rr_log_vcpu_state, $C0); jmp 2f; 1: RESTORE_FLAGS(vcpu + VCPU_TEMPORARIES_OFF(0)); movl %gs:(vcpu + VCPU_TEMPORARIES_OFF(1)), %eax; 2:
 //#define CALLOUT_RR_LOG_VCPU_STATE CALLOUT1(rr_log_vcpu_state, $C0)
+/* Counts down the superblock counter at C0 without touching the flags, and
+ * calls out to callout_superblock once it reaches zero. */
+#define SUPERBLOCK_COUNT movl %ecx, %gs:(vcpu + VCPU_SCRATCH_OFF(0)); movl %gs:C0, %ecx; leal -1(%ecx), %ecx; movl %ecx, %gs:C0; jecxz 1f; movl %gs:(vcpu + VCPU_SCRATCH_OFF(0)), %ecx; jmp 2f; 1: movl %gs:(vcpu + VCPU_SCRATCH_OFF(0)), %ecx; CALLOUT2(callout_superblock, $C0, $C1); 2:
+/* Calls out to the monitor, which then delivers the pending interrupt, if
+ * vcpu.irq_pending is set. Does not touch the flags. */
+#define CHECK_IRQ_PENDING movl %ecx, %gs:(vcpu + VCPU_SCRATCH_OFF(0)); movl %gs:(vcpu + VCPU_IRQ_PENDING_OFF), %ecx; jecxz 1f; movl %gs:(vcpu + VCPU_SCRATCH_OFF(0)), %ecx; CALLOUT0(callout_irq_poll); 1: movl %gs:(vcpu + VCPU_SCRATCH_OFF(0)), %ecx
 #define _(x) 1f+(x); 1:
 
 /* temp must be no_eax. seg must be cs_gs*/
@@ -507,6 +609,9 @@
 #define EXIT_TB SAVE_PREV_TB; JUMP_TO_MONITOR
 #define EDGE0 .edge0: movl $0, %gs:(vcpu + VCPU_EDGE_OFF); 1
 #define EDGE1 .edge1: movl $1, %gs:(vcpu + VCPU_EDGE_OFF); 1
+/* The side exit of a superblock. Its jump to target_C0 chains through edge 2
+ * rather than edge 0. */
+#define EDGE2 .edge2: movl $2, %gs:(vcpu + VCPU_EDGE_OFF); 1
 #define SAVE_TEMPORARY(tnum) \
   movl %tr##tnum##d, %gs:(vcpu + VCPU_TEMPORARIES_OFF(tnum))
 #define RESTORE_TEMPORARY(tnum) \
@@ -0,0 +1,67 @@
+#include "peep/rollback_cache.h"
+#include <debug.h>
+#include <stdio.h>
+#include "peep/peep.h"
+#include "peep/tb.h"
+
+#if (ROLLBACK_CACHE_SIZE & (ROLLBACK_CACHE_SIZE - 1)) != 0
+#error "ROLLBACK_CACHE_SIZE must be a power of two."
+#endif
+
+typedef struct rollback_cache_entry_t {
+  uint8_t const *tc_ptr;      /* Start of the insn's translation, or NULL. */
+  rollbacks_t rollbacks;
+  uint16_t code_offset[MAX_ROLLBACKS];
+  uint16_t rb_offset[MAX_ROLLBACKS];
+  uint8_t buf[MAX_ROLLBACK_SIZE];
+} rollback_cache_entry_t;
+
+static rollback_cache_entry_t rollback_cache[ROLLBACK_CACHE_SIZE];
+
+static long long stats_num_hits = 0;
+static long long stats_num_misses = 0;
+
+rollbacks_t const *
+rollback_cache_get(tb_t const *tb, unsigned n)
+{
+  rollback_cache_entry_t *e;
+  uint8_t const *tc_ptr;
+
+  ASSERT(n < tb->num_insns);
+  tc_ptr = tb->tc_ptr + tb_tc_boundary(tb, n);
+  e = &rollback_cache[((unsigned long)tc_ptr >> 2) & (ROLLBACK_CACHE_SIZE - 1)];
+  if (e->tc_ptr == tc_ptr) {
+    stats_num_hits++;
+    return &e->rollbacks;
+  }
+  stats_num_misses++;
+  e->rollbacks.buf = e->buf;
+  e->rollbacks.code_offset = e->code_offset;
+  e->rollbacks.rb_offset = e->rb_offset;
+  peep_retranslate_insn(tb, n, &e->rollbacks, NULL);
+  e->tc_ptr = tc_ptr;
+  return &e->rollbacks;
+}
+
+/* Called when TB is freed, as its tc addresses may be reused. */
+void
+rollback_cache_remove(tb_t const *tb)
+{
+  uint8_t const *tc_end;
+  unsigned i;
+
+  tc_end = tb->tc_ptr + tb->tc_len;
+  for (i = 0; i < ROLLBACK_CACHE_SIZE; i++) {
+    if (   rollback_cache[i].tc_ptr >= tb->tc_ptr
+        && rollback_cache[i].tc_ptr < tc_end) {
+      rollback_cache[i].tc_ptr = NULL;
+    }
+  }
+}
+
+void
+rollback_cache_print_stats(void)
+{
+  printf("MON-STATS: rollback cache: %lld hits, %lld misses.\n",
+      stats_num_hits, stats_num_misses);
+}
@@ -0,0 +1,17 @@
+#ifndef PEEP_ROLLBACK_CACHE_H
+#define PEEP_ROLLBACK_CACHE_H
+
+/* The rollback code of a translated insn is only needed when an exception
+ * hits the middle of its translation. It is regenerated on demand and kept in
+ * this small cache, indexed by the tc address of the insn. */
+#define ROLLBACK_CACHE_SIZE 64
+
+struct tb_t;
+struct rollbacks_t;
+
+struct rollbacks_t const *rollback_cache_get(struct tb_t const *tb,
+    unsigned n);
+void rollback_cache_remove(struct tb_t const *tb);
+void rollback_cache_print_stats(void);
+
+#endif
@@ -6,6 +6,8 @@ extern peepgen_label_t peep_snippet_restore_guest_flags;
 extern peepgen_label_t peep_snippet_exit_tb;
 extern peepgen_label_t peep_snippet_increment_vcpu_n_exec;
 extern peepgen_label_t peep_snippet_callout_rr_log_vcpu_state;
+extern peepgen_label_t peep_snippet_superblock_count;
+extern peepgen_label_t peep_snippet_check_irq_pending;
 extern peepgen_label_t peep_snippet_emit_edge1;
 extern peepgen_label_t peep_snippet_save_reg;
 extern peepgen_label_t peep_snippet_load_reg;
@@ -0,0 +1,104 @@
+#include "peep/superblock.h"
+#include <debug.h>
+#include <stdio.h>
+#include "peep/jumptable2.h"
+#include "peep/tb.h"
+
+/* Indexed by the eip of the candidate tb. Colliding candidates share a
+ * counter, which only makes them reach the threshold earlier. */
+static uint32_t superblock_counters[SUPERBLOCK_COUNTERS_SIZE];
+
+/* The candidates that were rejected, by the same index as the counters. */
+static struct {
+  bool valid;
+  target_ulong eip;
+} rejected[SUPERBLOCK_COUNTERS_SIZE];
+
+/* The superblock to be formed at the next translation of (eip_virt, eip). */
+static struct {
+  bool valid;
+  target_ulong eip_virt;
+  target_ulong eip;
+  int side_exits;
+} pending;
+
+static long long stats_num_superblocks = 0;
+static long long stats_num_rejected = 0;
+
+/* Returns the counter of the candidate at EIP, reset, or NULL if it has been
+ * rejected before. */
+uint32_t *
+superblock_counter(target_ulong eip)
+{
+  unsigned i = eip & (SUPERBLOCK_COUNTERS_SIZE - 1);
+
+  if (rejected[i].valid && rejected[i].eip == eip) {
+    return NULL;
+  }
+  superblock_counters[i] = SUPERBLOCK_THRESHOLD;
+  return &superblock_counters[i];
+}
+
+/* Returns the number of times the candidate owning COUNTER has executed since
+ * its counter was last reset. */
+static uint32_t
+superblock_count(uint32_t const *counter)
+{
+  return SUPERBLOCK_THRESHOLD - *counter;
+}
+
+/* Decides whether TB, whose superblock counter just reached zero, should be
+ * extended past its last insn, or should stop counting. Either way, the
+ * caller must then drop TB so that it gets retranslated. */
+void
+superblock_request(tb_t const *tb, uint32_t *counter, bool ends_in_jcc)
+{
+  tb_t const *fallthrough;
+
+  if (ends_in_jcc && !tb->jmp_next[1]) {
+    /* The fall-through path has never been taken. */
+    goto reject;
+  }
+  if (ends_in_jcc && tb->jmp_next[0]) {
+    /* Both paths are taken. Extend only if the fall-through tb has been
+     * executed at least half as often as TB. */
+    fallthrough = jumptable2_find(tb->eip_virt + tb->tb_len,
+        tb->eip + tb->tb_len);
+    if (!fallthrough
+        || superblock_count(&superblock_counters[fallthrough->eip
+             & (SUPERBLOCK_COUNTERS_SIZE - 1)]) < SUPERBLOCK_THRESHOLD / 2) {
+      goto reject;
+    }
+  }
+
+  pending.valid = true;
+  pending.eip_virt = tb->eip_virt;
+  pending.eip = tb->eip;
+  pending.side_exits = ends_in_jcc ? 1 : 0;
+  stats_num_superblocks++;
+  return;
+
+reject:
+  rejected[counter - superblock_counters].valid = true;
+  rejected[counter - superblock_counters].eip = tb->eip;
+  stats_num_rejected++;
+}
+
+/* Returns the number of side exits the translation of (eip_virt, eip) may
+ * have, or -1 if it should be translated as an ordinary tb. */
+int
+superblock_take(target_ulong eip_virt, target_ulong eip)
+{
+  if (!pending.valid || pending.eip_virt != eip_virt || pending.eip != eip) {
+    return -1;
+  }
+  pending.valid = false;
+  return pending.side_exits;
+}
+
+void
+superblock_print_stats(void)
+{
+  printf("MON-STATS: superblocks: %lld formed, %lld rejected.\n",
+      stats_num_superblocks, stats_num_rejected);
+}
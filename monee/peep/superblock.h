@@ -0,0 +1,32 @@
+#ifndef PEEP_SUPERBLOCK_H
+#define PEEP_SUPERBLOCK_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <types.h>
+
+/* Superblocks. A tb that ends in a conditional jump (or at the size limit)
+ * counts its executions down in a superblock counter. When the counter
+ * reaches zero and the fall-through path is the hot one, the tb is
+ * retranslated together with the code that follows it, turning the
+ * conditional jump into a side exit. A rejected candidate is retranslated
+ * without the counter, and is not counted again. A superblock always covers
+ * contiguous guest code, so that the per-tb bookkeeping (eip_boundaries,
+ * tb_len, eip_phys ranges) stays valid. */
+#ifndef SUPERBLOCK_THRESHOLD
+#define SUPERBLOCK_THRESHOLD 1024
+#endif
+#define SUPERBLOCK_COUNTERS_SIZE 4096
+
+/* Guest bytes covered by a superblock. Leaves room for one more insn below
+ * the 255 limit of eip_boundaries. */
+#define MAX_SUPERBLOCK_LEN 240
+
+struct tb_t;
+
+uint32_t *superblock_counter(target_ulong eip);
+void superblock_request(struct tb_t const *tb, uint32_t *counter,
+    bool ends_in_jcc);
+int superblock_take(target_ulong eip_virt, target_ulong eip);
+void superblock_print_stats(void);
+
+#endif
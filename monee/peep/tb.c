@@ -12,6 +12,9 @@
 #include "mem/vaddr.h"
 #include "peep/jumptable1.h"
 #include "peep/jumptable2.h"
+#include "peep/insn_cache.h"
+#include "peep/peep.h"
+#include "peep/rollback_cache.h"
 #include "peep/tb_exit_callbacks.h"
 #include "sys/vcpu.h"
 
@@ -85,7 +88,7 @@ tb_jmp_remove(tb_t *tb, unsigned int n)
       tb1 = (tb_t *)((long)tb1 & ~3);
       if (n1 == n && tb1 == tb)
         break;
-      if (n1 == 2) {
+      if (n1 == TB_EDGE_NONE) {
         ptb = &tb1->jmp_first;
       } else {
         ptb = &tb1->jmp_next[n1];
@@ -102,7 +105,7 @@ static void
 tb_tc_print(struct rbtree_elem const *elem, void *aux)
 {
   tb_t *tb = rbtree_entry(elem, tb_t, tc_elem);
-  printf("%p->%p\n", tb->tc_ptr, tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+  printf("%p->%p\n", tb->tc_ptr, tb->tc_ptr + tb->tc_len);
 }
 
 #define NUM_BIN_CHARS 33
@@ -137,8 +140,11 @@ tb_print_in_asm(tb_t const *tb, unsigned size)
       printf(" ");
     }
 #ifndef NDEBUG
-    if (tb->peep_string[n]) {
-      printf("%s", tb->peep_string[n]);
+    {
+      static char peep_string[MAX_PEEP_STRING_SIZE];
+      peep_string[0] = '\0';
+      peep_retranslate_insn(tb, n, NULL, peep_string);
+      printf("%s", peep_string);
     }
 #endif
     printf("\n");
@@ -180,7 +186,7 @@ tb_print_out_asm(tb_t const *tb)
 {
   char *disas_ptr = tb->tc_ptr;
   size_t const  num_bin_chars = NUM_BIN_CHARS;
-  size_t tlen = tb->tc_boundaries[tb->num_insns];
+  size_t tlen = tb->tc_len;
   unsigned target_size = 4;     // on target, we always use protected mode.
 
   printf("OUT:\n");
@@ -209,19 +215,25 @@ tb_print_rb_asm(tb_t const *tb)
 {
   size_t const  num_bin_chars = NUM_BIN_CHARS;
   bool rb_seen = false;
-  struct rollbacks_t *rollbacks = tb->rollbacks;
+  static uint8_t rb_buf[MAX_ROLLBACK_SIZE];
+  static uint16_t code_offset[MAX_ROLLBACKS], rb_offset[MAX_ROLLBACKS];
+  static struct rollbacks_t rollbacks[1];
   unsigned target_size = 4;     // on target, we always use protected mode.
   int n_in = tb->num_insns;
   int n;
 
   for (n = 0; n < n_in; n++) {
-    if (rollbacks[n].buf_size == 0) {
+    rollbacks[0].buf = rb_buf;
+    rollbacks[0].code_offset = code_offset;
+    rollbacks[0].rb_offset = rb_offset;
+    peep_retranslate_insn(tb, n, &rollbacks[0], NULL);
+    if (rollbacks[0].buf_size == 0) {
       continue;
     }
-    char *disas_ptr = rollbacks[n].buf;
-    char *disas_end = disas_ptr + rollbacks[n].buf_size;
-    int cur_rb = rollbacks[n].nb_rollbacks - 1;
-    ASSERT(rollbacks[n].nb_rollbacks);
+    char *disas_ptr = rollbacks[0].buf;
+    char *disas_end = disas_ptr + rollbacks[0].buf_size;
+    int cur_rb = rollbacks[0].nb_rollbacks - 1;
+    ASSERT(rollbacks[0].nb_rollbacks);
     if (!rb_seen) {
       printf("RB:\n");
       rb_seen = true;
@@ -232,10 +244,10 @@ tb_print_rb_asm(tb_t const *tb)
       size_t i, dlen;
       str[0] = '\0';
 
-      if (cur_rb >= 0 && disas_ptr - (char *)rollbacks[n].buf
-          >= rollbacks[n].rb_offset[cur_rb]) {
+      if (cur_rb >= 0 && disas_ptr - (char *)rollbacks[0].buf
+          >= rollbacks[0].rb_offset[cur_rb]) {
         printf("%d: %p:\n", n, (char *)tb->tc_ptr
-            + tb->tc_boundaries[n] + rollbacks[n].code_offset[cur_rb]);
+            + tb_tc_boundary(tb, n) + rollbacks[0].code_offset[cur_rb]);
         cur_rb--;
       }
       printf("   %p:", disas_ptr);
@@ -266,6 +278,7 @@ tb_mtrace(target_phys_addr_t start, size_t len, void *opaque)
 	//in both cases invalidate tb to avoid future trace-faults.
 	LOG(MTRACE, "%s(): %x %x. freeing tb [%x-%x] \n", __func__, start, start+len,
 			tb->eip_phys, tb->eip_phys + tb->tb_len);
+	insn_cache_invalidate(start, len);
 	if (vcpu.callout_next && tb_find(vcpu.callout_next) == tb) {
 		tb_unchain(tb);
 		jumptable2_remove(tb);
@@ -313,17 +326,17 @@ tb_free(void *opaque)
 	tb_t *tb;
   void *retp;
   bool retb;
-  unsigned i;
 
 	tb = (tb_t *)opaque;
 	ASSERT(tb == tb_find(tb->tc_ptr));
 	LOG(TB, "%s(): freeing %p: 0x%x-0x%x: %p->%p.\n", __func__, tb, tb->eip_phys,
 			tb->eip_phys + tb->tb_len, tb->tc_ptr,
-			tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+			tb->tc_ptr + tb->tc_len);
   tb_unchain(tb);
   jumptable2_remove(tb);
   jumptable1_remove(tb->eip);
   tb_trace_freed(tb);
+  rollback_cache_remove(tb);
   //callout_patches_tb_free(tb);
   retp = hash_delete(&pc_table, &tb->pc_elem);
   ASSERT(retp);
@@ -334,28 +347,6 @@ tb_free(void *opaque)
   nb_tbs--;
 	tb_mtrace_remove(tb);
   free(tb->tc_ptr);
-  free(tb->tc_boundaries);
-  free(tb->eip_boundaries);
-  for (i = 0; i < tb->num_insns; i++) {
-    if (tb->rollbacks[i].buf) {
-      free(tb->rollbacks[i].buf);
-    }
-    if (tb->rollbacks[i].code_offset) {
-      free(tb->rollbacks[i].code_offset);
-    }
-    if (tb->rollbacks[i].rb_offset) {
-      free(tb->rollbacks[i].rb_offset);
-    }
-  }
-  free(tb->rollbacks);
-#ifndef NDEBUG
-  for (i = 0; i < tb->num_insns; i++) {
-    if (tb->peep_string[i]) {
-      free(tb->peep_string[i]);
-    }
-  }
-  free(tb->peep_string);
-#endif
   free((char *)tb - tb->alignment);
 
 	/* Update stats. */
@@ -365,6 +356,13 @@ tb_free(void *opaque)
 	tb_num_replacements++;
 }
 
+/* Drops TB from the translation cache, e.g. to have it retranslated. */
+void
+tb_invalidate(tb_t *tb)
+{
+  tb_free(tb);
+}
+
 static bool
 free_a_tb(void)
 {
@@ -374,7 +372,7 @@ free_a_tb(void)
   if (replacement = tb_find_replacement()) {
 		DBGn(TB, "replacing %p: %#x: %p->%p.\n", replacement,
 				replacement->eip_phys, replacement->tc_ptr,
-				replacement->tc_ptr+replacement->tc_boundaries[replacement->num_insns]);
+				replacement->tc_ptr + replacement->tc_len);
 		tb_free(replacement);
 		return true;
 	}
@@ -397,12 +395,11 @@ tb_pool_malloc(size_t size)
 tb_t *
 tb_malloc(target_ulong eip, target_ulong eip_virt, target_phys_addr_t eip_phys,
 		target_phys_addr_t eip_phys_end_page, size_t num_insns, size_t size,
-		rollbacks_t const *rollbacks)
+		size_t boundaries_size)
 {
-  int alignment;
+  int alignment, i;
   void *alloc;
   tb_t *tb;
-  unsigned i;
 
   /* Uncomment to test cache replacement.
   if (nb_tbs) {
@@ -410,66 +407,225 @@ tb_malloc(target_ulong eip, target_ulong eip_virt, target_phys_addr_t eip_phys,
   }
   */
 	//printf("%s(): %x %x %x\n", __func__, eip, eip_virt, eip_phys);
-  alloc = tb_pool_malloc(sizeof *tb + 3);
+  /* The boundaries block directly follows the tb. */
+  alloc = tb_pool_malloc(sizeof *tb + boundaries_size + 3);
   tb = (void *)(((unsigned long)alloc + 3) & ~3);
   ASSERT(((unsigned long)tb & 3) == 0);
   alignment = (unsigned long)tb - (unsigned long)alloc;
   ASSERT(alignment >= 0 && alignment < 4);
   tb->alignment = alignment;
+  tb->part_starts = 0;
+  tb->sti_checks = 0;
   tb->eip = eip;
   tb->eip_virt = eip_virt;
   tb->eip_phys = eip_phys;
   tb->eip_phys_end_page = eip_phys_end_page;
-  tb->jmp_first = (void *)((long)tb | 2);
-  tb->jmp_next[0] = tb->jmp_next[1] = NULL;
-  tb->jmp_offset[0] = tb->jmp_offset[1] = 0xffff;
-  tb->edge_offset[0] = tb->edge_offset[1] = 0xffff;
-	tb_pool_lock(tb);
-  tb->rollbacks = tb_pool_malloc(num_insns * sizeof (*tb->rollbacks));
-  ASSERT(tb->rollbacks);
-  if (!tb->rollbacks) {
-    ABORT();
+  tb->jmp_first = (void *)((long)tb | TB_EDGE_NONE);
+  for (i = 0; i < TB_NUM_EDGES; i++) {
+    tb->jmp_next[i] = NULL;
+    tb->jmp_offset[i] = tb->edge_offset[i] = 0xffff;
   }
-
+  tb->jumptable1_site = jumptable1_site_alloc();
+	tb_pool_lock(tb);
   tb->tc_ptr = tb_pool_malloc(size);
-  tb->tc_boundaries = tb_pool_malloc((num_insns + 1) *
-      sizeof(*tb->tc_boundaries));
-  tb->eip_boundaries = tb_pool_malloc(num_insns * sizeof(*tb->eip_boundaries));
-#ifndef NDEBUG
-  tb->peep_string = tb_pool_malloc(num_insns * sizeof(char *));
-  memset(tb->peep_string, 0x0, num_insns*sizeof(char*));
-#endif
+  tb->tc_len = 0;
   tb->num_insns = num_insns;
+	tb_pool_unlock(tb);
 
-  if (!tb->rollbacks) {
-    ABORT();
-  }
+  return tb;
+}
+
+static inline tb_boundary_index_t *
+tb_boundary_index(tb_t const *tb)
+{
+  return (tb_boundary_index_t *)(tb + 1);
+}
+
+static inline uint8_t *
+tb_eip_deltas(tb_t const *tb)
+{
+  return (uint8_t *)(tb_boundary_index(tb)
+      + (tb->num_insns >> TB_BOUNDARY_INDEX_SHIFT) + 1);
+}
+
+static inline uint8_t *
+tb_tc_deltas(tb_t const *tb)
+{
+  return tb_eip_deltas(tb) + (tb->num_insns + 1) / 2;
+}
+
+/* Returns the size of the boundaries block of a tb with NUM_INSNS insns,
+ * whose translations start at TC_BOUNDARIES. */
+size_t
+tb_boundaries_size(size_t num_insns, uint16_t const *tc_boundaries)
+{
+  size_t size, i;
 
+  size = ((num_insns >> TB_BOUNDARY_INDEX_SHIFT) + 1)
+    * sizeof(tb_boundary_index_t);
+  size += (num_insns + 1) / 2;
   for (i = 0; i < num_insns; i++) {
-    tb->rollbacks[i].buf_size = rollbacks[i].buf_size;
-    if (rollbacks[i].buf_size) {
-      tb->rollbacks[i].buf = tb_pool_malloc(rollbacks[i].buf_size);
-      ASSERT(rollbacks[i].nb_rollbacks);
-      tb->rollbacks[i].code_offset = tb_pool_malloc(
-          rollbacks[i].nb_rollbacks * sizeof(uint16_t));
-      tb->rollbacks[i].rb_offset = tb_pool_malloc(
-          rollbacks[i].nb_rollbacks * sizeof(uint16_t));
-      tb->rollbacks[i].nb_rollbacks = rollbacks[i].nb_rollbacks;
+    size += (tc_boundaries[i + 1] - tc_boundaries[i] < 0x80)?1:2;
+  }
+  return size;
+}
+
+/* Encodes the boundaries produced by translate() into TB. EIP_BOUNDARIES[i]
+ * is the end of insn i, TC_BOUNDARIES[i] the start of its translation. */
+void
+tb_set_boundaries(tb_t *tb, uint8_t const *eip_boundaries,
+    uint16_t const *tc_boundaries)
+{
+  tb_boundary_index_t *index = tb_boundary_index(tb);
+  uint8_t *eip_deltas = tb_eip_deltas(tb);
+  uint8_t *tc_deltas = tb_tc_deltas(tb), *ptr = tc_deltas;
+  unsigned i, len, delta;
+  uint8_t eip = 0;
+
+  memset(eip_deltas, 0x0, (tb->num_insns + 1) / 2);
+  for (i = 0; i <= tb->num_insns; i++) {
+    if ((i & TB_BOUNDARY_INDEX_MASK) == 0) {
+      index[i >> TB_BOUNDARY_INDEX_SHIFT].tc = tc_boundaries[i];
+      index[i >> TB_BOUNDARY_INDEX_SHIFT].eip = eip;
+      index[i >> TB_BOUNDARY_INDEX_SHIFT].pos = ptr - tc_deltas;
+    }
+    if (i == tb->num_insns) {
+      break;
+    }
+    len = eip_boundaries[i] - eip;
+    ASSERT(len > 0 && len < 0x10);
+    eip_deltas[i / 2] |= len << ((i & 1) * 4);
+    eip = eip_boundaries[i];
+
+    delta = tc_boundaries[i + 1] - tc_boundaries[i];
+    if (delta < 0x80) {
+      *ptr++ = delta;
     } else {
-      tb->rollbacks[i].buf = NULL;
-      tb->rollbacks[i].code_offset = NULL;
-      tb->rollbacks[i].rb_offset = NULL;
-      tb->rollbacks[i].nb_rollbacks = 0;
+      ASSERT(delta < 0x8000);
+      *ptr++ = 0x80 | (delta >> 8);
+      *ptr++ = delta & 0xff;
     }
   }
-  if (!tb->rollbacks) {
-    ABORT();
+  ASSERT(ptr - (uint8_t *)index
+      == (int)tb_boundaries_size(tb->num_insns, tc_boundaries));
+  tb->tc_len = tc_boundaries[tb->num_insns];
+}
+
+/* Decodes boundary N of TB into *TC and *EIP. */
+static void
+tb_boundary(tb_t const *tb, unsigned n, uint16_t *tc, uint8_t *eip)
+{
+  tb_boundary_index_t const *index;
+  uint8_t const *eip_deltas, *ptr;
+  unsigned i, delta;
+
+  ASSERT(n <= tb->num_insns);
+  index = &tb_boundary_index(tb)[n >> TB_BOUNDARY_INDEX_SHIFT];
+  eip_deltas = tb_eip_deltas(tb);
+  ptr = tb_tc_deltas(tb) + index->pos;
+  *tc = index->tc;
+  *eip = index->eip;
+  for (i = n & ~TB_BOUNDARY_INDEX_MASK; i < n; i++) {
+    *eip += (eip_deltas[i / 2] >> ((i & 1) * 4)) & 0xf;
+    delta = *ptr++;
+    if (delta & 0x80) {
+      delta = ((delta & 0x7f) << 8) | *ptr++;
+    }
+    *tc += delta;
   }
-	tb_pool_unlock(tb);
+}
 
-  /* printf("%s(): returning tb(%p). tb->rollbacks(%p)=%p\n", __func__, tb,
-			&tb->rollbacks, tb->rollbacks); */
-  return tb;
+/* Returns the offset of the translation of insn N from tb->tc_ptr. */
+uint16_t
+tb_tc_boundary(tb_t const *tb, unsigned n)
+{
+  uint16_t tc;
+  uint8_t eip;
+
+  tb_boundary(tb, n, &tc, &eip);
+  return tc;
+}
+
+/* Returns the offset of insn N from tb->eip_virt. */
+uint8_t
+tb_eip_boundary(tb_t const *tb, unsigned n)
+{
+  uint16_t tc;
+  uint8_t eip;
+
+  tb_boundary(tb, n, &tc, &eip);
+  return eip;
+}
+
+/* Returns the last boundary of TB whose translation starts at or before
+ * TC_OFFSET from tb->tc_ptr, or 0 if there is none, and decodes it into *TC
+ * and *EIP. Searches the index first, so that fewer than
+ * 1 << TB_BOUNDARY_INDEX_SHIFT deltas are decoded. */
+unsigned
+tb_find_tc_boundary(tb_t const *tb, uint16_t tc_offset, uint16_t *tc,
+    uint8_t *eip)
+{
+  tb_boundary_index_t const *index = tb_boundary_index(tb);
+  uint8_t const *eip_deltas, *ptr;
+  unsigned lo, hi, mid, n, delta;
+
+  lo = 0;
+  hi = tb->num_insns >> TB_BOUNDARY_INDEX_SHIFT;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (index[mid].tc <= tc_offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  n = lo << TB_BOUNDARY_INDEX_SHIFT;
+  *tc = index[lo].tc;
+  *eip = index[lo].eip;
+  eip_deltas = tb_eip_deltas(tb);
+  ptr = tb_tc_deltas(tb) + index[lo].pos;
+  for (; n < tb->num_insns; n++) {
+    delta = *ptr++;
+    if (delta & 0x80) {
+      delta = ((delta & 0x7f) << 8) | *ptr++;
+    }
+    if (*tc + delta > tc_offset) {
+      break;
+    }
+    *tc += delta;
+    *eip += (eip_deltas[n / 2] >> ((n & 1) * 4)) & 0xf;
+  }
+  return n;
+}
+
+/* Decodes all num_insns + 1 boundaries of TB, for callers that scan them.
+ * Either array may be NULL. */
+void
+tb_get_boundaries(tb_t const *tb, uint8_t *eip_offsets, uint16_t *tc_offsets)
+{
+  uint8_t const *eip_deltas = tb_eip_deltas(tb);
+  uint8_t const *ptr = tb_tc_deltas(tb);
+  uint16_t tc = tb_boundary_index(tb)->tc;
+  uint8_t eip = 0;
+  unsigned i, delta;
+
+  for (i = 0; ; i++) {
+    if (eip_offsets) {
+      eip_offsets[i] = eip;
+    }
+    if (tc_offsets) {
+      tc_offsets[i] = tc;
+    }
+    if (i == tb->num_insns) {
+      break;
+    }
+    eip += (eip_deltas[i / 2] >> ((i & 1) * 4)) & 0xf;
+    delta = *ptr++;
+    if (delta & 0x80) {
+      delta = ((delta & 0x7f) << 8) | *ptr++;
+    }
+    tc += delta;
+  }
 }
 
 
@@ -557,7 +713,7 @@ tb_add(tb_t *tb)
 	void *retp;
 	LOG(TB, "%s(): adding %p: 0x%x-0x%x: %p->%p.\n", __func__, tb, tb->eip_phys,
 			tb->eip_phys + tb->tb_len, tb->tc_ptr,
-			tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+			tb->tc_ptr + tb->tc_len);
 	retp = hash_insert(&pc_table, &tb->pc_elem);
 	if (retp) {
 		tb_t *tmp;
@@ -625,12 +781,13 @@ tb_find_pc(target_ulong eip_phys, target_ulong eip_phys_end_page,
 tb_t *
 tb_find(const void *tc_ptr)
 {
-  uint16_t tc_boundaries[1] = {1};
-  struct tb_t tb = {0, 0, 0, 0, 0, 0, NULL, NULL, tc_boundaries, };
+  struct tb_t tb;
   struct rbtree_elem *found;
   struct tb_t *ret;
 
+  memset(&tb, 0, sizeof tb);
   tb.tc_ptr = (void *)tc_ptr;
+  tb.tc_len = 1;
   if (!(found = rbtree_find(&tc_tree, &tb.tc_elem))) {
     return NULL;
   }
@@ -647,15 +804,16 @@ tb_unchain(tb_t *tb)
   tb_t *tb1, *tb2;
 
 	//printf("%s(): %p: 0x%x\n", __func__, tb, tb->eip_virt);
-  /* suppress this TB from the two jump lists */
+  /* suppress this TB from its jump lists */
   tb_jmp_remove(tb, 0);
   tb_jmp_remove(tb, 1);
+  tb_jmp_remove(tb, 2);
 
   /* suppress any remaining jumps to this TB */
   for (tb1 = tb->jmp_first;;tb1 = tb2) {
     unsigned n1;
     n1 = (long)tb1 & 3;
-    if (n1 == 2) {
+    if (n1 == TB_EDGE_NONE) {
       tb->jmp_first = tb1;
       break;
     }
@@ -686,7 +844,7 @@ tb_set_jmp_target(tb_t *tb, unsigned n, uint8_t *addr)
   unsigned long val;
 	uint8_t *jmp_addr;
 	unsigned i;
-  ASSERT(tb->jmp_offset[n] < tb->tc_boundaries[tb->num_insns]);
+  ASSERT(tb->jmp_offset[n] < tb->tc_len);
   jmp_addr = tb->tc_ptr + tb->jmp_offset[n];
 	val = addr - (jmp_addr + sizeof(target_ulong));
   *(target_ulong *)jmp_addr = val;
@@ -699,7 +857,7 @@ tb_set_jmp_target(tb_t *tb, unsigned n, uint8_t *addr)
 void
 tb_add_jump(tb_t *tb, unsigned n, tb_t *tb_next)
 {
-  ASSERT(n == 0 || n == 1);
+  ASSERT(n < TB_NUM_EDGES);
   ASSERT(tb->jmp_offset[n] != 0xffff);
   LOG(IN_ASM, "Chaining %#x[n=%d,%p]-->%#x[%p]\n", tb->eip_phys, n,
       tb->tc_ptr + tb->jmp_offset[n], tb_next->eip_phys, tb_next->tc_ptr);
@@ -746,7 +904,7 @@ tc_less(struct rbtree_elem const *_a, struct rbtree_elem const *_b, void *aux)
 {
   struct tb_t *a = rbtree_entry(_a, struct tb_t, tc_elem);
   struct tb_t *b = rbtree_entry(_b, struct tb_t, tc_elem);
-  if ((a->tc_ptr + a->tc_boundaries[a->num_insns]) <= b->tc_ptr) {
+  if ((a->tc_ptr + a->tc_len) <= b->tc_ptr) {
     return true;
   }
   return false;
@@ -763,92 +921,95 @@ target_ulong
 tb_tc_ptr_to_eip_virt(const void *tcptr)
 {
   uint8_t const *tc_ptr;
-  size_t i;
+  uint16_t tc;
+  uint8_t eip;
   tb_t *tb;
 
   tc_ptr = tcptr;
   tb = tb_find(tc_ptr);
   ASSERT(tb);
   ASSERT(   tc_ptr >= tb->tc_ptr
-         && tc_ptr < tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
-
-	/*
-  if (boundary_only) {
-    if (tc_ptr == tb->tc_ptr + tb->tc_boundaries[0]) {
-      return tb->eip_virt;
-    }
-    for (i = 1; i < tb->num_insns; i++) {
-      if (tc_ptr == tb->tc_ptr + tb->tc_boundaries[i]) {
-        return tb->eip_virt + tb->eip_boundaries[i-1];
-      }
-    }
-    printf("tb->tc_ptr=%#x, tc_ptr=%#x, boundaries=", tb->tc_ptr, tc_ptr);
-    for (i = 0; i <= tb->num_insns; i++) {
-      printf("%#x,", tb->tc_boundaries[i]);
-    }
-    printf("\n");
-    NOT_REACHED();
-  } else
-	*/
-  if (tc_ptr < tb->tc_ptr + tb->tc_boundaries[0]) {
-    return tb->eip_virt;
-  }
-  for (i = 0; i < tb->num_insns; i++) {
-    if (   tc_ptr >= tb->tc_ptr + tb->tc_boundaries[i]
-        && tc_ptr <  tb->tc_ptr + tb->tc_boundaries[i + 1]) {
-      return tb->eip_virt + ((i == 0)?0:tb->eip_boundaries[i-1]);
-    }
-  }
-  printf("tb->tc_ptr=%p, tc_ptr=%p, boundaries=", tb->tc_ptr, tc_ptr);
-  for (i = 0; i <= tb->num_insns; i++) {
-    printf("%#x,", tb->tc_boundaries[i]);
-  }
-  printf("\n");
-  NOT_REACHED();
+         && tc_ptr < tb->tc_ptr + tb->tc_len);
+  tb_find_tc_boundary(tb, tc_ptr - tb->tc_ptr, &tc, &eip);
+  return tb->eip_virt + eip;
 }
 
 
 uint8_t const *
 tb_get_tc_next(tb_t const *tb, uint8_t const *tc_ptr)
 {
-  unsigned i;
-  if (tc_ptr >= tb->tc_ptr && tc_ptr < tb->tc_ptr + tb->tc_boundaries[0]) {
-    return tb->tc_ptr + tb->tc_boundaries[0];
+  unsigned n;
+  uint16_t tc;
+  uint8_t eip;
+
+  ASSERT(tc_ptr >= tb->tc_ptr && tc_ptr < tb->tc_ptr + tb->tc_len);
+  n = tb_find_tc_boundary(tb, tc_ptr - tb->tc_ptr, &tc, &eip);
+  if (tc_ptr <= tb->tc_ptr + tc) {
+    /* At a boundary, or before the first insn. */
+    return tb->tc_ptr + tc;
   }
-  for (i = 0; i < tb->num_insns; i++) {
-    if (   tc_ptr >= tb->tc_ptr + tb->tc_boundaries[i]
-        && tc_ptr < tb->tc_ptr + tb->tc_boundaries[i + 1]) {
-      if (tc_ptr == tb->tc_ptr + tb->tc_boundaries[i]) {
-        return tc_ptr;
-      }
-      return tb->tc_ptr + tb->tc_boundaries[i + 1];
-    }
+  return tb->tc_ptr + tb_tc_boundary(tb, n + 1);
+}
+
+static target_phys_addr_t
+tb_vaddr_to_paddr(tb_t const *tb, target_ulong vaddr)
+{
+  if ((vaddr & ~PGMASK) == (tb->eip_virt & ~PGMASK)) {
+    return tb->eip_phys + (vaddr - tb->eip_virt);
   }
-  NOT_REACHED();
+  return tb->eip_phys_end_page + (vaddr & PGMASK);
+}
+
+/* Returns the guest-physical address of insn N of TB. */
+target_phys_addr_t
+tb_insn_paddr(tb_t const *tb, unsigned n)
+{
+  return tb_vaddr_to_paddr(tb, tb->eip_virt + tb_eip_boundary(tb, n));
+}
+
+/* Copies the guest code of insn N of TB into BUF and returns its eip,
+ * relative to the code segment like tb->eip, which is the address translate()
+ * used for it. The code is read through its physical address, because its
+ * virtual mapping may be gone by now. */
+target_ulong
+tb_read_insn(tb_t const *tb, unsigned n, uint8_t *buf, size_t buf_size)
+{
+  target_ulong start, end, vaddr;
+  target_phys_addr_t paddr;
+  pt_mode_t pt_mode;
+
+  ASSERT(n < tb->num_insns);
+  start = tb->eip_virt + tb_eip_boundary(tb, n);
+  end = tb->eip_virt + tb_eip_boundary(tb, n + 1);
+  ASSERT(end - start <= buf_size);
+  pt_mode = switch_to_phys();
+  for (vaddr = start; vaddr < end; vaddr++) {
+    paddr = tb_vaddr_to_paddr(tb, vaddr);
+    *buf++ = *(uint8_t *)paddr;
+  }
+  switch_pt(pt_mode);
+  return tb->eip + tb_eip_boundary(tb, n);
 }
 
 bool
 tb_is_tc_boundary(const void *tcptr)
 {
   uint8_t const *tc_ptr;
-  size_t i;
+  uint16_t tc;
+  uint8_t eip;
   tb_t *tb;
 
   tc_ptr = tcptr;
   tb = tb_find(tc_ptr);
   ASSERT(tb);
   ASSERT(   tc_ptr >= tb->tc_ptr
-         && tc_ptr < tb->tc_ptr + tb->tc_boundaries[tb->num_insns]);
+         && tc_ptr < tb->tc_ptr + tb->tc_len);
 
   if (tc_ptr == tb->tc_ptr) {
     return true;
   }
-  for (i = 0; i < tb->num_insns; i++) {
-    if (tc_ptr == tb->tc_ptr + tb->tc_boundaries[i]) {
-      return true;
-    }
-  }
-  return false;
+  tb_find_tc_boundary(tb, tc_ptr - tb->tc_ptr, &tc, &eip);
+  return tc_ptr == tb->tc_ptr + tc;
 }
 
 void
@@ -859,6 +1020,7 @@ tb_flush(void)
 		freed = free_a_tb();
 		ASSERT(freed);
 	}
+	jumptable1_rstack_clear();
 }
 
 void
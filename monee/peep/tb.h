@@ -10,6 +10,23 @@
 //#define MAX_TU_SIZE 1         /* Max number of insns in a translation unit. */
 #endif
 
+/* Max number of insns in a superblock. part_starts has one bit per insn. */
+#ifndef MAX_SUPERBLOCK_SIZE
+#define MAX_SUPERBLOCK_SIZE 24
+#endif
+#if MAX_SUPERBLOCK_SIZE < MAX_TU_SIZE || MAX_SUPERBLOCK_SIZE > 32
+#error "MAX_SUPERBLOCK_SIZE must be between MAX_TU_SIZE and 32."
+#endif
+
+/* A tb exits through edge 0 (a taken jump), edge 1 (the fall-through) or
+ * edge 2 (the side exit of a superblock). vcpu.edge is TB_EDGE_NONE after
+ * any other exit. In the jmp_first lists, TB_EDGE_NONE in the low bits of a
+ * pointer marks the owner of the list. */
+#define TB_NUM_EDGES 3
+#define TB_EDGE_NONE 3
+
+/* Rollback code of a translated insn. Not kept with the tb; regenerated on
+ * demand by peep_retranslate_insn(). */
 typedef struct rollbacks_t {
   int nb_rollbacks;
   uint8_t *buf;
@@ -18,6 +35,24 @@ typedef struct rollbacks_t {
   uint16_t *rb_offset;
 } rollbacks_t;
 
+/* The insn boundaries of a tb are delta-encoded in a block that directly
+ * follows the tb_t:
+ *   tb_boundary_index_t index[(num_insns >> TB_BOUNDARY_INDEX_SHIFT) + 1];
+ *   uint8_t eip_deltas[(num_insns + 1) / 2];  insn lengths, a nibble each;
+ *   uint8_t tc_deltas[];  translation sizes, one byte each, or two bytes with
+ *                         the top bit set if the size is 0x80 or more.
+ * index[k] holds the boundary of insn k << TB_BOUNDARY_INDEX_SHIFT, so that a
+ * lookup decodes fewer than 1 << TB_BOUNDARY_INDEX_SHIFT deltas. Boundary n
+ * is the start of insn n; boundary num_insns is the end of the tb. */
+#define TB_BOUNDARY_INDEX_SHIFT 3
+#define TB_BOUNDARY_INDEX_MASK ((1 << TB_BOUNDARY_INDEX_SHIFT) - 1)
+
+typedef struct tb_boundary_index_t {
+  uint16_t tc;          /* Offset from tc_ptr. */
+  uint8_t eip;          /* Offset from eip_virt. */
+  uint8_t pos;          /* Offset of the following tc delta in tc_deltas. */
+} tb_boundary_index_t;
+
 typedef struct tb_t {
 	target_ulong eip;						/* The register eip when this tb was executed. */
   target_ulong eip_virt;			/* The (cs_base+eip) to get the virtual addr. */
@@ -27,25 +62,31 @@ typedef struct tb_t {
 																					 tb could span 2 pages). */
   size_t tb_len, num_insns;
   uint8_t *tc_ptr;
-  uint8_t  *eip_boundaries;
-  uint16_t *tc_boundaries;
-#ifndef NDEBUG
-  char **peep_string;
-#endif
-
-  struct rollbacks_t *rollbacks;
+  uint16_t tc_len;
 
   /* For cache replacement. */
   bool accessed_bit;
   struct list_elem clock_elem;
 
-  /* For direct jump chaining. */
+  /* For direct jump chaining, through the TB_NUM_EDGES exits of the tb. */
   struct tb_t *jmp_first;
-  struct tb_t *jmp_next[2];
-  uint16_t jmp_offset[2];
-  uint16_t edge_offset[2];
+  struct tb_t *jmp_next[TB_NUM_EDGES];
+  uint16_t jmp_offset[TB_NUM_EDGES];
+  uint16_t edge_offset[TB_NUM_EDGES];
+  /* The inline caches of the indirect branch that ends the tb. */
+  struct jumptable1_site_t *jumptable1_site;
 
   unsigned alignment:2;
+  /* The cpu mode this tb was translated for. */
+  unsigned protected_mode:1;
+  unsigned code32:1;
+
+  /* Bit i is set if insn i starts a new part of a superblock, i.e. follows a
+   * side exit. Each part has its own tb header. */
+  uint32_t part_starts;
+  /* Bit i is set if the translation of insn i starts with the IF==2 check
+   * of an sti fall-through. */
+  uint32_t sti_checks;
 
   /* For pc_hash. */
   struct hash_elem pc_elem;
@@ -58,8 +99,18 @@ typedef struct tb_t {
 void tb_init(void);
 tb_t *tb_malloc(target_ulong eip, target_ulong eip_virt,
 		target_phys_addr_t eip_phys, target_phys_addr_t eip_phys_end_page,
-    size_t num_insns, size_t size, rollbacks_t const *rollbacks);
+    size_t num_insns, size_t size, size_t boundaries_size);
+size_t tb_boundaries_size(size_t num_insns, uint16_t const *tc_boundaries);
+void tb_set_boundaries(tb_t *tb, uint8_t const *eip_boundaries,
+    uint16_t const *tc_boundaries);
+uint16_t tb_tc_boundary(tb_t const *tb, unsigned n);
+uint8_t tb_eip_boundary(tb_t const *tb, unsigned n);
+unsigned tb_find_tc_boundary(tb_t const *tb, uint16_t tc_offset, uint16_t *tc,
+    uint8_t *eip);
+void tb_get_boundaries(tb_t const *tb, uint8_t *eip_offsets,
+    uint16_t *tc_offsets);
 void tb_add(tb_t *tb);
+void tb_invalidate(tb_t *tb);
 tb_t *tb_find_pc(target_phys_addr_t eip_phys, target_ulong eip_phys_end_page,
 		target_ulong eip_virt, target_ulong eip);
 tb_t *tb_find(const void *tc_ptr);
@@ -67,6 +118,9 @@ void tb_add_jump(tb_t *tb, unsigned n, tb_t *tb_next);
 void tb_unchain_all(void);
 target_ulong tb_tc_ptr_to_eip_virt(const void *tc_ptr);
 bool tb_is_tc_boundary(const void *tc_ptr);
+target_phys_addr_t tb_insn_paddr(tb_t const *tb, unsigned n);
+target_ulong tb_read_insn(tb_t const *tb, unsigned n, uint8_t *buf,
+    size_t buf_size);
 uint8_t const *tb_get_tc_next(tb_t const *tb, uint8_t const *tc_ptr);
 void tb_flush(void);
 
@@ -0,0 +1,320 @@
+#include "sys/desc_cache.h"
+#include <debug.h>
+#include <stdio.h>
+#include "mem/malloc.h"
+#include "mem/malloc_cb.h"
+#include "mem/mtrace.h"
+#include "mem/paging.h"
+#include "mem/vaddr.h"
+#include "sys/vcpu.h"
+
+#define INTR_CNT 256
+
+/* A guest page that cached descriptors were read from. */
+struct desc_watch {
+  target_ulong vpage;
+  target_phys_addr_t ppage;     /* VPAGE maps PPAGE, which is write-traced. */
+  int n_writes;
+};
+
+static struct desc_watch watches[DESC_CACHE_MAX_WATCHES];
+static int n_watches = 0;
+static uint32_t untraced = 0;   /* watches written too often to trace. */
+
+/* Watches whose VPAGE is known to map their PPAGE under VERIFIED_CR3. */
+static uint32_t verified = 0;
+static target_ulong verified_cr3 = CR3_INVALID;
+
+struct gate_entry {
+  struct intr_gate gate;
+  uint32_t watches;             /* 0 if the entry is invalid. */
+};
+
+struct stack_entry {
+  struct ring_stack stack;
+  uint32_t watches;
+};
+
+struct seg_entry {
+  uint32_t e1, e2;
+  uint16_t index;               /* selector & ~7. */
+  uint32_t watches;
+};
+
+static struct gate_entry gates[INTR_CNT];
+static struct stack_entry stacks[3];
+static struct seg_entry segs[DESC_CACHE_SEGS];
+
+static long long stats_num_gate_hits = 0, stats_num_gate_misses = 0;
+static long long stats_num_stack_hits = 0, stats_num_stack_misses = 0;
+static long long stats_num_seg_hits = 0, stats_num_seg_misses = 0;
+static long long stats_num_writes = 0;
+static long long stats_num_flushes = 0;
+static long long stats_num_remaps = 0;
+
+static void desc_cache_mtrace(target_phys_addr_t start, size_t len,
+    void *opaque);
+
+static void
+desc_cache_nolock(void *opaque UNUSED)
+{
+}
+
+static struct malloc_cb desc_cache_malloc_cb = {
+  &malloc,
+  &desc_cache_nolock,
+  &desc_cache_nolock
+};
+
+static target_ulong
+cur_cr3(void)
+{
+  return using_cr3_page_table ? vcpu.cr[3] : CR3_INVALID;
+}
+
+/* Returns the frame that guest page VPAGE maps, or a value with bits in
+ * PGMASK if it is not mapped. */
+static target_phys_addr_t
+watch_walk(target_ulong vpage)
+{
+  return pt_walk((void *)vcpu.cr[3], vpage, NULL, NULL, 0);
+}
+
+static void
+drop_entries(uint32_t mask)
+{
+  int i;
+
+  for (i = 0; i < INTR_CNT; i++) {
+    if (gates[i].watches & mask) {
+      gates[i].watches = 0;
+    }
+  }
+  for (i = 0; i < 3; i++) {
+    if (stacks[i].watches & mask) {
+      stacks[i].watches = 0;
+    }
+  }
+  for (i = 0; i < DESC_CACHE_SEGS; i++) {
+    if (segs[i].watches & mask) {
+      segs[i].watches = 0;
+    }
+  }
+}
+
+/* Returns true if the pages of MASK still map the frames they were read
+ * from. Flushes the cache and returns false if one does not. */
+static inline bool
+watches_verify(uint32_t mask)
+{
+  target_ulong cr3 = cur_cr3();
+  uint32_t todo;
+
+  if (cr3 != verified_cr3) {
+    verified_cr3 = cr3;
+    verified = 0;
+  }
+  for (todo = mask & ~verified; todo; todo &= todo - 1) {
+    struct desc_watch const *w = &watches[__builtin_ctz(todo)];
+
+    if (watch_walk(w->vpage) != w->ppage) {
+      stats_num_remaps++;
+      desc_cache_flush();
+      return false;
+    }
+    verified |= todo & -todo;
+  }
+  return true;
+}
+
+/* Returns the index of the watch of VPAGE, adding it if needed, or -1. */
+static int
+watch_get(target_ulong vpage)
+{
+  target_phys_addr_t ppage;
+  struct desc_watch *w;
+  int i;
+
+  for (i = 0; i < n_watches; i++) {
+    if (watches[i].vpage == vpage) {
+      if ((untraced & (1u << i)) || !watches_verify(1u << i)) {
+        return -1;
+      }
+      return i;
+    }
+  }
+  if (n_watches == DESC_CACHE_MAX_WATCHES) {
+    return -1;
+  }
+  ppage = watch_walk(vpage);
+  if (ppage & PGMASK) {
+    return -1;
+  }
+  w = &watches[n_watches];
+  w->vpage = vpage;
+  w->ppage = ppage;
+  w->n_writes = 0;
+  mtrace_add(ppage, PGSIZE, desc_cache_mtrace, w, &desc_cache_malloc_cb);
+  watches_verify(0);
+  verified |= 1u << n_watches;
+  return n_watches++;
+}
+
+/* Write-traces the guest pages of VADDR...VADDR+LEN, which descriptors about
+ * to be inserted were read from. Returns the mask to insert them with, or 0
+ * if they cannot be cached. */
+uint32_t
+desc_cache_watch(target_ulong vaddr, size_t len)
+{
+  target_ulong vpage = vaddr & ~PGMASK;
+  size_t n_pages = ((vaddr + len - 1) >> PGBITS) - (vaddr >> PGBITS) + 1;
+  uint32_t mask = 0;
+
+  for (; n_pages > 0; n_pages--, vpage += PGSIZE) {
+    int i = watch_get(vpage);
+
+    if (i < 0) {
+      return 0;
+    }
+    mask |= 1u << i;
+  }
+  return mask;
+}
+
+struct intr_gate const *
+desc_cache_gate_lookup(unsigned intno)
+{
+  struct gate_entry const *e = &gates[intno];
+
+  if (e->watches && watches_verify(e->watches)) {
+    stats_num_gate_hits++;
+    return &e->gate;
+  }
+  stats_num_gate_misses++;
+  return NULL;
+}
+
+void
+desc_cache_gate_insert(unsigned intno, struct intr_gate const *gate,
+    uint32_t watches)
+{
+  ASSERT(intno < INTR_CNT);
+  if (watches && !(watches & untraced)) {
+    gates[intno].gate = *gate;
+    gates[intno].watches = watches;
+  }
+}
+
+struct ring_stack const *
+desc_cache_stack_lookup(unsigned dpl)
+{
+  struct stack_entry const *e = &stacks[dpl];
+
+  ASSERT(dpl < 3);
+  if (e->watches && watches_verify(e->watches)) {
+    stats_num_stack_hits++;
+    return &e->stack;
+  }
+  stats_num_stack_misses++;
+  return NULL;
+}
+
+void
+desc_cache_stack_insert(unsigned dpl, struct ring_stack const *stack,
+    uint32_t watches)
+{
+  ASSERT(dpl < 3);
+  if (watches && !(watches & untraced)) {
+    stacks[dpl].stack = *stack;
+    stacks[dpl].watches = watches;
+  }
+}
+
+/* Looks up the descriptor of GDT selector SELECTOR, as read_segment() would
+ * read it. */
+bool
+desc_cache_seg_lookup(int selector, uint32_t *e1, uint32_t *e2)
+{
+  struct seg_entry const *e = &segs[(selector >> 3) % DESC_CACHE_SEGS];
+
+  if (   e->watches && e->index == (selector & ~7)
+      && watches_verify(e->watches)) {
+    *e1 = e->e1;
+    *e2 = e->e2;
+    stats_num_seg_hits++;
+    return true;
+  }
+  stats_num_seg_misses++;
+  return false;
+}
+
+void
+desc_cache_seg_insert(int selector, uint32_t e1, uint32_t e2,
+    uint32_t watches)
+{
+  struct seg_entry *e = &segs[(selector >> 3) % DESC_CACHE_SEGS];
+
+  ASSERT(!(selector & 4));
+  if (watches && !(watches & untraced)) {
+    e->e1 = e1;
+    e->e2 = e2;
+    e->index = selector & ~7;
+    e->watches = watches;
+  }
+}
+
+/* Drops all entries and stops tracing their pages. */
+void
+desc_cache_flush(void)
+{
+  int i;
+
+  drop_entries(~0u);
+  for (i = 0; i < n_watches; i++) {
+    if (!(untraced & (1u << i))) {
+      mtrace_remove(watches[i].ppage, PGSIZE, desc_cache_mtrace, &watches[i],
+          NULL);
+    }
+  }
+  n_watches = 0;
+  untraced = 0;
+  verified = 0;
+  stats_num_flushes++;
+}
+
+static void
+desc_cache_mtrace(target_phys_addr_t start, size_t len, void *opaque)
+{
+  struct desc_watch *w = opaque;
+  uint32_t bit = 1u << (w - watches);
+
+  LOG(MTRACE, "%s(): %x %x. dropping descriptors of page %x\n", __func__,
+      start, start + len, w->vpage);
+  stats_num_writes++;
+  drop_entries(bit);
+  /* A page that is written often (e.g. a TSS whose esp0 changes on every
+   * task switch) costs more in write faults than its entries save. */
+  if (++w->n_writes > DESC_CACHE_MAX_WRITES) {
+    mtrace_remove(w->ppage, PGSIZE, desc_cache_mtrace, w, NULL);
+    untraced |= bit;
+  }
+}
+
+void
+desc_cache_print_stats(void)
+{
+  int i, n_untraced = 0;
+
+  for (i = 0; i < n_watches; i++) {
+    n_untraced += (untraced >> i) & 1;
+  }
+  printf("MON-STATS: desc cache: %lld gate hits, %lld gate misses, "
+      "%lld stack hits, %lld stack misses, %lld segment hits, "
+      "%lld segment misses.\n", stats_num_gate_hits, stats_num_gate_misses,
+      stats_num_stack_hits, stats_num_stack_misses, stats_num_seg_hits,
+      stats_num_seg_misses);
+  printf("MON-STATS: desc cache: %lld traced writes, %lld flushes, "
+      "%lld remaps, %d pages traced, %d untraced.\n", stats_num_writes,
+      stats_num_flushes, stats_num_remaps,
+      n_watches - n_untraced, n_untraced);
+}
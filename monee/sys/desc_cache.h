@@ -0,0 +1,69 @@
+#ifndef SYS_DESC_CACHE_H
+#define SYS_DESC_CACHE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/types.h>
+
+/* Decoded guest descriptors, for interrupt delivery, returns and segment
+ * loads without reading the guest's IDT, GDT and TSS through ldl_kernel()
+ * (and so switching page tables) every time. Segment descriptors are kept
+ * in a direct-mapped table of DESC_CACHE_SEGS entries indexed by selector.
+ *
+ * An entry records the guest pages its descriptors were read from. Every
+ * such page is write-traced with mtrace_add(), and a write to it drops the
+ * entries read from it. A page that is written more than
+ * DESC_CACHE_MAX_WRITES times is no longer traced, and entries that need it
+ * are no longer cached, until the next desc_cache_flush(). After a change of
+ * CR3, the linear address of each page is walked again the first time an
+ * entry needs it; if it now maps a different frame, the whole cache is
+ * flushed. lidt, lgdt, ltr and snapshot_restore() flush the cache. Writes to
+ * these pages through phys_map or the kmap window (DMA) are not seen. */
+#ifndef DESC_CACHE_MAX_WATCHES
+#define DESC_CACHE_MAX_WATCHES 16
+#endif
+#define DESC_CACHE_MAX_WRITES 64
+#ifndef DESC_CACHE_SEGS
+#define DESC_CACHE_SEGS 64
+#endif
+
+/* An interrupt or trap gate and the code segment it leads to. */
+struct intr_gate {
+  unsigned type;                /* gate type, 6, 7, 14 or 15. */
+  unsigned dpl;                 /* of the gate. */
+  uint32_t selector, offset;
+  uint32_t cs_e1, cs_e2;        /* descriptor of SELECTOR, accessed. */
+};
+
+/* A ring stack of the TSS and its stack segment. */
+struct ring_stack {
+  uint32_t ss, esp;
+  uint32_t ss_e1, ss_e2;        /* descriptor of SS, accessed. */
+};
+
+#ifdef __MONITOR__
+uint32_t desc_cache_watch(target_ulong vaddr, size_t len);
+struct intr_gate const *desc_cache_gate_lookup(unsigned intno);
+void desc_cache_gate_insert(unsigned intno, struct intr_gate const *gate,
+    uint32_t watches);
+struct ring_stack const *desc_cache_stack_lookup(unsigned dpl);
+void desc_cache_stack_insert(unsigned dpl, struct ring_stack const *stack,
+    uint32_t watches);
+bool desc_cache_seg_lookup(int selector, uint32_t *e1, uint32_t *e2);
+void desc_cache_seg_insert(int selector, uint32_t e1, uint32_t e2,
+    uint32_t watches);
+void desc_cache_flush(void);
+void desc_cache_print_stats(void);
+#else
+#define desc_cache_watch(vaddr, len) (0)
+#define desc_cache_gate_lookup(intno) ((struct intr_gate const *)NULL)
+#define desc_cache_gate_insert(intno, gate, watches)
+#define desc_cache_stack_lookup(dpl) ((struct ring_stack const *)NULL)
+#define desc_cache_stack_insert(dpl, stack, watches)
+#define desc_cache_seg_lookup(selector, e1, e2) (false)
+#define desc_cache_seg_insert(selector, e1, e2, watches)
+#define desc_cache_flush()
+#define desc_cache_print_stats()
+#endif
+
+#endif /* sys/desc_cache.h */
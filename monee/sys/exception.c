@@ -19,6 +19,7 @@
 #include "mem/palloc.h"
 #include "mem/pte.h"
 #include "mem/pt_mode.h"
+#include "mem/snapshot.h"
 #include "mem/vaddr.h"
 
 /* Number of page faults processed. */
@@ -199,6 +200,10 @@ page_fault (struct intr_frame *f)
 	ASSERT(   pde_error(shadow_paddr, pde_shadow, shadow_ptwalk_flags)
 			   || pte_error(shadow_paddr, pte_shadow, shadow_ptwalk_flags));
 
+	if (write_fault) {
+		/* Save the page first if it is write-protected for a checkpoint. */
+		snapshot_note_write(paddr, 1);
+	}
 	if (   write_fault
 			&& pte_error(shadow_paddr, pte_shadow, shadow_ptwalk_flags)
 			&& mtraces_handle_page_fault(pte_shadow, fault_addr, paddr, f)) {
@@ -3,6 +3,7 @@
 #include <bitmap.h>
 #include <string.h>
 #include <stdio.h>
+#include "sys/desc_cache.h"
 #include "sys/vcpu.h"
 #include "sys/tss.h"
 #include "sys/mode.h"
@@ -279,6 +280,29 @@ read_segment(uint32_t *e1_ptr, uint32_t *e2_ptr, int selector, bool shadow,
   return true;
 }
 
+/* Reads the guest descriptor of SELECTOR like read_segment(), but through
+ * the descriptor cache. The cache only holds GDT descriptors; LDT selectors
+ * always go to read_segment(). */
+bool
+read_segment_cached(uint32_t *e1_ptr, uint32_t *e2_ptr, int selector,
+    bool set_accessed)
+{
+  if (   !(selector & 0x4)
+      && desc_cache_seg_lookup(selector, e1_ptr, e2_ptr)
+      && (!set_accessed || (*e2_ptr & DESC_A_MASK))) {
+    return true;
+  }
+  if (!read_segment(e1_ptr, e2_ptr, selector, false, set_accessed)) {
+    return false;
+  }
+  if (!(selector & 0x4)) {
+    /* Traced after the accessed bit write, if any. */
+    desc_cache_seg_insert(selector, *e1_ptr, *e2_ptr,
+        desc_cache_watch(vcpu.gdt.base + (selector & ~7), 8));
+  }
+  return true;
+}
+
 void
 gdt_make_shadow_segdesc(long segno)
 {
@@ -393,7 +417,7 @@ segcache_sync(int segno)
     uint32_t e1, e2;
     /* printf("%s() %d: segno=%d, selector=%#x. SEL_BASE=%#x\n", __func__,
         __LINE__, segno, (uint32_t)vcpu.segs[segno].selector, SEL_BASE); */
-    read_segment(&e1, &e2, vcpu.orig_segs[segno], false, false);
+    read_segment_cached(&e1, &e2, vcpu.orig_segs[segno], false);
     vcpu.segs[segno].base = get_seg_base(e1, e2);
     vcpu.segs[segno].limit = get_seg_limit(e1, e2);
     /* printf("%s(%d): e1=0x%x, e2=0x%x, base=0x%x, limit=0x%x\n", __func__,
@@ -13,6 +13,8 @@ void gdt_load(uint32_t base, uint16_t limit);
 
 bool read_segment(uint32_t *e1_ptr, uint32_t *e2_ptr, int selector,
     bool shadow, bool set_accessed);
+bool read_segment_cached(uint32_t *e1_ptr, uint32_t *e2_ptr, int selector,
+    bool set_accessed);
 uint32_t get_seg_base(uint32_t e1, uint32_t e2);
 uint32_t get_seg_limit(uint32_t e1, uint32_t e2);
 void load_seg_cache(int segno, unsigned int selector, target_ulong base,
@@ -21,10 +21,13 @@
 #include "peep/jumptable2.h"
 #include "peep/cpu_constraints.h"
 #include "peep/funcs.h"
+#include "peep/insn_cache.h"
+#include "peep/superblock.h"
 #include "peep/tb.h"
 #include "peep/tb_exit_callbacks.h"
 #include "devices/disk.h"
 #include "devices/pci.h"
+#include "devices/timer.h"
 #include "devices/usb/usb.h"
 #include "sys/init.h"
 #include "sys/gdt.h"
@@ -49,7 +52,6 @@ guest_loop(void)
   /* These variables need to be static so that they are not optimized by the
    * compiler into registers; as register values get overwritten.
    */
-  static rollbacks_t rollbacks[MAX_TU_SIZE];
   static cpu_constraints_t cpu_constraints;
   static target_phys_addr_t eip_phys;
   static size_t tlen, num_insns;
@@ -115,7 +117,7 @@ guest_loop(void)
   } else {
     //MSG("Normal.\n");
   }
-	vcpu.edge = 2;
+	vcpu.edge = TB_EDGE_NONE;
 	vcpu.prev_tb = 0;
 
   while (1) {
@@ -140,7 +142,7 @@ guest_loop(void)
       ptb_eip_phys = 0;
       ptb_eip_virt = 0;
       ptb = NULL;
-      if (vcpu.edge != 2 && (ptb = tb_find(vcpu.prev_tb))) {
+      if (vcpu.edge != TB_EDGE_NONE && (ptb = tb_find(vcpu.prev_tb))) {
         ptb_eip_phys = ptb->eip_phys;
         ptb_eip_virt = ptb->eip_virt;
       }
@@ -155,6 +157,7 @@ guest_loop(void)
 				printf("%llx: Hit Panic function -- Micro-replaying.\n", vcpu.n_exec);
 				micro_replay_switch_mode();
 			}
+			micro_replay_checkpoint();
 
       /* XXX: vcpu_get_eip should also check against cs limit. */
       if ((tb = jumptable2_find(eip_virt, (target_ulong)vcpu.eip)) == NULL) {
@@ -217,10 +220,15 @@ guest_loop(void)
 				}
         if (!tb) {
 					static target_phys_addr_t eip_phys_end_page;
-					static size_t tb_len;
+					static size_t tb_len, boundaries_size;
+					static uint8_t eip_boundaries[MAX_SUPERBLOCK_SIZE];
+					static uint16_t tc_boundaries[MAX_SUPERBLOCK_SIZE + 1];
+					set_superblock_side_exits(superblock_take(eip_virt,
+								(target_ulong)vcpu.eip));
           tlen = translate((uint8_t *)eip_virt, (target_ulong)vcpu.eip, tpage,
-							2*PGSIZE, rollbacks, &tb_len, NULL, NULL, NULL, NULL, NULL,
-							&num_insns, &cpu_constraints);
+							2*PGSIZE, &tb_len, NULL, NULL, eip_boundaries, tc_boundaries,
+							&num_insns, NULL, NULL, &cpu_constraints);
+					boundaries_size = tb_boundaries_size(num_insns, tc_boundaries);
 					eip_phys_end_page = pt_walk((void *)vcpu.cr[3], eip_virt + tb_len - 1,
 							&pde_entry, &pte_entry, ptwalk_flags);
 					pde_err = pde_error(eip_phys_end_page, pde_entry, ptwalk_flags);
@@ -228,18 +236,19 @@ guest_loop(void)
 					ASSERT(!pde_err && !pte_err);
 					eip_phys_end_page &= ~PGMASK;
           tb = tb_malloc((target_ulong)vcpu.eip, eip_virt, eip_phys,
-						eip_phys_end_page, num_insns, tlen, rollbacks);
+						eip_phys_end_page, num_insns, tlen, boundaries_size);
+					set_jumptable1_site(tb->jumptable1_site);
           translate((uint8_t *)eip_virt, (target_ulong)vcpu.eip, tb->tc_ptr,
-						tlen, tb->rollbacks, &tb->tb_len, tb->edge_offset, tb->jmp_offset,
-						tb->eip_boundaries, tb->tc_boundaries,
-#ifndef NDEBUG
-							//tb->peep_string,		//malloc can fail if peep_string specified.
-							NULL,
-#else
-							NULL,
-#endif
-							&tb->num_insns,
-              &cpu_constraints);
+						tlen, &tb->tb_len, tb->edge_offset, tb->jmp_offset,
+						eip_boundaries, tc_boundaries, &tb->num_insns,
+						&tb->part_starts, &tb->sti_checks, &cpu_constraints);
+					ASSERT(tb_boundaries_size(tb->num_insns, tc_boundaries)
+							== boundaries_size);
+					tb_set_boundaries(tb, eip_boundaries, tc_boundaries);
+					tb->protected_mode = (cpu_constraints & CPU_CONSTRAINT_PROTECTED) != 0;
+					tb->code32 = (vcpu.segs[R_CS].flags & DESC_B_MASK) != 0;
+					set_superblock_side_exits(-1);
+					set_jumptable1_site(NULL);
           if (loglevel & VCPU_LOG_TRANSLATE) {
             static unsigned size;
             size = (vcpu.segs[R_CS].flags & DESC_B_MASK)?4:2;
@@ -270,7 +279,7 @@ guest_loop(void)
       }
       jumptable1_add((uint32_t)vcpu.eip, (uint32_t)tb->tc_ptr);
       gen_func = tb->tc_ptr;
-      if (vcpu.edge != 2) {
+      if (vcpu.edge != TB_EDGE_NONE) {
         static tb_t *ptb;
 				ptb = tb_find(vcpu.prev_tb);
         /* Check if ptb has not been replaced. */
@@ -283,7 +292,7 @@ guest_loop(void)
           tb->accessed_bit = true;
         }
         vcpu.prev_tb = 0;
-        vcpu.edge = 2;
+        vcpu.edge = TB_EDGE_NONE;
       }
     }
 
@@ -408,7 +417,7 @@ callout_label:
          * time of jumping to TC. So restore vcpu.eip.
          */
         ASSERT(gen_func == vcpu.tc_ptr);
-				vcpu.edge = 2;
+				vcpu.edge = TB_EDGE_NONE;
         //ASSERT(vcpu.interrupts.pending);
         //vcpu.eip = (void *)saved_eip;
       } else {
@@ -440,7 +449,7 @@ guest_init(void)
   vcpu.cr[3] = CR3_INVALID;
 
   vcpu.prev_tb = 0;
-  vcpu.edge = 2;
+  vcpu.edge = TB_EDGE_NONE;
   vcpu.eip = (void *)0x7c00;
   vcpu.n_exec = 0;
   vcpu.eflags = IF_MASK | FLAG_MBS | IOPL_MASK;
@@ -505,6 +514,198 @@ disk_read_test(void)
 			monitor_ticks, guest_ticks);
 }
 
+/* Checks memcpy(), memmove(), memset() and memcmp() against byte loops, for
+ * all alignments and overlaps of small blocks, and prints the throughput of
+ * the string and page primitives. */
+static void
+string_test(void)
+{
+	static uint8_t a[256], b[256], c[256], t[64];
+	uint32_t seed = 1;
+	uint8_t *page0, *page1;
+	int d, s, n, i;
+	int64_t start;
+	long long k;
+
+	for (d = 0; d < 8; d++) {
+		for (s = 0; s < 8; s++) {
+			for (n = 0; n < 64; n++) {
+				for (i = 0; i < 256; i++) {
+					seed = seed * 1103515245 + 12345;
+					a[i] = seed >> 16;
+					b[i] = c[i] = seed >> 24;
+				}
+				memcpy(b + d, a + s, n);
+				for (i = 0; i < n; i++) {
+					c[d + i] = a[s + i];
+				}
+				ASSERT(!memcmp(b, c, sizeof b));
+
+				/* Overlapping, in both directions. */
+				memmove(b + 64 + d, b + 64 + s - 4, n);
+				for (i = 0; i < n; i++) {
+					t[i] = c[64 + s - 4 + i];
+				}
+				for (i = 0; i < n; i++) {
+					c[64 + d + i] = t[i];
+				}
+				ASSERT(!memcmp(b, c, sizeof b));
+				memmove(b + 64 + s, b + 64 + d + 3, n);
+				for (i = 0; i < n; i++) {
+					t[i] = c[64 + d + 3 + i];
+				}
+				for (i = 0; i < n; i++) {
+					c[64 + s + i] = t[i];
+				}
+				ASSERT(!memcmp(b, c, sizeof b));
+
+				memset(b + d, s * 37, n);
+				for (i = 0; i < n; i++) {
+					c[d + i] = s * 37;
+				}
+				ASSERT(!memcmp(b, c, sizeof b));
+
+				if (n > 0) {
+					c[d + (s * 7) % n]++;
+					ASSERT(memcmp(b + d, c + d, n) < 0);
+					ASSERT(memcmp(c + d, b + d, n) > 0);
+				}
+			}
+		}
+	}
+
+	page0 = palloc_get_multiple(PAL_ASSERT, 2);
+	page1 = page0 + PGSIZE;
+	memset(page0, 0x5a, PGSIZE);
+	copy_page(page1, page0);
+	ASSERT(pages_equal(page0, page1));
+	page1[PGSIZE - 1]++;
+	ASSERT(!pages_equal(page0, page1));
+	zero_page(page1);
+	for (i = 0; i < PGSIZE; i++) {
+		ASSERT(page1[i] == 0);
+	}
+
+#define string_bench(name, stmt) do {                                         \
+	start = timer_ticks();                                                      \
+	for (k = 0; timer_elapsed(start) < TIMER_FREQ; k++) {                       \
+		stmt;                                                                     \
+	}                                                                           \
+	printf("%s(): %s: %lld MB/s\n", __func__, name, k * PGSIZE >> 20);          \
+} while (0)
+	string_bench("memcpy", memcpy(page1, page0 + 1, PGSIZE - 1));
+	string_bench("memset", memset(page1 + 1, 0, PGSIZE - 1));
+	string_bench("memcmp", memcmp(page1, page0, PGSIZE));
+	string_bench("copy_page", copy_page(page1, page0));
+	string_bench("zero_page", zero_page(page1));
+	string_bench("pages_equal", pages_equal(page1, page1));
+#undef string_bench
+	palloc_free_multiple(page0, 2);
+}
+
+#define PALLOC_TEST_SLOTS 256
+#define PALLOC_TEST_ITERS 100000
+
+/* Allocates and frees single pages and runs of pages of every class in random
+ * order, checking that no two allocations overlap, that the PAL_TC limit holds
+ * and that the page counts come back, then prints the allocation latency. */
+static void
+palloc_test(void)
+{
+	static struct {
+		uint8_t *pages;
+		size_t cnt;
+	} slots[PALLOC_TEST_SLOTS];
+	static enum palloc_flags const classes[] = { 0, PAL_TC, PAL_SWAP };
+	int tc = tc_page_count, swap = swap_page_count;
+	size_t kernel = kernel_page_count, limit = tc_page_limit;
+	uint8_t *pages[5];
+	uint32_t seed = 1;
+	size_t j;
+	int i, s;
+
+	for (i = 0; i < PALLOC_TEST_ITERS; i++) {
+		seed = seed * 1103515245 + 12345;
+		s = (seed >> 16) % PALLOC_TEST_SLOTS;
+		if (slots[s].pages) {
+			for (j = 0; j < slots[s].cnt; j++) {
+				uint32_t *page = (uint32_t *)(slots[s].pages + j * PGSIZE);
+				ASSERT(page[0] == (s << 16 | j));
+				ASSERT(page[PGSIZE / 4 - 1] == (s << 16 | j));
+			}
+			palloc_free_multiple(slots[s].pages, slots[s].cnt);
+			slots[s].pages = NULL;
+			continue;
+		}
+		slots[s].cnt = (seed >> 8) % 4 ? 1 : 2 + (seed >> 10) % 8;
+		slots[s].pages = palloc_get_multiple(classes[(seed >> 4) % 3]
+				| (i % 16 ? 0 : PAL_ZERO), slots[s].cnt);
+		for (j = 0; slots[s].pages && j < slots[s].cnt; j++) {
+			uint32_t *page = (uint32_t *)(slots[s].pages + j * PGSIZE);
+			page[0] = page[PGSIZE / 4 - 1] = s << 16 | j;
+		}
+	}
+	for (s = 0; s < PALLOC_TEST_SLOTS; s++) {
+		palloc_free_multiple(slots[s].pages, slots[s].cnt);
+		slots[s].pages = NULL;
+	}
+	ASSERT(tc_page_count == tc && swap_page_count == swap);
+	ASSERT(kernel_page_count == kernel);
+
+	tc_page_limit = tc_page_count + 4;
+	for (i = 0; i < 5; i++) {
+		pages[i] = palloc_get_page(PAL_TC);
+		ASSERT((pages[i] != NULL) == (i < 4));
+	}
+	for (i = 0; i < 5; i++) {
+		palloc_free_page(pages[i]);
+	}
+	tc_page_limit = limit;
+	ASSERT(tc_page_count == tc);
+
+	printf("%s(): %d iterations ok.\n", __func__, PALLOC_TEST_ITERS);
+	palloc_print_stats();
+}
+
+/* Monitor self-tests and benchmarks, named pintos-style. Build with
+ * `make TESTS=string:kmap-bench' to run them, in that order, once the memory
+ * system and mtrace are up and before the guest is loaded. */
+struct monitor_test {
+	const char *name;
+	void (*function)(void);
+};
+
+static const struct monitor_test monitor_tests[] = {
+	{"disk-read", disk_read_test},
+	{"kmap-bench", kmap_bench},
+	{"palloc", palloc_test},
+	{"string", string_test},
+};
+
+/* Runs the tests named in NAMES, separated by ':'. */
+static void
+run_tests(char *names)
+{
+	const struct monitor_test *t;
+	char *name, *save_ptr;
+
+	for (name = strtok_r(names, ":", &save_ptr); name;
+			name = strtok_r(NULL, ":", &save_ptr)) {
+		for (t = monitor_tests;
+				t < monitor_tests + sizeof monitor_tests / sizeof *monitor_tests; t++) {
+			if (!strcmp(name, t->name)) {
+				break;
+			}
+		}
+		if (t == monitor_tests + sizeof monitor_tests / sizeof *monitor_tests) {
+			PANIC("no test named \"%s\"", name);
+		}
+		printf("(%s) begin\n", name);
+		t->function();
+		printf("(%s) end\n", name);
+	}
+}
+
 /* Monitor main program. */
 int
 main(void)
@@ -557,7 +758,12 @@ main(void)
   swap_init();
 	mtrace_init();
 
-	//disk_read_test();
+#ifdef MONITOR_TESTS
+	{
+		static char tests[] = xstr(MONITOR_TESTS);
+		run_tests(tests);
+	}
+#endif
 
   guest_init();
 
@@ -581,6 +787,7 @@ main(void)
   peep_init();
   tb_init();
   jumptable1_init();
+  insn_cache_init();
   jumptable2_init();
 
   /* Reset the stack. We leave space for 2*intr_frame_size so that an
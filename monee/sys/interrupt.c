@@ -8,7 +8,9 @@
 #include "hw/i8259.h"
 #include "mem/vaddr.h"
 #include "peep/callouts.h"
+#include "peep/jumptable1.h"
 #include "peep/tb.h"
+#include "sys/desc_cache.h"
 #include "sys/flags.h"
 #include "sys/gdt.h"
 #include "sys/intr-stubs.h"
@@ -607,6 +609,9 @@ void
 do_interrupt(unsigned intno, int is_int, int error_code, uint32_t next_eip,
     int is_hw)
 {
+  /* The interrupt may switch guest stacks, after which the shadow return
+   * stack would only mispredict. */
+  jumptable1_rstack_clear();
   if (vcpu.cr[0] & CR0_PE_MASK) {
     do_interrupt_protected(intno, is_int, error_code, next_eip, is_hw);
   } else {
@@ -615,7 +620,8 @@ do_interrupt(unsigned intno, int is_int, int error_code, uint32_t next_eip,
 }
 
 static inline void get_ss_esp_from_tss(uint32_t *ss_ptr,
-                                           uint32_t *esp_ptr, int dpl)
+                                           uint32_t *esp_ptr, int dpl,
+                                           target_ulong *ptr, size_t *len)
 {
   unsigned type, index, shift;
 
@@ -633,6 +639,8 @@ static inline void get_ss_esp_from_tss(uint32_t *ss_ptr,
   if (index + (4 << shift) - 1 > vcpu.tr.limit) {
     raise_exception_err(EXCP0A_TSS, vcpu.tr.selector & 0xfffc);
   }
+  *ptr = vcpu.tr.base + index;
+  *len = 4 << shift;
   if (shift == 0) {
     *esp_ptr = lduw_kernel(vcpu.tr.base + index);
     *ss_ptr = lduw_kernel(vcpu.tr.base + index + 2);
@@ -642,49 +650,22 @@ static inline void get_ss_esp_from_tss(uint32_t *ss_ptr,
   }
 }
 
-static void
-do_interrupt_protected(unsigned intno, int is_int, int error_code,
-		uint32_t next_eip, int is_hw)
+/* Decodes the gate of INTNO and the code segment it leads to and caches
+ * them. The checks that depend on IS_INT and CPL are made here in the order
+ * the CPU makes them, and again by the caller for cached gates. */
+static struct intr_gate const *
+intr_gate_read(unsigned intno, int is_int, unsigned cpl,
+    struct intr_gate *gate)
 {
-  desc_table_t *dt;
-  target_ulong ptr, ssp;
-	unsigned type, dpl, selector, ss_dpl, cpl;
-  int has_error_code, new_stack, shift;
-  uint32_t e1, e2, offset, ss, esp, ss_e1, ss_e2;
-  uint32_t old_eip, sp_mask, push_eflags;
-
-  segcache_sync(R_SS);
+  target_ulong ptr;
+  uint32_t e1, e2, watches;
 
-  has_error_code = 0;
-  if (!is_int && !is_hw) {
-    switch(intno) {
-      case 8:
-      case 10:
-      case 11:
-      case 12:
-      case 13:
-      case 14:
-      case 17:
-        has_error_code = 1;
-        break;
-    }
-  }
-  if (is_int) {
-    old_eip = next_eip;
-  } else {
-    old_eip = (uint32_t)vcpu.eip;
-  }
-
-  dt = &vcpu.idt;
-  if (intno * 8 + 7 > dt->limit) {
-    raise_exception_err(EXCP0D_GPF, intno * 8 + 2);
-  }
-  ptr = dt->base + intno * 8;
+  ptr = vcpu.idt.base + intno * 8;
   e1 = ldl_kernel(ptr);
   e2 = ldl_kernel(ptr + 4);
   /* check gate type */
-  type = (e2 >> DESC_TYPE_SHIFT) & 0x1f;
-  switch(type) {
+  gate->type = (e2 >> DESC_TYPE_SHIFT) & 0x1f;
+  switch(gate->type) {
     case 5: /* task gate */
       NOT_IMPLEMENTED();
 #if 0
@@ -723,11 +704,10 @@ do_interrupt_protected(unsigned intno, int is_int, int error_code,
       raise_exception_err(EXCP0D_GPF, intno * 8 + 2);
       break;
   }
-  dpl = (e2 >> DESC_DPL_SHIFT) & 3;
-  cpl = vcpu.orig_segs[R_CS] & 3;
+  gate->dpl = (e2 >> DESC_DPL_SHIFT) & 3;
   //LOG(INT, "%s() %d: dpl=%d, cpl=%d\n", __func__, __LINE__, dpl, cpl);
   /* check privledge if software int */
-  if (is_int && dpl < cpl) {
+  if (is_int && gate->dpl < cpl) {
     printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
     raise_exception_err(EXCP0D_GPF, intno * 8 + 2);
   }
@@ -736,61 +716,174 @@ do_interrupt_protected(unsigned intno, int is_int, int error_code,
     printf("%s() %d: raising #NOSEG\n", __func__, __LINE__);
     raise_exception_err(EXCP0B_NOSEG, intno * 8 + 2);
   }
-  selector = e1 >> 16;
-  offset = (e2 & 0xffff0000) | (e1 & 0x0000ffff);
-  if ((selector & 0xfffc) == 0) {
+  gate->selector = e1 >> 16;
+  gate->offset = (e2 & 0xffff0000) | (e1 & 0x0000ffff);
+  if ((gate->selector & 0xfffc) == 0) {
     printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
     raise_exception_err(EXCP0D_GPF, 0);
   }
 
-  if (!read_segment(&e1, &e2, selector, false, true)) {
+  if (!read_segment_cached(&e1, &e2, gate->selector, true)) {
     printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
-    raise_exception_err(EXCP0D_GPF, selector & 0xfffc);
+    raise_exception_err(EXCP0D_GPF, gate->selector & 0xfffc);
   }
   if (!(e2 & DESC_S_MASK) || !(e2 & (DESC_CS_MASK))) {
     printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
-    raise_exception_err(EXCP0D_GPF, selector & 0xfffc);
+    raise_exception_err(EXCP0D_GPF, gate->selector & 0xfffc);
   }
-  dpl = (e2 >> DESC_DPL_SHIFT) & 3;
-  if (dpl > cpl) {
+  if (((e2 >> DESC_DPL_SHIFT) & 3) > cpl) {
     printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
-    raise_exception_err(EXCP0D_GPF, selector & 0xfffc);
+    raise_exception_err(EXCP0D_GPF, gate->selector & 0xfffc);
   }
   if (!(e2 & DESC_P_MASK)) {
     printf("%s() %d: raising #NOSEG\n", __func__, __LINE__);
-    raise_exception_err(EXCP0B_NOSEG, selector & 0xfffc);
+    raise_exception_err(EXCP0B_NOSEG, gate->selector & 0xfffc);
+  }
+  gate->cs_e1 = e1;
+  gate->cs_e2 = e2;
+
+  /* Only trace the pages once all the reads (and accessed bit writes) are
+   * done. A code segment in the LDT is not traced, and lldt does not flush
+   * the cache, so such a gate is not cached. */
+  watches = (gate->selector & 0x4) ? 0 : desc_cache_watch(ptr, 8);
+  if (watches) {
+    uint32_t cs_watches = desc_cache_watch(
+        vcpu.gdt.base + (gate->selector & ~7), 8);
+    watches = cs_watches ? watches | cs_watches : 0;
+  }
+  desc_cache_gate_insert(intno, gate, watches);
+  return gate;
+}
+
+/* Reads the stack of ring DPL from the TSS and checks its stack segment,
+ * and caches them. */
+static struct ring_stack const *
+ring_stack_read(unsigned dpl, struct ring_stack *stack)
+{
+  target_ulong tss_ptr;
+  uint32_t ss, watches;
+  size_t tss_len;
+  unsigned ss_dpl;
+
+  get_ss_esp_from_tss(&stack->ss, &stack->esp, dpl, &tss_ptr, &tss_len);
+  ss = stack->ss;
+  //LOG(INT, "Interrupt to inner privilege. ss=0x%x, esp=0x%x\n", ss, esp);
+  if ((ss & 0xfffc) == 0) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+  if ((ss & 3) != dpl) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+  if (!read_segment_cached(&stack->ss_e1, &stack->ss_e2, ss, true)) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+  ss_dpl = (stack->ss_e2 >> DESC_DPL_SHIFT) & 3;
+  if (ss_dpl != dpl) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+  if (!(stack->ss_e2 & DESC_S_MASK) ||
+      (stack->ss_e2 & DESC_CS_MASK) ||
+      !(stack->ss_e2 & DESC_W_MASK)) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+  if (!(stack->ss_e2 & DESC_P_MASK)) {
+    //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
+    raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+  }
+
+  /* As for gates, a stack segment in the LDT is not cached. */
+  watches = (ss & 0x4) ? 0 : desc_cache_watch(tss_ptr, tss_len);
+  if (watches) {
+    uint32_t ss_watches = desc_cache_watch(vcpu.gdt.base + (ss & ~7), 8);
+    watches = ss_watches ? watches | ss_watches : 0;
+  }
+  desc_cache_stack_insert(dpl, stack, watches);
+  return stack;
+}
+
+/* Interrupt delivery latency, with [1] and without [0] a cached gate. */
+static long long stats_num_intrs[2] = {0, 0};
+static uint64_t stats_intr_cycles[2] = {0, 0};
+
+/* Latency of [is_iret][to an outer level] returns. */
+static long long stats_num_rets[2][2];
+static uint64_t stats_ret_cycles[2][2];
+
+static void
+do_interrupt_protected(unsigned intno, int is_int, int error_code,
+		uint32_t next_eip, int is_hw)
+{
+  struct intr_gate const *gate;
+  struct intr_gate gate_buf;
+  struct ring_stack const *stack;
+  struct ring_stack stack_buf;
+  desc_table_t *dt;
+  target_ulong ssp;
+	unsigned type, dpl, selector, cpl;
+  int has_error_code, new_stack, shift;
+  uint32_t e1, e2, offset, ss, esp, ss_e1, ss_e2;
+  uint32_t old_eip, sp_mask, push_eflags;
+  uint64_t start = rdtsc();
+
+  segcache_sync(R_SS);
+
+  has_error_code = 0;
+  if (!is_int && !is_hw) {
+    switch(intno) {
+      case 8:
+      case 10:
+      case 11:
+      case 12:
+      case 13:
+      case 14:
+      case 17:
+        has_error_code = 1;
+        break;
+    }
+  }
+  if (is_int) {
+    old_eip = next_eip;
+  } else {
+    old_eip = (uint32_t)vcpu.eip;
+  }
+
+  dt = &vcpu.idt;
+  if (intno * 8 + 7 > dt->limit) {
+    raise_exception_err(EXCP0D_GPF, intno * 8 + 2);
+  }
+  cpl = vcpu.orig_segs[R_CS] & 3;
+  if (!(gate = desc_cache_gate_lookup(intno))) {
+    gate = intr_gate_read(intno, is_int, cpl, &gate_buf);
+  }
+  type = gate->type;
+  dpl = gate->dpl;
+  if (is_int && dpl < cpl) {
+    printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
+    raise_exception_err(EXCP0D_GPF, intno * 8 + 2);
+  }
+  selector = gate->selector;
+  offset = gate->offset;
+  e1 = gate->cs_e1;
+  e2 = gate->cs_e2;
+  dpl = (e2 >> DESC_DPL_SHIFT) & 3;
+  if (dpl > cpl) {
+    printf("%s() %d: raising #GPF.\n", __func__, __LINE__);
+    raise_exception_err(EXCP0D_GPF, selector & 0xfffc);
   }
   if (!(e2 & DESC_C_MASK) && dpl < cpl) {
     /* to inner priviledge */
-    get_ss_esp_from_tss(&ss, &esp, dpl);
-		//LOG(INT, "Interrupt to inner privilege. ss=0x%x, esp=0x%x\n", ss, esp);
-    if ((ss & 0xfffc) == 0) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
-    }
-    if ((ss & 3) != dpl) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
-    }
-    if (!read_segment(&ss_e1, &ss_e2, ss, false, true)) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
-    }
-    ss_dpl = (ss_e2 >> DESC_DPL_SHIFT) & 3;
-    if (ss_dpl != dpl) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
-    }
-    if (!(ss_e2 & DESC_S_MASK) ||
-        (ss_e2 & DESC_CS_MASK) ||
-        !(ss_e2 & DESC_W_MASK)) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
-    }
-    if (!(ss_e2 & DESC_P_MASK)) {
-      //printf("Calling raise_exception_err(0x%x).\n", EXCP0A_TSS);
-      raise_exception_err(EXCP0A_TSS, ss & 0xfffc);
+    if (!(stack = desc_cache_stack_lookup(dpl))) {
+      stack = ring_stack_read(dpl, &stack_buf);
     }
+    ss = stack->ss;
+    esp = stack->esp;
+    ss_e1 = stack->ss_e1;
+    ss_e2 = stack->ss_e2;
     new_stack = 1;
     sp_mask = get_sp_mask(ss_e2);
     ssp = get_seg_base(ss_e1, ss_e2);
@@ -824,23 +917,36 @@ do_interrupt_protected(unsigned intno, int is_int, int error_code,
   push_eflags = (vcpu.eflags & ~IF_MASK & ~IOPL_MASK) | ((vcpu.IF == 1)?IF_MASK:0)
 		| ((uint32_t)vcpu.IOPL << 12) | (vcpu.AC?AC_MASK:0);
   if (shift == 1) {
+    /* The frame, lowest address first, written with a single switch to the
+     * shadow page table unless it wraps around the stack segment. */
+    uint32_t frame[10];
+    int n = 0, i;
+
+    if (has_error_code) {
+      frame[n++] = error_code;
+    }
+    frame[n++] = old_eip;
+    frame[n++] = vcpu.orig_segs[R_CS];
+    frame[n++] = push_eflags;
     if (new_stack) {
+      frame[n++] = vcpu.regs[R_ESP];
+      frame[n++] = vcpu.orig_segs[R_SS];
       if (vcpu.eflags & VM_MASK) {
-        PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_GS]);
-        PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_FS]);
-        PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_DS]);
-        PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_ES]);
+        frame[n++] = vcpu.orig_segs[R_ES];
+        frame[n++] = vcpu.orig_segs[R_DS];
+        frame[n++] = vcpu.orig_segs[R_FS];
+        frame[n++] = vcpu.orig_segs[R_GS];
       }
-      PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_SS]);
-      PUSHL(ssp, esp, sp_mask, vcpu.regs[R_ESP]);
     }
-    PUSHL(ssp, esp, sp_mask, push_eflags);
-    PUSHL(ssp, esp, sp_mask, vcpu.orig_segs[R_CS]);
-    PUSHL(ssp, esp, sp_mask, old_eip);
-		//printf("%s(): pushed 0x%x at 0x%x\n", __func__, old_eip, esp);
-    if (has_error_code) {
-      PUSHL(ssp, esp, sp_mask, error_code);
+    esp -= n * 4;
+    if ((esp & sp_mask) + n * 4 - 1 <= sp_mask) {
+      stl_kernel_n(ssp + (esp & sp_mask), frame, n);
+    } else {
+      for (i = 0; i < n; i++) {
+        stl_kernel(ssp + ((esp + i * 4) & sp_mask), frame[i]);
+      }
     }
+		//printf("%s(): pushed 0x%x at 0x%x\n", __func__, old_eip, esp);
   } else {
     if (new_stack) {
       if (vcpu.eflags & VM_MASK) {
@@ -889,6 +995,30 @@ do_interrupt_protected(unsigned intno, int is_int, int error_code,
     vcpu.IF = 0;
   }
   vcpu.eflags &= ~(TF_MASK | VM_MASK | RF_MASK | NT_MASK);
+
+  stats_num_intrs[gate != &gate_buf]++;
+  stats_intr_cycles[gate != &gate_buf] += rdtsc() - start;
+}
+
+void
+intr_print_stats(void)
+{
+  printf("MON-STATS: interrupts: %lld delivered with cached gates, "
+      "%llu cycles avg; %lld without, %llu cycles avg.\n", stats_num_intrs[1],
+      stats_num_intrs[1] ? stats_intr_cycles[1] / stats_num_intrs[1] : 0,
+      stats_num_intrs[0],
+      stats_num_intrs[0] ? stats_intr_cycles[0] / stats_num_intrs[0] : 0);
+  printf("MON-STATS: returns: %lld irets to the same level, %llu cycles avg; "
+      "%lld to an outer level, %llu cycles avg.\n", stats_num_rets[1][0],
+      stats_num_rets[1][0] ? stats_ret_cycles[1][0] / stats_num_rets[1][0] : 0,
+      stats_num_rets[1][1],
+      stats_num_rets[1][1] ? stats_ret_cycles[1][1] / stats_num_rets[1][1] : 0);
+  printf("MON-STATS: returns: %lld lrets to the same level, %llu cycles avg; "
+      "%lld to an outer level, %llu cycles avg.\n", stats_num_rets[0][0],
+      stats_num_rets[0][0] ? stats_ret_cycles[0][0] / stats_num_rets[0][0] : 0,
+      stats_num_rets[0][1],
+      stats_num_rets[0][1] ? stats_ret_cycles[0][1] / stats_num_rets[0][1] : 0);
+  desc_cache_print_stats();
 }
 
 static void
@@ -1047,6 +1177,9 @@ ret_protected(int is_iret, int addend)
   uint32_t e1, e2, ss_e1, ss_e2;
   unsigned cpl, dpl, rpl, iopl;
   target_ulong ssp, sp, new_eip, new_esp, sp_mask;
+  uint32_t frame[5];
+  int n_frame = 0;
+  uint64_t start = rdtsc();
   int shift = 1; //XXX
 
   segcache_sync(R_SS);
@@ -1056,15 +1189,35 @@ ret_protected(int is_iret, int addend)
   new_eflags = 0; /* avoid warning */
   if (shift == 1) {
     /* 32 bits */
-    POPL(ssp, sp, sp_mask, new_eip);
-    POPL(ssp, sp, sp_mask, new_cs);
+    n_frame = is_iret ? 3 : 2;
+    if ((sp & sp_mask) + n_frame * 4 - 1 <= sp_mask) {
+      /* Read the outer esp and ss of an iret too, if they are on the same
+       * page, so that a return to user mode needs a single page table
+       * switch. They are not used if the return is to the same level. */
+      if (   is_iret && addend == 0
+          && (sp & sp_mask) + 5 * 4 - 1 <= sp_mask
+          && ((ssp + (sp & sp_mask)) & PGMASK) <= PGSIZE - 5 * 4) {
+        n_frame = 5;
+      }
+      ldl_kernel_n(ssp + (sp & sp_mask), frame, n_frame);
+      new_eip = frame[0];
+      new_cs = frame[1];
+      if (is_iret) {
+        new_eflags = frame[2];
+      }
+      sp += (is_iret ? 3 : 2) * 4;
+    } else {
+      n_frame = 0;
+      POPL(ssp, sp, sp_mask, new_eip);
+      POPL(ssp, sp, sp_mask, new_cs);
+      if (is_iret) {
+        POPL(ssp, sp, sp_mask, new_eflags);
+      }
+    }
     //printf("new_cs=0x%x\n", new_cs);
     new_cs &= 0xffff;
-    if (is_iret) {
-      POPL(ssp, sp, sp_mask, new_eflags);
-      if (new_eflags & VM_MASK) {
-        goto return_to_vm86;
-      }
+    if (is_iret && (new_eflags & VM_MASK)) {
+      goto return_to_vm86;
     }
   } else {
     /* 16 bits */
@@ -1077,7 +1230,7 @@ ret_protected(int is_iret, int addend)
   if ((new_cs & 0xfffc) == 0) {
     raise_exception_err(EXCP0D_GPF, new_cs & 0xfffc);
   }
-  if (!read_segment(&e1, &e2, new_cs, false, true)) {
+  if (!read_segment_cached(&e1, &e2, new_cs, true)) {
     raise_exception_err(EXCP0D_GPF, new_cs & 0xfffc);
   }
   if (!(e2 & DESC_S_MASK) ||
@@ -1112,7 +1265,11 @@ ret_protected(int is_iret, int addend)
         e2);
   } else {
     /* return to different privilege level */
-    if (shift == 1) {
+    if (n_frame == 5) {
+      new_esp = frame[3];
+      new_ss = frame[4] & 0xffff;
+      sp += 2 * 4;
+    } else if (shift == 1) {
       /* 32 bits */
       POPL(ssp, sp, sp_mask, new_esp);
       POPL(ssp, sp, sp_mask, new_ss);
@@ -1131,7 +1288,7 @@ ret_protected(int is_iret, int addend)
       if ((new_ss & 3) != rpl) {
         raise_exception_err(EXCP0D_GPF, new_ss & 0xfffc);
       }
-      if (!read_segment(&ss_e1, &ss_e2, new_ss, false, true)) {
+      if (!read_segment_cached(&ss_e1, &ss_e2, new_ss, true)) {
         printf("%s() %d:\n", __func__, __LINE__);
         raise_exception_err(EXCP0D_GPF, new_ss & 0xfffc);
       }
@@ -1201,6 +1358,8 @@ ret_protected(int is_iret, int addend)
       vcpu.AC = (new_eflags >> AC_SHIFT) & 1;
     }
   }
+  stats_num_rets[is_iret][rpl != cpl]++;
+  stats_ret_cycles[is_iret][rpl != cpl] += rdtsc() - start;
 
 	//printf("%s(): exiting. eip=%p, esp=%x\n", __func__, vcpu.eip, vcpu.regs[R_ESP]);
   return;
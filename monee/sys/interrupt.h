@@ -102,5 +102,6 @@ void iret_protected(void);
 
 void do_interrupt(unsigned intno, int is_int, int error_code, uint32_t next_eip,
     int is_hw);
+void intr_print_stats(void);
 
 #endif /* threads/interrupt.h */
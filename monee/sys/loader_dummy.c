@@ -24,3 +24,4 @@ char shadow_pagedir_sync;
 int vcpu_get_privilege_level(void) {return 0;}
 char rr_log_vcpu_state;
 char pde_error, pte_error, phys_map_install_page;
+char jumptable1_rstack_clear;
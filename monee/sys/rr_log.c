@@ -38,6 +38,23 @@
 #ifndef REPLAY_DISK
 #define REPLAY_DISK QEMU:replay.dsk
 #endif
+
+/* Define RR_LOG_COMPRESS (in RR_FLAGS) to write and read the logs as
+ * block-framed LZ, see lib/lz.h. QEMU decompresses them in block-fifo.c and
+ * when it opens a replay log. */
+
+/* Compression stats categories, see file_set_tag(). */
+enum {
+  RR_LOG_STATS_MS,
+  RR_LOG_STATS_IN,
+  RR_LOG_STATS_INS,
+  RR_LOG_STATS_INTR,
+  RR_LOG_STATS_END,
+  RR_LOG_STATS_NUM
+};
+static char const *rr_log_stats_names[RR_LOG_STATS_NUM] = {
+  "MS", "IN", "INS", "INTR", "PANC/EXIT",
+};
 extern size_t ram_pages;
 
 static vcpu_t vcpu_copy;
@@ -52,19 +69,106 @@ static uint64_t prev_n_exec;
 
 target_ulong rr_log_panic_eip = 0;
 
+/* Index of the replay log: the header offsets of every MS entry and of every
+ * replay_index_stride-th entry, in log order. It is filled in as the log is
+ * read, so it covers the part of the log replayed so far, and lets
+ * replay_log_seek() find a machine state without reading the log from the
+ * start. When the index is full, every other entry is dropped and the stride
+ * doubles; the remaining MS entries are still valid places to start from. */
+#define REPLAY_INDEX_SIZE 4096
+#define REPLAY_INDEX_STRIDE 256
+static struct replay_index_entry {
+  off_t offset;
+  uint64_t n_exec;
+  char tag[8];
+} replay_index[REPLAY_INDEX_SIZE];
+static size_t replay_index_len = 0;
+static unsigned replay_index_stride = REPLAY_INDEX_STRIDE;
+static unsigned replay_index_skipped = 0;
+
 /* Helper functions. */
 static void rr_callbacks(char const *tag, bool replay);
+static void replay_index_add(off_t offset, uint64_t n_exec, char const *tag);
 
 static void
 read_next_tag(void) {
   int num_read;
   uint32_t dummy;
 	uint32_t last_entry_size;
+  off_t offset = ftello(vcpu.replay_log);
   num_read = replay_log_scanf("%[^:]: %016llx %08lx %08x:", last_entry_tag,
         &vcpu.replay_last_entry_n_exec, &last_entry_size, &dummy);
   ASSERT(strlen(last_entry_tag)<sizeof(last_entry_tag));
   last_entry_tell = replay_log_tell();
   ASSERT(num_read == 4);
+  replay_index_add(offset, vcpu.replay_last_entry_n_exec, last_entry_tag);
+}
+
+static void
+replay_index_add(off_t offset, uint64_t n_exec, char const *tag)
+{
+  size_t i;
+
+  if (replay_index_len && offset <= replay_index[replay_index_len - 1].offset) {
+    /* Read again after a seek; already indexed. */
+    return;
+  }
+  if (strcmp(tag, "MS") && ++replay_index_skipped < replay_index_stride) {
+    return;
+  }
+  replay_index_skipped = 0;
+  if (replay_index_len == REPLAY_INDEX_SIZE) {
+    for (i = 0; 2 * i < REPLAY_INDEX_SIZE; i++) {
+      replay_index[i] = replay_index[2 * i];
+    }
+    replay_index_len = i;
+    replay_index_stride *= 2;
+  }
+  replay_index[replay_index_len].offset = offset;
+  replay_index[replay_index_len].n_exec = n_exec;
+  strlcpy(replay_index[replay_index_len].tag, tag,
+      sizeof replay_index[replay_index_len].tag);
+  replay_index_len++;
+}
+
+/* Forgets the index. Must be called when the log is about to be rewritten. */
+void
+replay_log_index_clear(void)
+{
+  replay_index_len = 0;
+  replay_index_skipped = 0;
+  replay_index_stride = REPLAY_INDEX_STRIDE;
+}
+
+/* Positions the replay log at the header of the last indexed TAG entry at or
+ * before N_EXEC that starts before LIMIT, so that the next read_next_tag()
+ * reads it. Every MS entry read so far is indexed (until the index thins
+ * out). Returns false, leaving the log where it is, if there is none. */
+bool
+replay_log_seek(uint64_t n_exec, char const *tag, off_t limit)
+{
+  size_t lo = 0, hi = replay_index_len;
+  int seek;
+
+  ASSERT(vcpu.replay_log);
+  /* The first entry past N_EXEC or LIMIT. */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (   replay_index[mid].n_exec <= n_exec
+        && replay_index[mid].offset < limit) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  while (lo-- > 0) {
+    if (!strcmp(replay_index[lo].tag, tag)) {
+      seek = fseeko(vcpu.replay_log, replay_index[lo].offset, SEEK_SET);
+      ASSERT(seek == 0);
+      return true;
+    }
+  }
+  return false;
 }
 
 uint64_t
@@ -80,6 +184,29 @@ record_log_tell(void)
   return ftello(vcpu.record_log);
 }
 
+void
+replay_log_get_pos(struct replay_log_pos *pos)
+{
+  ASSERT(vcpu.replay_log);
+  pos->offset = ftello(vcpu.replay_log);
+  strlcpy(pos->last_entry_tag, last_entry_tag, sizeof pos->last_entry_tag);
+  pos->last_entry_tell = last_entry_tell;
+  pos->last_entry_n_exec = vcpu.replay_last_entry_n_exec;
+}
+
+void
+replay_log_set_pos(struct replay_log_pos const *pos)
+{
+  int seek;
+
+  ASSERT(vcpu.replay_log);
+  seek = fseeko(vcpu.replay_log, pos->offset, SEEK_SET);
+  ASSERT(seek == 0);
+  strlcpy(last_entry_tag, pos->last_entry_tag, sizeof last_entry_tag);
+  last_entry_tell = pos->last_entry_tell;
+  vcpu.replay_last_entry_n_exec = pos->last_entry_n_exec;
+}
+
 int
 replay_log_scanf(char const *format, ...)
 {
@@ -142,6 +269,9 @@ rr_log_identify_disks(void)
 		int seek;
     /* hdb is present. Use record mode. */
     vcpu.record_log = fopen(record_log_disk, "rw");
+#ifdef RR_LOG_COMPRESS
+    file_set_compress(vcpu.record_log);
+#endif
 		seek = fseeko(vcpu.record_log, record_log_disk_begin, SEEK_SET);
 		ASSERT(seek == 0);
     ASSERT(vcpu.record_log);
@@ -158,6 +288,9 @@ rr_log_identify_disks(void)
         disk_size(replay_log_disk));
     vcpu.replay_log = fopen(replay_log_disk, "rw");
     ASSERT(vcpu.replay_log);
+#ifdef RR_LOG_COMPRESS
+    file_set_compress(vcpu.replay_log);
+#endif
   }
 }
 
@@ -350,6 +483,7 @@ replay_log_mem_cmp(void *buf, size_t count)
     vcpu.n_exec = vcpu.replay_last_entry_n_exec;                              \
   } else {                                                                    \
     eip_virt = vcpu_get_eip();                                                \
+    file_set_tag(vcpu.record_log, RR_LOG_STATS_MS);                           \
     func("MS:  %016llx %08lx %08x:", prefix cur_n_exec, prefix len, 0);       \
     ms_start = rr##_log_tell();                                               \
     func(" %#x:", eip);                                         							\
@@ -453,6 +587,7 @@ rr_log_lockstep_mode(void)
   } else {                                                                    \
     target_ulong eip_virt;                                          					\
     eip_virt = vcpu_get_eip();                                                \
+    file_set_tag(vcpu.record_log, RR_LOG_STATS_INTR);                         \
     record_log_printf("INTR:%016llx %08lx %08x:", vcpu.n_exec, len, 0);       \
     intr_start = record_log_tell();                                           \
     rr##_log_printf(" %#x:", vcpu.eip);                         							\
@@ -522,7 +657,7 @@ rr_log_vcpu_state(int n_exec)
       if (vcpu.a20_mask == 0xffffffff) {
         paging_enable_a20();
       }
-      vcpu.edge = 2;
+      vcpu.edge = TB_EDGE_NONE;
       clear_fcallout_patches();
       //XXX deal with other orig elements: idt, gdt, etc...
 		} else {
@@ -676,6 +811,7 @@ record_log_finish(char const *tag)
   ASSERT(cur_n_exec <= vcpu.n_exec);
 	vcpu.n_exec = cur_n_exec;
   //record_log_printf("PANC:%016llx %08lx %08x:", cur_n_exec, 512, 0);
+  file_set_tag(vcpu.record_log, RR_LOG_STATS_END);
   record_log_printf("%s:%016llx %08lx %08x:", tag, vcpu.n_exec, 512, 0);
   for (i = 0; i < 1024; i++) {
     record_log_printf("%c", '0');
@@ -691,6 +827,27 @@ record_log_finish(char const *tag)
 	*/
 }
 
+void
+rr_log_print_stats(void)
+{
+  /* After micro-replay the record log may be open as the replay log. */
+  FILE const *log = vcpu.record_log ? vcpu.record_log : vcpu.replay_log;
+  int i;
+
+  if (!log || !log->compress) {
+    return;
+  }
+  for (i = 0; i < RR_LOG_STATS_NUM; i++) {
+    if (!log->stats_raw[i]) {
+      continue;
+    }
+    printf("MON-STATS: record log %s: %llu bytes compressed to %lld (%llu%%), "
+        "%llu cycles/KB.\n", rr_log_stats_names[i], log->stats_raw[i],
+        log->stats_comp[i], log->stats_comp[i] * 100 / log->stats_raw[i],
+        log->stats_cycles[i] * 1024 / log->stats_raw[i]);
+  }
+}
+
 void
 record_log_panic(void)
 {
@@ -717,6 +874,7 @@ record_log_shutdown(void)
 				vcpu.replay_last_entry_n_exec, vcpu.n_exec, cur_n_exec); */           \
     ASSERT(!strcmp(last_entry_tag, "IN"));                                    \
   } else {                                                                    \
+    file_set_tag(vcpu.record_log, RR_LOG_STATS_IN);                           \
     func("IN:  %016llx %08lx", prefix cur_n_exec, prefix len);                \
     func(" %08hx", prefix rport);                                             \
     func(":");                                                                \
@@ -763,6 +921,7 @@ record_log_shutdown(void)
   } else {                                                                    \
     uint64_t cur_n_exec;                                                      \
     cur_n_exec = get_n_exec(vcpu.callout_next);                               \
+    file_set_tag(vcpu.record_log, RR_LOG_STATS_INS);                          \
     func("INS: %016llx %08lx", prefix cur_n_exec, prefix len);                \
     func(" %08hx", prefix rport);                                             \
     func(":");                                                                \
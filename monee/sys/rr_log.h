@@ -16,9 +16,23 @@ void record_log_flush(void);
 void record_log_panic(void);
 void record_log_shutdown(void);
 void record_log_finish(char const *tag);
+void rr_log_print_stats(void);
 uint64_t replay_log_tell(void);
 uint64_t record_log_tell(void);
 
+/* A position in the replay log, including the header of the next entry,
+ * which has already been read. */
+struct replay_log_pos {
+  off_t offset;
+  char last_entry_tag[16];
+  uint64_t last_entry_tell;
+  uint64_t last_entry_n_exec;
+};
+void replay_log_get_pos(struct replay_log_pos *pos);
+void replay_log_set_pos(struct replay_log_pos const *pos);
+bool replay_log_seek(uint64_t n_exec, char const *tag, off_t limit);
+void replay_log_index_clear(void);
+
 void rr_log_vcpu_state(int n_exec);
 
 struct FILE;
@@ -71,8 +71,9 @@ uint64_t
 get_n_exec(const void *tc_ptr)
 {
   tb_t const *tb;
-  int cur_pos;
-	unsigned i;
+  unsigned i, n, cur_pos, part_end;
+  uint16_t tc;
+  uint8_t eip;
   ASSERT(vcpu.record_log || vcpu.replay_log);
 
   if (!tc_ptr || !(tb = tb_find(tc_ptr))) {
@@ -82,22 +83,26 @@ get_n_exec(const void *tc_ptr)
   if (tc_ptr == tb->tc_ptr) {
     return vcpu.n_exec;
   }
-  cur_pos = -1;
-  for (i = 0; i < tb->num_insns; i++) {
-    if (tb->tc_ptr + tb->tc_boundaries[i] >= (uint8_t *)tc_ptr) {
-      cur_pos = i;
-      break;
-    }
+  /* The first insn whose translation starts at or after tc_ptr. */
+  n = tb_find_tc_boundary(tb, (uint8_t const *)tc_ptr - tb->tc_ptr - 1, &tc,
+      &eip);
+  cur_pos = (tb->tc_ptr + tc >= (uint8_t const *)tc_ptr)?n:n + 1;
+  if (cur_pos >= tb->num_insns) {
+    printf("tc_ptr=%p, tb->tc_ptr=%p, tb->num_insns=%d\n", tc_ptr, tb->tc_ptr,
+        (int)tb->num_insns);
   }
-  if (cur_pos == -1) {
-    printf("tc_ptr=%p\n", tc_ptr);
-    for (i = 0; i <= tb->num_insns; i++) {
-      printf("tb->tc_ptr[%d]=%p\n", i, tb->tc_ptr + tb->tc_boundaries[i]);
+  ASSERT(cur_pos < tb->num_insns);
+  /* vcpu.n_exec already counts the insns up to the end of the current part
+   * (see tb_t.part_starts). */
+  part_end = tb->num_insns;
+  for (i = cur_pos; i < tb->num_insns; i++) {
+    if (tb->part_starts & (1 << i)) {
+      part_end = i;
+      break;
     }
   }
-  ASSERT(cur_pos != -1);
-  ASSERT(vcpu.n_exec >= tb->num_insns);
-  return (vcpu.n_exec - tb->num_insns + cur_pos);
+  ASSERT(vcpu.n_exec >= part_end);
+  return (vcpu.n_exec - part_end + cur_pos);
 }
 
 void
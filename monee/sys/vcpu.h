@@ -5,7 +5,9 @@
 #include <stdio.h>
 #include <lib/types.h>
 #include "hw/i8259.h"
+#include "mem/kmap.h"
 #include "mem/pt_mode.h"
+#include "mem/snapshot.h"
 #include "peep/insntypes.h"
 #include "sys/interrupt.h"
 #include "sys/loader.h"
@@ -121,7 +123,7 @@ typedef struct vcpu_t {
 
   /* Direct jump chaining. */
   uint8_t *prev_tb;
-  unsigned long edge;
+  unsigned long edge;         /* edge of prev_tb, or TB_EDGE_NONE. */
 
 	/* Emulated I/O devices. */
 	struct PicState2 isa_pic;
@@ -156,6 +158,7 @@ typedef struct vcpu_t {
 
   /* interrupt handling. */
   int interrupt_request;
+  uint32_t irq_pending;         /* Tested at back-edges with IRQ_POLL. */
 
   /* callouts and funcs. */
   void (*tc_label)(void);
@@ -255,13 +258,20 @@ extern struct BlockDriverState *hda_bdrv, *hdb_bdrv, swap_bdrv,
 
 #define ld_kernel(ptr, type, suffix)  ({																			\
 		type ret;																																	\
+		target_ulong vaddr_ = (target_ulong)(ptr);																\
+		type *kaddr_;																															\
 		pt_mode_t pt_mode;																												\
 		/* ld_kernel may cause a TRACED page fault. Hence, it should always				\
 		 * execute at cpl 3. */																										\
 		ASSERT(read_cpl() == 3);																									\
-		pt_mode = switch_to_shadow(0);																						\
-		ret = ld(ptr, type, suffix);																							\
-		switch_pt(pt_mode);																												\
+		kaddr_ = kmap_kernel(vaddr_, sizeof(type));																\
+		if (kaddr_) {																															\
+			ret = *kaddr_;																													\
+		} else {																																	\
+			pt_mode = switch_to_shadow(0);																					\
+			ret = ld(vaddr_, type, suffix);																					\
+			switch_pt(pt_mode);																											\
+		}																																					\
 		ret;																																			\
 		})
 
@@ -275,7 +285,8 @@ extern struct BlockDriverState *hda_bdrv, *hdb_bdrv, swap_bdrv,
 		switch_pt(pt_mode);																												\
 		})
 
-#define ld_phys(ptr, type, suffix)  ({																				\
+/* Accesses guest-physical memory by switching to phys_map. */
+#define ld_phys_map(ptr, type, suffix)  ({																		\
 		type ret;																																	\
 		pt_mode_t pt_mode;																												\
 		pt_mode = switch_to_phys();																								\
@@ -284,13 +295,39 @@ extern struct BlockDriverState *hda_bdrv, *hdb_bdrv, swap_bdrv,
 		ret;																																			\
 		})
 
-#define st_phys(ptr, val, type, suffix)  ({																		\
+#define st_phys_map(ptr, val, type, suffix)  ({																\
 		pt_mode_t pt_mode;																												\
 		pt_mode = switch_to_phys();																								\
 		st(ptr, val, type, suffix);																								\
 		switch_pt(pt_mode);																												\
 		})
 
+/* Accesses guest-physical memory through the kmap window, or through
+ * phys_map if the window cannot map it (see mem/kmap.h). */
+#define ld_phys(ptr, type, suffix)  ({																				\
+		type ret;																																	\
+		target_phys_addr_t paddr_ = (target_phys_addr_t)(ptr);										\
+		type *kaddr_ = kmap_phys(paddr_, sizeof(type));														\
+		if (kaddr_) {																															\
+			ret = *kaddr_;																													\
+		} else {																																	\
+			ret = ld_phys_map(paddr_, type, suffix);																\
+		}																																					\
+		ret;																																			\
+		})
+
+#define st_phys(ptr, val, type, suffix)  ({																		\
+		target_phys_addr_t paddr_ = (target_phys_addr_t)(ptr);										\
+		type *kaddr_;																															\
+		snapshot_note_write(paddr_, sizeof(type));																\
+		kaddr_ = kmap_phys(paddr_, sizeof(type));																	\
+		if (kaddr_) {																															\
+			*kaddr_ = (val);																												\
+		} else {																																	\
+			st_phys_map(paddr_, val, type, suffix);																	\
+		}																																					\
+		})
+
 static inline uint32_t
 ldub(target_ulong ptr) {
 	return ld(ptr, uint8_t, b);
@@ -316,13 +353,52 @@ stl(target_ulong ptr, uint32_t val)	{
 	st(ptr, val, uint32_t, l);
 }
 
+/* Loads N values from consecutive guest addresses from PTR into VALS through
+ * the kmap window if they are in one page the shadow already maps, or else
+ * with a single switch to the shadow page table. */
+#define ld_kernel_n(ptr, vals, n, type, suffix)  ({														\
+		pt_mode_t pt_mode;																												\
+		target_ulong ptr_ = (target_ulong)(ptr);																	\
+		type *kaddr_;																															\
+		int i_;																																		\
+		ASSERT(read_cpl() == 3);																									\
+		kaddr_ = kmap_kernel(ptr_, (n) * sizeof(type));														\
+		if (kaddr_) {																															\
+			for (i_ = 0; i_ < (n); i_++) {																					\
+				(vals)[i_] = kaddr_[i_];																							\
+			}																																				\
+		} else {																																	\
+			pt_mode = switch_to_shadow(0);																					\
+			for (i_ = 0; i_ < (n); i_++) {																					\
+				(vals)[i_] = ld(ptr_ + i_ * sizeof(type), type, suffix);							\
+			}																																				\
+			switch_pt(pt_mode);																											\
+		}																																					\
+		})
+
+/* Stores the N values at VALS to consecutive guest addresses from PTR with a
+ * single switch to the shadow page table. */
+#define st_kernel_n(ptr, vals, n, type, suffix)  ({														\
+		pt_mode_t pt_mode;																												\
+		target_ulong ptr_ = (target_ulong)(ptr);																	\
+		int i_;																																		\
+		ASSERT(read_cpl() == 3);																									\
+		pt_mode = switch_to_shadow(0);																						\
+		for (i_ = 0; i_ < (n); i_++) {																						\
+			st(ptr_ + i_ * sizeof(type), (vals)[i_], type, suffix);									\
+		}																																					\
+		switch_pt(pt_mode);																												\
+		})
+
 #define ldub_kernel(ptr) 			ld_kernel(ptr, uint8_t, b)
 #define lduw_kernel(ptr) 			ld_kernel(ptr, uint16_t, w)
 #define ldl_kernel(ptr) 			ld_kernel(ptr, uint32_t, l)
+#define ldl_kernel_n(ptr, vals, n) 	ld_kernel_n(ptr, vals, n, uint32_t, l)
 
 #define stb_kernel(ptr, val) 	st_kernel(ptr, val, uint8_t, b)
 #define stw_kernel(ptr, val) 	st_kernel(ptr, val, uint16_t, w)
 #define stl_kernel(ptr, val) 	st_kernel(ptr, val, uint32_t, l)
+#define stl_kernel_n(ptr, vals, n) 	st_kernel_n(ptr, vals, n, uint32_t, l)
 
 #define ldub_phys(ptr) 				ld_phys(ptr, uint8_t, b)
 #define lduw_phys(ptr) 				ld_phys(ptr, uint16_t, w)
@@ -24,11 +24,15 @@
 #include <aio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <signal.h>
 #include <assert.h>
 #include <execinfo.h>
 #include "vl.h"
 #include "block_int.h"
 #include "mdbg.h"
+#include "rr_lz.h"
 
 #define ASSERT assert
 
@@ -41,19 +45,76 @@ static uint8_t cur_buffer[512];
 static int64_t cur_offset = 0;
 static BlockDriverState *cur_write_state = NULL;
 
+/* A compressed log (see rr_lz.h) is written as one frame per slot, and each
+ * frame is rewritten from its first sector whenever the log is flushed. The
+ * reader at the other end of the fifo gets the decompressed log instead. */
+static int frame_mode = 0;
+static int64_t frame_slot = -1;
+static size_t frame_filled;             /* bytes of the slot received. */
+static int frame_emitted;               /* raw bytes passed to the fifo. */
+static uint8_t frame_buf[RR_LZ_SLOT_SIZE];
+static uint8_t frame_raw[RR_LZ_BLOCK_SIZE];
+
+/* Output is gathered in a buffer of fifo_buffer_size bytes (0 writes
+ * through) and passed on once FIFO_FLUSH_BYTES are pending, once the oldest
+ * pending byte is FIFO_FLUSH_MS old, on bdrv_flush() and on SIGHUP. Input is
+ * read FIFO_READ_SIZE bytes at a time. */
+#define FIFO_BUFFER_SIZE (1 << 20)
+#define FIFO_FLUSH_BYTES (256 << 10)
+#define FIFO_FLUSH_MS 10
+#define FIFO_READ_SIZE (256 << 10)
+
+static size_t fifo_buffer_size = FIFO_BUFFER_SIZE;
+
 typedef struct BDRVFifoState {
     int fd;
     int flags;
+
+    uint8_t *out_buf;
+    size_t out_len;
+    int64_t out_since;          /* ms time of the oldest pending byte. */
+
+    uint8_t *in_buf;
+    size_t in_pos, in_len;
+
+    uint64_t num_syscalls;
+    uint64_t num_bytes;
 } BDRVFifoState;
 
 static void fifo_flush(BlockDriverState *bs);
+static void fifo_drain(BDRVFifoState *s);
 
 static void hup_handler(int sig)
 {
-  fifo_flush(cur_write_state);
+  if (cur_write_state) {
+    fifo_flush(cur_write_state);
+  }
   exit(0);
 }
 
+static int64_t
+fifo_time_ms(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+#ifndef QEMU_TOOL
+/* Keeps the reader from waiting on output that sits in the buffer while the
+ * guest does not write. */
+static int fifo_poll(void *opaque)
+{
+  BDRVFifoState *s = ((BlockDriverState *)opaque)->opaque;
+
+  if (s->out_len && fifo_time_ms() - s->out_since >= FIFO_FLUSH_MS) {
+    fifo_drain(s);
+  }
+  return 0;
+}
+#endif
+
 static int fifo_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVFifoState *s = bs->opaque;
@@ -74,7 +135,21 @@ static int fifo_open(BlockDriverState *bs, const char *filename, int flags)
     }
     s->fd = fd;
     s->flags = flags;
+    s->out_buf = NULL;
+    s->out_len = 0;
+    s->in_buf = NULL;
+    s->in_pos = s->in_len = 0;
+    s->num_syscalls = 0;
+    s->num_bytes = 0;
+    if (fifo_buffer_size) {
+      s->out_buf = qemu_malloc(fifo_buffer_size);
+      s->in_buf = qemu_malloc(FIFO_READ_SIZE);
+      ASSERT(s->out_buf && s->in_buf);
+    }
     signal(SIGHUP, hup_handler);
+#ifndef QEMU_TOOL
+    qemu_add_polling_cb(fifo_poll, bs);
+#endif
     return 0;
 }
 
@@ -108,32 +183,153 @@ static int fifo_read(BlockDriverState *bs, int64_t offset,
   }
 
   do {
-    ret = read(s->fd, end - remaining, remaining);
-    if (ret != -1) {
+    if (s->in_pos < s->in_len) {
+      ret = MIN(remaining, s->in_len - s->in_pos);
+      memcpy(end - remaining, s->in_buf + s->in_pos, ret);
+      s->in_pos += ret;
       remaining -= ret;
+      continue;
+    }
+    /* Large requests go straight to the caller's buffer. */
+    if (!s->in_buf || remaining >= FIFO_READ_SIZE) {
+      ret = read(s->fd, end - remaining, remaining);
+      s->num_syscalls++;
+      if (ret != -1) {
+        remaining -= ret;
+      }
+      continue;
+    }
+    ret = read(s->fd, s->in_buf, FIFO_READ_SIZE);
+    s->num_syscalls++;
+    if (ret != -1) {
+      s->in_pos = 0;
+      s->in_len = ret;
     }
   } while (remaining);
 
   return count;
 }
 
+/* Writes out all of the IOVCNT buffers at IOV, which it modifies. */
 static void
-fifo_write_sector(BDRVFifoState *s, uint8_t const *buf)
+fifo_writev_all(BDRVFifoState *s, struct iovec *iov, int iovcnt)
 {
-  int remaining;
-  uint8_t const *end;
+  while (iovcnt) {
+    ssize_t ret;
 
-  remaining = 512;
-  end = buf + 512;
+    ret = writev(s->fd, iov, iovcnt);
+    s->num_syscalls++;
+    if (ret == -1) {
+      continue;
+    }
+    s->num_bytes += ret;
+    while (iovcnt && ret >= (ssize_t)iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = (uint8_t *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
 
-  do {
-    int ret;
+/* Writes out the pending output. */
+static void
+fifo_drain(BDRVFifoState *s)
+{
+  struct iovec iov;
 
-    ret = write(s->fd, end - remaining, remaining);
-    if (ret != -1) {
-      remaining -= ret;
+  if (!s->out_len) {
+    return;
+  }
+  iov.iov_base = s->out_buf;
+  iov.iov_len = s->out_len;
+  fifo_writev_all(s, &iov, 1);
+  s->out_len = 0;
+}
+
+static void
+fifo_write_bytes(BDRVFifoState *s, uint8_t const *buf, int len)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+
+  if (!len) {
+    return;
+  }
+  if (s->out_len + len <= fifo_buffer_size) {
+    if (!s->out_len) {
+      s->out_since = fifo_time_ms();
     }
-  } while (remaining);
+    memcpy(s->out_buf + s->out_len, buf, len);
+    s->out_len += len;
+    if (   s->out_len >= FIFO_FLUSH_BYTES
+        || fifo_time_ms() - s->out_since >= FIFO_FLUSH_MS) {
+      fifo_drain(s);
+    }
+    return;
+  }
+  /* Too big to buffer: write the pending output and BUF in one go. */
+  if (s->out_len) {
+    iov[iovcnt].iov_base = s->out_buf;
+    iov[iovcnt].iov_len = s->out_len;
+    iovcnt++;
+  }
+  iov[iovcnt].iov_base = (void *)buf;
+  iov[iovcnt].iov_len = len;
+  iovcnt++;
+  fifo_writev_all(s, iov, iovcnt);
+  s->out_len = 0;
+}
+
+static void
+fifo_write_sector(BDRVFifoState *s, uint8_t const *buf)
+{
+  fifo_write_bytes(s, buf, 512);
+}
+
+static int
+fifo_is_frame(int64_t offset, uint8_t const *buf)
+{
+  struct rr_lz_frame_header const *h = (void const *)buf;
+
+  return    offset % RR_LZ_SLOT_SECTORS == 0 && h->magic == RR_LZ_FRAME_MAGIC
+         && h->block == offset / RR_LZ_SLOT_SECTORS;
+}
+
+/* Collects the sectors of the current slot and passes the raw bytes of its
+ * frame that the fifo has not seen yet. */
+static void
+fifo_write_frame(BDRVFifoState *s, int64_t offset, uint8_t const *buf,
+    int nb_sectors)
+{
+  int64_t slot = offset / RR_LZ_SLOT_SECTORS;
+  size_t start = (offset % RR_LZ_SLOT_SECTORS) * 512;
+  size_t end = start + nb_sectors * 512;
+  int raw_len;
+
+  ASSERT(end <= RR_LZ_SLOT_SIZE);
+  if (slot != frame_slot) {
+    ASSERT(slot == frame_slot + 1 && start == 0);
+    frame_slot = slot;
+    frame_emitted = 0;
+  }
+  if (start == 0) {
+    frame_filled = 0;
+  }
+  ASSERT(start <= frame_filled);
+  memcpy(frame_buf + start, buf, end - start);
+  if (end > frame_filled) {
+    frame_filled = end;
+  }
+
+  raw_len = rr_lz_frame_decode(frame_buf, frame_filled, slot, frame_raw);
+  if (raw_len > frame_emitted) {
+    fifo_write_bytes(s, frame_raw + frame_emitted, raw_len - frame_emitted);
+    frame_emitted = raw_len;
+  }
 }
 
 static int
@@ -143,13 +339,20 @@ fifo_write(BlockDriverState *bs, int64_t offset,
   BDRVFifoState *s = bs->opaque;
   int count;
   uint8_t const *ptr;
-  int i;
 
   if (!cur_write_state) {
     cur_write_state = bs;
   }
   count = nb_sectors * 512;
   //printf("%s(): offset=%llx, cur_offset=%llx\n", __func__, offset, cur_offset);
+  if (offset == 0 && cur_offset == 0 && frame_slot == -1) {
+    frame_mode = fifo_is_frame(offset, buf);
+  }
+  if (frame_mode) {
+    fifo_write_frame(s, offset, buf, nb_sectors);
+    return 0;
+  }
+
   ASSERT(offset == cur_offset || offset == (cur_offset + 1));
   ASSERT(bs == cur_write_state);
 
@@ -182,12 +385,10 @@ fifo_write(BlockDriverState *bs, int64_t offset,
     cur_offset++;
   }
   ASSERT(offset == cur_offset);
-  ptr = buf;
-  for (i = 0; i < nb_sectors - 1; i++) {
-    fifo_write_sector(s, ptr);
-    ptr += 512;
-    cur_offset++;
-  }
+  /* All but the last sector are final; the last may be rewritten. */
+  ptr = buf + (nb_sectors - 1) * 512;
+  fifo_write_bytes(s, buf, ptr - buf);
+  cur_offset += nb_sectors - 1;
   memcpy(cur_buffer, ptr, 512);
 
 	return 0;
@@ -197,6 +398,16 @@ fifo_write(BlockDriverState *bs, int64_t offset,
 static void fifo_close(BlockDriverState *bs)
 {
     BDRVFifoState *s = bs->opaque;
+#ifndef QEMU_TOOL
+    qemu_del_polling_cb(fifo_poll, bs);
+#endif
+    fifo_drain(s);
+    qemu_free(s->out_buf);
+    qemu_free(s->in_buf);
+    s->out_buf = s->in_buf = NULL;
+    if (cur_write_state == bs) {
+      cur_write_state = NULL;
+    }
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
@@ -224,7 +435,11 @@ static int fifo_create(const char *filename, int64_t total_size,
 static void fifo_flush(BlockDriverState *bs)
 {
   BDRVFifoState *s = bs->opaque;
-  fifo_write_sector(s, cur_buffer);
+  if (!frame_mode) {
+    /* fifo_write_frame() holds nothing back. */
+    fifo_write_sector(s, cur_buffer);
+  }
+  fifo_drain(s);
 }
 
 static int64_t fifo_getlength(BlockDriverState *bs)
@@ -233,6 +448,20 @@ static int64_t fifo_getlength(BlockDriverState *bs)
   return 0xffffffff;
 }
 
+void bdrv_fifo_set_buffer_size(size_t size)
+{
+  fifo_buffer_size = size;
+}
+
+void bdrv_fifo_get_stats(BlockDriverState *bs, uint64_t *num_syscalls,
+    uint64_t *num_bytes)
+{
+  BDRVFifoState *s = bs->opaque;
+
+  *num_syscalls = s->num_syscalls;
+  *num_bytes = s->num_bytes;
+}
+
 BlockDriver bdrv_fifo = {
     "fifo",
     sizeof(BDRVFifoState),
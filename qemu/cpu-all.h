@@ -775,6 +775,9 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 
 #define VGA_DIRTY_FLAG  0x01
 #define CODE_DIRTY_FLAG 0x02
+/* Written since the replay checker last compared the page with the log
+   (see rr_log_cmp() in vl.c). */
+#define RR_DIRTY_FLAG   0x04
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -121,6 +121,9 @@ CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
 CPUReadMemoryFunc *io_mem_read[IO_MEM_NB_ENTRIES][4];
 void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 static int io_mem_nb;
+/* Stores to pages with memory monitors (see mdbg.h) go through this I/O
+ * slot, so that only they pay for the check. */
+static int io_mem_watch;
 
 /* log support */
 char *logfilename = "/tmp/qemu.log";
@@ -1473,6 +1476,11 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                 /* write access calls the I/O callback */
                 te->addr_write = vaddr | 
                     (pd & ~(TARGET_PAGE_MASK | IO_MEM_ROMD));
+            } else if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM &&
+                       num_memory_monitors > 0 &&
+                       memory_monitor_find(vaddr,
+                           (uint64_t)vaddr + TARGET_PAGE_SIZE) >= 0) {
+                te->addr_write = vaddr | io_mem_watch;
             } else if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM && 
                        !cpu_physical_memory_is_dirty(pd)) {
                 te->addr_write = vaddr | IO_MEM_NOTDIRTY;
@@ -1869,12 +1877,55 @@ static CPUWriteMemoryFunc *notdirty_mem_write[3] = {
     notdirty_mem_writel,
 };
 
+/* A store of SIZE bytes to a watched page. ADDR is the host address, as for
+ * notdirty_mem_write, which does the store itself. */
+static void watch_mem_write(target_phys_addr_t addr, uint32_t val, int size)
+{
+    CPUState *env = cpu_single_env;
+    target_ulong vaddr;
+    uint8_t old[4];
+
+    vaddr = (env->mem_write_vaddr & TARGET_PAGE_MASK) |
+        (addr & ~TARGET_PAGE_MASK);
+    memcpy(old, (uint8_t *)(long)addr, size);
+    notdirty_mem_write[size >> 1](NULL, addr, val);
+#if defined(TARGET_I386)
+    if (memory_monitor_find(vaddr, (uint64_t)vaddr + size) >= 0) {
+        cpu_x86_memory_monitor_hit(env, vaddr, old, (uint8_t *)(long)addr,
+                                   size);
+    }
+#endif
+}
+
+static void watch_mem_writeb(void *opaque, target_phys_addr_t addr, uint32_t val)
+{
+    watch_mem_write(addr, val, 1);
+}
+
+static void watch_mem_writew(void *opaque, target_phys_addr_t addr, uint32_t val)
+{
+    watch_mem_write(addr, val, 2);
+}
+
+static void watch_mem_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
+{
+    watch_mem_write(addr, val, 4);
+}
+
+static CPUWriteMemoryFunc *watch_mem_write_funcs[3] = {
+    watch_mem_writeb,
+    watch_mem_writew,
+    watch_mem_writel,
+};
+
 static void io_mem_init(void)
 {
     cpu_register_io_memory(IO_MEM_ROM >> IO_MEM_SHIFT, error_mem_read, unassigned_mem_write, NULL);
     cpu_register_io_memory(IO_MEM_UNASSIGNED >> IO_MEM_SHIFT, unassigned_mem_read, unassigned_mem_write, NULL);
     cpu_register_io_memory(IO_MEM_NOTDIRTY >> IO_MEM_SHIFT, error_mem_read, notdirty_mem_write, NULL);
     io_mem_nb = 5;
+    io_mem_watch = cpu_register_io_memory(0, error_mem_read,
+                                          watch_mem_write_funcs, NULL);
 
     /* alloc dirty bits array */
     phys_ram_dirty = qemu_vmalloc(phys_ram_size >> TARGET_PAGE_BITS);
@@ -2060,6 +2111,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
             /* ROM/RAM case */
             ptr = phys_ram_base + addr1;
             memcpy(ptr, buf, l);
+            phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |= RR_DIRTY_FLAG;
         }
         len -= l;
         buf += l;
@@ -2151,8 +2203,8 @@ uint32_t lduw_phys(target_phys_addr_t addr)
 }
 
 /* warning: addr must be aligned. The ram page is not masked as dirty
-   and the code inside is not invalidated. It is useful if the dirty
-   bits are used to track modified PTEs */
+   (but for RR_DIRTY_FLAG) and the code inside is not invalidated. It
+   is useful if the dirty bits are used to track modified PTEs */
 void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
 {
     int io_index;
@@ -2190,6 +2242,8 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         ptr = phys_ram_base + (pd & TARGET_PAGE_MASK) + 
             (addr & ~TARGET_PAGE_MASK);
         stl_p(ptr, val);
+        phys_ram_dirty[(pd & TARGET_PAGE_MASK) >> TARGET_PAGE_BITS] |=
+            RR_DIRTY_FLAG;
     }
 }
 
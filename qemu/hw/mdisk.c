@@ -6,6 +6,7 @@
 #include "vl.h"
 #include "mdbg.h"
 #include "block_int.h"
+#include "exec-all.h"
 
 #define IOBASE 0x2345
 #define SET_ADDR 0x123456
@@ -13,10 +14,49 @@
 #define START_TRANSFER 0x345678
 #define SET_BLOCK 0x456789
 #define SET_OP 0x56789a
+#define SET_RING 0x6789ab
+#define DOORBELL 0x789abc
 
 #define READ 0
 #define WRITE 1
 
+#define DISK_SECTOR_SIZE 512
+
+/* Descriptor ring, in guest RAM at the physical address given with SET_RING.
+ * The monitor fills in desc[prod % MDISK_RING_SIZE], sets its status to
+ * MDISK_PENDING, increments prod and writes DOORBELL. For every descriptor
+ * between cons and prod, qemu transfers the segments, in order, between
+ * guest RAM and consecutive sectors starting at BLOCK, asynchronously; then
+ * it sets the status (0, or a negative errno), increments done, and pulses
+ * ISA interrupt IRQ unless it is 0. Must match monee/devices/mdisk.c. */
+#define MDISK_RING_MAGIC 0x474e4952       /* "RING" */
+#define MDISK_RING_SIZE 32
+#define MDISK_MAX_SEGS 8
+#define MDISK_PENDING 1
+
+struct mdisk_seg {
+  uint32_t paddr;
+  uint32_t len;     /* bytes, a multiple of 512. */
+};
+
+struct mdisk_desc {
+  uint32_t op;
+  uint32_t block;
+  uint32_t n_segs;
+  int32_t status;
+  struct mdisk_seg segs[MDISK_MAX_SEGS];
+};
+
+struct mdisk_ring {
+  uint32_t magic;   /* set by qemu when it accepts the ring. */
+  uint32_t irq;
+  uint32_t prod;
+  uint32_t cons;
+  uint32_t done;
+  uint32_t pad[3];
+  struct mdisk_desc desc[MDISK_RING_SIZE];
+};
+
 static int cur_io_base = IOBASE;
 static int num_mdisk_devices = 0;
 
@@ -35,9 +75,155 @@ struct mdisk_struct
   uint32_t len;     /* length of data to be transferred. */
   uint32_t block;   /* block (sector) number on disk to transfer. */
 
-  enum { OP, ADDR, LEN, BLOCK, NONE } state;
+  struct mdisk_ring *ring;  /* in phys_ram_base, NULL if not set. */
+
+  enum { OP, ADDR, LEN, BLOCK, RING, NONE } state;
+};
+
+/* A descriptor in flight. */
+struct mdisk_req
+{
+  struct mdisk_struct *mdisk;
+  struct mdisk_desc *desc;
+  int pending;      /* segments not completed yet. */
+  int status;
 };
 
+/* Returns true if [PADDR, PADDR + LEN) is plain guest RAM, which is then at
+ * phys_ram_base + PADDR. */
+static int
+mdisk_ram_ok(uint32_t paddr, uint32_t len)
+{
+  uint64_t end = (uint64_t)paddr + len;
+
+  if (end > (uint64_t)ram_size) {
+    return 0;
+  }
+  /* The VGA and BIOS hole. */
+  return end <= 0xa0000 || paddr >= 0x100000;
+}
+
+/* Like cpu_physical_memory_rw(), after a transfer into guest RAM: drops the
+ * translated code of the pages and marks them dirty. */
+static void
+mdisk_ram_written(uint32_t paddr, uint32_t len)
+{
+  ram_addr_t addr;
+
+  for (addr = paddr & TARGET_PAGE_MASK; addr < paddr + len;
+       addr += TARGET_PAGE_SIZE) {
+    if (!cpu_physical_memory_is_dirty(addr)) {
+      tb_invalidate_phys_page_range(addr, addr + TARGET_PAGE_SIZE, 0);
+      phys_ram_dirty[addr >> TARGET_PAGE_BITS] |= (0xff & ~CODE_DIRTY_FLAG);
+    }
+  }
+}
+
+/* The ring is written behind the back of the softmmu too. */
+static void
+mdisk_ring_written(struct mdisk_struct *mdisk)
+{
+  mdisk_ram_written((uint8_t *)mdisk->ring - phys_ram_base,
+      sizeof *mdisk->ring);
+}
+
+static void
+mdisk_req_complete(struct mdisk_req *req)
+{
+  struct mdisk_ring *ring = req->mdisk->ring;
+  struct mdisk_desc *desc = req->desc;
+  uint32_t i;
+
+  if (desc->op == READ && req->status == 0) {
+    for (i = 0; i < desc->n_segs; i++) {
+      mdisk_ram_written(desc->segs[i].paddr, desc->segs[i].len);
+    }
+  }
+  desc->status = req->status;
+  ring->done++;
+  mdisk_ring_written(req->mdisk);
+  if (ring->irq) {
+    pic_set_irq(ring->irq, 1);
+    pic_set_irq(ring->irq, 0);
+  }
+  qemu_free(req);
+}
+
+static void
+mdisk_seg_done(void *opaque, int ret)
+{
+  struct mdisk_req *req = opaque;
+
+  if (ret < 0) {
+    req->status = ret;
+  }
+  if (--req->pending == 0) {
+    mdisk_req_complete(req);
+  }
+}
+
+/* Starts the transfers of DESC straight between guest RAM and the disk. */
+static void
+mdisk_submit(struct mdisk_struct *mdisk, struct mdisk_desc *desc)
+{
+  struct mdisk_req *req;
+  uint32_t block = desc->block, i;
+
+  req = qemu_mallocz(sizeof *req);
+  ASSERT(req);
+  req->mdisk = mdisk;
+  req->desc = desc;
+  /* Holds the request until all segments are submitted. */
+  req->pending = 1;
+
+  if (   (desc->op != READ && desc->op != WRITE)
+      || desc->n_segs > MDISK_MAX_SEGS) {
+    req->status = -EINVAL;
+    mdisk_seg_done(req, 0);
+    return;
+  }
+  for (i = 0; i < desc->n_segs; i++) {
+    struct mdisk_seg const *seg = &desc->segs[i];
+    uint8_t *ptr = phys_ram_base + seg->paddr;
+    BlockDriverAIOCB *acb;
+
+    if (   (seg->len % DISK_SECTOR_SIZE)
+        || !mdisk_ram_ok(seg->paddr, seg->len)) {
+      req->status = -EINVAL;
+      break;
+    }
+    req->pending++;
+    if (desc->op == READ) {
+      acb = bdrv_aio_read(mdisk->bs, block, ptr, seg->len / DISK_SECTOR_SIZE,
+          mdisk_seg_done, req);
+    } else {
+      acb = bdrv_aio_write(mdisk->bs, block, ptr, seg->len / DISK_SECTOR_SIZE,
+          mdisk_seg_done, req);
+    }
+    if (!acb) {
+      req->pending--;
+      req->status = -EIO;
+      break;
+    }
+    block += seg->len / DISK_SECTOR_SIZE;
+  }
+  mdisk_seg_done(req, 0);
+}
+
+static void
+mdisk_doorbell(struct mdisk_struct *mdisk)
+{
+  struct mdisk_ring *ring = mdisk->ring;
+
+  ASSERT(ring);
+  while (ring->cons != ring->prod) {
+    ASSERT(ring->prod - ring->cons <= MDISK_RING_SIZE);
+    mdisk_submit(mdisk, &ring->desc[ring->cons % MDISK_RING_SIZE]);
+    ring->cons++;
+  }
+  mdisk_ring_written(mdisk);
+}
+
 int
 mdisk_device_add(char *filename)
 {
@@ -94,7 +280,6 @@ mdisk_control_read(void *opaque, uint32_t addr)
 static void
 mdisk_control_write(void *opaque, uint32_t addr, uint32_t val)
 {
-#define DISK_SECTOR_SIZE 512
   struct mdisk_struct *mdisk;
   mdisk = (struct mdisk_struct *)opaque;
 	//printf("%s(): addr=0x%x, val=0x%x\n", __func__, addr, val);
@@ -110,6 +295,10 @@ mdisk_control_write(void *opaque, uint32_t addr, uint32_t val)
         mdisk->state = BLOCK;
 			} else if (val == SET_OP) {
 				mdisk->state = OP;
+      } else if (val == SET_RING) {
+        mdisk->state = RING;
+      } else if (val == DOORBELL) {
+        mdisk_doorbell(mdisk);
       } else if (val == START_TRANSFER) {
         size_t BUF_SIZE = 65536;
         char buffer[BUF_SIZE];
@@ -130,6 +319,8 @@ mdisk_control_write(void *opaque, uint32_t addr, uint32_t val)
                 txsize/DISK_SECTOR_SIZE);
           }
           mdisk->len -= txsize;
+          mdisk->ptr += txsize;
+          mdisk->block += txsize/DISK_SECTOR_SIZE;
         }
         ASSERT(mdisk->len == 0);
         mdisk->state = NONE;
@@ -149,6 +340,19 @@ mdisk_control_write(void *opaque, uint32_t addr, uint32_t val)
       mdisk->len = val;
       ASSERT((mdisk->len % DISK_SECTOR_SIZE) == 0);
       mdisk->state = NONE;
+      break;
+    case RING:
+      if (!mdisk_ram_ok(val, sizeof *mdisk->ring)) {
+        fprintf(stderr, "mdisk: ring at %#x is not in RAM.\n", val);
+        mdisk->ring = NULL;
+      } else {
+        mdisk->ring = (struct mdisk_ring *)(phys_ram_base + val);
+        mdisk->ring->cons = mdisk->ring->prod;
+        mdisk->ring->done = 0;
+        mdisk->ring->magic = MDISK_RING_MAGIC;
+        mdisk_ring_written(mdisk);
+      }
+      mdisk->state = NONE;
       break;
 		case OP:
 			mdisk->op = val;
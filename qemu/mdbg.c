@@ -9,3 +9,76 @@ FILE *mdbg_fp = NULL;
 int num_memory_monitors = 0;
 uint64_t memory_monitors[MAX_MEMORY_MONITORS];
 uint64_t prev_memory_monitor_value[MAX_MEMORY_MONITORS];
+
+/* memory_monitors[] is kept sorted, so that the watched addresses in a page
+ * or in the bytes of a store are found by binary search. */
+
+/* Returns the index of the first monitor at or above ADDR. */
+static int
+memory_monitor_lower_bound(uint64_t addr)
+{
+  int lo = 0, hi = num_memory_monitors;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (memory_monitors[mid] < addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Watches ADDR, whose current value is VALUE. Returns its index, or -1 if
+ * there are too many monitors. */
+int
+memory_monitor_add(uint64_t addr, uint64_t value)
+{
+  int i = memory_monitor_lower_bound(addr), j;
+
+  if (i < num_memory_monitors && memory_monitors[i] == addr) {
+    prev_memory_monitor_value[i] = value;
+    return i;
+  }
+  if (num_memory_monitors == MAX_MEMORY_MONITORS) {
+    return -1;
+  }
+  for (j = num_memory_monitors; j > i; j--) {
+    memory_monitors[j] = memory_monitors[j - 1];
+    prev_memory_monitor_value[j] = prev_memory_monitor_value[j - 1];
+  }
+  memory_monitors[i] = addr;
+  prev_memory_monitor_value[i] = value;
+  num_memory_monitors++;
+  return i;
+}
+
+/* Stops watching ADDR. Returns 0 if it was not watched. */
+int
+memory_monitor_remove(uint64_t addr)
+{
+  int i = memory_monitor_lower_bound(addr), j;
+
+  if (i == num_memory_monitors || memory_monitors[i] != addr) {
+    return 0;
+  }
+  for (j = i + 1; j < num_memory_monitors; j++) {
+    memory_monitors[j - 1] = memory_monitors[j];
+    prev_memory_monitor_value[j - 1] = prev_memory_monitor_value[j];
+  }
+  num_memory_monitors--;
+  return 1;
+}
+
+/* Returns the index of the first monitor in [START, END), or -1. */
+int
+memory_monitor_find(uint64_t start, uint64_t end)
+{
+  int i = memory_monitor_lower_bound(start);
+
+  if (i < num_memory_monitors && memory_monitors[i] < end) {
+    return i;
+  }
+  return -1;
+}
@@ -31,6 +31,9 @@ extern FILE *mdbg_fp;
 extern int num_memory_monitors;
 extern uint64_t memory_monitors[MAX_MEMORY_MONITORS];
 extern uint64_t prev_memory_monitor_value[MAX_MEMORY_MONITORS];
+int memory_monitor_add(uint64_t addr, uint64_t value);
+int memory_monitor_remove(uint64_t addr);
+int memory_monitor_find(uint64_t start, uint64_t end);
 
 extern uint64_t n_exec;
 extern uint64_t next_breakpoint;
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mdbg.h"
+#include "mdbg_trace.h"
+
+#define MDBG_TRACE_MAX_CPUS 16
+#define MDBG_TRACE_MAP_SIZE (sizeof(struct mdbg_trace_header)                 \
+    + (size_t)MDBG_TRACE_RECORDS * sizeof(struct mdbg_trace_record))
+
+static struct mdbg_trace *mdbg_traces[MDBG_TRACE_MAX_CPUS];
+
+void
+mdbg_trace_sync(struct mdbg_trace *t)
+{
+  msync(t->header, MDBG_TRACE_MAP_SIZE, MS_ASYNC);
+}
+
+static void
+mdbg_trace_close_all(void)
+{
+  int i;
+
+  for (i = 0; i < MDBG_TRACE_MAX_CPUS; i++) {
+    struct mdbg_trace *t = mdbg_traces[i];
+
+    if (t) {
+      msync(t->header, MDBG_TRACE_MAP_SIZE, MS_SYNC);
+      munmap(t->header, MDBG_TRACE_MAP_SIZE);
+      free(t);
+      mdbg_traces[i] = NULL;
+    }
+  }
+}
+
+/* Returns the ring of CPU_INDEX, creating its file the first time. */
+struct mdbg_trace *
+mdbg_trace_get(int cpu_index)
+{
+  struct mdbg_trace *t;
+  char path[64];
+  void *map;
+  int fd, i;
+
+  ASSERT(cpu_index >= 0 && cpu_index < MDBG_TRACE_MAX_CPUS);
+  if ((t = mdbg_traces[cpu_index])) {
+    return t;
+  }
+
+  snprintf(path, sizeof path, "%s.%d", MDBG_TRACE_PATH, cpu_index);
+  if (   (fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+      || ftruncate(fd, MDBG_TRACE_MAP_SIZE) < 0
+      || (map = mmap(NULL, MDBG_TRACE_MAP_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+
+  t = calloc(1, sizeof *t);
+  ASSERT(t);
+  t->header = map;
+  t->records = (struct mdbg_trace_record *)(t->header + 1);
+  memcpy(t->header->magic, MDBG_TRACE_MAGIC, sizeof t->header->magic);
+  t->header->record_size = sizeof(struct mdbg_trace_record);
+  t->header->n_records = MDBG_TRACE_RECORDS;
+  t->header->head = 0;
+
+  for (i = 0; i < MDBG_TRACE_MAX_CPUS && !mdbg_traces[i]; i++);
+  if (i == MDBG_TRACE_MAX_CPUS) {
+    atexit(mdbg_trace_close_all);
+  }
+  mdbg_traces[cpu_index] = t;
+  return t;
+}
@@ -0,0 +1,82 @@
+#ifndef __MDBG_TRACE_H
+#define __MDBG_TRACE_H
+#include <stdint.h>
+
+/* Binary execution trace of mdbg_level 8, 9 and 10. Each CPU writes
+ * fixed-size records into its own ring file, MDBG_TRACE_PATH.<cpu_index>,
+ * which is mapped into memory: a struct mdbg_trace_header followed by
+ * N_RECORDS records. Record I of the trace is at I % N_RECORDS, so once the
+ * ring is full the oldest records are overwritten; HEAD counts all the
+ * records ever written. qemu-trace-dump renders a ring file in the text
+ * format the levels used to print.
+ *
+ * A STATE record only carries EIP, N_EXEC and EFLAGS. It is followed by a
+ * REG record for every general register and a SEG record for every segment
+ * that changed since the previous STATE record, or for all of them if the
+ * STATE record has MDBG_TRACE_FULL, which every MDBG_TRACE_FULL_STRIDE-th
+ * one does, so that a reader can start in the middle of a ring. */
+#define MDBG_TRACE_MAGIC "MDBGTRC1"
+#define MDBG_TRACE_PATH "/tmp/log.trace"
+#ifndef MDBG_TRACE_RECORDS
+#define MDBG_TRACE_RECORDS (1 << 21)        /* 64MB of records. */
+#endif
+#define MDBG_TRACE_FULL_STRIDE 1024
+/* Dirty pages are written back with msync() every this many records. */
+#define MDBG_TRACE_SYNC_RECORDS (1 << 16)
+
+enum mdbg_trace_type {
+  MDBG_TRACE_EIP = 1,       /* mdbg_level 9. */
+  MDBG_TRACE_STATE = 2,     /* mdbg_level 8 and 10. */
+  MDBG_TRACE_REG = 3,       /* VAL[0] is register INDEX, 0-7 as in regs[]. */
+  MDBG_TRACE_SEG = 4,       /* VAL[] is selector, base, limit, flags. */
+  MDBG_TRACE_MEM = 5,       /* VAL[0] is the address, VAL[1] the value. */
+};
+
+/* Record flags. */
+#define MDBG_TRACE_FULL   0x1   /* STATE: all registers follow. */
+#define MDBG_TRACE_VALUE  0x1   /* MEM: VAL[1] holds the 4 bytes at VAL[0]. */
+
+struct mdbg_trace_record {
+  uint8_t type;             /* enum mdbg_trace_type. */
+  uint8_t flags;
+  uint16_t index;
+  uint32_t eip;
+  uint64_t n_exec;
+  uint32_t val[4];
+};
+
+struct mdbg_trace_header {
+  char magic[8];
+  uint32_t record_size;     /* sizeof(struct mdbg_trace_record). */
+  uint32_t n_records;
+  uint64_t head;            /* records written. */
+  uint8_t pad[40];          /* to a multiple of the record size. */
+};
+
+/* The ring of one CPU, and what its last records left behind. */
+struct mdbg_trace {
+  struct mdbg_trace_header *header;
+  struct mdbg_trace_record *records;
+  uint32_t eip;             /* of the last EIP or STATE record. */
+  uint64_t n_states;
+  uint32_t regs[8];
+  uint32_t segs[6][4];
+};
+
+struct mdbg_trace *mdbg_trace_get(int cpu_index);
+void mdbg_trace_sync(struct mdbg_trace *t);
+
+/* Returns the slot of the next record of T, to be filled in by the caller. */
+static inline struct mdbg_trace_record *
+mdbg_trace_append(struct mdbg_trace *t)
+{
+  struct mdbg_trace_header *h = t->header;
+  struct mdbg_trace_record *r = &t->records[h->head % h->n_records];
+
+  if (++h->head % MDBG_TRACE_SYNC_RECORDS == 0) {
+    mdbg_trace_sync(t);
+  }
+  return r;
+}
+
+#endif
@@ -3,89 +3,246 @@
 #include <assert.h>
 #include "profile_log.h"
 #include <stdlib.h>
+#include <string.h>
 #include "hash.h"
 #define ASSERT assert
 
-static struct hash ptab;
 FILE *profile_log = NULL;
 
+static struct profile_block *blocks = NULL;
+/* Counts the exits of blocks with PROFILE_BLOCK_EDGES edges already. */
+static uint64_t lost_edges_count;
+
+struct profile_block *
+profile_block_new(uint32_t eip)
+{
+  struct profile_block *b = calloc(1, sizeof *b);
+
+  ASSERT(b);
+  b->eip = eip;
+  b->next = blocks;
+  blocks = b;
+  return b;
+}
+
+void
+profile_block_add_insn(struct profile_block *b, uint32_t eip)
+{
+  /* Grow INSN_EIPS at powers of two. */
+  if ((b->n_insns & (b->n_insns - 1)) == 0) {
+    b->insn_eips = realloc(b->insn_eips,
+        (b->n_insns ? 2 * b->n_insns : 1) * sizeof b->insn_eips[0]);
+    ASSERT(b->insn_eips);
+  }
+  b->insn_eips[b->n_insns++] = eip;
+}
+
+/* Returns the counter of an exit of B, from its last instruction so far to
+ * TO_EIP. */
+uint64_t *
+profile_block_edge(struct profile_block *b, uint32_t to_eip)
+{
+  struct profile_edge *edge;
+
+  if (b->n_edges == PROFILE_BLOCK_EDGES) {
+    return &lost_edges_count;
+  }
+  edge = &b->edges[b->n_edges++];
+  edge->from_eip = b->n_insns ? b->insn_eips[b->n_insns - 1] : 0;
+  edge->to_eip = to_eip;
+  edge->count = 0;
+  return &edge->count;
+}
+
 typedef struct entry_t {
   uint32_t prev_eip;
   uint32_t eip;
-  uint64_t count;
+  int64_t count;
   struct hash_elem ptab_elem;
 } entry_t;
 
-uint64_t total_count = 0;
-uint64_t total_eips = 0;
+static unsigned
+entry_hash_func(struct hash_elem const *e, void *aux)
+{
+  entry_t const *en = hash_entry(e, entry_t, ptab_elem);
+  return en->eip*7 + en->prev_eip;
+}
 
-void
-profile_log_increment_count(uint32_t eip)
+static bool
+entry_less_func(struct hash_elem const *a, struct hash_elem const *b, void *aux)
+{
+  entry_t const *ea, *eb;
+  ea = hash_entry(a, entry_t, ptab_elem);
+  eb = hash_entry(b, entry_t, ptab_elem);
+  return ea->eip < eb->eip ||
+    ((ea->eip == eb->eip) && ea->prev_eip < eb->prev_eip);
+}
+
+static void
+entry_free(struct hash_elem *e, void *aux)
+{
+  free(hash_entry(e, entry_t, ptab_elem));
+}
+
+static void
+entry_add(struct hash *ptab, uint32_t prev_eip, uint32_t eip, int64_t count)
 {
   struct hash_elem *e;
-  static uint32_t prev_eip = 0;
   entry_t needle, *entry;
+
   needle.eip = eip;
   needle.prev_eip = prev_eip;
-  e = hash_find(&ptab, &needle.ptab_elem);
-  if (e) {
+  if ((e = hash_find(ptab, &needle.ptab_elem))) {
     entry = hash_entry(e, entry_t, ptab_elem);
-    entry->count++;
   } else {
-    entry_t *new_entry = malloc(sizeof(entry_t));
-    new_entry->prev_eip = prev_eip;
-    new_entry->eip = eip;
-    new_entry->count = 1;
-    hash_insert(&ptab, &new_entry->ptab_elem);
-    total_eips++;
+    entry = malloc(sizeof(entry_t));
+    ASSERT(entry);
+    *entry = needle;
+    entry->count = 0;
+    hash_insert(ptab, &entry->ptab_elem);
   }
-  prev_eip = eip;
-  total_count++;
+  entry->count += count;
 }
 
-int entry_compare(const void *_a, const void *_b)
+static int
+entry_compare(const void *_a, const void *_b)
+{
+  entry_t * const *a = _a;
+  entry_t * const *b = _b;
+  return ((*b)->count > (*a)->count) - ((*b)->count < (*a)->count);
+}
+
+/* The blocks at one eip, across retranslations. */
+struct hot_block {
+  uint32_t eip;
+  int n_insns;
+  uint64_t count, n_insns_executed;
+};
+
+static int
+block_eip_compare(const void *_a, const void *_b)
 {
-  entry_t **a = (entry_t **)_a;
-  entry_t **b = (entry_t **)_b;
-  return (*b)->count - (*a)->count;
+  struct profile_block * const *a = _a;
+  struct profile_block * const *b = _b;
+  return ((*a)->eip > (*b)->eip) - ((*a)->eip < (*b)->eip);
+}
+
+static int
+hot_block_compare(const void *_a, const void *_b)
+{
+  struct hot_block const *a = _a;
+  struct hot_block const *b = _b;
+  return    (b->n_insns_executed > a->n_insns_executed)
+          - (b->n_insns_executed < a->n_insns_executed);
+}
+
+static void
+dump_hot_blocks(int n_blocks, uint64_t total_count)
+{
+  struct profile_block **sorted, *b;
+  struct hot_block *hot;
+  int i, n_hot = 0;
+
+  sorted = malloc(n_blocks * sizeof sorted[0]);
+  hot = malloc(n_blocks * sizeof hot[0]);
+  ASSERT(sorted && hot);
+  for (i = 0, b = blocks; b; b = b->next) {
+    sorted[i++] = b;
+  }
+  qsort(sorted, n_blocks, sizeof sorted[0], block_eip_compare);
+  for (i = 0; i < n_blocks; i++) {
+    b = sorted[i];
+    if (!b->count) {
+      continue;
+    }
+    if (n_hot == 0 || hot[n_hot - 1].eip != b->eip) {
+      hot[n_hot].eip = b->eip;
+      hot[n_hot].n_insns = 0;
+      hot[n_hot].count = 0;
+      hot[n_hot].n_insns_executed = 0;
+      n_hot++;
+    }
+    if (b->n_insns > hot[n_hot - 1].n_insns) {
+      hot[n_hot - 1].n_insns = b->n_insns;
+    }
+    hot[n_hot - 1].count += b->count;
+    hot[n_hot - 1].n_insns_executed += b->count * b->n_insns;
+  }
+  qsort(hot, n_hot, sizeof hot[0], hot_block_compare);
+
+  fprintf(profile_log, "Hottest blocks:\n");
+  for (i = 0; i < n_hot && i < PROFILE_LOG_HOT_BLOCKS; i++) {
+    fprintf(profile_log, "%#x %d insns %llu executions %llu insns executed "
+        "%.2f%%\n", hot[i].eip, hot[i].n_insns,
+        (unsigned long long)hot[i].count,
+        (unsigned long long)hot[i].n_insns_executed,
+        total_count ? 100.0 * hot[i].n_insns_executed / total_count : 0.0);
+  }
+  free(hot);
+  free(sorted);
 }
 
 void
 profile_log_dump(void)
 {
+  struct hash ptab;
   struct hash_iterator iter;
-  int i = 0;
-  entry_t *entries[total_eips];
- 
+  struct profile_block *b;
+  entry_t **entries;
+  uint64_t total_count = 0;
+  size_t n_entries;
+  int i, n_blocks = 0;
+
+  /* Expand the blocks into prev_eip->eip counts. An entry of a block is
+   * first charged to prev_eip 0, and then moved to the instructions whose
+   * edges lead to it. */
+  hash_init(&ptab, &entry_hash_func, &entry_less_func, NULL);
+  for (b = blocks; b; b = b->next) {
+    n_blocks++;
+    if (b->count && b->n_insns) {
+      entry_add(&ptab, 0, b->insn_eips[0], b->count);
+      for (i = 1; i < b->n_insns; i++) {
+        entry_add(&ptab, b->insn_eips[i - 1], b->insn_eips[i], b->count);
+      }
+      total_count += b->count * b->n_insns;
+    }
+    for (i = 0; i < b->n_edges; i++) {
+      struct profile_edge const *edge = &b->edges[i];
+      if (edge->count) {
+        entry_add(&ptab, edge->from_eip, edge->to_eip, edge->count);
+        entry_add(&ptab, 0, edge->to_eip, -(int64_t)edge->count);
+      }
+    }
+  }
+
+  entries = malloc(hash_size(&ptab) * sizeof entries[0]);
+  ASSERT(entries);
+  n_entries = 0;
   hash_first(&iter, &ptab);
   while (hash_next(&iter)) {
-    entries[i++] = hash_entry(hash_cur(&iter), entry_t, ptab_elem);
+    entry_t *entry = hash_entry(hash_cur(&iter), entry_t, ptab_elem);
+    /* An edge taken just before an interrupt is counted, but the entry of
+     * its target is not. */
+    if (entry->count > 0) {
+      entries[n_entries++] = entry;
+    }
   }
-  ASSERT(i == total_eips);
-  qsort(entries, total_eips, sizeof entries[0], entry_compare);
+  qsort(entries, n_entries, sizeof entries[0], entry_compare);
   fprintf(profile_log, "Dumping profile log:\n");
-  for (i = 0; i < total_eips; i++) {
+  for (i = 0; i < n_entries; i++) {
     fprintf(profile_log, "%#x->%#x %lld\n", entries[i]->prev_eip,
-        entries[i]->eip, entries[i]->count);
+        entries[i]->eip, (long long)entries[i]->count);
   }
-  fclose(profile_log);
-}
+  free(entries);
+  hash_destroy(&ptab, &entry_free);
 
-unsigned
-entry_hash_func(struct hash_elem const *e, void *aux)
-{
-  entry_t const *en = hash_entry(e, entry_t, ptab_elem);
-  return en->eip*7 + en->prev_eip;
-}
-
-bool
-entry_less_func(struct hash_elem const *a, struct hash_elem const *b, void *aux)
-{
-  entry_t const *ea, *eb;
-  ea = hash_entry(a, entry_t, ptab_elem);
-  eb = hash_entry(b, entry_t, ptab_elem);
-  return ea->eip < eb->eip ||
-    ((ea->eip == eb->eip) && ea->prev_eip < eb->prev_eip);
+  dump_hot_blocks(n_blocks, total_count);
+  if (lost_edges_count) {
+    fprintf(profile_log, "%llu exits of blocks with more than %d edges "
+        "left at prev_eip 0.\n", (unsigned long long)lost_edges_count,
+        PROFILE_BLOCK_EDGES);
+  }
+  fclose(profile_log);
 }
 
 void
@@ -93,21 +250,20 @@ profile_log_init(char const *filename)
 {
   profile_log = fopen(filename, "w");
   ASSERT(profile_log);
-  hash_init(&ptab, &entry_hash_func, &entry_less_func, NULL);
-}
-
-static void
-entry_free(struct hash_elem *e, void *aux)
-{
-  entry_t const *en;
-  en = hash_entry(e, entry_t, ptab_elem);
-  free(en);
 }
 
+/* Zeroes the counters. The blocks stay, as translated code points to them. */
 void
 profile_log_reset(void)
 {
-  hash_clear(&ptab, &entry_free);
-  total_eips = 0;
-  total_count = 0;
+  struct profile_block *b;
+  int i;
+
+  for (b = blocks; b; b = b->next) {
+    b->count = 0;
+    for (i = 0; i < b->n_edges; i++) {
+      b->edges[i].count = 0;
+    }
+  }
+  lost_edges_count = 0;
 }
@@ -2,9 +2,37 @@
 #define __PROFILE_LOG_H
 #include <stdint.h>
 
+/* Execution counts of translated code. Every translation block has a
+ * profile_block, whose COUNT is incremented by a single inline op on entry,
+ * and every exit of the block to an eip known at translation time (a direct
+ * jump, a conditional branch or a fall through) has an edge counter of its
+ * own. The prev_eip->eip counts of the dump are derived from these: the
+ * instructions of a block run as many times as the block was entered, and
+ * the entries of a block that no edge accounts for (indirect jumps, returns,
+ * interrupts) are reported with a prev_eip of 0. Blocks outlive their
+ * translation blocks, so that counts survive tb_flush(). */
+#define PROFILE_BLOCK_EDGES 4
+#define PROFILE_LOG_HOT_BLOCKS 32
+
+struct profile_edge {
+  uint32_t from_eip, to_eip;
+  uint64_t count;
+};
+
+struct profile_block {
+  uint64_t count;
+  uint32_t eip;
+  int n_insns, n_edges;
+  uint32_t *insn_eips;          /* N_INSNS instruction starts. */
+  struct profile_edge edges[PROFILE_BLOCK_EDGES];
+  struct profile_block *next;
+};
+
 extern FILE *profile_log;
 void profile_log_init(char const *filename);
-void profile_log_increment_count(uint32_t eip);
+struct profile_block *profile_block_new(uint32_t eip);
+void profile_block_add_insn(struct profile_block *b, uint32_t eip);
+uint64_t *profile_block_edge(struct profile_block *b, uint32_t to_eip);
 void profile_log_dump(void);
 void profile_log_reset(void);
 
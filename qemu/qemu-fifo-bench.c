@@ -0,0 +1,179 @@
+/*
+ * Throughput and syscall benchmark of the fifo block driver.
+ *
+ * A synthetic writer streams sequential sectors into a fifo through
+ * bdrv_write(), the way hw/mdisk.c streams the record log, while a child
+ * process drains the fifo.
+ *
+ * usage: qemu-fifo-bench [-m MB] [-n sectors] [-b bytes] file.fifo
+ *
+ * -n is the number of sectors per bdrv_write() (default 128, a monitor
+ * FILE block), -b the output buffer size of the driver (0 writes through).
+ */
+#include "vl.h"
+#include <sys/time.h>
+#include <sys/wait.h>
+
+void *get_mmap_addr(unsigned long size)
+{
+    return NULL;
+}
+
+void qemu_free(void *ptr)
+{
+    free(ptr);
+}
+
+void *qemu_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void *qemu_mallocz(size_t size)
+{
+    void *ptr;
+    ptr = qemu_malloc(size);
+    if (!ptr)
+        return NULL;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char *qemu_strdup(const char *str)
+{
+    char *ptr;
+    ptr = qemu_malloc(strlen(str) + 1);
+    if (!ptr)
+        return NULL;
+    strcpy(ptr, str);
+    return ptr;
+}
+
+void term_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void term_print_filename(const char *filename)
+{
+    term_printf(filename);
+}
+
+static void __attribute__((noreturn))
+usage(void)
+{
+    printf("usage: qemu-fifo-bench [-m MB] [-n sectors] [-b bytes] file.fifo\n"
+           "\n"
+           "Writes MB megabytes (default 256) into the fifo, N sectors per\n"
+           "bdrv_write() (default 128), with a driver output buffer of the\n"
+           "given size (default 1M, 0 writes through), and reports the\n"
+           "throughput and the number of syscalls.\n");
+    exit(1);
+}
+
+static double
+time_s(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Reads the fifo to EOF and reports what it got. */
+static void __attribute__((noreturn))
+reader(const char *path)
+{
+    static uint8_t buf[65536];
+    unsigned long long num_bytes = 0, num_reads = 0;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        _exit(1);
+    }
+    while ((ret = read(fd, buf, sizeof buf)) != 0) {
+        num_reads++;
+        if (ret > 0) {
+            num_bytes += ret;
+        }
+    }
+    printf("reader: %llu bytes in %llu reads.\n", num_bytes, num_reads);
+    fflush(stdout);
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    int mb = 256, nb_sectors = 128, c, status;
+    size_t buffer_size = 1 << 20;
+    int64_t sector, total_sectors;
+    uint64_t num_syscalls, num_bytes;
+    BlockDriverState *bs;
+    const char *path;
+    uint8_t *buf;
+    double start, secs;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "m:n:b:h")) != -1) {
+        switch (c) {
+        case 'm':
+            mb = atoi(optarg);
+            break;
+        case 'n':
+            nb_sectors = atoi(optarg);
+            break;
+        case 'b':
+            buffer_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 1 != argc || mb <= 0 || nb_sectors <= 0
+        || !strstr(argv[optind], ".fifo")) {
+        usage();
+    }
+    path = argv[optind];
+    if (mkfifo(path, 0644) < 0 && errno != EEXIST) {
+        perror(path);
+        return 1;
+    }
+    fflush(stdout);
+    if (!(pid = fork())) {
+        reader(path);
+    }
+
+    bdrv_init();
+    bdrv_fifo_set_buffer_size(buffer_size);
+    bs = bdrv_new("");
+    if (!bs || bdrv_open(bs, path, BDRV_O_LOG | BDRV_O_APPEND) < 0) {
+        fprintf(stderr, "%s: cannot open.\n", path);
+        kill(pid, SIGKILL);
+        return 1;
+    }
+    buf = qemu_malloc(nb_sectors * 512);
+    memset(buf, 'x', nb_sectors * 512);
+
+    total_sectors = (int64_t)mb << 11;
+    start = time_s();
+    for (sector = 0; sector < total_sectors; sector += nb_sectors) {
+        bdrv_write(bs, sector, buf, nb_sectors);
+    }
+    bdrv_flush(bs);
+    bdrv_fifo_get_stats(bs, &num_syscalls, &num_bytes);
+    bdrv_close(bs);
+    waitpid(pid, &status, 0);
+    secs = time_s() - start;
+
+    printf("writer: %d MB, %d sectors per write, %zu byte buffer: "
+           "%.3f s, %.1f MB/s, %llu syscalls (%.1f per MB).\n",
+           mb, nb_sectors, buffer_size, secs, mb / secs,
+           (unsigned long long)num_syscalls, (double)num_syscalls / mb);
+    qemu_free(buf);
+    return 0;
+}
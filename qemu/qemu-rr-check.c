@@ -0,0 +1,269 @@
+/*
+ * Parallel checker for record logs.
+ *
+ * Every MS entry of a record log holds a full machine state, so the stretch
+ * of the log between two consecutive MS entries can be verified on its own:
+ * load the first MS entry (rr_log_loadvm(env, 1)) and run up to the next
+ * one. qemu-rr-check indexes the MS entries of a log, runs one checker qemu
+ * per segment (-replay_start/-replay_stop), at most N at a time, and merges
+ * the results into one pass/fail report.
+ *
+ * usage: qemu-rr-check [-j N] [-o dir] log -- qemu [qemu options]
+ *
+ * The output of the checker of segment I goes to DIR/segment-I.log. The exit
+ * code is 0 if all segments pass, and otherwise the exit code of the checker
+ * of the earliest failing segment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mdbg.h"
+#include "rr_index.h"
+#include "rr_lz.h"
+
+struct segment {
+  off_t offset;             /* file offset of the MS entry it starts at. */
+  uint64_t start;           /* n_exec of that MS entry. */
+  uint64_t stop;            /* n_exec of the next MS entry, 0 for the last. */
+  pid_t pid;
+  int status;               /* -1 while not run or running. */
+  uint64_t exit_n_exec;
+};
+
+static struct segment *segments = NULL;
+static int num_segments = 0;
+
+static void __attribute__((noreturn))
+usage(void)
+{
+  printf("usage: qemu-rr-check [-j N] [-o dir] log -- qemu [qemu options]\n"
+      "\n"
+      "Verifies the segments of a record log between consecutive MS entries\n"
+      "in parallel, with N checker processes (default: one per online cpu).\n"
+      "The output of segment I goes to DIR/segment-I.log (default: .).\n");
+  exit(1);
+}
+
+static void
+add_segment(off_t offset, uint64_t n_exec)
+{
+  if (num_segments) {
+    segments[num_segments - 1].stop = n_exec;
+  }
+  segments = realloc(segments, (num_segments + 1) * sizeof *segments);
+  ASSERT(segments);
+  segments[num_segments].offset = offset;
+  segments[num_segments].start = n_exec;
+  segments[num_segments].stop = 0;
+  segments[num_segments].pid = 0;
+  segments[num_segments].status = -1;
+  segments[num_segments].exit_n_exec = 0;
+  num_segments++;
+}
+
+/* Records a segment per MS entry of LOG, using its index. */
+static void
+index_log(char const *log)
+{
+  rr_index_t *idx;
+  uint32_t i;
+  FILE *fp;
+
+  if (!(fp = fopen(log, "r"))) {
+    perror(log);
+    exit(1);
+  }
+  fp = rr_lz_fopen(fp);
+  idx = rr_index_open(log, fp);
+  for (i = 0; i < idx->n_entries; i++) {
+    if (idx->entries[i].tag == RR_LOG_TAG_MS) {
+      add_segment(idx->entries[i].offset, idx->entries[i].n_exec);
+    }
+  }
+  rr_index_free(idx);
+  fclose(fp);
+}
+
+static pid_t
+run_segment(int i, char const *log, char const *dir, int argc, char **argv)
+{
+  char path[4096], start[32], stop[32];
+  char **args;
+  pid_t pid;
+  int fd, n;
+
+  if ((pid = fork())) {
+    ASSERT(pid > 0);
+    return pid;
+  }
+
+  snprintf(path, sizeof path, "%s/segment-%d.log", dir, i);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(path);
+    _exit(1);
+  }
+  dup2(fd, 1);
+  dup2(fd, 2);
+  close(fd);
+
+  snprintf(start, sizeof start, "%#llx",
+      (unsigned long long)segments[i].offset);
+  snprintf(stop, sizeof stop, "%#llx", (unsigned long long)segments[i].stop);
+  args = malloc((argc + 7) * sizeof *args);
+  ASSERT(args);
+  for (n = 0; n < argc; n++) {
+    args[n] = argv[n];
+  }
+  args[n++] = "-use_replay_log";
+  args[n++] = (char *)log;
+  args[n++] = "-replay_start";
+  args[n++] = start;
+  if (segments[i].stop) {
+    args[n++] = "-replay_stop";
+    args[n++] = stop;
+  }
+  args[n] = NULL;
+  execvp(args[0], args);
+  perror(args[0]);
+  _exit(1);
+}
+
+/* Reads the n_exec at which the checker of segment I exited from its log. */
+static uint64_t
+segment_exit_n_exec(int i, char const *dir)
+{
+  char path[4096], line[256];
+  unsigned long long n_exec = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof path, "%s/segment-%d.log", dir, i);
+  if (!(fp = fopen(path, "r"))) {
+    return 0;
+  }
+  while (fgets(line, sizeof line, fp)) {
+    sscanf(line, "rr_log: exit at n_exec %llx", &n_exec);
+  }
+  fclose(fp);
+  return n_exec;
+}
+
+static char const *
+status_str(int status)
+{
+  if (WIFSIGNALED(status)) {
+    return "killed by signal";
+  }
+  switch (WEXITSTATUS(status)) {
+    case 0:                          return "ok";
+    case MISMATCH_EXITCODE:          return "mismatch or panic";
+    case INSN_COUNT_ERROR_EXITCODE:  return "insn count error";
+    default:                         return "failed";
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char const *log, *dir = ".";
+  int num_jobs = 0, running = 0, next = 0, failed = -1;
+  int c, i, status;
+  pid_t pid;
+
+  while ((c = getopt(argc, argv, "j:o:h")) != -1) {
+    switch (c) {
+      case 'j':
+        num_jobs = atoi(optarg);
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  /* The log, then the qemu command line after "--". */
+  if (optind + 2 > argc) {
+    usage();
+  }
+  log = argv[optind++];
+  if (num_jobs <= 0) {
+    num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_jobs <= 0) {
+      num_jobs = 1;
+    }
+  }
+
+  index_log(log);
+  if (!num_segments) {
+    printf("%s: no MS entries.\n", log);
+    return 1;
+  }
+  printf("%s: %d segments, %d jobs.\n", log, num_segments, num_jobs);
+  fflush(stdout);
+
+  for (;;) {
+    /* Segments after a failed one cannot change the first divergence. */
+    while (   running < num_jobs && next < num_segments
+           && (failed == -1 || next < failed)) {
+      segments[next].pid = run_segment(next, log, dir, argc - optind,
+          argv + optind);
+      running++;
+      next++;
+    }
+    if (!running) {
+      break;
+    }
+    pid = wait(&status);
+    if (pid < 0) {
+      perror("wait");
+      return 1;
+    }
+    for (i = 0; i < next && segments[i].pid != pid; i++);
+    if (i == next) {
+      continue;
+    }
+    running--;
+    segments[i].status = status;
+    segments[i].exit_n_exec = segment_exit_n_exec(i, dir);
+    if (status && (failed == -1 || i < failed)) {
+      int j;
+      failed = i;
+      for (j = i + 1; j < next; j++) {
+        if (segments[j].status == -1) {
+          kill(segments[j].pid, SIGKILL);
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < num_segments; i++) {
+    if (segments[i].status == -1) {
+      continue;
+    }
+    if (failed != -1 && i > failed) {
+      break;
+    }
+    printf("segment %d [%llx, %llx): %s", i,
+        (unsigned long long)segments[i].start,
+        (unsigned long long)segments[i].stop, status_str(segments[i].status));
+    if (segments[i].status) {
+      printf(" at %llx, see %s/segment-%d.log",
+          (unsigned long long)segments[i].exit_n_exec, dir, i);
+    }
+    printf(".\n");
+  }
+  if (failed == -1) {
+    printf("PASS\n");
+    return 0;
+  }
+  printf("FAIL: first divergence at n_exec %llx (segment %d).\n",
+      (unsigned long long)segments[failed].exit_n_exec, failed);
+  status = segments[failed].status;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,120 @@
+/*
+ * Builds, verifies or looks up the index of a record log (see rr_index.h).
+ *
+ * usage: qemu-rr-index [-s stride] log            (re)build log.idx
+ *        qemu-rr-index -c log                     verify log.idx
+ *        qemu-rr-index -f n_exec [-t tag] log     print the entry to seek to
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rr_index.h"
+#include "rr_lz.h"
+
+static void __attribute__((noreturn))
+usage(void)
+{
+  printf("usage: qemu-rr-index [-s stride] log\n"
+      "       qemu-rr-index -c log\n"
+      "       qemu-rr-index -f n_exec [-t MS|INTR|IN|INS|any] log\n"
+      "\n"
+      "Builds the index log.idx, checks it against the log (-c), or prints\n"
+      "the last entry with the given tag at or before n_exec (-f, default\n"
+      "tag MS).\n");
+  exit(1);
+}
+
+static int
+parse_tag(char const *name)
+{
+  if (!strcmp(name, "MS")) {
+    return RR_LOG_TAG_MS;
+  } else if (!strcmp(name, "INTR")) {
+    return RR_LOG_TAG_INTR;
+  } else if (!strcmp(name, "IN")) {
+    return RR_LOG_TAG_IN;
+  } else if (!strcmp(name, "INS")) {
+    return RR_LOG_TAG_INS;
+  } else if (!strcmp(name, "any")) {
+    return -1;
+  }
+  usage();
+}
+
+int
+main(int argc, char **argv)
+{
+  char const *log, *find = NULL;
+  int check = 0, tag = RR_LOG_TAG_MS, c, ret = 0;
+  uint32_t stride = RR_INDEX_STRIDE;
+  char path[4096];
+  rr_index_t *idx;
+  FILE *fp;
+
+  while ((c = getopt(argc, argv, "s:cf:t:h")) != -1) {
+    switch (c) {
+      case 's':
+        stride = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        check = 1;
+        break;
+      case 'f':
+        find = optarg;
+        break;
+      case 't':
+        tag = parse_tag(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+  log = argv[optind];
+  if (!(fp = fopen(log, "r"))) {
+    perror(log);
+    return 1;
+  }
+  fp = rr_lz_fopen(fp);
+  snprintf(path, sizeof path, "%s.idx", log);
+
+  if (check) {
+    int pos;
+
+    if (!(idx = rr_index_load(path))) {
+      printf("%s: missing or corrupt.\n", path);
+      return 1;
+    }
+    if ((pos = rr_index_verify(idx, fp, log))) {
+      printf("%s: does not match %s at entry %d.\n", path, log, pos - 1);
+      ret = 1;
+    } else {
+      printf("%s: ok, %u entries.\n", path, idx->n_entries);
+    }
+  } else if (find) {
+    struct rr_index_entry const *e;
+
+    idx = rr_index_open(log, fp);
+    if (!(e = rr_index_find(idx, strtoull(find, NULL, 16), tag))) {
+      printf("no such entry.\n");
+      ret = 1;
+    } else {
+      printf("n_exec %llx, tag %u, offset %#llx, size %#x\n",
+          (unsigned long long)e->n_exec, e->tag,
+          (unsigned long long)e->offset, e->size);
+    }
+  } else {
+    idx = rr_index_build(fp, log, stride);
+    if (rr_index_save(idx, path)) {
+      perror(path);
+      return 1;
+    }
+    printf("%s: %u entries, stride %u.\n", path, idx->n_entries, idx->stride);
+  }
+  rr_index_free(idx);
+  fclose(fp);
+  return ret;
+}
@@ -0,0 +1,361 @@
+/*
+ * Benchmark of the replay log parser of vl.c.
+ *
+ * Builds a synthetic log of MS, IN and INTR entries in memory, in the format
+ * the monitor writes, and parses it the way rr_log_loadvm(),
+ * rr_log_scan_in_val() and rr_log_interrupt() do: once with rr_scan(), and
+ * once with the vsscanf() reader that vl.c used before it. Both must read the
+ * same values.
+ *
+ * usage: qemu-rr-scan-bench [-n entries] [-s ms_stride] [-m mem_bytes]
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "rr_index.h"
+#include "rr_scan.h"
+
+#define NUM_REGS 8
+#define NUM_CRS  5
+#define NUM_SEGS 6
+
+static void __attribute__((noreturn))
+usage(void)
+{
+  printf("usage: qemu-rr-scan-bench [-n entries] [-s ms_stride] "
+      "[-m mem_bytes]\n"
+      "\n"
+      "Parses a synthetic log of N entries (default 100000), one MS entry\n"
+      "with MEM_BYTES of memory (default 4096) every MS_STRIDE entries\n"
+      "(default 100) and IN and INTR entries in between, with rr_scan() and\n"
+      "with vsscanf(), and reports the time taken by each.\n");
+  exit(1);
+}
+
+static double
+time_s(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char *log_buf;
+static size_t log_len, log_size;
+
+static void __attribute__((format(printf, 1, 2)))
+log_printf(char const *format, ...)
+{
+  va_list args;
+  int n;
+
+  for (;;) {
+    va_start(args, format);
+    n = vsnprintf(log_buf + log_len, log_size - log_len, format, args);
+    va_end(args);
+    if (log_len + n < log_size) {
+      break;
+    }
+    log_size = 2 * log_size + n;
+    log_buf = realloc(log_buf, log_size);
+  }
+  log_len += n;
+}
+
+/* Appends an entry with tag NAME whose body starts at BODY in log_buf: moves
+ * the body up and writes the header in front of it. */
+static void
+log_entry(char const *name, uint64_t n_exec, size_t body)
+{
+  char header[RR_LOG_HEADER_SIZE + 1];
+  size_t len = log_len - body;
+
+  snprintf(header, sizeof header, "%s%016llx %08lx %08x:", name,
+      (unsigned long long)n_exec, (unsigned long)len, 0);
+  log_printf("%s", header);
+  memmove(log_buf + body + RR_LOG_HEADER_SIZE, log_buf + body, len);
+  memcpy(log_buf + body, header, RR_LOG_HEADER_SIZE);
+}
+
+static uint32_t
+rnd(void)
+{
+  static uint32_t seed = 1;
+
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void
+make_log(int n_entries, int ms_stride, size_t mem_size)
+{
+  int k, i;
+
+  for (k = 0; k < n_entries; k++) {
+    size_t body = log_len;
+
+    if (k % ms_stride == 0) {
+      uint32_t eip = rnd();
+
+      log_printf(" %#x: %#x: machine_state_start\n", eip, eip);
+      log_printf("\tregs:\n");
+      for (i = 0; i < NUM_REGS; i++) {
+        log_printf("\t\t%d: %08x\n", i, rnd());
+      }
+      log_printf("\teip: %08x\n", eip);
+      log_printf("\teflags: %08x\n", rnd());
+      log_printf("\tldt: [%04x,%08x,%08x,%08x]\n", rnd() & 0xffff, rnd(),
+          rnd(), rnd());
+      log_printf("\ttr: [%04x,%08x,%08x,%08x]\n", rnd() & 0xffff, rnd(),
+          rnd(), rnd());
+      log_printf("\tgdt: [%08x,%08x]\n", rnd(), rnd());
+      log_printf("\tidt: [%08x,%08x]\n", rnd(), rnd());
+      log_printf("\tcr:\n");
+      for (i = 0; i < NUM_CRS; i++) {
+        log_printf("\t\t%d: %08x\n", i, rnd());
+      }
+      log_printf("\tIF: %hx\n", 1);
+      log_printf("\tIOPL: %hx\n", 0);
+      log_printf("\tAC: %hx\n", 0);
+      log_printf("\ta20_mask: %x\n", 0xffffffff);
+      log_printf("\tsegs:\n");
+      for (i = 0; i < NUM_SEGS; i++) {
+        log_printf("\t\t%d: [%04x,%08x,%08x,%08x]\n", i, rnd() & 0xffff,
+            rnd(), rnd(), rnd());
+      }
+      log_printf("\tfxstate:\n");
+      for (i = 0; i < 512; i++) {
+        log_printf(" %02hhx", (uint8_t)rnd());
+      }
+      log_printf("\n");
+      log_printf("\tmem[%zx]:\n", mem_size);
+      for (i = 0; i < (int)mem_size; i++) {
+        log_printf("%c", 'a' + rnd() % 26);
+      }
+      log_printf("\n");
+      log_printf("%016llx %#x: machine_state_stop", (unsigned long long)k,
+          eip);
+      log_printf("%*s\n", 16, "");
+      log_entry("MS:  ", k, body);
+    } else if (k % 4) {
+      log_printf(" %08x", rnd());
+      log_printf("%*s\n", 24, "");
+      log_entry("IN:  ", k, body);
+    } else {
+      log_printf(" %#x:", rnd());
+      log_printf(" %x", rnd() & 0xff);
+      log_printf("%*s\n", 16, "");
+      log_entry("INTR:", k, body);
+    }
+  }
+}
+
+/* The reader of vl.c before rr_scan(): counts the conversions of FORMAT and
+ * runs vsscanf() on what is left of the entry. */
+static void
+old_scanf(char const *buf, char const *format, ...)
+{
+  va_list args;
+  int retval;
+  int n_args = 0;
+  char const *ptr;
+
+  ptr = format;
+  while ((ptr = strchr(ptr, '%'))) {
+    if (*(ptr + 1) != '%' && *(ptr + 1) != '*' && *(ptr + 1) != 'n') {
+      n_args++;
+      ptr = ptr + 1;
+    } else {
+      ptr = ptr + 2;
+    }
+  }
+  va_start(args, format);
+  retval = vsscanf(buf, format, args);
+  va_end(args);
+  if (retval != n_args) {
+    printf("old_scanf: expected '%s', matched %d args.\n", format, retval);
+    exit(1);
+  }
+}
+
+static char const *ptr;
+
+#define OLD_SCAN(format, args...) ({                                          \
+  int numchars;                                                               \
+  old_scanf(ptr, format "%n", ##args, &numchars);                             \
+  ptr += numchars;                                                            \
+})
+#define OLD_SCAN_BYTES(out, n) ({                                             \
+  int __i;                                                                    \
+  for (__i = 0; __i < (n); __i++) {                                           \
+    OLD_SCAN(" %02hhx", &(out)[__i]);                                         \
+  }                                                                           \
+})
+#define NEW_SCAN(format, args...) ({                                          \
+  if (rr_scan(&ptr, format, ##args) < 0) {                                    \
+    printf("rr_scan: expected '%s'.\n", format);                              \
+    exit(1);                                                                  \
+  }                                                                           \
+})
+#define NEW_SCAN_BYTES(out, n) ({                                             \
+  if (rr_scan_bytes(&ptr, out, n) != (n)) {                                   \
+    printf("rr_scan_bytes: expected %d bytes.\n", n);                         \
+    exit(1);                                                                  \
+  }                                                                           \
+})
+
+/* Parses the body of an MS entry the way rr_log_loadvm() does, and returns
+ * a checksum of what it read. */
+#define PARSE_MS(scan, scan_bytes) ({                                         \
+  uint32_t eip, regs[NUM_REGS], cr[NUM_CRS], a20_mask, mem_size, sum = 0;     \
+  uint32_t sel, base, limit, flags;                                           \
+  uint16_t IF, IOPL, AC;                                                      \
+  uint8_t fxstate[512];                                                       \
+  int i, j;                                                                   \
+  scan("%*x: %x: machine_state_start\n", &eip);                               \
+  scan("\tregs:\n");                                                          \
+  for (i = 0; i < NUM_REGS; i++) {                                            \
+    scan("\t\t%d: %08x\n", &j, &regs[i]);                                     \
+    sum = sum * 31 + regs[i] + j;                                             \
+  }                                                                           \
+  scan("\teip: %08x\n", &eip);                                                \
+  scan("\teflags: %08x\n", &flags);                                           \
+  sum = sum * 31 + eip + flags;                                               \
+  scan("\tldt: [%04x,%08x,%08x,%08x]\n", &sel, &base, &limit, &flags);        \
+  sum = sum * 31 + sel + base + limit + flags;                                \
+  scan("\ttr: [%04x,%08x,%08x,%08x]\n", &sel, &base, &limit, &flags);         \
+  sum = sum * 31 + sel + base + limit + flags;                                \
+  scan("\tgdt: [%08x,%08x]\n", &base, &limit);                                \
+  sum = sum * 31 + base + limit;                                              \
+  scan("\tidt: [%08x,%08x]\n", &base, &limit);                                \
+  sum = sum * 31 + base + limit;                                              \
+  scan("\tcr:\n");                                                            \
+  for (i = 0; i < NUM_CRS; i++) {                                             \
+    scan("\t\t%d: %08x\n", &j, &cr[i]);                                       \
+    sum = sum * 31 + cr[i] + j;                                               \
+  }                                                                           \
+  scan("\tIF: %hx\n", &IF);                                                   \
+  scan("\tIOPL: %hx\n", &IOPL);                                               \
+  scan("\tAC: %hx\n", &AC);                                                   \
+  scan("\ta20_mask: %x\n", &a20_mask);                                        \
+  sum = sum * 31 + IF + IOPL + AC + a20_mask;                                 \
+  scan("\tsegs:\n");                                                          \
+  for (i = 0; i < NUM_SEGS; i++) {                                            \
+    scan("\t\t%d: [%04x,%08x,%08x,%08x]\n", &j, &sel, &base, &limit, &flags); \
+    sum = sum * 31 + j + sel + base + limit + flags;                          \
+  }                                                                           \
+  scan("\tfxstate:\n");                                                       \
+  scan_bytes(fxstate, 512);                                                   \
+  for (i = 0; i < 512; i++) {                                                 \
+    sum = sum * 31 + fxstate[i];                                              \
+  }                                                                           \
+  scan("\n");                                                                 \
+  scan("\tmem[%x]:\n", &mem_size);                                            \
+  ptr += mem_size;                                                            \
+  scan("\n");                                                                 \
+  scan("%*x %x: machine_state_stop\n", &eip);                                 \
+  sum * 31 + eip + mem_size;                                                  \
+})
+
+/* Parses the whole log and returns a checksum of what it read. Each entry
+ * is first copied out of the log, as vl.c reads it from the file. */
+static uint32_t
+parse_log(int use_rr_scan)
+{
+  static char *entry;
+  static size_t entry_size;
+  char header[RR_LOG_HEADER_SIZE + 1];
+  char const *p = log_buf, *end = log_buf + log_len;
+  uint32_t sum = 0;
+
+  while (p < end) {
+    uint64_t n_exec;
+    uint32_t size, eip, val;
+    int tag;
+
+    memcpy(header, p, RR_LOG_HEADER_SIZE);
+    header[RR_LOG_HEADER_SIZE] = '\0';
+    tag = rr_index_parse_header(header, &n_exec, &size);
+    p += RR_LOG_HEADER_SIZE;
+    if (size + 1 > entry_size) {
+      entry_size = size + 1;
+      entry = realloc(entry, entry_size);
+    }
+    memcpy(entry, p, size);
+    entry[size] = '\0';
+    p += size;
+    ptr = entry;
+
+    if (tag == RR_LOG_TAG_MS) {
+      sum = sum * 31 + (use_rr_scan ? PARSE_MS(NEW_SCAN, NEW_SCAN_BYTES)
+                                    : PARSE_MS(OLD_SCAN, OLD_SCAN_BYTES));
+    } else if (tag == RR_LOG_TAG_IN) {
+      if (use_rr_scan) {
+        NEW_SCAN(" %x", &val);
+      } else {
+        OLD_SCAN(" %x", &val);
+      }
+      sum = sum * 31 + val;
+    } else if (tag == RR_LOG_TAG_INTR) {
+      if (use_rr_scan) {
+        NEW_SCAN("%x: %x\n", &eip, &val);
+      } else {
+        OLD_SCAN("%x: %x\n", &eip, &val);
+      }
+      sum = sum * 31 + eip + val;
+    } else {
+      printf("bad tag at offset %zu.\n", (size_t)(p - log_buf));
+      exit(1);
+    }
+  }
+  return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+  int n_entries = 100000, ms_stride = 100, c, i;
+  size_t mem_size = 4096;
+  uint32_t sum[2];
+  double start, secs[2];
+
+  while ((c = getopt(argc, argv, "n:s:m:h")) != -1) {
+    switch (c) {
+      case 'n':
+        n_entries = atoi(optarg);
+        break;
+      case 's':
+        ms_stride = atoi(optarg);
+        break;
+      case 'm':
+        mem_size = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc || n_entries <= 0 || ms_stride <= 0) {
+    usage();
+  }
+  make_log(n_entries, ms_stride, mem_size);
+
+  for (i = 0; i < 2; i++) {
+    start = time_s();
+    sum[i] = parse_log(i);
+    secs[i] = time_s() - start;
+    printf("%s: %d entries, %zu bytes: %.3f s, %.0f entries/s, %.1f MB/s.\n",
+        i ? "rr_scan" : "vsscanf", n_entries, log_len, secs[i],
+        n_entries / secs[i], log_len / secs[i] / (1 << 20));
+  }
+  if (sum[0] != sum[1]) {
+    printf("results differ: %#x[vsscanf] <-> %#x[rr_scan]\n", sum[0], sum[1]);
+    return 1;
+  }
+  printf("results match, %.1fx faster.\n", secs[0] / secs[1]);
+  free(log_buf);
+  return 0;
+}
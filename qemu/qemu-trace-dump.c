@@ -0,0 +1,199 @@
+/*
+ * Renders a binary execution trace (see mdbg_trace.h) in the text format
+ * that mdbg_level 8, 9 and 10 used to print to /tmp/log.
+ *
+ * usage: qemu-trace-dump [-e eip[-eip]] [-n n_exec[-n_exec]] [-v] trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mdbg_trace.h"
+
+static void __attribute__((noreturn))
+usage(void)
+{
+  printf("usage: qemu-trace-dump [-e eip[-eip]] [-n n_exec[-n_exec]] [-v] "
+      "trace\n"
+      "\n"
+      "Prints the records of trace (e.g. /tmp/log.trace.0) whose eip and\n"
+      "n_exec are in the given inclusive ranges, in hex. -v also prints the\n"
+      "value of each memory access, where the trace has it.\n");
+  exit(1);
+}
+
+/* Parses "LO" or "LO-HI", in hex. */
+static void
+parse_range(char const *arg, uint64_t *lo, uint64_t *hi)
+{
+  char *end;
+
+  *lo = *hi = strtoull(arg, &end, 16);
+  if (*end == '-') {
+    *hi = strtoull(end + 1, &end, 16);
+  }
+  if (*end || *hi < *lo) {
+    usage();
+  }
+}
+
+static uint64_t eip_lo = 0, eip_hi = UINT64_MAX;
+static uint64_t n_exec_lo = 0, n_exec_hi = UINT64_MAX;
+static int print_values = 0;
+
+static int
+selected(struct mdbg_trace_record const *r)
+{
+  return    r->eip >= eip_lo && r->eip <= eip_hi
+         && r->n_exec >= n_exec_lo && r->n_exec <= n_exec_hi;
+}
+
+/* The state being rebuilt from a STATE record and the REG and SEG records
+ * that follow it. */
+static struct mdbg_trace_record state;
+static uint32_t regs[8], segs[6][4];
+static int have_full = 0, state_pending = 0;
+static uint64_t n_states_skipped = 0;
+
+static void
+print_state(void)
+{
+  static char const *seg_name[6] = { "ES", "CS", "SS", "DS", "FS" ,"GS" };
+  int i;
+
+  if (!state_pending) {
+    return;
+  }
+  state_pending = 0;
+  if (!have_full) {
+    n_states_skipped++;
+    return;
+  }
+  if (!selected(&state)) {
+    return;
+  }
+  printf("0x%x:\n", state.eip);
+  printf("\teax : %08x\n", regs[0]);
+  printf("\tebx : %08x\n", regs[3]);
+  printf("\tecx : %08x\n", regs[1]);
+  printf("\tedx : %08x\n", regs[2]);
+  printf("\tesi : %08x\n", regs[6]);
+  printf("\tedi : %08x\n", regs[7]);
+  printf("\tebp : %08x\n", regs[5]);
+  printf("\tesp : %08x\n", regs[4]);
+  printf("\tesp : %08x\n", regs[4]);
+  printf("\teflags : %08x\n", state.val[0]);
+  for (i = 0; i < 6; i++) {
+    printf("\t%s  : %04x %08x %08x %08x\n", seg_name[i], segs[i][0],
+        segs[i][1], segs[i][2], segs[i][3]);
+  }
+}
+
+static void
+dump_record(struct mdbg_trace_record const *r)
+{
+  switch (r->type) {
+    case MDBG_TRACE_REG:
+      if (r->index < 8) {
+        regs[r->index] = r->val[0];
+      }
+      return;
+    case MDBG_TRACE_SEG:
+      if (r->index < 6) {
+        memcpy(segs[r->index], r->val, sizeof segs[r->index]);
+      }
+      return;
+  }
+  print_state();
+  switch (r->type) {
+    case MDBG_TRACE_EIP:
+      if (selected(r)) {
+        printf("0x%x:\n", r->eip);
+      }
+      break;
+    case MDBG_TRACE_STATE:
+      state = *r;
+      state_pending = 1;
+      have_full |= r->flags & MDBG_TRACE_FULL;
+      break;
+    case MDBG_TRACE_MEM:
+      if (selected(r)) {
+        printf("\t[%08x]: ", r->val[0]);
+        if (print_values && (r->flags & MDBG_TRACE_VALUE)) {
+          printf("%08x", r->val[1]);
+        }
+        printf("\n");
+      }
+      break;
+    default:
+      fprintf(stderr, "unknown record type %d.\n", r->type);
+      exit(1);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct mdbg_trace_header const *h;
+  struct mdbg_trace_record const *records;
+  uint64_t i, first;
+  struct stat st;
+  char const *path;
+  int fd, c;
+
+  while ((c = getopt(argc, argv, "e:n:vh")) != -1) {
+    switch (c) {
+      case 'e':
+        parse_range(optarg, &eip_lo, &eip_hi);
+        break;
+      case 'n':
+        parse_range(optarg, &n_exec_lo, &n_exec_hi);
+        break;
+      case 'v':
+        print_values = 1;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+  path = argv[optind];
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return 1;
+  }
+  if (   st.st_size < (off_t)sizeof *h
+      || (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+         == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map.\n", path);
+    return 1;
+  }
+  if (   memcmp(h->magic, MDBG_TRACE_MAGIC, sizeof h->magic)
+      || h->record_size != sizeof *records || h->n_records == 0
+      || (uint64_t)st.st_size
+         < sizeof *h + (uint64_t)h->n_records * sizeof *records) {
+    fprintf(stderr, "%s: not a trace.\n", path);
+    return 1;
+  }
+  records = (struct mdbg_trace_record const *)(h + 1);
+
+  /* Once the ring is full, the oldest records are gone. */
+  first = h->head > h->n_records ? h->head - h->n_records : 0;
+  for (i = first; i < h->head; i++) {
+    dump_record(&records[i % h->n_records]);
+  }
+  print_state();
+  if (first || n_states_skipped) {
+    fprintf(stderr, "%s: %llu records lost to the ring, %llu states before "
+        "the first full one skipped.\n", path, (unsigned long long)first,
+        (unsigned long long)n_states_skipped);
+  }
+  munmap((void *)h, st.st_size);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "rr_index.h"
+#include "mdbg.h"
+
+static struct {
+  char const *name;
+  enum rr_log_tag_t tag;
+} const rr_log_tags[] = {
+  { "MS:  ", RR_LOG_TAG_MS },
+  { "INTR:", RR_LOG_TAG_INTR },
+  { "IN:  ", RR_LOG_TAG_IN },
+  { "INS: ", RR_LOG_TAG_INS },
+  { "PANC:", RR_LOG_TAG_PANIC },
+  { "EXIT:", RR_LOG_TAG_EXIT },
+};
+
+/* Parses the entry header in BUF, which holds RR_LOG_HEADER_SIZE characters
+ * followed by a null. Returns the tag, or -1 if it is not recognized. */
+int
+rr_index_parse_header(char const *buf, uint64_t *n_exec, uint32_t *size)
+{
+  unsigned i;
+
+  *n_exec = strtoull(buf + RR_LOG_TAG_SIZE, NULL, 16);
+  *size = strtoul(buf + RR_LOG_TAG_SIZE + RR_LOG_N_EXEC_SIZE, NULL, 16);
+  for (i = 0; i < sizeof rr_log_tags/sizeof rr_log_tags[0]; i++) {
+    if (!memcmp(buf, rr_log_tags[i].name, RR_LOG_TAG_SIZE)) {
+      return rr_log_tags[i].tag;
+    }
+  }
+  return -1;
+}
+
+/* Returns the size of the log file at LOG_PATH, as stored, compressed or not.
+ * The stream read by the index may come from rr_lz_fopen(), which has no file
+ * descriptor to fstat(). */
+static uint64_t
+rr_index_log_size(char const *log_path)
+{
+  struct stat st;
+
+  if (stat(log_path, &st)) {
+    return 0;
+  }
+  return st.st_size;
+}
+
+static void
+rr_index_append(rr_index_t *idx, struct rr_index_entry const *e)
+{
+  uint32_t n = idx->n_entries;
+
+  /* The capacity is 1024 entries, doubled whenever it is reached. */
+  if (n == 0 || (n >= 1024 && !(n & (n - 1)))) {
+    idx->entries = realloc(idx->entries,
+        (n ? 2 * n : 1024) * sizeof *idx->entries);
+    ASSERT(idx->entries);
+  }
+  idx->entries[idx->n_entries++] = *e;
+}
+
+/* Scans LOG, which was opened from LOG_PATH, from the start and indexes every
+ * MS entry and every STRIDE-th entry. The file position of LOG is
+ * preserved. */
+rr_index_t *
+rr_index_build(FILE *log, char const *log_path, uint32_t stride)
+{
+  char buf[RR_LOG_HEADER_SIZE + 1];
+  struct rr_index_entry e;
+  rr_index_t *idx;
+  off_t pos;
+  uint64_t n;
+  int tag;
+
+  idx = calloc(1, sizeof *idx);
+  ASSERT(idx);
+  idx->stride = stride ? stride : RR_INDEX_STRIDE;
+  idx->log_size = rr_index_log_size(log_path);
+
+  pos = ftello(log);
+  fseeko(log, 0, SEEK_SET);
+  for (n = 0; ; n++) {
+    e.offset = ftello(log);
+    if (fread(buf, 1, RR_LOG_HEADER_SIZE, log) != RR_LOG_HEADER_SIZE) {
+      break;
+    }
+    buf[RR_LOG_HEADER_SIZE] = '\0';
+    if ((tag = rr_index_parse_header(buf, &e.n_exec, &e.size)) < 0) {
+      break;
+    }
+    e.tag = tag;
+    if (   tag == RR_LOG_TAG_MS || tag == RR_LOG_TAG_EXIT
+        || tag == RR_LOG_TAG_PANIC || n % idx->stride == 0) {
+      rr_index_append(idx, &e);
+    }
+    if (   tag == RR_LOG_TAG_EXIT || tag == RR_LOG_TAG_PANIC
+        || fseeko(log, e.size, SEEK_CUR)) {
+      break;
+    }
+  }
+  fseeko(log, pos, SEEK_SET);
+  return idx;
+}
+
+rr_index_t *
+rr_index_load(char const *path)
+{
+  struct rr_index_header h;
+  rr_index_t *idx;
+  FILE *fp;
+
+  if (!(fp = fopen(path, "r"))) {
+    return NULL;
+  }
+  if (   fread(&h, sizeof h, 1, fp) != 1
+      || memcmp(h.magic, RR_INDEX_MAGIC, sizeof h.magic)) {
+    fclose(fp);
+    return NULL;
+  }
+  idx = calloc(1, sizeof *idx);
+  ASSERT(idx);
+  idx->stride = h.stride;
+  idx->n_entries = h.n_entries;
+  idx->log_size = h.log_size;
+  idx->entries = malloc(h.n_entries * sizeof *idx->entries);
+  ASSERT(idx->entries || !h.n_entries);
+  if (fread(idx->entries, sizeof *idx->entries, h.n_entries, fp)
+      != h.n_entries) {
+    rr_index_free(idx);
+    idx = NULL;
+  }
+  fclose(fp);
+  return idx;
+}
+
+int
+rr_index_save(rr_index_t const *idx, char const *path)
+{
+  struct rr_index_header h;
+  FILE *fp;
+  int ret = 0;
+
+  if (!(fp = fopen(path, "w"))) {
+    return -1;
+  }
+  memcpy(h.magic, RR_INDEX_MAGIC, sizeof h.magic);
+  h.stride = idx->stride;
+  h.n_entries = idx->n_entries;
+  h.log_size = idx->log_size;
+  if (   fwrite(&h, sizeof h, 1, fp) != 1
+      || fwrite(idx->entries, sizeof *idx->entries, idx->n_entries, fp)
+         != idx->n_entries) {
+    ret = -1;
+  }
+  if (fclose(fp)) {
+    ret = -1;
+  }
+  return ret;
+}
+
+/* Rebuilds the index of LOG, which was opened from LOG_PATH, and compares it
+ * with IDX. Returns 0 if they match, and otherwise 1 + the position of the
+ * first entry that differs. */
+int
+rr_index_verify(rr_index_t const *idx, FILE *log, char const *log_path)
+{
+  rr_index_t *fresh;
+  uint32_t i;
+  int ret = 0;
+
+  fresh = rr_index_build(log, log_path, idx->stride);
+  for (i = 0; i < idx->n_entries && i < fresh->n_entries; i++) {
+    if (memcmp(&idx->entries[i], &fresh->entries[i], sizeof idx->entries[i])) {
+      break;
+    }
+  }
+  if (   i < idx->n_entries || i < fresh->n_entries
+      || idx->log_size != fresh->log_size) {
+    ret = 1 + i;
+  }
+  rr_index_free(fresh);
+  return ret;
+}
+
+/* Returns the index of LOG, which was opened from LOG_PATH. The sidecar is
+ * used if it was built from a log of the same size, and is (re)written
+ * otherwise. */
+rr_index_t *
+rr_index_open(char const *log_path, FILE *log)
+{
+  char path[strlen(log_path) + sizeof ".idx"];
+  rr_index_t *idx;
+
+  snprintf(path, sizeof path, "%s.idx", log_path);
+  if ((idx = rr_index_load(path))) {
+    if (idx->log_size == rr_index_log_size(log_path)) {
+      return idx;
+    }
+    rr_index_free(idx);
+  }
+  idx = rr_index_build(log, log_path, RR_INDEX_STRIDE);
+  if (rr_index_save(idx, path)) {
+    fprintf(stderr, "%s: could not write index.\n", path);
+  }
+  return idx;
+}
+
+/* Returns the last indexed entry at or before N_EXEC with tag TAG (any tag if
+ * TAG is negative), or NULL. Every MS entry is indexed, so for MS this is the
+ * last MS entry at or before N_EXEC. */
+struct rr_index_entry const *
+rr_index_find(rr_index_t const *idx, uint64_t n_exec, int tag)
+{
+  uint32_t lo = 0, hi = idx->n_entries;
+
+  /* The first entry past N_EXEC. */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (idx->entries[mid].n_exec <= n_exec) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  while (lo-- > 0) {
+    if (tag < 0 || idx->entries[lo].tag == (uint32_t)tag) {
+      return &idx->entries[lo];
+    }
+  }
+  return NULL;
+}
+
+void
+rr_index_free(rr_index_t *idx)
+{
+  if (idx) {
+    free(idx->entries);
+    free(idx);
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef __RR_INDEX_H
+#define __RR_INDEX_H
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "rr_log.h"
+
+/* Index of a record log, kept next to it in <log>.idx. It lists the
+ * (n_exec, tag, file offset) of every MS entry and of every STRIDE-th entry,
+ * in log order, so that a reader can seek to an n_exec or to an MS entry with
+ * a binary search instead of scanning the log from the start. The index only
+ * holds what can be recomputed from the log; LOG_SIZE is the size of the log
+ * file it was built from (compressed, if the log is), and an index whose
+ * LOG_SIZE does not match is rebuilt. */
+#define RR_INDEX_MAGIC "RRINDEX1"
+#define RR_INDEX_STRIDE 256
+
+/* The header of a log entry: "TAG: N_EXEC NBYTES COMMENT:". */
+#define RR_LOG_TAG_SIZE 5
+#define RR_LOG_N_EXEC_SIZE (16+1)
+#define RR_LOG_NBYTES_SIZE (8+1)
+#define RR_LOG_COMMENT_SIZE (8+1)
+#define RR_LOG_HEADER_SIZE (RR_LOG_TAG_SIZE + RR_LOG_N_EXEC_SIZE              \
+    + RR_LOG_NBYTES_SIZE + RR_LOG_COMMENT_SIZE)
+
+struct rr_index_header {
+  char magic[8];
+  uint32_t stride;
+  uint32_t n_entries;
+  uint64_t log_size;
+};
+
+struct rr_index_entry {
+  uint64_t n_exec;
+  uint64_t offset;
+  uint32_t tag;             /* enum rr_log_tag_t. */
+  uint32_t size;            /* bytes following the header. */
+};
+
+typedef struct rr_index_t {
+  uint32_t stride;
+  uint32_t n_entries;
+  uint64_t log_size;
+  struct rr_index_entry *entries;
+} rr_index_t;
+
+int rr_index_parse_header(char const *buf, uint64_t *n_exec, uint32_t *size);
+rr_index_t *rr_index_build(FILE *log, char const *log_path, uint32_t stride);
+rr_index_t *rr_index_load(char const *path);
+int rr_index_save(rr_index_t const *idx, char const *path);
+int rr_index_verify(rr_index_t const *idx, FILE *log, char const *log_path);
+rr_index_t *rr_index_open(char const *log_path, FILE *log);
+struct rr_index_entry const *rr_index_find(rr_index_t const *idx,
+    uint64_t n_exec, int tag);
+void rr_index_free(rr_index_t *idx);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "rr_lz.h"
+#include "mdbg.h"
+
+/* Decompresses IN_LEN bytes of LZF data at IN into OUT. Returns the
+ * decompressed length, or 0 if the data is corrupt or does not fit in
+ * OUT_LEN bytes. Same as lz_decompress() in monee/lib/lz.c. */
+size_t
+rr_lz_decompress(void const *in, size_t in_len, void *out_, size_t out_len)
+{
+  uint8_t const *ip = in, *in_end = ip + in_len;
+  uint8_t *out = out_, *op = out, *out_end = out + out_len;
+
+  while (ip < in_end) {
+    unsigned c = *ip++;
+
+    if (c < 32) {
+      size_t n = c + 1;
+      if (ip + n > in_end || op + n > out_end) {
+        return 0;
+      }
+      memcpy(op, ip, n);
+      ip += n;
+      op += n;
+    } else {
+      size_t len = c >> 5;
+      uint8_t const *ref;
+
+      if (len == 7) {
+        if (ip >= in_end) {
+          return 0;
+        }
+        len += *ip++;
+      }
+      if (ip >= in_end) {
+        return 0;
+      }
+      ref = op - ((c & 0x1f) << 8) - 1 - *ip++;
+      len += 2;
+      if (ref < out || op + len > out_end) {
+        return 0;
+      }
+      while (len--) {
+        *op++ = *ref++;
+      }
+    }
+  }
+  return op - out;
+}
+
+/* Decodes the frame of BLOCK at FRAME, of which LEN bytes are available,
+ * into OUT (RR_LZ_BLOCK_SIZE bytes). Returns the number of raw bytes, or -1
+ * if FRAME does not hold a complete, valid frame of BLOCK. */
+int
+rr_lz_frame_decode(void const *frame, size_t len, uint32_t block, void *out)
+{
+  struct rr_lz_frame_header const *h = frame;
+
+  if (   len < sizeof *h || h->magic != RR_LZ_FRAME_MAGIC || h->block != block
+      || h->raw_len > RR_LZ_BLOCK_SIZE || h->comp_len > RR_LZ_BLOCK_SIZE
+      || len < sizeof *h + h->comp_len) {
+    return -1;
+  }
+  if (h->flags & RR_LZ_FRAME_STORED) {
+    if (h->comp_len != h->raw_len) {
+      return -1;
+    }
+    memcpy(out, h + 1, h->raw_len);
+  } else if (rr_lz_decompress(h + 1, h->comp_len, out, RR_LZ_BLOCK_SIZE)
+      != h->raw_len) {
+    return -1;
+  }
+  return h->raw_len;
+}
+
+/* Reader for a compressed log stored in slots. Reads stop at the first
+ * block that is not full. */
+typedef struct rr_lz_file {
+  FILE *raw;
+  uint64_t block;
+  int len;                      /* raw bytes in BUF, -1 if not loaded. */
+  size_t pos;
+  uint8_t buf[RR_LZ_BLOCK_SIZE];
+  uint8_t frame[RR_LZ_SLOT_SIZE];
+} rr_lz_file;
+
+static void
+rr_lz_load(rr_lz_file *f, uint64_t block)
+{
+  size_t n = 0;
+
+  f->block = block;
+  f->pos = 0;
+  if (!fseeko(f->raw, block * RR_LZ_SLOT_SIZE, SEEK_SET)) {
+    n = fread(f->frame, 1, sizeof f->frame, f->raw);
+  }
+  f->len = rr_lz_frame_decode(f->frame, n, block, f->buf);
+  if (f->len < 0) {
+    f->len = 0;
+  }
+}
+
+static ssize_t
+rr_lz_read(void *cookie, char *buf, size_t size)
+{
+  rr_lz_file *f = cookie;
+  size_t done = 0;
+
+  while (done < size) {
+    size_t n;
+
+    if (f->len < 0) {
+      rr_lz_load(f, f->block);
+    }
+    if (f->pos == (size_t)f->len) {
+      if (f->len < (int)RR_LZ_BLOCK_SIZE) {
+        break;
+      }
+      rr_lz_load(f, f->block + 1);
+      continue;
+    }
+    n = f->len - f->pos;
+    if (n > size - done) {
+      n = size - done;
+    }
+    memcpy(buf + done, f->buf + f->pos, n);
+    f->pos += n;
+    done += n;
+  }
+  return done;
+}
+
+static int
+rr_lz_seek(void *cookie, off64_t *offset, int whence)
+{
+  rr_lz_file *f = cookie;
+  uint64_t target;
+
+  if (whence == SEEK_SET) {
+    target = *offset;
+  } else if (whence == SEEK_CUR) {
+    target = f->block * RR_LZ_BLOCK_SIZE + f->pos + *offset;
+  } else {
+    return -1;
+  }
+  if (target / RR_LZ_BLOCK_SIZE != f->block || f->len < 0) {
+    rr_lz_load(f, target / RR_LZ_BLOCK_SIZE);
+  }
+  f->pos = target % RR_LZ_BLOCK_SIZE;
+  *offset = target;
+  return 0;
+}
+
+static int
+rr_lz_close(void *cookie)
+{
+  rr_lz_file *f = cookie;
+  int ret;
+
+  ret = fclose(f->raw);
+  free(f);
+  return ret;
+}
+
+/* If RAW, which must be seekable and at offset 0, holds a compressed log,
+ * returns a stream that reads (and seeks in) the decompressed log and owns
+ * RAW. Otherwise returns RAW. */
+FILE *
+rr_lz_fopen(FILE *raw)
+{
+  struct rr_lz_frame_header h;
+  cookie_io_functions_t io = { rr_lz_read, NULL, rr_lz_seek, rr_lz_close };
+  rr_lz_file *f;
+  FILE *fp;
+  int n;
+
+  n = fread(&h, 1, sizeof h, raw);
+  fseeko(raw, 0, SEEK_SET);
+  if (n != sizeof h || h.magic != RR_LZ_FRAME_MAGIC || h.block != 0) {
+    return raw;
+  }
+  f = malloc(sizeof *f);
+  ASSERT(f);
+  f->raw = raw;
+  f->block = 0;
+  f->len = -1;
+  f->pos = 0;
+  fp = fopencookie(f, "r", io);
+  ASSERT(fp);
+  return fp;
+}
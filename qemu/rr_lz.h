@@ -0,0 +1,33 @@
+#ifndef __RR_LZ_H
+#define __RR_LZ_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Block-framed LZ logs, as written by the monitor when it is built with
+ * RR_LOG_COMPRESS (see monee/lib/lz.h, which this must match). Logical block
+ * N of the log is stored as one frame at byte N * RR_LZ_SLOT_SIZE; a frame is
+ * a header followed by COMP_LEN bytes of LZF data, or of the raw block if
+ * LZ_FRAME_STORED is set. */
+#define RR_LZ_FRAME_MAGIC 0x315a5252       /* "RRZ1" */
+#define RR_LZ_FRAME_STORED 0x1
+#define RR_LZ_SLOT_SIZE 65536
+#define RR_LZ_SLOT_SECTORS (RR_LZ_SLOT_SIZE / 512)
+
+struct rr_lz_frame_header {
+  uint32_t magic;
+  uint32_t block;
+  uint16_t raw_len;
+  uint16_t flags;
+  uint32_t comp_len;
+};
+
+#define RR_LZ_BLOCK_SIZE (RR_LZ_SLOT_SIZE - sizeof(struct rr_lz_frame_header))
+
+size_t rr_lz_decompress(void const *in, size_t in_len, void *out,
+    size_t out_len);
+int rr_lz_frame_decode(void const *frame, size_t len, uint32_t block,
+    void *out);
+FILE *rr_lz_fopen(FILE *raw);
+
+#endif
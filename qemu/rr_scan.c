@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rr_scan.h"
+
+/* Value of each hex digit, -1 for other characters. */
+static signed char const rr_scan_hexval[256] = {
+  [0 ... 255] = -1,
+  ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+  ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+  ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+  ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/* isspace() in the C locale. */
+static char const rr_scan_space[256] = {
+  [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+};
+
+#define hexval(c) rr_scan_hexval[(unsigned char)(c)]
+#define is_space(c) rr_scan_space[(unsigned char)(c)]
+
+/* Reads a number of at most WIDTH characters in BASE 10 or 16 at *P, the way
+ * scanf() does after skipping white space. Returns 0 if there is none. */
+static int
+rr_scan_number(char const **p, int base, size_t width, uint64_t *val)
+{
+  char const *s = *p;
+  uint64_t v = 0;
+  int neg = 0, d;
+  char const *digits;
+
+  if (width && (*s == '-' || *s == '+')) {
+    neg = *s++ == '-';
+    width--;
+  }
+  if (   base == 16 && width >= 3 && s[0] == '0' && (s[1] | 0x20) == 'x'
+      && hexval(s[2]) >= 0) {
+    s += 2;
+    width -= 2;
+  }
+  for (digits = s; width && (d = hexval(*s)) >= 0 && d < base; s++, width--) {
+    v = v * base + d;
+  }
+  if (s == digits) {
+    return 0;
+  }
+  *val = neg ? -v : v;
+  *p = s;
+  return 1;
+}
+
+int
+rr_vscan(char const **bufp, char const *format, va_list args)
+{
+  char const *s = *bufp, *f = format;
+  int n_assigned = 0;
+
+  while (*f) {
+    size_t width = (size_t)-1;
+    int suppress = 0, size = 0, base;
+    uint64_t val;
+    char conv;
+
+    if (is_space(*f)) {
+      while (is_space(*f)) {
+        f++;
+      }
+      while (is_space(*s)) {
+        s++;
+      }
+      continue;
+    }
+    if (*f != '%' || f[1] == '%') {
+      f += *f == '%';
+      if (*s != *f) {
+        return -1 - n_assigned;
+      }
+      s++;
+      f++;
+      continue;
+    }
+
+    f++;
+    if (*f == '*') {
+      suppress = 1;
+      f++;
+    }
+    if (*f >= '0' && *f <= '9') {
+      width = strtoul(f, (char **)&f, 10);
+    }
+    for (; *f == 'h'; f++) {
+      size--;
+    }
+    for (; *f == 'l'; f++) {
+      size++;
+    }
+    conv = *f++;
+    if (conv == 'n') {
+      if (!suppress) {
+        *va_arg(args, int *) = s - *bufp;
+      }
+      continue;
+    }
+    if (conv == 'x') {
+      base = 16;
+    } else if (conv == 'd' || conv == 'u') {
+      base = 10;
+    } else {
+      fprintf(stderr, "rr_scan: unsupported conversion %%%c in '%s'.\n", conv,
+          format);
+      abort();
+    }
+    while (is_space(*s)) {
+      s++;
+    }
+    if (!rr_scan_number(&s, base, width, &val)) {
+      return -1 - n_assigned;
+    }
+    if (suppress) {
+      continue;
+    }
+    if (size <= -2) {
+      *va_arg(args, char *) = val;
+    } else if (size == -1) {
+      *va_arg(args, short *) = val;
+    } else if (size == 0) {
+      *va_arg(args, int *) = val;
+    } else if (size == 1) {
+      *va_arg(args, long *) = val;
+    } else {
+      *va_arg(args, long long *) = val;
+    }
+    n_assigned++;
+  }
+  *bufp = s;
+  return n_assigned;
+}
+
+int
+rr_scan(char const **bufp, char const *format, ...)
+{
+  va_list args;
+  int ret;
+
+  va_start(args, format);
+  ret = rr_vscan(bufp, format, args);
+  va_end(args);
+  return ret;
+}
+
+size_t
+rr_scan_bytes(char const **bufp, uint8_t *out, size_t n)
+{
+  char const *s = *bufp;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    int hi, lo;
+
+    while (is_space(*s)) {
+      s++;
+    }
+    /* The fast path: exactly the two digits the log writes. */
+    if ((hi = hexval(s[0])) >= 0 && (lo = hexval(s[1])) >= 0) {
+      out[i] = hi << 4 | lo;
+      s += 2;
+    } else {
+      uint64_t val;
+
+      if (!rr_scan_number(&s, 16, 2, &val)) {
+        break;
+      }
+      out[i] = val;
+    }
+  }
+  *bufp = s;
+  return i;
+}
@@ -0,0 +1,26 @@
+#ifndef __RR_SCAN_H
+#define __RR_SCAN_H
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Parser for the text of replay log entries. rr_scan() takes the same
+ * formats as sscanf() and matches them the same way, but only supports what
+ * the log uses: the conversions %x, %d, %u, %n and %%, with assignment
+ * suppression, a maximum field width and the hh, h, l and ll modifiers.
+ * It walks the format and the input once, decodes hex digits through a
+ * table, and never looks past the end of the input it consumes, so that it
+ * costs the same wherever in a large entry it starts.
+ *
+ * On success, returns the number of assignments and advances *BUFP past the
+ * input consumed. If the input does not match all of FORMAT, returns -1 - the
+ * number of assignments made before the failure, and leaves *BUFP alone. */
+int rr_scan(char const **bufp, char const *format, ...)
+    __attribute__((format(scanf, 2, 3)));
+int rr_vscan(char const **bufp, char const *format, va_list args);
+
+/* Same as calling rr_scan(bufp, " %02hhx", &out[i]) for I from 0 to N - 1.
+ * Returns the number of bytes decoded; *BUFP is advanced past them. */
+size_t rr_scan_bytes(char const **bufp, uint8_t *out, size_t n);
+
+#endif
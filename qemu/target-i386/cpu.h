@@ -547,6 +547,9 @@ void cpu_x86_close(CPUX86State *s);
 int cpu_get_pic_interrupt(CPUX86State *s);
 /* MSDOS compatibility mode FPU exception support */
 void cpu_set_ferr(CPUX86State *s);
+void cpu_x86_memory_monitor_hit(CPUX86State *env, target_ulong vaddr,
+                                uint8_t const *old, uint8_t const *new,
+                                int size);
 
 /* this function must always be used to load data in the segment
    cache: it synchronizes the hflags with the segment cache values */
@@ -213,7 +213,6 @@ void helper_print_memaccess(int, int, int, int, target_ulong);
 void helper_inspect_memory(long, long);
 void helper_set_mem_monitor(long, long);
 void helper_reset_mem_monitor(long, long);
-void helper_memory_monitor(long);
 target_ulong helper2_inspect_memory_read_addr(FILE *fp);
 void helper_print_errormsg(void);
 void helper_print_debugmsg(void);
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include "exec.h"
 #include "mdbg.h"
+#include "mdbg_trace.h"
 #include "profile_log.h"
 
 FILE *fopen(char const *, char const *);
@@ -1509,36 +1510,33 @@ void do_smm_enter(void)
     CC_OP = CC_OP_EFLAGS;
 }
 
+/* Memory monitors are write watchpoints: the TLB sends stores to their pages
+ * through the watch I/O slot (see exec.c), which logs the watched bytes they
+ * change. Flush the TLB so that existing entries pick up the change. */
 void helper_set_mem_monitor(long val_low, long val_high)
 {
   static int exception;
   target_ulong val = (uint32_t)val_low + ((target_ulong)val_high << 32);
+  uint64_t value;
 
-  memory_monitors[num_memory_monitors] = val;
-  prev_memory_monitor_value[num_memory_monitors] = ld_kernel_no_exception(val,
-      &exception, 1);
+  value = ld_kernel_no_exception(val, &exception, 1);
   if (exception) {
-    prev_memory_monitor_value[num_memory_monitors] = -1;
+    value = -1;
   }
-  num_memory_monitors++;
+  if (memory_monitor_add(val, value) < 0) {
+    printf("Too many memory monitors, not watching %x.\n", (uint32_t)val);
+    return;
+  }
+  tlb_flush(env, 1);
 }
 
 void helper_reset_mem_monitor(long val_low, long val_high)
 {
-  int i, j;
-  target_ulong val = val_low + ((target_ulong)val_high << 32);
+  target_ulong val = (uint32_t)val_low + ((target_ulong)val_high << 32);
 
-  for (i = 0; i < num_memory_monitors; i++) {
-    if ((uint32_t)memory_monitors[i] == (uint32_t)val) {
-      break;
-    }
-  }
-  if (i == num_memory_monitors)
-    return;
-  for (j = i + 1; j < num_memory_monitors; j++) {
-    memory_monitors[j - 1] = memory_monitors[j];
+  if (memory_monitor_remove(val)) {
+    tlb_flush(env, 1);
   }
-  num_memory_monitors--;
 }
 
 void
@@ -1673,23 +1671,31 @@ void helper_print_debugmsg(void)
 
 FILE *helper_fp = NULL;
 
+/* Returns the slot of the next record of the trace of the current CPU,
+ * filled in as far as the caller does not need to. */
+static struct mdbg_trace_record *
+helper_trace_record(struct mdbg_trace *t, int type, target_ulong eip)
+{
+  struct mdbg_trace_record *r = mdbg_trace_append(t);
+
+  r->type = type;
+  r->flags = 0;
+  r->index = 0;
+  r->eip = t->eip = eip;
+  r->n_exec = env->n_exec;
+  return r;
+}
+
 void helper_print_eip(target_ulong eip)
 {
-  if (!helper_fp) {
-    helper_fp = fopen("/tmp/log", "w");
-  }
-  fprintf(helper_fp, "0x%x:\n", eip);
-  fflush(helper_fp);
+  helper_trace_record(mdbg_trace_get(env->cpu_index), MDBG_TRACE_EIP, eip);
 }
 
 void helper_print_state(target_ulong eip)
 {
-  target_ulong ptr;
-  int selector;
-  uint32_t offset = 0;
-  uint16_t limit;
-  uint32_t base = 0, flags;
-  static const char *seg_name[6] = { "ES", "CS", "SS", "DS", "FS" ,"GS" };
+  struct mdbg_trace *t = mdbg_trace_get(env->cpu_index);
+  struct mdbg_trace_record *r;
+  int full = t->n_states++ % MDBG_TRACE_FULL_STRIDE == 0;
   int i;
   uint32_t eflags;
 
@@ -1697,116 +1703,57 @@ void helper_print_state(target_ulong eip)
   eflags |= (DF & DF_MASK);
   eflags |= env->eflags & ~(VM_MASK | RF_MASK);
 
-  if (!helper_fp) {
-    helper_fp = fopen("/tmp/log", "w");
+  r = helper_trace_record(t, MDBG_TRACE_STATE, eip);
+  r->flags = full ? MDBG_TRACE_FULL : 0;
+  r->val[0] = eflags;
+  for (i = 0; i < 8; i++) {
+    if (full || t->regs[i] != (uint32_t)env->regs[i]) {
+      t->regs[i] = env->regs[i];
+      r = helper_trace_record(t, MDBG_TRACE_REG, eip);
+      r->index = i;
+      r->val[0] = env->regs[i];
+    }
   }
-  fprintf(helper_fp, "0x%x:\n", eip);
-  fprintf(helper_fp, "\teax : %08x\n", env->regs[0]);
-  fprintf(helper_fp, "\tebx : %08x\n", env->regs[3]);
-  fprintf(helper_fp, "\tecx : %08x\n", env->regs[1]);
-  fprintf(helper_fp, "\tedx : %08x\n", env->regs[2]);
-  fprintf(helper_fp, "\tesi : %08x\n", env->regs[6]);
-  fprintf(helper_fp, "\tedi : %08x\n", env->regs[7]);
-  fprintf(helper_fp, "\tebp : %08x\n", env->regs[5]);
-  fprintf(helper_fp, "\tesp : %08x\n", env->regs[4]);
-  fprintf(helper_fp, "\tesp : %08x\n", env->regs[4]);
-  fprintf(helper_fp, "\teflags : %08x\n", eflags);
-
   for (i = 0; i < 6; i++) {
     SegmentCache *sc = &env->segs[i];
-    fprintf(helper_fp, "\t%s  : %04x %08x %08x %08x\n", seg_name[i], sc->selector,
-        (uint32_t)sc->base, sc->limit, sc->flags);
-  }
-  fflush(helper_fp);
-#if 0
-  printf("GDTR=%016" PRIx64 ":%08x\n", env->gdt.base, env->gdt.limit);
-  for (i = 0; i < env->gdt.limit/8; i++) {
-    ptr = env->gdt.base + 4*i;
-    offset = lduw_kernel(ptr);
-    selector = lduw_kernel(ptr + 2);
-    if (selector <= 8192*8) {
-      base = lduw_kernel(env->gdt.base + selector + 2);
-      base |= ldub_kernel(env->gdt.base + selector + 4) << 16;
-      base |= ldub_kernel(env->gdt.base + selector + 7) << 24;
-      limit = lduw_kernel(env->gdt.base + selector);
-      flags = ldul_kernel(env->gdt.base + selector + 4);
-      flags &= 0x00f0ff00;
-    } else {
-      base = 0;
-      limit = 0;
-      flags = 0;
-    }
-
-    printf("#0x%x =%04x %08x %08x %08x [offset %04x]\n", i,
-        selector, base, limit, flags, offset);
-  }
+    uint32_t seg[4] = { sc->selector, sc->base, sc->limit, sc->flags };
 
-  if (env->cr[0] & CR0_PE_MASK) {
-    assert(0);
-  } else {
-    /* real mode */
-    printf("\nIDTR=%016" PRIx64 ":%08x\n", env->idt.base, env->idt.limit);
-    for (i = 0; i < env->idt.limit/4; i++) {
-      uint16_t old_base = base;
-      uint32_t old_offset = offset;
-
-      ptr = env->idt.base + 4*i;
-      offset = lduw_kernel(ptr);
-      selector = lduw_kernel(ptr + 2);
-      if (selector <= 8192*8) {
-        base = lduw_kernel(env->gdt.base + selector + 2);
-        base |= ldub_kernel(env->gdt.base + selector + 4) << 16;
-        base |= ldub_kernel(env->gdt.base + selector + 7) << 24;
-        limit = lduw_kernel(env->gdt.base + selector);
-        flags = ldul_kernel(env->gdt.base + selector + 4);
-        flags &= 0x00f0ff00;
-      } else {
-        base = 0;
-        limit = 0;
-        flags = 0;
-      }
-
-      if (base != old_base || offset != old_offset) {
-        printf("#0x%x =%04x %08x %08x %08x [offset %04x]\n", i,
-            selector, base, limit, flags, offset);
-      }
+    if (full || memcmp(t->segs[i], seg, sizeof seg)) {
+      memcpy(t->segs[i], seg, sizeof seg);
+      r = helper_trace_record(t, MDBG_TRACE_SEG, eip);
+      r->index = i;
+      memcpy(r->val, seg, sizeof seg);
     }
   }
-#endif
 }
 
 
 void helper_print_memaccess(int seg, int base, int scale, int index,
     target_ulong disp)
 {
-  if (!helper_fp) {
-    helper_fp = fopen("/tmp/log", "w");
-  }
+  struct mdbg_trace *t;
+  struct mdbg_trace_record *r;
   target_ulong addr = 0;
+  int is_user, tlb_index;
   
   addr += (seg == -1)?0:env->segs[seg].base;
   addr += (base == -1)?0:env->regs[base];
   addr += scale * ((index == -1)?0:env->regs[index]);
   addr += disp;
-  //fprintf(helper_fp, "\t[%08" PRIx64 "]: ", addr);
-  fprintf(helper_fp, "\t[%08x]: ", addr);
-  /*
-  fprintf(fp, "\t[%08" PRIx64 " (%08" PRIx64 " + %08" PRIx64 " + %d*%08"
-      PRIx64 " + %08" PRIx64 "]:\n", addr,
-      (seg == -1)?0:env->segs[seg].base,
-      (base == -1)?0:env->regs[base],
-      scale,
-      (index == -1)?0:env->regs[index],
-      disp); 
-      */
-  /*
-  for (i = 0; i < 8; i++) {
-    fprintf(fp, " %02hhx", ldub_kernel(addr+ i));
+
+  t = mdbg_trace_get(env->cpu_index);
+  r = helper_trace_record(t, MDBG_TRACE_MEM, t->eip);
+  r->val[0] = addr;
+  /* The value is only read if it is in RAM that the TLB already maps. */
+  is_user = (env->hflags & HF_CPL_MASK) == 3;
+  tlb_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+  if (   env->tlb_table[is_user][tlb_index].addr_read
+         == (addr & TARGET_PAGE_MASK)
+      && (addr & ~TARGET_PAGE_MASK) <= TARGET_PAGE_SIZE - 4) {
+    r->flags = MDBG_TRACE_VALUE;
+    r->val[1] = ldl_raw((uint8_t *)(addr
+          + env->tlb_table[is_user][tlb_index].addend));
   }
-  fprintf(fp, " (%x)\n", ldul_kernel(addr));
-  */
-  fprintf(helper_fp, "\n");
-  fflush(helper_fp);
 }
 
 void helper_inspect_memory(long addr_low, long addr_high)
@@ -1828,30 +1775,6 @@ void helper_inspect_memory(long addr_low, long addr_high)
   inspect_memory_addr = addr;
 }
 
-void helper_memory_monitor(long eip)
-{
-  int i;
-
-  if (!helper_fp) {
-    helper_fp = fopen("/tmp/log", "w");
-  }
-  for (i = 0; i < num_memory_monitors; i++) {
-    static int exception;
-    uint8_t byte;
-    
-    byte = ld_kernel_no_exception(memory_monitors[i], &exception, 1);
-    if (i == 0) {
-      fprintf(helper_fp, "0x%x [%d]:\n", (uint32_t)eip, num_memory_monitors);
-    }
-    if (!exception) {
-      fprintf(helper_fp, "\t%x: %02hhx\n", (uint32_t)memory_monitors[i], byte);
-    } else {
-      fprintf(helper_fp, "\t%x: EX\n", (uint32_t)memory_monitors[i]);
-    }
-  }
-  fflush(helper_fp);
-}
-
 void helper_rsm(void)
 {
     target_ulong sm_state;
@@ -1090,3 +1090,43 @@ target_ulong helper2_inspect_memory_read_addr(FILE *fp)
   }
   return addr;
 }
+
+extern FILE *helper_fp;
+
+/* Called by the softmmu after a store of SIZE bytes at VADDR, on a page with
+ * memory monitors, changed OLD into NEW. Logs the watched bytes it wrote. */
+void cpu_x86_memory_monitor_hit(CPUX86State *env, target_ulong vaddr,
+                                uint8_t const *old, uint8_t const *new,
+                                int size)
+{
+  target_ulong eip = env->eip;
+  TranslationBlock *tb;
+  int i;
+
+  /* Find the eip of the store without disturbing the running TB. */
+  tb = tb_find_pc(env->mem_write_pc);
+  if (tb) {
+    target_ulong saved_eip = env->eip;
+    int saved_cc_op = env->cc_op;
+
+    cpu_restore_state(tb, env, env->mem_write_pc, NULL);
+    eip = env->eip;
+    env->eip = saved_eip;
+    env->cc_op = saved_cc_op;
+  }
+  if (!helper_fp) {
+    helper_fp = fopen("/tmp/log", "w");
+  }
+  for (i = memory_monitor_find(vaddr, (uint64_t)vaddr + size);
+       i >= 0 && i < num_memory_monitors
+       && memory_monitors[i] < (uint64_t)vaddr + size;
+       i++) {
+    int off = memory_monitors[i] - vaddr;
+
+    fprintf(helper_fp, "0x%x [n_exec %llx]: %x: %02hhx -> %02hhx\n",
+        (uint32_t)eip, (unsigned long long)env->n_exec,
+        (uint32_t)memory_monitors[i], old[off], new[off]);
+    prev_memory_monitor_value[i] = new[off];
+  }
+  fflush(helper_fp);
+}
@@ -2475,15 +2475,9 @@ void OPPROTO op_inspect_memory(void)
   helper_inspect_memory(PARAM1, PARAM2);
 }
 
-void OPPROTO op_memory_monitor(void)
+void OPPROTO op_profile_count(void)
 {
-  helper_memory_monitor(PARAM1);
-}
-
-void OPPROTO op_count_executions(void)
-{
-  target_ulong eip = (uint32_t)PARAM1;
-  profile_log_increment_count(eip);
+  (*(uint64_t *)PARAM1)++;
 }
 
 void OPPROTO op_check_stack_pointers(void)
@@ -106,6 +106,7 @@ typedef struct DisasContext {
 
     memaccess_t memdef;
 #define memuse memdef
+    struct profile_block *profile; /* if profile_log */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -1827,11 +1828,21 @@ static inline int insn_const_size(unsigned int ot)
         return 4;
 }
 
+/* Counts the exits of the block from the current instruction to EIP. */
+static inline void gen_profile_edge(DisasContext *s, target_ulong eip)
+{
+    if (profile_log) {
+        gen_op_profile_count((long)profile_block_edge(s->profile, eip));
+    }
+}
+
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 {
     TranslationBlock *tb;
     target_ulong pc;
 
+    /* before the direct jump, which skips the rest once chained */
+    gen_profile_edge(s, eip);
     pc = s->cs_base + eip;
     tb = s->tb;
     /* NOTE: we handle the case where the TB spans two pages here */
@@ -2373,6 +2384,7 @@ static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
         gen_goto_tb(s, tb_num, eip);
         s->is_jmp = 3;
     } else {
+        gen_profile_edge(s, eip);
         gen_jmp_im(eip);
         gen_eob(s);
     }
@@ -6659,6 +6671,21 @@ static inline int gen_intermediate_code_internal(CPUState *env,
     pc_ptr = pc_start;
     lj = -1;
 
+/* sorav */
+    if (profile_log) {
+        /* A retranslation to find the pc of an op must generate the same
+           ops, but its counters are never incremented. */
+        static struct profile_block profile_scratch;
+        if (search_pc) {
+            profile_scratch.n_edges = 0;
+            dc->profile = &profile_scratch;
+        } else {
+            dc->profile = profile_block_new(pc_start - dc->cs_base);
+        }
+        gen_op_profile_count((long)&dc->profile->count);
+    }
+/* sorav */
+
     for(;;) {
         if (env->nb_breakpoints > 0) {
             for(j = 0; j < env->nb_breakpoints; j++) {
@@ -6684,8 +6711,8 @@ static inline int gen_intermediate_code_internal(CPUState *env,
        if (rr_log) {
          gen_op_check_breakpoint(pc_ptr - dc->cs_base);
        }
-       if (profile_log) {
-         gen_op_count_executions(pc_ptr - dc->cs_base);
+       if (profile_log && !search_pc) {
+         profile_block_add_insn(dc->profile, pc_ptr - dc->cs_base);
        }
 /* sorav */
 
@@ -6722,11 +6749,6 @@ static inline int gen_intermediate_code_internal(CPUState *env,
            exit(1);
        }
 
-       /* memory monitor. */
-       if (num_memory_monitors > 0) {
-         gen_op_memory_monitor(pc_ptr);
-       }
-
 /*sorav*/
 
        pc_ptr = new_pc_ptr;
@@ -6741,6 +6763,7 @@ static inline int gen_intermediate_code_internal(CPUState *env,
         if (dc->tf || dc->singlestep_enabled || 
             (flags & HF_INHIBIT_IRQ_MASK) ||
             (cflags & CF_SINGLE_INSN)) {
+            gen_profile_edge(dc, pc_ptr - dc->cs_base);
             gen_jmp_im(pc_ptr - dc->cs_base);
             gen_eob(dc);
             break;
@@ -6748,6 +6771,7 @@ static inline int gen_intermediate_code_internal(CPUState *env,
         /* if too long translation, stop generation too */
         if (gen_opc_ptr >= gen_opc_end ||
             (pc_ptr - pc_start) >= (TARGET_PAGE_SIZE - 32)) {
+            gen_profile_edge(dc, pc_ptr - dc->cs_base);
             gen_jmp_im(pc_ptr - dc->cs_base);
             gen_eob(dc);
             break;
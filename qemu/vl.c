@@ -90,6 +90,9 @@
 
 #include "exec-all.h"
 #include "rr_log.h"
+#include "rr_index.h"
+#include "rr_lz.h"
+#include "rr_scan.h"
 #include "profile_log.h"
 
 #define DEFAULT_NETWORK_SCRIPT "/etc/qemu-ifup"
@@ -185,18 +188,27 @@ int semihosting_enabled = 0;
 int autostart = 1;
 FILE *rr_log = NULL;
 int rr_log_relaxed = 0;
+/* Segment checking (see qemu-rr-check.c): start at the MS entry at file
+ * offset rr_log_start, and stop successfully at the first MS entry at or
+ * after n_exec rr_log_stop. */
+off_t rr_log_start = 0;
+uint64_t rr_log_stop = 0;
+/* -replay_seek: start at the last MS entry at or before this n_exec, found
+ * through the index of the log. */
+uint64_t rr_log_seek = 0;
 
 /* R/R support. */
 //CPUState cpu_next;
 uint64_t next_breakpoint = 0;
 int rr_log_record_size = 0;
-static void __rr_log_scanf(char const *buf, char const *format, ...);
+static char const *__rr_log_scanf(char const *buf, char const *format, ...);
 static enum rr_log_tag_t rr_log_read_tag(void);
 
 uint8_t *replay_log_buf = NULL;
 size_t replay_log_buf_size = 0;
 uint8_t *replay_log_ptr = "";
 uint8_t *replay_log_end = NULL;
+static uint8_t *replay_log_data_end = NULL;
 
 int romwrite = 0;
 long romwrite_dst = 0;
@@ -213,14 +225,17 @@ resize_replay_log(size_t len)
   }
 }
 
+/* Reads the entry whose header was read last straight into replay_log_buf,
+ * after what is left of the previous entry (white space, if anything). */
 static void
 rr_log_read_entry(void)
 {
-  char buf[strlen(replay_log_ptr) + 1];
-  strncpy(buf, replay_log_ptr, sizeof buf);
-  resize_replay_log(strlen(buf) + rr_log_record_size + 1);
-  memcpy(replay_log_buf, buf, strlen(buf));
-  uint8_t *start = (uint8_t *)replay_log_buf + strlen(buf);
+  size_t left = replay_log_data_end ? replay_log_data_end - replay_log_ptr : 0;
+  size_t ofs = left ? replay_log_ptr - replay_log_buf : 0;
+
+  resize_replay_log(left + rr_log_record_size + 1);
+  memmove(replay_log_buf, replay_log_buf + ofs, left);
+  uint8_t *start = (uint8_t *)replay_log_buf + left;
   uint8_t *end = start + rr_log_record_size;
   int remaining = rr_log_record_size;
   do {
@@ -228,14 +243,14 @@ rr_log_read_entry(void)
   } while(remaining);
   replay_log_ptr = replay_log_buf;
   *end = '\0';
+  replay_log_data_end = end;
   replay_log_end = end - 1;
   for (replay_log_end = end - 1; isspace(*replay_log_end); replay_log_end--);
 	first_cpu->prev_tag = first_cpu->next_tag;
   first_cpu->next_tag = rr_log_read_next();
 }
 
-#define rr_log_scanf(format, args...) ({                                      \
-  int numchars;                                                               \
+#define rr_log_need_entry() do {                                              \
   if (!replay_log_end || replay_log_ptr >= replay_log_end) {                  \
     if (first_cpu->next_tag == RR_LOG_TAG_PANIC) {                            \
       helper_panic();                                                         \
@@ -244,12 +259,33 @@ rr_log_read_entry(void)
     }                                                                         \
     rr_log_read_entry();                                                      \
   }                                                                           \
-  __rr_log_scanf(replay_log_ptr, format "%n", ##args, &numchars);             \
-  replay_log_ptr += numchars;                                                 \
+} while (0)
+
+#define rr_log_scanf(format, args...) ({                                      \
+  rr_log_need_entry();                                                        \
+  replay_log_ptr = (uint8_t *)__rr_log_scanf(replay_log_ptr, format, ##args); \
 })
 
-char *phys_mem = NULL;
-size_t phys_mem_size = 0;
+/* Reads N bytes written as " %02hhx" each. */
+#define rr_log_scan_bytes(out, n) ({                                          \
+  char const *__ptr;                                                          \
+  rr_log_need_entry();                                                        \
+  __ptr = (char const *)replay_log_ptr;                                       \
+  if (rr_scan_bytes(&__ptr, out, n) != (n)) {                                 \
+    printf("Error scanning replay log. Expected %d bytes.\n", (int)(n));      \
+    printf("buf: %s\n", replay_log_ptr);                                      \
+    exit(1);                                                                  \
+  }                                                                           \
+  replay_log_ptr = (uint8_t *)__ptr;                                          \
+})
+
+/* For each page of the address space compared at MS: entries, the hash of
+ * its contents when it last matched the log. A RAM page whose RR_DIRTY_FLAG
+ * is still clear has not been written since, so it matches the log as long
+ * as the log page has the same hash, and is not compared byte by byte. */
+static uint64_t *rr_page_hashes = NULL;
+static uint8_t *rr_page_hashed = NULL;  /* rr_page_hashes[i] is valid. */
+static size_t rr_num_pages = 0;
 
 static void
 rr_log_copy(size_t size)
@@ -259,6 +295,7 @@ rr_log_copy(size_t size)
   romwrite = 1;
   cpu_physical_memory_rw(0, replay_log_ptr, size, 1);
   romwrite = 0;
+  memset(rr_page_hashed, 0, rr_num_pages);
   //cpu_physical_memory_write_rom(0, replay_log_ptr, size);
   //cpu_physical_memory_rw(0xb88c6, &chr, 1, 0);
   //printf("*0xb88c6=%#hhx\n", chr);
@@ -266,54 +303,104 @@ rr_log_copy(size_t size)
   printf("%s(): done\n", __func__);
 }
 
-static void
-output_failed_mem_compare(uint8_t const *phys_mem, uint8_t *replay_mem,
-    size_t size)
+static uint64_t
+rr_page_hash(uint8_t const *page)
 {
-  uint8_t *ptr1, *ptr2;
-  ptr1 = phys_mem;
-  ptr2 = replay_mem;
-  while (ptr2 < replay_mem + size) {
-    if (*ptr1++ != *ptr2++) {
-      break;
+  uint64_t const *p = (uint64_t const *)page;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; i < TARGET_PAGE_SIZE / 8; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Prints every range of bytes in which the LEN bytes at ADDR differ between
+ * QEMU and the log. Returns the number of differing bytes. */
+static size_t
+output_failed_page_compare(target_phys_addr_t addr, uint8_t const *qemu_mem,
+    uint8_t const *replay_mem, size_t len)
+{
+  size_t i = 0, start, num_bytes = 0;
+
+  while (i < len) {
+    if (qemu_mem[i] == replay_mem[i]) {
+      i++;
+      continue;
     }
+    for (start = i; i < len && qemu_mem[i] != replay_mem[i]; i++);
+    num_bytes += i - start;
+    printf("\t%#x-%#x: %02hhx%s[qemu]<->%02hhx%s[monitor]\n",
+        (unsigned)(addr + start), (unsigned)(addr + i - 1), qemu_mem[start],
+        i - start > 1 ? ".." : "", replay_mem[start],
+        i - start > 1 ? ".." : "");
   }
-  printf("Mismatch on memory character %#x: %hhx[qemu]<->%hhx[monitor]\n",
-      ptr2-1-replay_mem, *(ptr1-1), *(ptr2-1));
-  exit(MISMATCH_EXITCODE);
+  return num_bytes;
 }
 
 static void
 rr_log_cmp(CPUState *env, size_t size)
 {
-  if (size >= phys_mem_size) {
-    phys_mem = realloc(phys_mem, size);
-    ASSERT(phys_mem);
-    phys_mem_size = size;
+  size_t num_pages = (size + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+  size_t num_bad_pages = 0, num_bad_bytes = 0, i;
+  uint8_t const *log;
+  uint8_t buf[TARGET_PAGE_SIZE];
+
+  if (num_pages > rr_num_pages) {
+    rr_page_hashes = realloc(rr_page_hashes, num_pages * sizeof *rr_page_hashes);
+    rr_page_hashed = realloc(rr_page_hashed, num_pages);
+    ASSERT(rr_page_hashes && rr_page_hashed);
+    memset(rr_page_hashed + rr_num_pages, 0, num_pages - rr_num_pages);
+    rr_num_pages = num_pages;
   }
-  cpu_physical_memory_rw(0, phys_mem, size, 0);
   ASSERT(replay_log_ptr + size <= replay_log_end);
+  log = replay_log_ptr;
   replay_log_ptr += size;
 
-  if (rr_log_relaxed) {
-#if 0
-    size_t size1 = min(0xa0000, size);
-    if (memcmp(phys_mem, replay_log_ptr - size, size1)) {
-      printf("%llx: memory mismatch.\n", env->n_exec);
-      output_failed_comparison(phys_mem, replay_log_ptr - size, size1);
+  for (i = 0; i < num_pages; i++) {
+    target_phys_addr_t addr = (target_phys_addr_t)i << TARGET_PAGE_BITS;
+    size_t len = size - addr < TARGET_PAGE_SIZE ? size - addr : TARGET_PAGE_SIZE;
+    uint32_t pd = cpu_get_physical_page_desc(addr);
+    uint8_t const *mem;
+    int is_ram;
+
+    is_ram = (   (pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM
+              || (pd & ~TARGET_PAGE_MASK) == IO_MEM_ROM)
+             && len == TARGET_PAGE_SIZE;
+    if (is_ram) {
+      ram_addr_t ram_addr = pd & TARGET_PAGE_MASK;
+
+      mem = phys_ram_base + ram_addr;
+      if (   rr_page_hashed[i]
+          && !cpu_physical_memory_get_dirty(ram_addr, RR_DIRTY_FLAG)) {
+        if (rr_page_hash(log + addr) == rr_page_hashes[i]) {
+          continue;
+        }
+      }
+    } else {
+      cpu_physical_memory_rw(addr, buf, len, 0);
+      mem = buf;
     }
-    size1 = 0xb8000;
-    if (memcmp(phys_mem + size1, replay_log_ptr - size1, size1)) {
-      printf("%llx: memory mismatch.\n", env->n_exec);
-      output_failed_comparison(phys_mem + size1, replay_log_ptr - size1, size1);
+    if (memcmp(mem, log + addr, len)) {
+      if (!num_bad_pages++) {
+        printf("%llx: memory mismatch.\n", env->n_exec);
+      }
+      printf("page %#x:\n", (unsigned)addr);
+      num_bad_bytes += output_failed_page_compare(addr, mem, log + addr, len);
+      rr_page_hashed[i] = 0;
+    } else if (is_ram) {
+      rr_page_hashes[i] = rr_page_hash(mem);
+      rr_page_hashed[i] = 1;
     }
-#endif
   }
-
-  if (memcmp(phys_mem, replay_log_ptr - size, size)) {
-    printf("%llx: memory mismatch.\n", env->n_exec);
-    output_failed_mem_compare(phys_mem, replay_log_ptr - size, size);
+  if (num_bad_pages) {
+    printf("%llx: %zu bytes differ in %zu pages.\n", env->n_exec,
+        num_bad_bytes, num_bad_pages);
+    exit(MISMATCH_EXITCODE);
   }
+  /* Everything matched: start tracking writes afresh. */
+  cpu_physical_memory_reset_dirty(0, phys_ram_size, RR_DIRTY_FLAG);
 }
 
 /***********************************************************/
@@ -4970,76 +5057,48 @@ void
 rr_log_helper_load_seg(CPUState *env, int seg_reg, SegmentCache const *sc,
     uint32_t cr0);
 
-static void
+/* Scans FORMAT at BUF, and returns the end of the input it matched. */
+static char const *
 __rr_log_scanf(char const *buf, char const *format, ...)
 {
   va_list args;
   int retval;
-  int n_args = 0;
-  char const *ptr;
   static int n_lines = 1;
 
-  ptr = format;
-  while ((ptr = strchr(ptr, '%'))) {
-    if (*(ptr + 1) != '%' && *(ptr + 1) != '*' && *(ptr + 1) != 'n') {
-      n_args++;
-      ptr = ptr + 1;
-    } else {
-      ptr = ptr + 2;
-    }
-  }
-
   va_start (args, format);
-  retval = vsscanf(buf, format, args);
+  retval = rr_vscan(&buf, format, args);
   va_end(args);
 
-  if (retval != n_args) {
-    printf("Error scanning replay log. Expected '%s'[%d args] at line %d, "
-        "matched %d args.\n", format, n_args, n_lines+1, retval);
+  if (retval < 0) {
+    printf("Error scanning replay log. Expected '%s' at line %d, "
+        "matched %d args.\n", format, n_lines+1, -1 - retval);
     printf("buf: %s\n", buf);
     exit(1);
   }
   n_lines++;
+  return buf;
 }
 
 static enum rr_log_tag_t
 rr_log_read_tag(void)
 {
-#define RR_LOG_TAG_SIZE 5
-#define RR_LOG_N_EXEC_SIZE (16+1)
-#define RR_LOG_NBYTES_SIZE (8+1)
-#define RR_LOG_COMMENT_SIZE (8+1)
-  size_t size = RR_LOG_TAG_SIZE + RR_LOG_N_EXEC_SIZE + RR_LOG_NBYTES_SIZE +
-    RR_LOG_COMMENT_SIZE;
-  char buf[size];
-  uint8_t *end = (uint8_t *)buf + size;
-  int remaining = size;
-  char tag[RR_LOG_TAG_SIZE + 1];
+  char buf[RR_LOG_HEADER_SIZE + 1];
+  uint8_t *end = (uint8_t *)buf + RR_LOG_HEADER_SIZE;
+  int remaining = RR_LOG_HEADER_SIZE;
+  uint32_t size;
+  int tag;
   do {
     remaining -= fread(end - remaining, 1, remaining, rr_log);
   } while(remaining);
   *end = '\0';
-  memcpy(tag, buf, RR_LOG_TAG_SIZE);
-  tag[RR_LOG_TAG_SIZE] = '\0';
-  next_breakpoint = strtoll((uint8_t *)buf + RR_LOG_TAG_SIZE, NULL, 16);
-  rr_log_record_size = strtoll((uint8_t *)buf + RR_LOG_TAG_SIZE
-      + RR_LOG_N_EXEC_SIZE, NULL, 16);
-  //printf("tag=%s.\n", tag);
-  if (!strcmp(tag, "MS:  ")) {
-    return RR_LOG_TAG_MS;
-  } else if (!strcmp(tag, "INTR:")) {
-    return RR_LOG_TAG_INTR;
-  } else if (!strcmp(tag, "IN:  ")) {
-    return RR_LOG_TAG_IN;
-  } else if (!strcmp(tag, "INS: ")) {
-    return RR_LOG_TAG_INS;
-  } else if (!strcmp(tag, "PANC:")) {
-    return RR_LOG_TAG_PANIC;
-  } else if (!strcmp(tag, "EXIT:")) {
-    return RR_LOG_TAG_EXIT;
+  tag = rr_index_parse_header(buf, &next_breakpoint, &size);
+  rr_log_record_size = size;
+  if (tag < 0) {
+    printf("\nFatal error: Unrecognized tag: %.*s, buf=%s\n", RR_LOG_TAG_SIZE,
+        buf, buf);
+    ASSERT(0);
   }
-  printf("\nFatal error: Unrecognized tag: %s, buf=%s\n", tag, buf);
-  ASSERT(0);
+  return tag;
 }
 
 void
@@ -5260,9 +5319,7 @@ rr_log_loadvm(CPUState *env, int init)
     ASSERT(i == j);
   }
   rr_log_scanf("\tfxstate:\n");
-  for (i = 0; i < 512; i++) {
-    rr_log_scanf(" %02hhx", &fxstate[i]);
-  }
+  rr_log_scan_bytes(fxstate, 512);
   rr_log_scanf("\n");
   if (init) {
     fxload(env, fxstate);
@@ -5345,6 +5402,19 @@ rr_log_loadvm(CPUState *env, int init)
   env->interrupt_request = 0;
   if (!init) {
     printf("%s() succeeded at %#llx.\n", __func__, env->n_exec);
+    if (rr_log_stop && env->n_exec >= rr_log_stop) {
+      printf("%s(): segment end reached at %#llx.\n", __func__, env->n_exec);
+      exit(0);
+    }
+  }
+}
+
+/* Lets qemu-rr-check find out where a segment stopped, whatever the reason. */
+static void
+rr_log_exit_report(void)
+{
+  if (first_cpu) {
+    printf("rr_log: exit at n_exec %llx\n", first_cpu->n_exec);
   }
 }
 
@@ -6394,6 +6464,9 @@ enum {
     QEMU_OPTION_mdbg,
     QEMU_OPTION_use_replay_log,
     QEMU_OPTION_rr_log_relaxed,
+    QEMU_OPTION_replay_start,
+    QEMU_OPTION_replay_stop,
+    QEMU_OPTION_replay_seek,
     QEMU_OPTION_profile,
     QEMU_OPTION_mdisk,
 };
@@ -6475,6 +6548,9 @@ const QEMUOption qemu_options[] = {
     { "mdbg", HAS_ARG, QEMU_OPTION_mdbg},
     { "use_replay_log", HAS_ARG, QEMU_OPTION_use_replay_log },
     { "relaxed", 0, QEMU_OPTION_rr_log_relaxed},
+    { "replay_start", HAS_ARG, QEMU_OPTION_replay_start },
+    { "replay_stop", HAS_ARG, QEMU_OPTION_replay_stop },
+    { "replay_seek", HAS_ARG, QEMU_OPTION_replay_seek },
     { "profile", HAS_ARG, QEMU_OPTION_profile},
     { "mdisk", HAS_ARG, QEMU_OPTION_mdisk },
     { NULL },
@@ -7137,6 +7213,15 @@ int main(int argc, char **argv)
             case QEMU_OPTION_rr_log_relaxed:
                 //XXX: 
                 break;
+            case QEMU_OPTION_replay_start:
+                rr_log_start = strtoll(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_stop:
+                rr_log_stop = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_seek:
+                rr_log_seek = strtoull(optarg, NULL, 0);
+                break;
             case QEMU_OPTION_mdisk:
                 if (mdisk_devices_index >= MAX_MDISK_CMDLINE) {
                   fprintf(stderr, "Too many mdisk devices\n");
@@ -7313,10 +7398,35 @@ int main(int argc, char **argv)
     }
 
     if (use_replay_log) {
+      static char rr_log_buf[1 << 20];
+
       do {
         rr_log = fopen(use_replay_log, "r");
       } while (strstr(use_replay_log, ".fifo") && !rr_log);
       ASSERT(rr_log);
+      /* Entries are read whole; MS entries hold all of guest memory. The
+       * buffer must be set before rr_lz_fopen() reads from the stream. */
+      setvbuf(rr_log, rr_log_buf, _IOFBF, sizeof rr_log_buf);
+      /* block-fifo already decompresses what it passes to the fifo. */
+      if (!strstr(use_replay_log, ".fifo")) {
+        rr_log = rr_lz_fopen(rr_log);
+      }
+      if (rr_log_seek) {
+        rr_index_t *idx = rr_index_open(use_replay_log, rr_log);
+        struct rr_index_entry const *e;
+
+        e = rr_index_find(idx, rr_log_seek, RR_LOG_TAG_MS);
+        ASSERT(e);
+        printf("Starting replay at MS entry %#llx [offset %#llx].\n",
+            e->n_exec, e->offset);
+        rr_log_start = e->offset;
+        rr_index_free(idx);
+      }
+      if (rr_log_start) {
+        /* A fifo cannot seek; segments need a regular log file. */
+        ASSERT(fseeko(rr_log, rr_log_start, SEEK_SET) == 0);
+      }
+      atexit(rr_log_exit_report);
     }
 
     if (dump_profile_log) {
@@ -551,6 +551,11 @@ extern BlockDriver bdrv_vpc;
 extern BlockDriver bdrv_vvfat;
 extern BlockDriver bdrv_qcow2;
 
+/* block-fifo.c */
+void bdrv_fifo_set_buffer_size(size_t size);
+void bdrv_fifo_get_stats(BlockDriverState *bs, uint64_t *num_syscalls,
+                         uint64_t *num_bytes);
+
 typedef struct BlockDriverInfo {
     /* in bytes, 0 if irrelevant */
     int cluster_size; 